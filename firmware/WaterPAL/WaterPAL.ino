@@ -35,20 +35,15 @@ TinyGsm modem(SerialAT);
 
 // All RTC_DATA_ATTR variables are persisted while the device is in deep sleep
 volatile RTC_DATA_ATTR int64_t bootCount = 0;
-volatile RTC_DATA_ATTR int64_t total_water_usage_time_s = 0; // Total time in seconds that the water pump has been in use
 volatile RTC_DATA_ATTR int     last_water_sensor_value = 0; // Last value of the water sensor input
 volatile RTC_DATA_ATTR int64_t last_water_sensor_edge_time_s = 0; // Seconds since epoch of the last water sensor edge (whether rising or falling)
 volatile RTC_DATA_ATTR int64_t total_sms_send_count = 0; // Total number of SMS messages sent
 
 volatile RTC_DATA_ATTR int64_t last_sms_send_time_s = 0;         // Seconds since epoch of the last SMS send time
-volatile RTC_DATA_ATTR int64_t last_extra_sensor_read_time_s = 0;// Seconds since epoch of the last extra sensor read
 
 // How frequently do we want to log from peripheral sensors? (temp, humidity, etc)
 #define EXTRA_SENSOR_READ_INTERVAL ((24l * 60l * 60l) / (NUM_EXTRA_SENSOR_READS_PER_DAY > 0 ? NUM_EXTRA_SENSOR_READS_PER_DAY : 1)) // 24 hours in seconds divided by the number of readings per day
 
-// Array to store the last read values from the extra sensors
-volatile RTC_DATA_ATTR float extra_sensor_values[(NUM_EXTRA_SENSORS > 0 ? NUM_EXTRA_SENSORS : 1) * (NUM_EXTRA_SENSOR_READS_PER_DAY > 0 ? NUM_EXTRA_SENSOR_READS_PER_DAY : 1)];
-volatile RTC_DATA_ATTR int extra_sensor_read_count = 0;
 volatile RTC_DATA_ATTR int64_t last_time_drift_val_s = 0; // Time drift in seconds at the last check
 
 // The current value of the input pin
@@ -65,9 +60,31 @@ char sms_buffer[256];
 #include "waterpal_error_logging.h"
 #include "waterpal_modem.h"
 #include "waterpal_sensors.h"
+#include "waterpal_wake.h"
+#include "waterpal_channels.h"
 #include "waterpal_handle_counter.h"
+#include "waterpal_flowlog.h"
+#include "waterpal_usage.h"
+#include "waterpal_flow_monitor.h"
 #include "waterpal_clock.h"
 #include "waterpal_gprs.h"
+#include "waterpal_upload.h"
+#include "waterpal_coap.h"
+#include "waterpal_sms_codec.h"
+#include "waterpal_sms_pdu.h"
+#include "waterpal_sms_outbox.h"
+#include "waterpal_ota.h"
+#include "waterpal_scheduler.h"
+
+// Running statistics of each extra sensor's readings since the last report (see waterpal_sensors.h)
+RTC_DATA_ATTR extraSensors::state extra_sensor_state;
+
+RTC_DATA_ATTR gpsInfo last_gps_fix; // Latest GPS fix, sent with the extended check (zeros until the first fix)
+
+#if WATERPAL_USE_SMS_BINARY
+dailyReport sms_binary_reports[WATERPAL_UPLOAD_BATCH_MAX];
+uint8_t sms_binary_buffer[1 + SMS_PDU_MAX_PART_DATA * WATERPAL_SMS_BINARY_MAX_PARTS];
+#endif
 
 // Function prototypes
 void doTimeChecks();
@@ -76,13 +93,17 @@ void doDeepSleep(time_t nextWakeTime);
 void doLogRisingEdge();
 void doLogFallingEdge();
 void doSendSMS();
+void format_report_sms(char* buf, size_t size, const dailyReport& report, char type);
 void printLocalTime();
 void doExtendedSelfCheck(bool doSetNetworkMode);
+void doReadGPS();
+void doTimeSync();
+void doScheduleTimeSync(time_t now);
+void doConfigPoll();
+void doScheduleTasks(time_t now);
+void doRunTask(int task);
 
 void print_extra_sensor_vals();
-float get_extra_sensor_min(int sensor_index);
-float get_extra_sensor_max(int sensor_index);
-float get_extra_sensor_avg(int sensor_index);
 
 #define GET_LOCALTIME_NOW struct timeval tv; gettimeofday(&tv, NULL); time_t now = tv.tv_sec; struct tm timeinfo; localtime_r(&now, &timeinfo);
 
@@ -93,8 +114,8 @@ void setup()
   watchdog_enable();
   watchdog_pet();
 
-  // Configure the input pin with a pulldown resistor
-  pinMode(WATERPAL_FLOAT_SWITCH_INPUT_PIN, INPUT_PULLUP); // Steve - Aug 7 - pullup two x 10k resistor added, which also drains while switch is closed.
+  // Configure the water input pins
+  water_channels_setup();
 
   bootCount++;
 
@@ -107,32 +128,20 @@ void setup()
   }
 
   Serial.println("setup()");
-  Serial.println("  Reading from pin " + String(WATERPAL_FLOAT_SWITCH_INPUT_PIN));
   Serial.println("  Boot number: " + String(bootCount));
 
-  // Read from inputPin X times and debounce by taking the majority reading from X readings with a 50ms delay in between each read.
-  int totalReading = 0; // start with no count
-  int NUM_READS = 5;    // count X times, should always be an odd number.
-
-  for (int cnt = 0; cnt < NUM_READS; cnt++)
+  // If a sensor read is coming up this wake, power the sensors now so their warm-up overlaps the debounce, handle counter and water
+  //  logging below. The clock hasn't had its drift correction yet, but it's well within the read's tolerance.
+  if (sched_initialized && sched_is_runnable(SCHED_TASK_SENSOR_READ, time(NULL)))
   {
-    totalReading += digitalRead(WATERPAL_FLOAT_SWITCH_INPUT_PIN); // Accumulate readings from the input pin
-    delay(50);                              // Delay for a bit between each read.
+    extraSensors::power_up(extra_sensor_state, time(NULL));
   }
 
-  watchdog_pet();
-
-  // Democratically vote for the value of the input pin.
-  //  If we have a majority of readings that are HIGH, then set the input pin value to HIGH. If we have a majority of readings that are LOW, then set the input pin value to LOW.
-  water_sensor_value = (totalReading * 2 > NUM_READS);
-
-  Serial.println("  Current input pin value: " + String(water_sensor_value));
+  // Read every water input channel, debounced by the majority of a few reads 50 ms apart
+  water_channels_read();
+  water_sensor_value = water_channel_values[0];
 
-  if (totalReading > 0 && totalReading < NUM_READS)
-  {
-    // If we have a mix of readings, then note it in the log so that we know the debounce code did something
-    Serial.println("   Mixed readings detected -- debouncing code worked! Total readings: " + String(totalReading) + " out of " + String(NUM_READS));
-  }
+  watchdog_pet();
 
   // Check the reset reason to see if we are waking up from a WDT reset
   esp_reset_reason_t reset_reason = esp_reset_reason();
@@ -150,57 +159,58 @@ void setup()
   // If it's powering on for the first time, then do all of our initialization
   if (wakeup_reason == ESP_SLEEP_WAKEUP_UNDEFINED)
   {
+#if WATERPAL_USE_OTA
+    // After a restart into (or back from) an update, carry on with the counters, drift model and schedule from before it
+    ota_read_handoff();
+#endif // WATERPAL_USE_OTA
+
     // Note that we have to do this first, because without it, we don't have a valid clock for measuring any other timings.
     // Only set our network mode on our first bootup
     doExtendedSelfCheck(true);
   }
   else if (wakeup_reason == ESP_SLEEP_WAKEUP_EXT0)
   {
-    Serial.println("   Waking up from water input pin");
+    Serial.println("   Waking up from a water input pin");
   }
   else if (wakeup_reason == ESP_SLEEP_WAKEUP_TIMER)
   {
     Serial.println("   Waking up from timer");
   }
+  else if (wakeup_reason == ESP_SLEEP_WAKEUP_EXT1)
+  {
+    // Water input pins, or counter LOOP pins (a count wrapped), that share ext1 (see waterpal_wake.h)
+    uint64_t wake_pins = esp_sleep_get_ext1_wakeup_status();
+    Serial.println("   Waking up from ext1, pin mask: " + String((uint32_t)(wake_pins >> 32), HEX) + " " + String((uint32_t)wake_pins, HEX));
+  }
 
   watchdog_pet();
 
+  // Correct the clock for the RTC's drift while we slept, before anything gets timestamped
+  drift_apply_correction();
+
   // Read handle-counter changes before logging the float edge. On an edge wake, strokes since the last wake belong to the previous water state.
   handle_counter_setup();
-  handle_counter_update(handle_counter_water_is_flowing(last_water_sensor_value));
+  bool water_was_flowing = handle_counter_water_is_flowing(last_water_sensor_value);
+  if (handle_counter_update(water_was_flowing))
+  {
+    usage_log_strokes(handle_counter_get_last_delta(), water_was_flowing, time(NULL));
+  }
 
   watchdog_pet();
 
   // No matter why we woke up, attempt to log our water usage time.
   doLogWaterInput();
   last_water_sensor_value = water_sensor_value;
-
-  // Now that the time-critical things are done (logging the water input), then we can see if it's time to do an extended self-check.
-  if (wakeup_reason != ESP_SLEEP_WAKEUP_UNDEFINED && (total_sms_send_count % 8 == 0))
-  {
-    // If we are not waking up for the first time, then we can do an extended self-check, but don't set the network mode again.
-    doExtendedSelfCheck(false);
-  }
+  water_channels_log_edges(time(NULL)); // And the other channels' flows
 
   watchdog_pet();
 
-  // No matter why we woke up, always check to see if it's time to send an SMS.
-
-  // Check to see if we've received any SMS
-  String incoming_sms = modem_read_sms();
-  if (incoming_sms.length() > 0)
-  {
-    Serial.println("Received SMS: '" + incoming_sms + "'");
-    // TODO: Do something with the received SMS (apply reconfiguration, etc)
-  }
-
-  watchdog_pet();
-
-  // No matter how we woke up, always go back to sleep at the end.
+  // Now that the time-critical things are done (logging the water input), run whatever scheduled tasks are due (sensor reads, reports,
+  //  extended self-check, ...), and always go back to sleep at the end.
   doTimeChecks();
 }
 
-// We only do an extended self-check every X boots, to save power.
+// We only do an extended self-check every WATERPAL_EXTENDED_CHECK_INTERVAL_S (scheduled in doTimeChecks()), to save power.
 void doExtendedSelfCheck(bool doSetNetworkMode = false)
 {
   watchdog_pet();
@@ -231,32 +241,16 @@ void doExtendedSelfCheck(bool doSetNetworkMode = false)
     modem.setNetworkMode(WATERPAL_NETWORK_MODE);
   }
 
-  gpsInfo gps_data;
-
-  // Check GPS (optional)
+  // Check GPS (optional). On power-on we get a fix here; after that, the scheduled GPS task keeps it fresh.
   #if WATERPAL_USE_GPS
-
-  watchdog_pet();
-
-  // Turn GPS on
-  bool gps_res = modem_gps_on();
-
-  // Get GPS data, with a timeout of 60 seconds.
-  if (modem_get_gps(gps_data, 60))
+  if (doSetNetworkMode)
   {
-    Serial.printf("GPS Lat:%f Lon:%f\n", gps_data.lat, gps_data.lon);
-    Serial.printf("GPS Time: %d/%d/%d %d:%d:%d\n", gps_data.year, gps_data.month, gps_data.day, gps_data.hour, gps_data.minute, gps_data.second);
+    doReadGPS();
   }
-  else
-  {
-    logError(ERROR_GPS_FAIL); // , "Failed to get GPS data");
-  }
-
-  // Turn GPS off
-  gps_res = modem_gps_off();
-
   #endif // WATERPAL_USE_GPS
 
+  gpsInfo gps_data = last_gps_fix;
+
   watchdog_pet();
 
   // Get Cell Tower Info
@@ -281,6 +275,11 @@ void doExtendedSelfCheck(bool doSetNetworkMode = false)
       Serial.println("Failed to connect to GPRS");
       logError(ERROR_GPRS_FAIL); // , "Failed to connect to GPRS");
     } else {
+#if WATERPAL_USE_OTA
+      // If this is the first boot after an update, the new firmware has proven it can reach the network
+      ota_confirm_boot();
+#endif // WATERPAL_USE_OTA
+
       Serial.println("Sending extended data via GPRS...");
       for (int cnt = 0; cnt < WATERPAL_HTTP_RETRY_CNT; cnt++) {
         watchdog_pet();
@@ -390,17 +389,30 @@ void doLogWaterInput()
       time_diff_s = 0;
     }
 
-    // Log water usage time of falling edges (when WATERPAL_FLOAT_SWITCH_INVERT is false)
-    // Log water usage time of rising edges (when WATERPAL_FLOAT_SWITCH_INVERT is true)
+    // Log a flow session on falling edges (when WATERPAL_FLOAT_SWITCH_INVERT is false)
+    // Log a flow session on rising edges (when WATERPAL_FLOAT_SWITCH_INVERT is true)
     if (water_sensor_value == WATERPAL_FLOAT_SWITCH_INVERT)
     {
-      // Only log water usage time if the water sensor is in the "on" state (whatever that is -- configured by WATERPAL_FLOAT_SWITCH_INVERT)
-      total_water_usage_time_s += time_diff_s;
+      // Only log a session if the water sensor was in the "on" state (whatever that is -- configured by WATERPAL_FLOAT_SWITCH_INVERT).
+      //  The report's water usage time and flowing / dry-start stroke totals are summed from the sessions.
+      flowSession session;
+      session.start_s = last_water_sensor_edge_time_s;
+      session.duration_s = time_diff_s;
+      session.flowing_strokes = handle_counter_get_session_strokes();
+      session.dry_start = handle_counter_get_session_dry_start(&session.dry_start_strokes);
+      flow_monitor_session_end(session); // Stroke-rate profile, if the flow was monitored
+      flowlog_add(session);
+      usage_flow_ended(tv.tv_sec);
+    }
+    else
+    {
+      usage_flow_started(tv.tv_sec);
+      flow_monitor_session_start();
     }
 
     Serial.println("  Edge detected at " + String(timeinfo.tm_hour) + ":" + String(timeinfo.tm_min) + ":" + String(timeinfo.tm_sec));
     Serial.println("  Water input sensor was " + String(!water_sensor_value) + " for " + String(time_diff_s) + " seconds");
-    Serial.println("  Total water usage time: " + String(total_water_usage_time_s) + " seconds");
+    Serial.println("  Total water usage time: " + String((long)usage_total_s()) + " seconds");
 
     handle_counter_log_water_state_change(handle_counter_water_is_flowing(water_sensor_value), tv.tv_sec);
 
@@ -409,6 +421,92 @@ void doLogWaterInput()
   }
 }
 
+// Scheduled task: refresh the GPS fix that the extended self-check sends
+void doReadGPS()
+{
+  watchdog_pet();
+
+  Serial.println("doReadGPS()");
+  imei = modem_on_get_imei();
+
+  // Turn GPS on
+  bool gps_res = modem_gps_on();
+
+  // Get GPS data, with a timeout of 60 seconds.
+  gpsInfo gps_data;
+  if (modem_get_gps(gps_data, 60))
+  {
+    Serial.printf("GPS Lat:%f Lon:%f\n", gps_data.lat, gps_data.lon);
+    Serial.printf("GPS Time: %d/%d/%d %d:%d:%d\n", gps_data.year, gps_data.month, gps_data.day, gps_data.hour, gps_data.minute, gps_data.second);
+    last_gps_fix = gps_data;
+
+    // A fix carries UTC time, so it's also a sync point for the drift model (once CCLK has given us the local time offset)
+    if (drift_sync_count > 0)
+    {
+      struct tm gps_time;
+      memset(&gps_time, 0, sizeof(gps_time));
+      gps_time.tm_year = gps_data.year - 1900;
+      gps_time.tm_mon = gps_data.month - 1;
+      gps_time.tm_mday = gps_data.day;
+      gps_time.tm_hour = gps_data.hour;
+      gps_time.tm_min = gps_data.minute;
+      gps_time.tm_sec = gps_data.second;
+      drift_sync(mktime(&gps_time) + drift_utc_offset_s, "GPS");
+    }
+  }
+  else
+  {
+    logError(ERROR_GPS_FAIL); // , "Failed to get GPS data");
+  }
+
+  // Turn GPS off
+  gps_res = modem_gps_off();
+
+  watchdog_pet();
+}
+
+// Scheduled task: set the clock from the modem, once the drift model says it might be too far off
+void doTimeSync()
+{
+  watchdog_pet();
+
+  Serial.println("doTimeSync()");
+  imei = modem_on_get_imei();
+
+  if (!modem_setLocalTimeFromCCLK())
+  {
+    logError(ERROR_TIMESTAMP_FAIL);
+  }
+
+  watchdog_pet();
+}
+
+// The next time sync is due when the drift model's predicted error reaches WATERPAL_DRIFT_MAX_ERROR_S. It may run up to halfway
+//  there, so it usually rides along with a wake that has the modem on anyway.
+void doScheduleTimeSync(time_t now)
+{
+  int64_t next_sync_s = drift_next_sync_s(now);
+  sched_once(SCHED_TASK_TIME_SYNC, next_sync_s, (next_sync_s - drift_last_sync_s) / 2);
+}
+
+// Scheduled task: check to see if we've received any SMS
+void doConfigPoll()
+{
+  watchdog_pet();
+
+  Serial.println("doConfigPoll()");
+  imei = modem_on_get_imei();
+
+  String incoming_sms = modem_read_sms();
+  if (incoming_sms.length() > 0)
+  {
+    Serial.println("Received SMS: '" + incoming_sms + "'");
+    // TODO: Do something with the received SMS (apply reconfiguration, etc)
+  }
+
+  watchdog_pet();
+}
+
 void doSendSMS()
 {
   watchdog_pet();
@@ -437,42 +535,61 @@ void doSendSMS()
   int8_t signal_quality = modem_get_signal_quality_retry();
   Serial.println("Signal quality: " + String(signal_quality) + "%");
 
-  Serial.println("  >> Sending SMS with water usage time: " + String(total_water_usage_time_s) + " seconds");
   Serial.println("  >> SMS sent at " + String(timeinfo.tm_hour) + ":" + String(timeinfo.tm_min) + ":" + String(timeinfo.tm_sec));
 
   uint32_t handle_strokes_total_report = handle_counter_get_handle_strokes_total();
-  uint32_t handle_strokes_flowing_total_report = handle_counter_get_handle_strokes_flowing_total();
-  uint32_t handle_strokes_flowing_per_min_report = total_water_usage_time_s > 0 ? (handle_strokes_flowing_total_report * 60ULL) / total_water_usage_time_s : 0;
-  uint32_t dry_start_count_report = handle_counter_get_dry_start_count();
-  uint32_t dry_start_stroke_total_report = handle_counter_get_dry_start_stroke_total();
-  uint32_t dry_start_stroke_avg_report = handle_counter_get_dry_start_stroke_avg();
-  uint32_t dry_start_stroke_max_report = handle_counter_get_dry_start_stroke_max();
-
   Serial.println("  >> Handle strokes total: " + String(handle_strokes_total_report));
-  Serial.println("  >> Handle strokes flowing total: " + String(handle_strokes_flowing_total_report));
-  Serial.println("  >> Handle strokes flowing per min: " + String(handle_strokes_flowing_per_min_report));
-  Serial.println("  >> Dry starts: " + String(dry_start_count_report));
-  Serial.println("  >> Dry start stroke total: " + String(dry_start_stroke_total_report));
-  Serial.println("  >> Dry start stroke avg: " + String(dry_start_stroke_avg_report));
-  Serial.println("  >> Dry start stroke max: " + String(dry_start_stroke_max_report));
+  handle_counter_print();
+  flowlog_print();
 
   watchdog_pet();
 
   // Calculate extra sensor values
   print_extra_sensor_vals();
-  float humidity_min = get_extra_sensor_min(0);
-  float humidity_max = get_extra_sensor_max(0);
-  float humidity_avg = get_extra_sensor_avg(0);
-  float temp_min = get_extra_sensor_min(1);
-  float temp_max = get_extra_sensor_max(1);
-  float temp_avg = get_extra_sensor_avg(1);
-
-  Serial.println("  Calculated extra sensor values:");
-  Serial.println("    Humidity: Min: " + String(humidity_min, 2) + " - Avg: " + String(humidity_avg, 2) + " - Max: " + String(humidity_max, 2));
-  Serial.println("    Temperature: Min: " + String(temp_min, 2) + " - Avg: " + String(temp_avg, 2) + " - Max: " + String(temp_max, 2));
 
   watchdog_pet();
 
+  // Gather everything into one report, so that every channel sends the same values
+  dailyReport report;
+  memset(&report, 0, sizeof(report));
+  strncpy(report.imei, imei_base64.c_str(), sizeof(report.imei) - 1);
+  report.timestamp_s = tv.tv_sec;
+  report.total_sms_count = total_sms_send_count;
+  flowlog_fill_report(report); // Session count and dry starts, summed from the period's flow sessions
+  usage_fill_report(report, tv.tv_sec); // Water usage time and flowing strokes, by time of day, up to now (even if the water is running)
+  flow_monitor_fill_report(report); // Time spent monitoring flows, and the charge it took
+  water_channels_fill_report(report, tv.tv_sec); // The other water channels' usage time and flows, up to now
+  report.clock_drift_s = last_time_drift_val_s;
+  extraSensors::fill_report(extra_sensor_state, report); // Each sensor's min / avg / max into its own fields
+  report.signal_strength = signal_quality;
+  report.battery_charge_status = batt_val.charging;
+  report.battery_charge_pct = batt_val.percentage;
+  report.battery_voltage_mv = batt_val.voltage_mV;
+  report.boot_count = bootCount;
+  report.handle_strokes_total = handle_strokes_total_report;
+  report.counter_read_fail_count = handle_counter_get_read_fail_count();
+
+  // The report now holds everything from this period, so it goes into the outbox (which keeps it until every channel has
+  //  delivered it) and the accumulators start over -- a later report never merges in an undelivered period.
+  outbox_add(report);
+
+  Serial.println("  >> Water usage time: " + String((long)report.water_usage_time_s) + " seconds");
+  usage_print();
+  flow_monitor_print();
+  water_channels_print();
+
+  // Start a new period of flow sessions (the sessions themselves stay in the log until they drop out of it), and of usage
+  flowlog_start_period();
+  usage_start_period();
+  flow_monitor_start_period();
+  water_channels_start_period();
+  // Clear our extra sensor data
+  extraSensors::reset(extra_sensor_state);
+
+  // Save our last send time
+  last_sms_send_time_s = tv.tv_sec;
+  handle_counter_mark_report_sent();
+
   // Check to see if we should send our update via HTTP
   if (WATERPAL_USE_GPRS)
   {
@@ -484,91 +601,22 @@ void doSendSMS()
       Serial.println("Failed to connect to GPRS");
       logError(ERROR_GPRS_FAIL); // , "Failed to connect to GPRS");
     } else {
-      Serial.println("Sending data via GPRS...");
-      for (int cnt = 0; cnt < WATERPAL_HTTP_RETRY_CNT; cnt++) {
-        gprs_success = gprs_send_data_daily(
-          imei_base64,
-          total_sms_send_count,
-          total_water_usage_time_s,
-          last_time_drift_val_s,
-          temp_min,
-          temp_avg,
-          temp_max,
-          humidity_min,
-          humidity_avg,
-          humidity_max,
-          signal_quality,
-          batt_val.charging,
-          batt_val.percentage,
-          batt_val.voltage_mV,
-          bootCount,
-          handle_strokes_total_report,
-          handle_strokes_flowing_total_report,
-          handle_strokes_flowing_per_min_report,
-          dry_start_count_report,
-          dry_start_stroke_total_report,
-          dry_start_stroke_avg_report,
-          dry_start_stroke_max_report);
-
-        if (!gprs_success)
-        {
-          Serial.print("Failed to send daily data via GPRS. Retry #");
-          Serial.println(cnt + 1);
-          logError(ERROR_GPRS_FAIL); // , "Failed to send data via GPRS");
-        } else {
-          Serial.println("Daily data sent successfully via GPRS");
-          break;
-        }
-      }
-      if (!gprs_success)
-      {
-        Serial.println("Failed to send daily data via GPRS. No more retries!");
-        logError(ERROR_GPRS_FAIL); // , "Failed to send data via GPRS");
-      }
+#if WATERPAL_USE_OTA
+      ota_confirm_boot();
+#endif // WATERPAL_USE_OTA
 
-#if WATERPAL_USE_DESIGNOUTREACH_HTTP
-      Serial.println("Sending data via GPRS to DesignOutreach...");
-      for (int cnt = 0; cnt < WATERPAL_HTTP_RETRY_CNT; cnt++) {
-        gprs_success = gprs_post_data_daily_designoutreach(
-          imei_base64,
-          total_sms_send_count,
-          total_water_usage_time_s,
-          last_time_drift_val_s,
-          temp_min,
-          temp_avg,
-          temp_max,
-          humidity_min,
-          humidity_avg,
-          humidity_max,
-          signal_quality,
-          batt_val.charging,
-          batt_val.percentage,
-          batt_val.voltage_mV,
-          bootCount,
-          handle_strokes_total_report,
-          handle_strokes_flowing_total_report,
-          handle_strokes_flowing_per_min_report,
-          dry_start_count_report,
-          dry_start_stroke_total_report,
-          dry_start_stroke_avg_report,
-          dry_start_stroke_max_report);
+      Serial.println("Sending data via GPRS to " + String(UPLOAD_NUM_ENDPOINTS) + " endpoints...");
+      int num_uploaded = upload_flush_outbox();
+      Serial.println("Outbox delivered to " + String(num_uploaded) + " of " + String(UPLOAD_NUM_ENDPOINTS) + " endpoints");
 
-        if (!gprs_success)
-        {
-          Serial.print("Failed to send daily data to Design Outreach via GPRS. Retry #");
-          Serial.println(cnt + 1);
-          logError(ERROR_GPRS_FAIL); // , "Failed to send data via GPRS");
-        } else {
-          Serial.println("Daily data sent successfully to Design Outreach via GPRS");
-          break;
-        }
-      }
-      if (!gprs_success)
+#if WATERPAL_USE_COAP
+      if (!coap_flush_outbox())
       {
-        Serial.println("Failed to send daily data to Design Outreach via GPRS. No more retries!");
-        logError(ERROR_GPRS_FAIL); // , "Failed to send data via GPRS");
+        Serial.println("Failed to send daily data via CoAP");
+        logError(ERROR_GPRS_FAIL); // , "Failed to send data via CoAP");
       }
-#endif // WATERPAL_USE_DESIGNOUTREACH_HTTP
+      coap_print_stats();
+#endif // WATERPAL_USE_COAP
     }
   }
 
@@ -576,22 +624,35 @@ void doSendSMS()
 
   watchdog_pet();
 
-  // Confirm that it sent correctly, and if so, clear the total water usage time.
+  // Confirm that it sent correctly
   bool success = false;
 
   // Low water usage alert
-
-  // Check for low usage
-  if (total_water_usage_time_s < WATERPAL_LOW_USAGE_THRESHOLD)
+  bool low_usage = (report.water_usage_time_s < WATERPAL_LOW_USAGE_THRESHOLD);
+  char alert_text[96];
+  if (low_usage)
   {
-    Serial.printf("Low water usage detected (%lld)", total_water_usage_time_s);
-    snprintf(sms_buffer, sizeof(sms_buffer), "%s [%s]: Low water usage detected (%lld)",
+    Serial.printf("Low water usage detected (%lld)", report.water_usage_time_s);
+    snprintf(alert_text, sizeof(alert_text), "%s [%s]: Low water usage detected (%lld)",
                SITE_IDENTIFIER,
                imei_base64.c_str(),
-               total_water_usage_time_s);
+               report.water_usage_time_s);
+  }
 
-    success = modem_send_urgent_sms(sms_buffer, WATERPAL_SMS_RETRY_CNT);
-    if (success)
+  // Regular usage messages: every report in the outbox that hasn't gone out by SMS yet (and still needs to, per WATERPAL_SMS_POLICY), oldest first
+  success = true;
+  // Every text SMS of this pass (alert and reports, over however many batches) shares one retry budget
+  int sms_retries_left = WATERPAL_SMS_RETRY_BUDGET;
+  // The numbers that haven't got this report in full, for the short fallback: all of them, unless its text SMS went out to some
+  sms_outbox_begin();
+  uint16_t report_undelivered = sms_outbox_dest_mask;
+#if WATERPAL_USE_SMS_BINARY
+  // A binary SMS can't carry the alert, so it goes out on its own first
+  if (low_usage)
+  {
+    sms_outbox_begin();
+    sms_outbox_add(alert_text, SMS_PRIORITY_URGENT, sms_outbox_urgent_mask);
+    if (sms_outbox_send(sms_retries_left))
     {
       Serial.println("Low water usage SMS sent successfully");
       total_sms_send_count++;
@@ -599,65 +660,149 @@ void doSendSMS()
     else
     {
       Serial.println("Low water usage SMS failed to send");
-      logError(ERROR_SMS_FAIL); // , "Failed to send low water usage SMS message");
     }
   }
 
+  // Binary SMS: everything pending goes out in as few messages as possible (each up to WATERPAL_UPLOAD_BATCH_MAX reports, as many as fit)
+  int num_pending;
+  while (success && (num_pending = outbox_read_pending(OUTBOX_CHANNEL_SMS, sms_binary_reports, WATERPAL_UPLOAD_BATCH_MAX)) > 0)
+  {
+    watchdog_pet();
 
-  // Regular usage message
-  snprintf(sms_buffer, sizeof(sms_buffer), "1,%s,%lld,R,%lld,%lld,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu",
-           // Header:
-             // Version (1)
-             imei_base64.c_str(),
-             total_sms_send_count,
-             // Packet type (R)
-           // Body
-             total_water_usage_time_s, // Total water usage time (s)
-             last_time_drift_val_s, // Time drift (s)
-             int(get_extra_sensor_min(1) + 0.5f), // Temperature C (Low)
-             int(get_extra_sensor_avg(1) + 0.5f), // Temperature C (Avg)
-             int(get_extra_sensor_max(1) + 0.5f), // Temperature C (High)
-             int(get_extra_sensor_min(0) + 0.5f), // Humidity (Low)
-             int(get_extra_sensor_avg(0) + 0.5f), // Humidity (Avg)
-             int(get_extra_sensor_max(0) + 0.5f), // Humidity (High)
-             signal_quality, // Signal Strength Pct
-             batt_val.charging, // Battery Charge Status
-             batt_val.percentage, // Battery Charge
-             batt_val.voltage_mV, // Battery Voltage (mV)
-             bootCount, // Boot Count
-             (unsigned long)handle_strokes_total_report, // Handle strokes total
-             (unsigned long)handle_strokes_flowing_total_report, // Handle strokes while water was flowing
-             (unsigned long)handle_strokes_flowing_per_min_report, // Handle strokes per minute while water was flowing
-             (unsigned long)dry_start_count_report, // Dry start count
-             (unsigned long)dry_start_stroke_total_report, // Dry start stroke total
-             (unsigned long)dry_start_stroke_avg_report, // Dry start stroke avg
-             (unsigned long)dry_start_stroke_max_report); // Dry start stroke max
-
-  // Send the SMS
-  success = modem_broadcast_sms(sms_buffer, WATERPAL_SMS_RETRY_CNT);
+    int num_needed = 0;
+    for (int i = 0; i < num_pending; i++)
+    {
+      if (ledger_sms_needed(sms_binary_reports[i]))
+      {
+        sms_binary_reports[num_needed++] = sms_binary_reports[i];
+      }
+    }
+    uint32_t last_seq = sms_binary_reports[num_pending - 1].seq;
 
-  if (success)
+    if (num_needed > 0)
+    {
+      // As many of the reports as fit in one message -- the rest go in the next one (each attempt starts over from the receiver's delta baseline)
+      const uint8_t* payload;
+      size_t payload_len = 0;
+      int num_sent;
+      for (num_sent = num_needed; num_sent > 0; num_sent--)
+      {
+        payload_len = payload_encode(sms_binary_reports, num_sent, WATERPAL_SMS_BINARY_ENCODING, outbox_delta_begin(OUTBOX_CHANNEL_SMS), &payload);
+        if (payload_len > 0 && payload_len < sizeof(sms_binary_buffer))
+        {
+          break;
+        }
+      }
+      success = (num_sent > 0);
+      if (success)
+      {
+        sms_binary_buffer[0] = WATERPAL_SMS_BINARY_ENCODING;
+        memcpy(sms_binary_buffer + 1, payload, payload_len);
+        success = sms_pdu_broadcast_binary(sms_binary_buffer, payload_len + 1, WATERPAL_SMS_RETRY_CNT);
+      }
+      if (!success)
+      {
+        break;
+      }
+      Serial.println("Binary SMS with " + String(num_sent) + " of " + String(num_needed) + " reports sent successfully");
+      ledger_sms_sent(sms_binary_reports[num_sent - 1]);
+      total_sms_send_count++;
+      if (num_sent < num_needed)
+      {
+        last_seq = sms_binary_reports[num_sent - 1].seq;
+      }
+    }
+    outbox_mark_sent(OUTBOX_CHANNEL_SMS, last_seq);
+  }
+#else
+  // If this report goes out by SMS in the first pass, the alert rides along in it (as an "A" packet, sent first), and only urgent numbers
+  //  that aren't also regular recipients get the alert text on its own. Otherwise every urgent number gets the alert text.
+  bool merge_alert = low_usage && ledger_sms_needed(report) && outbox_pending_count(OUTBOX_CHANNEL_SMS) < SMS_OUTBOX_MAX_MESSAGES;
+  bool alert_pending = low_usage;
+  int alert_index = -1;
+  dailyReport pending[SMS_OUTBOX_MAX_MESSAGES - 1]; // Leave room in the queue for the alert
+  int message_index[SMS_OUTBOX_MAX_MESSAGES - 1];
+  while (success)
   {
-    Serial.println("SMS sent successfully");
-    // Clear the total water usage time
-    total_water_usage_time_s = 0;
-    // Clear our extra sensor data
-    for (int i = 0; i < NUM_EXTRA_SENSORS * NUM_EXTRA_SENSOR_READS_PER_DAY; i++)
+    watchdog_pet();
+
+    int num_pending = outbox_read_pending(OUTBOX_CHANNEL_SMS, pending, SMS_OUTBOX_MAX_MESSAGES - 1);
+    if (num_pending == 0 && !alert_pending)
     {
-      extra_sensor_values[i] = 0;
+      break;
     }
-    extra_sensor_read_count = 0;
 
-    // Save our last send time
-    last_sms_send_time_s = tv.tv_sec;
-    handle_counter_mark_report_sent();
-    total_sms_send_count++;
+    sms_outbox_begin();
+    for (int i = 0; i < num_pending; i++)
+    {
+      message_index[i] = -1;
+      if (!ledger_sms_needed(pending[i]))
+      {
+        Serial.println("Report #" + String(pending[i].seq) + " was delivered over GPRS -- skipping SMS");
+        continue;
+      }
+      if (merge_alert && pending[i].seq == report.seq)
+      {
+        format_report_sms(sms_buffer, sizeof(sms_buffer), pending[i], SMS_PACKET_ALERT);
+        message_index[i] = sms_outbox_add(sms_buffer, SMS_PRIORITY_URGENT, sms_outbox_dest_mask);
+      }
+      else
+      {
+        format_report_sms(sms_buffer, sizeof(sms_buffer), pending[i], SMS_PACKET_REGULAR);
+        message_index[i] = sms_outbox_add(sms_buffer, SMS_PRIORITY_REGULAR, sms_outbox_dest_mask);
+      }
+    }
+    if (alert_pending)
+    {
+      alert_index = sms_outbox_add(alert_text, SMS_PRIORITY_URGENT, sms_outbox_urgent_mask & ~(merge_alert ? sms_outbox_dest_mask : 0));
+      alert_pending = false;
+    }
+
+    success = sms_outbox_send(sms_retries_left);
+
+    if (alert_index >= 0 && sms_outbox_delivered(alert_index))
+    {
+      Serial.println("Low water usage SMS sent successfully");
+      total_sms_send_count++;
+    }
+    alert_index = -1;
+
+    // The SMS channel delivers in order, so stop at the first report that didn't go out
+    for (int i = 0; i < num_pending; i++)
+    {
+      if (message_index[i] >= 0 && pending[i].seq == report.seq)
+      {
+        report_undelivered = sms_outbox_undelivered(message_index[i]);
+      }
+    }
+    for (int i = 0; i < num_pending; i++)
+    {
+      if (message_index[i] >= 0)
+      {
+        if (!sms_outbox_delivered(message_index[i]))
+        {
+          success = false;
+          break;
+        }
+        Serial.println("SMS for report #" + String(pending[i].seq) + " sent successfully");
+        ledger_sms_sent(pending[i]);
+        total_sms_send_count++;
+      }
+      outbox_mark_sent(OUTBOX_CHANNEL_SMS, pending[i].seq);
+    }
   }
-  else
+#endif
+  outbox_trim();
+
+  if (!success)
   {
     Serial.println("Regular SMS failed to send");
     logError(ERROR_SMS_FAIL); // , "SMS failed to send");
 
+#if WATERPAL_SMS_PACKET_VERSION == 2
+    // Same packet with a short header, keeping as many of the most important fields as fit
+    sms_codec_encode(sms_buffer, sizeof(sms_buffer), report, SMS_PACKET_SHORT, WATERPAL_SMS_SHORT_MAX_CHARS);
+#else
     // Create a short identifier by only taking the last 2 characters of the IMEI for an identifier
     String imei_short = imei_base64.substring(imei_base64.length() - 2);
 
@@ -667,118 +812,125 @@ void doSendSMS()
       // Short buffer, limited to 14 characters
       // rIMEIsms_count,water_usage_time,batt_pct,temp_avg
       // Short "regular" packet uses a lower-case 'r' to indicate a short packet.
-      "r%s%d,%d,%d,%d",
+      "r%s%d,%lld,%d,%d",
       // Header: (5 characters)
         // 'x' (for "short extended packet")
         imei_short.c_str(), // Short IMEI
         sms_send_count_last_digit, // SMS count, limited to 1 digits
       // Body: (9 characters)
-        total_water_usage_time_s,
-        batt_val.percentage,
-        int(get_extra_sensor_avg(1) + 0.5f)
+        report.water_usage_time_s,
+        report.battery_charge_pct,
+        report.temperature_avg
     );
 
     // Ensure we're truncated to 14 characters
     sms_buffer[14] = '\0';
+#endif
 
+    // The full report stays in the outbox, and goes out again with the next report. Numbers that got this report in full
+    //  don't need the short one.
     Serial.println("Failed to send full SMS. Retrying with shorter message: " + String(sms_buffer));
-    success = modem_broadcast_sms(sms_buffer, WATERPAL_SMS_SHORT_RETRY_CNT);
+    sms_outbox_begin();
+    if (sms_outbox_add(sms_buffer, SMS_PRIORITY_REGULAR, report_undelivered) >= 0)
+    {
+      int short_retries_left = WATERPAL_SMS_SHORT_RETRY_CNT;
+      success = sms_outbox_send(short_retries_left);
+    }
   }
 
+#if WATERPAL_USE_OTA
+  // A restart into an update waits for this point, when there's nothing of the period left to lose
+  ota_report_done();
+#endif // WATERPAL_USE_OTA
+}
+
+// Format the regular SMS for a report (type SMS_PACKET_REGULAR, or SMS_PACKET_ALERT if it carries the low water usage alert)
+void format_report_sms(char* buf, size_t size, const dailyReport& report, char type)
+{
+#if WATERPAL_SMS_PACKET_VERSION == 2
+  sms_codec_encode(buf, size, report, type, WATERPAL_SMS_MAX_CHARS);
+#else
+  // The fields (and their order) come from waterpal_schema.h
+  textWriter w;
+  text_init(w, buf, size);
+  schema_write_sms(w, report, type);
+#endif
 }
 
 void doReadExtraSensors() {
   watchdog_pet();
 
-  if (NUM_EXTRA_SENSOR_READS_PER_DAY == 0 || NUM_EXTRA_SENSORS == 0)
+  if (extraSensors::count == 0)
   {
     return;
   }
 
-  // Read the extra sensors here (such as temperature, humidity, etc)
-  sensors_setup();
-
-  // Read humidity
-  float humidity = sensors_read_humidity_retry();
-  // Read temperature as Celsius (the default)
-  float temp_c = sensors_read_temp_c_retry();
-
-  // Print sensor readings (to 2 decimal places)
-  Serial.println("   > Sensor reading: " + String(extra_sensor_read_count) + ":  Humidity: " + String(humidity, 2) + "%, Temp: " + String(temp_c, 2) + "°C");
-
-  // Store the sensor values in the array
-  extra_sensor_values[extra_sensor_read_count * NUM_EXTRA_SENSORS] = humidity;
-  extra_sensor_values[extra_sensor_read_count * NUM_EXTRA_SENSORS + 1] = temp_c;
-
-  extra_sensor_read_count++;
+  // Read whichever extra sensors are due (such as temperature, humidity, etc), and fold the readings into their statistics
+  int num_read = extraSensors::sample(extra_sensor_state, time(NULL));
+  Serial.println("   > Read " + String(num_read) + " of " + String(extraSensors::count) + " extra sensors");
 
   watchdog_pet();
 }
 
 void print_extra_sensor_vals()
 {
-  Serial.println(" **> Debug extra sensor values (" + String(extra_sensor_read_count) + " readings):");
-  for (int i = 0; i < extra_sensor_read_count; i++)
-  {
-    Serial.println("  Reading " + String(i) + ": Humidity: " + String(extra_sensor_values[i * NUM_EXTRA_SENSORS], 2) + "%, Temp: " + String(extra_sensor_values[i * NUM_EXTRA_SENSORS + 1], 2) + " °C");
-  }
+  Serial.println(" **> Debug extra sensor values:");
+  extraSensors::print(extra_sensor_state);
 }
 
-float get_extra_sensor_min(int sensor_index)
+// Sets up the task schedule (see waterpal_scheduler.h) the first time through, once the power-on self-check has set the clock.
+//  As before the scheduler, the first boot reads the sensors and sends a report straight away; the extended check (and GPS fix) just ran.
+void doScheduleTasks(time_t now)
 {
-  float min_val = extra_sensor_values[sensor_index];
-  for (int i = 0; i < extra_sensor_read_count; i++)
-  {
-    if (extra_sensor_values[i * NUM_EXTRA_SENSORS + sensor_index] < min_val)
-    {
-      min_val = extra_sensor_values[i * NUM_EXTRA_SENSORS + sensor_index];
-    }
-  }
-  if (isnan(min_val))
+  if (extraSensors::count > 0)
   {
-    return 0;
+    sched_every(SCHED_TASK_SENSOR_READ, now, extraSensors::min_period_s(), WATERPAL_SENSOR_READ_TOLERANCE_S, true);
   }
-  return min_val;
+#if WATERPAL_USE_GPS
+  sched_every(SCHED_TASK_GPS, now, WATERPAL_GPS_INTERVAL_S, WATERPAL_GPS_TOLERANCE_S, false);
+#endif // WATERPAL_USE_GPS
+  sched_every(SCHED_TASK_EXTENDED_CHECK, now, WATERPAL_EXTENDED_CHECK_INTERVAL_S, WATERPAL_EXTENDED_CHECK_TOLERANCE_S, false);
+  sched_every(SCHED_TASK_REPORT, now, SMS_DAILY_SEND_INTERVAL, WATERPAL_REPORT_TOLERANCE_S, true);
+  sched_every(SCHED_TASK_CONFIG_POLL, now, WATERPAL_CONFIG_POLL_INTERVAL_S, WATERPAL_CONFIG_POLL_TOLERANCE_S, true);
+  doScheduleTimeSync(now);
+
+  sched_initialized = true;
 }
 
-float get_extra_sensor_max(int sensor_index)
+void doRunTask(int task)
 {
-  float max_val = extra_sensor_values[sensor_index];
-  for (int i = 0; i < extra_sensor_read_count; i++)
+  switch (task)
   {
-    if (extra_sensor_values[i * NUM_EXTRA_SENSORS + sensor_index] > max_val)
-    {
-      max_val = extra_sensor_values[i * NUM_EXTRA_SENSORS + sensor_index];
-    }
-  }
-  if (isnan(max_val))
+  case SCHED_TASK_SENSOR_READ:
   {
-    return 0;
-  }
-  return max_val;
-}
+    doReadExtraSensors();
 
-float get_extra_sensor_avg(int sensor_index)
-{
-  if (extra_sensor_read_count == 0)
-  {
-    return 0;
+    print_extra_sensor_vals();
+    break;
   }
-
-  float sum = 0;
-  for (int i = 0; i < extra_sensor_read_count; i++)
-  {
-    sum += extra_sensor_values[i * NUM_EXTRA_SENSORS + sensor_index];
-  }
-  float avg = sum / extra_sensor_read_count;
-  if (isnan(avg))
-  {
-    return 0;
+  case SCHED_TASK_GPS:
+    doReadGPS();
+    break;
+  case SCHED_TASK_EXTENDED_CHECK:
+    // Don't set the network mode again (that's only done on power-on)
+    doExtendedSelfCheck(false);
+    break;
+  case SCHED_TASK_REPORT:
+    // Send our SMS and clear our accumulated data readings
+    doSendSMS();
+    break;
+  case SCHED_TASK_CONFIG_POLL:
+    doConfigPoll();
+    break;
+  case SCHED_TASK_TIME_SYNC:
+    doTimeSync();
+    break;
   }
-  return avg;
 }
 
 // doTimeChecks() takes care of all time-based housekeeping tasks, such as reading the extra sensors, sending SMS messages, and going back to sleep.
+// Every task whose tolerance window has opened runs now, whether we woke up for it or not (e.g. a float switch wake a few minutes before a
+//  sensor read), so that tasks due close together share one wake.
 void doTimeChecks() {
   watchdog_pet();
 
@@ -788,87 +940,36 @@ void doTimeChecks() {
   Serial.println("doTimeChecks()");
   Serial.println("  Current time of day: " + String(timeinfo.tm_hour) + ":" + String(timeinfo.tm_min) + ":" + String(timeinfo.tm_sec) + " (" + String(now) + ")");
 
-  struct tm midnight = timeinfo;
-  midnight.tm_hour = 0;
-  midnight.tm_min = 0;
-  midnight.tm_sec = 0;
-  // What is the epoch time of the previous midnight?
-  time_t prev_midnight = mktime(&midnight);
-
-  Serial.println("  Previous midnight: " + String(prev_midnight));
-
-  if (now < prev_midnight) {
-    Serial.println("**** Time is before midnight -- something is wrong!");
-    prev_midnight -= 86400; // Subtract one day in seconds
+  if (!sched_initialized)
+  {
+    doScheduleTasks(now);
   }
 
-  // What is our current time since midnight?
-  long seconds_since_midnight = now - prev_midnight;
-
-  Serial.println("  Seconds since midnight: " + String(seconds_since_midnight));
-  time_t prev_scheduled_sensor_read_time = 0;
-
-  if (NUM_EXTRA_SENSOR_READS_PER_DAY > 0 && NUM_EXTRA_SENSORS > 0)
+  int task;
+  while ((task = sched_next_runnable(now)) >= 0)
   {
-    // When was the last time that we should have read the sensors?
-    prev_scheduled_sensor_read_time = prev_midnight + long(seconds_since_midnight / EXTRA_SENSOR_READ_INTERVAL) * EXTRA_SENSOR_READ_INTERVAL;
-
-    Serial.println("  Previous scheduled sensor read time: " + String(prev_scheduled_sensor_read_time));
-
-    // If the previous sensor read time is newer than the last time we read the sensors, then we should read the sensors now.
-    // TODO: Add a grace period here, so that if we're within X minutes of the target time, then do the send / read anyways?
-    if (prev_scheduled_sensor_read_time > last_extra_sensor_read_time_s)
-    {
-      Serial.println("    !Time to read extra sensors!");
-      doReadExtraSensors();
-
-      last_extra_sensor_read_time_s = now;
-
-      print_extra_sensor_vals();
-      float humidity_min = get_extra_sensor_min(0);
-      float humidity_max = get_extra_sensor_max(0);
-      float humidity_avg = get_extra_sensor_avg(0);
-      float temp_min = get_extra_sensor_min(1);
-      float temp_max = get_extra_sensor_max(1);
-      float temp_avg = get_extra_sensor_avg(1);
+    Serial.println("    !Time to run task: " + String(sched_task_names[task]) + " (due: " + String(sched_tasks[task].next_due_s) + ", delta: " + String(sched_tasks[task].next_due_s - now) + ")");
+    doRunTask(task);
 
-      Serial.println("  Calculated extra sensor values:");
-      Serial.println("    Humidity: Min: " + String(humidity_min, 2) + " - Avg: " + String(humidity_avg, 2) + " - Max: " + String(humidity_max, 2));
-      Serial.println("    Temperature: Min: " + String(temp_min, 2) + " - Avg: " + String(temp_avg, 2) + " - Max: " + String(temp_max, 2));
+    watchdog_pet();
 
-    }
+    // Tasks can take a while (GPS, SMS retries), so pick up the time again before scheduling the next run
+    now = time(NULL);
+    sched_task_done(task, now);
   }
 
-  watchdog_pet();
-
-  // When was the previous time that we should have sent an SMS today?
-  time_t prev_scheduled_sms_send_time = prev_midnight + long(seconds_since_midnight / SMS_DAILY_SEND_INTERVAL) * SMS_DAILY_SEND_INTERVAL;
-
-  Serial.println("  Previous scheduled SMS send time: " + String(prev_scheduled_sms_send_time));
-
-  // If the previous due SMS send time is newer than the last time we sent an SMS, then we should send an SMS now.
-  // TODO: Add a grace period here, so that if we're within X minutes of the target time, then do the send / read anyways?
-  if (prev_scheduled_sms_send_time > last_sms_send_time_s)
+  // If the modem is on anyway and the clock has drifted halfway to the limit, a time sync costs next to nothing
+  if (_modem_is_on && drift_predicted_error_s(now) > WATERPAL_DRIFT_MAX_ERROR_S / 2.0f)
   {
-    // Send our SMS and clear our accumulated data readings
-    doSendSMS();
+    modem_setLocalTimeFromCCLK();
+    now = time(NULL);
   }
+  // Any sync this wake (the extended check, a GPS fix, or the one above) moves the next one out
+  doScheduleTimeSync(now);
 
-  time_t next_scheduled_sms_send_time = prev_scheduled_sms_send_time + SMS_DAILY_SEND_INTERVAL;
-  time_t next_scheduled_sensor_read_time = (NUM_EXTRA_SENSOR_READS_PER_DAY > 0 && NUM_EXTRA_SENSORS > 0) ? prev_scheduled_sensor_read_time + EXTRA_SENSOR_READ_INTERVAL : next_scheduled_sms_send_time;
+  sched_print(now);
 
-  Serial.println("  Next scheduled sensor read time: " + String(next_scheduled_sensor_read_time) + " (delta: " + String(next_scheduled_sensor_read_time - now) + ")");
-  Serial.println("  Next scheduled SMS send time: " + String(next_scheduled_sms_send_time) + " (delta: " + String(next_scheduled_sms_send_time - now) + ")");
-
-  // Figure out which of the two times is closer, and set the next wake up time to be that time.
-  time_t next_wake_time = next_scheduled_sms_send_time;
-  if (next_scheduled_sensor_read_time < next_scheduled_sms_send_time)
-  {
-    Serial.println("   Next wake time is the sensor read time");
-    next_wake_time = next_scheduled_sensor_read_time;
-  } else {
-    Serial.println("   Next wake time is the SMS send time");
-  }
+  time_t next_wake_time = sched_next_wake(now);
 
   Serial.println("  Next wake time: " + String(next_wake_time) + " (delta: " + String(next_wake_time - now) + ")");
 
@@ -887,6 +988,14 @@ void doDeepSleep(time_t nextWakeTime)
   // Calculate the time until the next wakeup time. Get current RTC time via gettimeofday()
   GET_LOCALTIME_NOW; // populate `now` and `timeinfo`
 
+#if WATERPAL_USE_OTA
+  // Everything else is done, so any spare time on the connection goes to firmware updates
+  if (gprs_connected)
+  {
+    ota_poll();
+  }
+#endif // WATERPAL_USE_OTA
+
   // Disconnect from GPRS if needed
   if (WATERPAL_USE_GPRS)
   {
@@ -906,6 +1015,20 @@ void doDeepSleep(time_t nextWakeTime)
   // Shut off the modem (TODO: Perhaps only put it into sleep / low-power mode?)
   modem_off();
 
+  // In case the sensors were powered up for a read that didn't run after all
+  extraSensors::power_down(extra_sensor_state);
+
+#if WATERPAL_USE_OTA
+  // Restart into a newly installed update, or go back from one that never reached the network
+  ota_before_sleep(water_channels_any_flowing());
+#endif // WATERPAL_USE_OTA
+
+  // If the water is running, sample the handle counter from light sleep until it stops (or the next task is due). If it stopped,
+  //  the float switch wakes us again as soon as we're in deep sleep, and the edge is logged as usual.
+  flow_monitor_run(water_sensor_value, nextWakeTime);
+  now = time(NULL);
+  localtime_r(&now, &timeinfo);
+
   // Calculate the time until the next wakeup
   time_t seconds_until_wakeup = nextWakeTime - now;
 
@@ -914,29 +1037,24 @@ void doDeepSleep(time_t nextWakeTime)
 
   Serial.println("  Seconds until next wake up: " + String(seconds_until_wakeup));
 
-  int triggerOnEdge = 1; // Default to triggering on a rising edge.
+  watchdog_pet();
 
-  // If we're currently tracking a rising edge, then configure to trigger on a falling edge instead.
-  if (water_sensor_value == HIGH)
-  {
-    triggerOnEdge = 0;
-    Serial.println("  Configuring trigger for falling edge");
-  }
-  else
+  // Configure the deep sleep wakeup: every water input pin on the level it doesn't have now, and every counter's LOOP pin on its
+  //  next change, so that no wrap is missed. If a water input pin can't be a wake source this time, wake to poll it instead.
+  wakePlan wake_plan;
+  wake_plan_init(wake_plan);
+  water_channels_add_wake_pins(wake_plan);
+  handle_counter_add_wake_pins(wake_plan);
+  if (!wake_plan_apply(wake_plan) && seconds_until_wakeup > WATERPAL_WAKE_POLL_S)
   {
-    Serial.println("  Configuring trigger for rising edge");
+    seconds_until_wakeup = WATERPAL_WAKE_POLL_S;
   }
 
-  watchdog_pet();
-
-  // Configure the deep sleep wakeup
-  esp_sleep_enable_ext0_wakeup(WATERPAL_FLOAT_SWITCH_INPUT_PIN, triggerOnEdge);
-
   //  Configure the deep sleep timer
-  esp_sleep_enable_timer_wakeup(seconds_until_wakeup * 1000000ull);
+  esp_sleep_enable_timer_wakeup(drift_sleep_us(seconds_until_wakeup)); // Adjusted for the RTC running fast or slow
 
   // Log some information for debugging purposes:
-  Serial.println("  Total water usage time: " + String(total_water_usage_time_s) + " seconds");
+  Serial.println("  Total water usage time: " + String((long)usage_total_s()) + " seconds");
 
   Serial.println("  Disabling watchdog timer");
   // Disable the watchdog timer before going to sleep
@@ -0,0 +1,126 @@
+// waterpal_cbor.h: Minimal CBOR (RFC 8949) writer into a caller-provided buffer
+
+#ifndef WATERPAL_CBOR_H
+#define WATERPAL_CBOR_H
+
+#include <Arduino.h>
+
+// CBOR major types
+#define CBOR_MAJOR_UINT 0
+#define CBOR_MAJOR_NEGINT 1
+#define CBOR_MAJOR_BYTES 2
+#define CBOR_MAJOR_TEXT 3
+#define CBOR_MAJOR_ARRAY 4
+#define CBOR_MAJOR_MAP 5
+
+typedef struct cborWriter
+{
+  uint8_t* buf;
+  size_t size;
+  size_t len;
+  bool overflow; // Set if anything didn't fit -- the output is unusable in that case
+} cborWriter;
+
+void cbor_init(cborWriter& w, uint8_t* buf, size_t size)
+{
+  w.buf = buf;
+  w.size = size;
+  w.len = 0;
+  w.overflow = false;
+}
+
+void cbor_put_byte(cborWriter& w, uint8_t b)
+{
+  if (w.len >= w.size)
+  {
+    w.overflow = true;
+    return;
+  }
+  w.buf[w.len++] = b;
+}
+
+// Write a major type and its argument, using the shortest encoding
+void cbor_put_head(cborWriter& w, uint8_t major, uint64_t val)
+{
+  uint8_t mt = major << 5;
+  if (val < 24)
+  {
+    cbor_put_byte(w, mt | (uint8_t)val);
+    return;
+  }
+
+  int num_bytes;
+  if (val <= 0xFF)
+  {
+    cbor_put_byte(w, mt | 24);
+    num_bytes = 1;
+  }
+  else if (val <= 0xFFFF)
+  {
+    cbor_put_byte(w, mt | 25);
+    num_bytes = 2;
+  }
+  else if (val <= 0xFFFFFFFFULL)
+  {
+    cbor_put_byte(w, mt | 26);
+    num_bytes = 4;
+  }
+  else
+  {
+    cbor_put_byte(w, mt | 27);
+    num_bytes = 8;
+  }
+
+  for (int i = num_bytes - 1; i >= 0; i--)
+  {
+    cbor_put_byte(w, (uint8_t)(val >> (i * 8)));
+  }
+}
+
+void cbor_put_uint(cborWriter& w, uint64_t val)
+{
+  cbor_put_head(w, CBOR_MAJOR_UINT, val);
+}
+
+void cbor_put_int(cborWriter& w, int64_t val)
+{
+  if (val >= 0)
+  {
+    cbor_put_head(w, CBOR_MAJOR_UINT, (uint64_t)val);
+  }
+  else
+  {
+    cbor_put_head(w, CBOR_MAJOR_NEGINT, (uint64_t)(-1 - val));
+  }
+}
+
+void cbor_put_bytes(cborWriter& w, const uint8_t* data, size_t len)
+{
+  cbor_put_head(w, CBOR_MAJOR_BYTES, len);
+  for (size_t i = 0; i < len; i++)
+  {
+    cbor_put_byte(w, data[i]);
+  }
+}
+
+void cbor_put_text(cborWriter& w, const char* str)
+{
+  size_t len = strlen(str);
+  cbor_put_head(w, CBOR_MAJOR_TEXT, len);
+  for (size_t i = 0; i < len; i++)
+  {
+    cbor_put_byte(w, (uint8_t)str[i]);
+  }
+}
+
+void cbor_put_array(cborWriter& w, size_t num_items)
+{
+  cbor_put_head(w, CBOR_MAJOR_ARRAY, num_items);
+}
+
+void cbor_put_map(cborWriter& w, size_t num_pairs)
+{
+  cbor_put_head(w, CBOR_MAJOR_MAP, num_pairs);
+}
+
+#endif // WATERPAL_CBOR_H
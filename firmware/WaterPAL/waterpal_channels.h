@@ -0,0 +1,217 @@
+// waterpal_channels.h: Water input channels -- one float switch each -- read together, debounced separately, and all wake sources
+// Every wake reads every channel WATERPAL_WATER_DEBOUNCE_READS times, and each channel takes its own majority, so all of the edges
+//  since the last wake (however many channels changed at once) are handled in that one wake. Before deep sleep, each channel is a
+//  wake source for the level it doesn't have now (see waterpal_wake.h).
+// Channel 0 is the pump with the handle counter: its edges are logged by doLogWaterInput() in WaterPAL.ino, into the flow sessions and
+//  usage buckets. The other channels only have their flows counted and timed here -- split at report time like waterpal_usage.h, so a
+//  flow that's still running counts up to the report in this period -- and go out as their own report fields.
+#ifndef WATERPAL_CHANNELS_H
+#define WATERPAL_CHANNELS_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include "waterpal_config.h"
+#include "waterpal_report.h"
+#include "waterpal_wake.h"
+
+typedef struct waterChannelConfig
+{
+  int8_t pin;
+  bool invert; // Whether the pin is low while the water runs
+  const char* name;
+} waterChannelConfig;
+
+// Per-channel state, for channels 1 and up. Plain data, so it can live in RTC memory.
+typedef struct waterChannelState
+{
+  uint8_t last_value;         // Level at the last wake
+  int64_t edge_time_s;        // Time of the last edge
+  int64_t credited_until_s;   // How far the running flow has been credited (0 if the water isn't running)
+  uint32_t period_usage_s;    // This report period's flow time
+  uint32_t period_flow_count; // Flows that ended this report period
+} waterChannelState;
+
+const waterChannelConfig water_channel_configs[] = WATERPAL_WATER_CHANNELS;
+#define WATER_CHANNEL_NUM (sizeof(water_channel_configs) / sizeof(water_channel_configs[0]))
+
+static_assert(WATER_CHANNEL_NUM <= REPORT_WATER_CHANNELS_MAX, "The report only has fields for REPORT_WATER_CHANNELS_MAX channels");
+static_assert(WATERPAL_WATER_DEBOUNCE_READS % 2 == 1, "WATERPAL_WATER_DEBOUNCE_READS has to be odd");
+
+RTC_DATA_ATTR waterChannelState water_channel_states[WATER_CHANNEL_NUM];
+int water_channel_values[WATER_CHANNEL_NUM]; // This wake's debounced levels
+
+bool water_channel_is_flowing(int i, int value)
+{
+  return value != water_channel_configs[i].invert;
+}
+
+void water_channels_setup()
+{
+  for (int i = 0; i < WATER_CHANNEL_NUM; i++)
+  {
+    pinMode(water_channel_configs[i].pin, INPUT_PULLUP); // Steve - Aug 7 - pullup two x 10k resistor added, which also drains while switch is closed.
+  }
+}
+
+// Read every channel WATERPAL_WATER_DEBOUNCE_READS times, 50 ms apart, into water_channel_values[] by majority
+void water_channels_read()
+{
+  int total_reading[WATER_CHANNEL_NUM] = {};
+  for (int cnt = 0; cnt < WATERPAL_WATER_DEBOUNCE_READS; cnt++)
+  {
+    for (int i = 0; i < WATER_CHANNEL_NUM; i++)
+    {
+      total_reading[i] += digitalRead(water_channel_configs[i].pin);
+    }
+    delay(50);
+  }
+
+  for (int i = 0; i < WATER_CHANNEL_NUM; i++)
+  {
+    water_channel_values[i] = (total_reading[i] * 2 > WATERPAL_WATER_DEBOUNCE_READS);
+    Serial.println("  Channel " + String(i) + " (" + String(water_channel_configs[i].name) + ", pin " + String(water_channel_configs[i].pin) + "): " + String(water_channel_values[i]));
+    if (total_reading[i] > 0 && total_reading[i] < WATERPAL_WATER_DEBOUNCE_READS)
+    {
+      // If we have a mix of readings, then note it in the log so that we know the debounce code did something
+      Serial.println("   Mixed readings detected -- debouncing code worked! Total readings: " + String(total_reading[i]) + " out of " + String(WATERPAL_WATER_DEBOUNCE_READS));
+    }
+  }
+}
+
+// Log the edges on channels 1 and up since the last wake (channel 0's are logged by doLogWaterInput())
+void water_channels_log_edges(int64_t now_s)
+{
+  for (int i = 1; i < WATER_CHANNEL_NUM; i++)
+  {
+    waterChannelState& s = water_channel_states[i];
+    int value = water_channel_values[i];
+    if (value == s.last_value && s.edge_time_s != 0)
+    {
+      continue;
+    }
+
+    if (s.edge_time_s == 0)
+    {
+      // First wake since power-on: only take the level (a flow that's already running isn't timed)
+    }
+    else if (water_channel_is_flowing(i, value))
+    {
+      s.credited_until_s = now_s;
+      Serial.println("  Channel " + String(i) + " (" + String(water_channel_configs[i].name) + "): water started");
+    }
+    else
+    {
+      // Nothing to credit for a flow that was already running at power-on
+      if (s.credited_until_s > 0 && now_s > s.credited_until_s)
+      {
+        s.period_usage_s += now_s - s.credited_until_s;
+      }
+      s.credited_until_s = 0;
+      s.period_flow_count++;
+      Serial.println("  Channel " + String(i) + " (" + String(water_channel_configs[i].name) + "): water stopped after " + String((long)(now_s - s.edge_time_s)) + " seconds");
+    }
+    s.edge_time_s = now_s;
+    s.last_value = value;
+  }
+}
+
+// Whether the water is running on any channel, as of this wake's read
+bool water_channels_any_flowing()
+{
+  for (int i = 0; i < WATER_CHANNEL_NUM; i++)
+  {
+    if (water_channel_is_flowing(i, water_channel_values[i]))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Each channel wakes us on the level it doesn't have now
+void water_channels_add_wake_pins(wakePlan& plan)
+{
+  for (int i = 0; i < WATER_CHANNEL_NUM; i++)
+  {
+    wake_plan_add(plan, water_channel_configs[i].pin, !water_channel_values[i], true);
+  }
+}
+
+// Likewise for a light sleep, where every pin can have its own level
+void water_channels_enable_light_sleep_wakeup()
+{
+  for (int i = 0; i < WATER_CHANNEL_NUM; i++)
+  {
+    gpio_wakeup_enable((gpio_num_t)water_channel_configs[i].pin, water_channel_values[i] ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+  }
+  esp_sleep_enable_gpio_wakeup();
+}
+
+void water_channels_disable_light_sleep_wakeup()
+{
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_GPIO);
+  for (int i = 0; i < WATER_CHANNEL_NUM; i++)
+  {
+    gpio_wakeup_disable((gpio_num_t)water_channel_configs[i].pin);
+  }
+}
+
+// Whether any channel has changed since this wake's read, checked twice so a bounce doesn't count
+bool water_channels_changed()
+{
+  for (int i = 0; i < WATER_CHANNEL_NUM; i++)
+  {
+    if (digitalRead(water_channel_configs[i].pin) != water_channel_values[i])
+    {
+      delay(50);
+      if (digitalRead(water_channel_configs[i].pin) != water_channel_values[i])
+      {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// The period's flows on channels 1 and up go into the report, with a flow that's still running credited up to now
+void water_channels_fill_report(dailyReport& report, int64_t now_s)
+{
+  for (int i = 0; i < REPORT_WATER_CHANNELS_MAX - 1; i++)
+  {
+    report.channel_usage_s[i] = 0;
+    report.channel_flow_count[i] = 0;
+  }
+  for (int i = 1; i < WATER_CHANNEL_NUM; i++)
+  {
+    waterChannelState& s = water_channel_states[i];
+    if (s.credited_until_s > 0 && now_s > s.credited_until_s)
+    {
+      s.period_usage_s += now_s - s.credited_until_s;
+      s.credited_until_s = now_s;
+    }
+    report.channel_usage_s[i - 1] = s.period_usage_s;
+    report.channel_flow_count[i - 1] = s.period_flow_count;
+  }
+}
+
+void water_channels_start_period()
+{
+  for (int i = 1; i < WATER_CHANNEL_NUM; i++)
+  {
+    water_channel_states[i].period_usage_s = 0;
+    water_channel_states[i].period_flow_count = 0;
+  }
+}
+
+void water_channels_print()
+{
+  for (int i = 1; i < WATER_CHANNEL_NUM; i++)
+  {
+    const waterChannelState& s = water_channel_states[i];
+    Serial.println("  Channel " + String(i) + " (" + String(water_channel_configs[i].name) + "): " + String(s.period_usage_s) + " s of water in " + String(s.period_flow_count) + " flows" + (s.credited_until_s > 0 ? " (running now)" : ""));
+  }
+}
+
+#endif // WATERPAL_CHANNELS_H
@@ -0,0 +1,303 @@
+// waterpal_coap.h: Authenticated CoAP-over-UDP report upload, as a lighter-weight alternative to HTTPS
+
+#ifndef WATERPAL_COAP_H
+#define WATERPAL_COAP_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include <mbedtls/md.h>
+#include "waterpal_config.h"
+#include "waterpal_report.h"
+#include "waterpal_payload.h"
+#include "waterpal_transport.h"
+#include "waterpal_outbox.h"
+
+// Each report goes out as a single CoAP (RFC 7252) confirmable POST in one UDP datagram, and the collector's ACK is the only
+//  thing that comes back -- no TCP or TLS handshake, no HTTP headers and no redirect body.
+//
+// Datagram layout:
+//  CoAP header (4 bytes, no token) | Uri-Path option | Content-Format option (CBOR) | 0xFF |
+//  auth sequence number (4 bytes, big-endian) | CBOR report (see waterpal_payload.h) | HMAC-SHA256 (first COAP_HMAC_LEN bytes)
+// The HMAC covers every byte before it, using WATERPAL_COAP_HMAC_KEY. mbedtls runs SHA-256 on the ESP32's SHA accelerator.
+// The collector rejects any sequence number at or below the last one it accepted from that IMEI (except for a retransmission
+//  of that same datagram, which it ACKs again), so captured datagrams can't be replayed. See firmware/utils/waterpal_coap_collector.py.
+
+#define COAP_VERSION 1
+#define COAP_TYPE_CON 0
+#define COAP_TYPE_ACK 2
+#define COAP_TYPE_RST 3
+#define COAP_CODE_POST 0x02
+#define COAP_CODE_CLASS(code) ((code) >> 5)
+#define COAP_OPTION_URI_PATH 11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_CONTENT_FORMAT_CBOR 60
+#define COAP_PAYLOAD_MARKER 0xFF
+
+#define COAP_HMAC_LEN 16 // Truncated HMAC-SHA256
+#define COAP_SOCKET_MUX 2 // Modem socket for the UDP "connection" (0 and 1 are the HTTPS endpoints)
+#define COAP_POLL_INTERVAL_MS 100
+
+// Message ID for matching ACKs, and the last sequence number that we signed
+volatile RTC_DATA_ATTR uint16_t coap_message_id;
+volatile RTC_DATA_ATTR uint32_t coap_auth_seq;
+
+// Cumulative (since power-on) statistics, for comparing against the HTTPS transport (see transport_print_stats())
+volatile RTC_DATA_ATTR uint32_t coap_exchange_count;   // Reports that were ACKed
+volatile RTC_DATA_ATTR uint32_t coap_retransmit_count;
+volatile RTC_DATA_ATTR uint32_t coap_bytes_sent;
+volatile RTC_DATA_ATTR uint32_t coap_bytes_received;
+volatile RTC_DATA_ATTR uint32_t coap_exchange_ms_total; // Time from first send until the ACK, summed over ACKed reports
+
+uint8_t coap_message_buffer[WATERPAL_COMPACT_PAYLOAD_MAX + 64];
+
+// The next sequence number to sign. RTC memory is lost on a power cut, so never go below the clock -- that keeps us above
+//  anything the collector has already accepted, as long as we average less than one report per second.
+uint32_t coap_next_auth_seq()
+{
+  uint32_t seq = coap_auth_seq + 1;
+  uint32_t now = (uint32_t)time(NULL);
+  if (now > seq)
+  {
+    seq = now;
+  }
+  coap_auth_seq = seq;
+  return seq;
+}
+
+// Build the signed CON POST for a report into coap_message_buffer. Returns the message length, or 0 on failure.
+size_t coap_build_report_message(const dailyReport& report, uint16_t message_id, uint32_t seq)
+{
+  const uint8_t* payload;
+  size_t payload_len = payload_encode(&report, 1, PAYLOAD_ENCODING_CBOR, outbox_delta_begin(OUTBOX_CHANNEL_COAP), &payload);
+  size_t path_len = strlen(WATERPAL_COAP_URI_PATH);
+  if (payload_len == 0 || path_len > 12 || 4 + 1 + path_len + 2 + 1 + 4 + payload_len + COAP_HMAC_LEN > sizeof(coap_message_buffer))
+  {
+    return 0;
+  }
+
+  uint8_t* buf = coap_message_buffer;
+  size_t len = 0;
+  buf[len++] = (COAP_VERSION << 6) | (COAP_TYPE_CON << 4); // No token -- the ACK is matched on message ID
+  buf[len++] = COAP_CODE_POST;
+  buf[len++] = message_id >> 8;
+  buf[len++] = message_id & 0xFF;
+
+  // Options are delta-encoded against the previous option number
+  buf[len++] = (COAP_OPTION_URI_PATH << 4) | path_len;
+  memcpy(buf + len, WATERPAL_COAP_URI_PATH, path_len);
+  len += path_len;
+  buf[len++] = ((COAP_OPTION_CONTENT_FORMAT - COAP_OPTION_URI_PATH) << 4) | 1;
+  buf[len++] = COAP_CONTENT_FORMAT_CBOR;
+
+  buf[len++] = COAP_PAYLOAD_MARKER;
+  for (int i = 3; i >= 0; i--)
+  {
+    buf[len++] = (uint8_t)(seq >> (i * 8));
+  }
+  memcpy(buf + len, payload, payload_len);
+  len += payload_len;
+
+  uint8_t hmac[32];
+  if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                      (const unsigned char*)WATERPAL_COAP_HMAC_KEY, strlen(WATERPAL_COAP_HMAC_KEY),
+                      buf, len, hmac) != 0)
+  {
+    Serial.println("Failed to compute HMAC");
+    return 0;
+  }
+  memcpy(buf + len, hmac, COAP_HMAC_LEN);
+  len += COAP_HMAC_LEN;
+
+  return len;
+}
+
+// Open the modem's UDP socket to the collector (GPRS must already be connected)
+bool coap_socket_open()
+{
+  modem.sendAT("+CAOPEN=", COAP_SOCKET_MUX, ",\"", WATERPAL_COAP_HOST, "\",", WATERPAL_COAP_PORT, ",\"UDP\"");
+  if (modem.waitResponse(10000L, "+CAOPEN: ") != 1)
+  {
+    Serial.println("Failed to open UDP socket");
+    return false;
+  }
+  modem.streamGetIntBefore(','); // Socket
+  int result = modem.streamGetIntBefore('\n');
+  modem.waitResponse();
+  if (result != 0)
+  {
+    Serial.println("Failed to open UDP socket, result: " + String(result));
+    return false;
+  }
+  return true;
+}
+
+void coap_socket_close()
+{
+  modem.sendAT("+CACLOSE=", COAP_SOCKET_MUX);
+  modem.waitResponse();
+}
+
+bool coap_socket_send(const uint8_t* data, size_t len)
+{
+  modem.sendAT("+CASEND=", COAP_SOCKET_MUX, ",", len);
+  if (modem.waitResponse(">") != 1)
+  {
+    return false;
+  }
+  modem.stream.write(data, len);
+  modem.stream.flush();
+  if (modem.waitResponse(5000L) != 1)
+  {
+    return false;
+  }
+  coap_bytes_sent += len;
+  return true;
+}
+
+// Read one waiting datagram into buf. Returns its length, 0 if nothing is waiting, or -1 on error.
+int coap_socket_receive(uint8_t* buf, size_t size)
+{
+  modem.sendAT("+CARECV=", COAP_SOCKET_MUX, ",", size);
+  if (modem.waitResponse("+CARECV: ") != 1)
+  {
+    return -1;
+  }
+  int len = modem.stream.parseInt();
+  if (len <= 0 || modem.stream.read() != ',')
+  {
+    // "+CARECV: 0" -- nothing waiting
+    modem.waitResponse();
+    return 0;
+  }
+  int bytes_read = modem.stream.readBytes(buf, len);
+  modem.waitResponse();
+  coap_bytes_received += bytes_read;
+  return bytes_read;
+}
+
+// Send a report to the CoAP collector, retransmitting with exponential backoff until it is ACKed. Returns 1 if the collector accepted it.
+int coap_send_report(const dailyReport& report)
+{
+  watchdog_pet();
+
+  uint16_t message_id = ++coap_message_id;
+  size_t len = coap_build_report_message(report, message_id, coap_next_auth_seq());
+  if (len == 0)
+  {
+    Serial.println("Failed to build CoAP message");
+    return 0;
+  }
+
+  if (!coap_socket_open())
+  {
+    return 0;
+  }
+
+  Serial.println("Sending CoAP report (" + String(len) + " bytes, message ID " + String(message_id) + ")");
+
+  // RFC 7252 section 4.8: the first timeout is randomized between ACK_TIMEOUT and 1.5 * ACK_TIMEOUT, then doubles each time
+  uint32_t timeout_ms = WATERPAL_COAP_ACK_TIMEOUT_MS + (esp_random() % (WATERPAL_COAP_ACK_TIMEOUT_MS / 2));
+  uint32_t start_ms = millis();
+  int result = -1; // -1: no response yet, 0: rejected, 1: accepted
+  uint8_t response[32];
+
+  for (int attempt = 0; attempt <= WATERPAL_COAP_MAX_RETRANSMIT && result < 0; attempt++)
+  {
+    watchdog_pet();
+
+    if (attempt > 0)
+    {
+      coap_retransmit_count++;
+      Serial.println("No CoAP ACK, retransmitting. Retry #" + String(attempt));
+    }
+    if (!coap_socket_send(coap_message_buffer, len))
+    {
+      Serial.println("Failed to send UDP datagram");
+    }
+
+    uint32_t sent_ms = millis();
+    while (result < 0 && millis() - sent_ms < timeout_ms)
+    {
+      watchdog_pet();
+      delay(COAP_POLL_INTERVAL_MS);
+
+      int response_len = coap_socket_receive(response, sizeof(response));
+      if (response_len < 4)
+      {
+        continue;
+      }
+
+      uint8_t type = (response[0] >> 4) & 0x03;
+      uint8_t code = response[1];
+      uint16_t response_id = (response[2] << 8) | response[3];
+      if (response_id != message_id || (type != COAP_TYPE_ACK && type != COAP_TYPE_RST))
+      {
+        // Stale ACK for an earlier message
+        continue;
+      }
+
+      if (type == COAP_TYPE_ACK && COAP_CODE_CLASS(code) == 2)
+      {
+        result = 1;
+      }
+      else
+      {
+        Serial.println("CoAP report rejected, type: " + String(type) + ", code: " + String(COAP_CODE_CLASS(code)) + "." + String(code & 0x1F));
+        result = 0;
+      }
+    }
+
+    timeout_ms *= 2;
+  }
+
+  coap_socket_close();
+
+  if (result == 1)
+  {
+    uint32_t exchange_ms = millis() - start_ms;
+    coap_exchange_count++;
+    coap_exchange_ms_total += exchange_ms;
+    Serial.println("CoAP report ACKed after " + String(exchange_ms) + " ms");
+    return 1;
+  }
+
+  if (result < 0)
+  {
+    Serial.println("No CoAP ACK after " + String(WATERPAL_COAP_MAX_RETRANSMIT) + " retransmissions");
+  }
+  return 0;
+}
+
+// Send every report in the outbox that the collector hasn't ACKed yet, oldest first. Returns 1 once it is caught up, or 0 if a report failed.
+int coap_flush_outbox()
+{
+  dailyReport report;
+  while (outbox_read_pending(OUTBOX_CHANNEL_COAP, &report, 1) == 1)
+  {
+    if (!coap_send_report(report))
+    {
+      return 0;
+    }
+    outbox_mark_sent(OUTBOX_CHANNEL_COAP, report.seq);
+  }
+  return 1;
+}
+
+// Compare the average cost of a CoAP report against an HTTPS request to the WaterPAL endpoint
+void coap_print_stats()
+{
+  Serial.println("CoAP: " + String(coap_exchange_count) + " reports ACKed, " + String(coap_retransmit_count) + " retransmits, sent " + String(coap_bytes_sent) + " bytes, received " + String(coap_bytes_received) + " bytes");
+  if (coap_exchange_count > 0)
+  {
+    Serial.println("  CoAP per report: " + String((coap_bytes_sent + coap_bytes_received) / coap_exchange_count) + " bytes, " + String(coap_exchange_ms_total / coap_exchange_count) + " ms");
+  }
+
+  uint32_t http_requests = transport_handshake_count[HTTP_ENDPOINT_WATERPAL] + transport_reuse_count[HTTP_ENDPOINT_WATERPAL];
+  if (http_requests > 0)
+  {
+    // NOTE: The modem terminates TLS, so these are plaintext bytes -- the TLS handshake and record overhead on the air is not included.
+    Serial.println("  HTTPS per request: " + String((transport_bytes_sent[HTTP_ENDPOINT_WATERPAL] + transport_bytes_received[HTTP_ENDPOINT_WATERPAL]) / http_requests) + " bytes");
+  }
+}
+
+#endif // WATERPAL_COAP_H
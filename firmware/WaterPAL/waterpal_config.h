@@ -38,12 +38,118 @@ const char WATERPAL_GPRS_PASS[] = "";
 
 // The max time to wait for a response from the server
 // NOTE: There may be a bug with this -- need to test more: https://github.com/arduino-libraries/ArduinoHttpClient/issues/154
+// This is also the ceiling (and the starting value) for the learned timeouts below.
 const uint32_t WATERPAL_HTTP_TIMEOUT_MS = 60 * 1000;
 #define WATERPAL_HTTP_RETRY_CNT 3 // How many times to retry sending an HTTP request
+#define WATERPAL_HTTP_DRAIN_MAX_BYTES 512 // Responses with a longer (or unknown length) body are cut off by closing the connection instead of being read
+#define WATERPAL_REPORT_TEXT_MAX 8192 // Buffer size (bytes) for a text report request (URL query, or JSON body of up to WATERPAL_UPLOAD_BATCH_MAX reports)
 
+// Learned HTTP timeouts: each endpoint remembers its recent connect / first-byte / total times, and times out at a margin above a high percentile of them.
+const uint32_t WATERPAL_HTTP_TIMEOUT_MIN_MS = 10 * 1000; // Never time out faster than this
+#define WATERPAL_HTTP_TIMING_HISTORY 8       // How many recent requests to remember per endpoint
+#define WATERPAL_HTTP_TIMING_MIN_SAMPLES 3   // How many samples we need before trusting the history over WATERPAL_HTTP_TIMEOUT_MS
+#define WATERPAL_HTTP_TIMEOUT_PERCENTILE 90  // Which percentile of the history to base the timeout on
+#define WATERPAL_HTTP_TIMEOUT_MARGIN_PCT 200 // Timeout is this percentage of the percentile value (200 = twice as long)
+
+#define WATERPAL_USE_WATERPAL_HTTP true // Whether or not to send daily reports to the WaterPAL HTTPS endpoint (the weekly extended data always goes over HTTPS)
 #define WATERPAL_USE_DESIGNOUTREACH_HTTP true // Whether or not to send HTTP requests to the Design Outreach server in addition to the regular WaterPAL endpoint
 #define WATERPAL_LITERS_PER_HR 950 // The number of liters transferred in 1 hour of water usage. NOTE: Only needed for Design Outreach reporting.
 
+// Upload modes for each HTTP endpoint:
+//  UPLOAD_MODE_PER_PERIOD: Send each report as soon as it is made (one request per report period). A backlog goes out one request
+//   per report, over the same connection.
+//  UPLOAD_MODE_BATCHED: Keep reports on the device and send them together as a single POST with an array of reports, every
+//   WATERPAL_UPLOAD_BATCH_PERIODS report periods (or sooner if the outbox fills up). Reports that fail to send are kept and resent
+//   with the next batch. Useful for high-frequency reporting (e.g. a 5 minute SMS_DAILY_SEND_INTERVAL).
+//  NOTE: The Design Outreach endpoint only accepts one report per request, so it only supports UPLOAD_MODE_PER_PERIOD.
+#define UPLOAD_MODE_PER_PERIOD 0
+#define UPLOAD_MODE_BATCHED 1
+#define WATERPAL_UPLOAD_MODE_WATERPAL UPLOAD_MODE_PER_PERIOD
+#define WATERPAL_UPLOAD_BATCH_PERIODS 6 // How many report periods to collect before sending a batch
+#define WATERPAL_UPLOAD_BATCH_MAX 12 // Max number of reports in one batch request (a longer backlog goes out in several requests over the same connection)
+
+// Outbox: every report is kept on the device until every channel (HTTP endpoints, CoAP and SMS) has delivered it, and
+//  undelivered reports are sent in order when connectivity returns (see waterpal_outbox.h).
+#define WATERPAL_OUTBOX_SIZE 12 // Max number of reports kept in RTC memory
+#define WATERPAL_USE_OUTBOX_FLASH true // Whether or not to move older undelivered reports into flash (LittleFS) when RTC memory is full
+#define WATERPAL_OUTBOX_FLASH_SIZE 48 // Max number of reports kept in flash
+
+// Flow sessions (each time the water runs) are logged in RTC memory and go out with their report in batched and compact uploads
+//  (see waterpal_flowlog.h). A session takes about 7-12 bytes; when the log is full the oldest are dropped.
+#define WATERPAL_FLOWLOG_BYTES 1024
+
+// Every report also breaks its water usage time and handle strokes down by time of day, into this many buckets from local midnight
+//  (24 = hourly). It has to divide the day evenly, into buckets of at most 65535 s. See waterpal_usage.h.
+#define WATERPAL_USAGE_BUCKETS 24
+
+// How an HTTP endpoint acknowledges a report (see waterpal_ledger.h):
+//  UPLOAD_ACK_STATUS: An accepted status code means the reports were delivered.
+//  UPLOAD_ACK_REPORT_ID: The response body must also be JSON carrying the server's report ID ("id"), and optionally the sequence
+//   number of the newest report it stored ("seq"). Anything not acknowledged is sent again (with the same sequence number).
+#define UPLOAD_ACK_STATUS 0
+#define UPLOAD_ACK_REPORT_ID 1
+#define WATERPAL_ACK_MODE_WATERPAL UPLOAD_ACK_STATUS // Apps Script answers with a redirect, so there is no body to read
+#define WATERPAL_ACK_MODE_DESIGNOUTREACH UPLOAD_ACK_STATUS
+
+// When to send the regular report SMS:
+//  SMS_POLICY_ALWAYS: Every report goes out by SMS, whatever happened over GPRS.
+//  SMS_POLICY_FALLBACK: Only reports that no GPRS channel (HTTP or CoAP) has delivered go out by SMS.
+//  SMS_POLICY_HEARTBEAT: Like SMS_POLICY_FALLBACK, but also send the latest report by SMS at least every WATERPAL_SMS_HEARTBEAT_INTERVAL_S.
+// Low water usage alerts always go out by SMS.
+#define SMS_POLICY_ALWAYS 0
+#define SMS_POLICY_FALLBACK 1
+#define SMS_POLICY_HEARTBEAT 2
+#define WATERPAL_SMS_POLICY SMS_POLICY_HEARTBEAT
+#define WATERPAL_SMS_HEARTBEAT_INTERVAL_S (24 * (60l * 60l)) // 24 hours
+
+// Payload encoding for each HTTP endpoint (see waterpal_payload.h):
+//  PAYLOAD_ENCODING_TEXT: The endpoint's own URL query string / JSON format.
+//  PAYLOAD_ENCODING_CBOR: Compact binary CBOR with integer field keys, POSTed as application/cbor.
+//  PAYLOAD_ENCODING_CBOR_HEATSHRINK: The same CBOR, compressed with heatshrink (window 8, lookahead 4) and sent with Content-Encoding: x-heatshrink.
+// The server has to understand the compact encodings (see firmware/utils/waterpal_decode.py). The Design Outreach endpoint only accepts its JSON format.
+#define PAYLOAD_ENCODING_TEXT 0
+#define PAYLOAD_ENCODING_CBOR 1
+#define PAYLOAD_ENCODING_CBOR_HEATSHRINK 2
+#define WATERPAL_PAYLOAD_ENCODING_WATERPAL PAYLOAD_ENCODING_TEXT
+#define WATERPAL_COMPACT_PAYLOAD_MAX 1024 // Buffer size (bytes) for compact payloads
+
+// WATERPAL_USE_DELTA_REPORTS: Compact (CBOR) reports only carry the fields that moved past their threshold since the last report
+//  the receiver got on that channel, with a full report every WATERPAL_DELTA_KEYFRAME_INTERVAL reports (see waterpal_delta.h).
+//  Text reports (query, JSON and SMS) always go out in full.
+#define WATERPAL_USE_DELTA_REPORTS false
+#define WATERPAL_DELTA_KEYFRAME_INTERVAL 7
+
+// WATERPAL_USE_COAP: Send each daily report as a single HMAC-signed CoAP message over UDP (see waterpal_coap.h).
+//  This skips the TLS handshake, HTTP headers and response body, so it uses far fewer bytes (and less modem time) than HTTPS.
+//  To use it instead of HTTPS for the WaterPAL reports, also set WATERPAL_USE_WATERPAL_HTTP to false.
+#define WATERPAL_USE_COAP false
+// TODO: Replace with your collector's address and key (the collector must know the same key)
+const char WATERPAL_COAP_HOST[] = "collector.example.com";
+#define WATERPAL_COAP_PORT 5683
+const char WATERPAL_COAP_URI_PATH[] = "r"; // At most 12 characters
+const char WATERPAL_COAP_HMAC_KEY[] = "change-me";
+#define WATERPAL_COAP_ACK_TIMEOUT_MS 4000 // Initial wait for the ACK before retransmitting (doubles each retry)
+#define WATERPAL_COAP_MAX_RETRANSMIT 4
+
+// WATERPAL_USE_OTA: Check for firmware updates over GPRS, and download them as signed delta patches against this firmware (see waterpal_ota.h).
+//  Needs a partition table with two OTA app partitions (the default), and a bootloader built with CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+//  so that an update that crashes before its first sleep is rolled back (one that can't reach the network goes back after
+//  WATERPAL_OTA_CONFIRM_ATTEMPTS tries). firmware/utils/waterpal_ota_patch.py makes the keys, patches and manifests, and
+//  firmware/utils/waterpal_ota_server.py is a local stand-in for the update server.
+#define WATERPAL_USE_OTA false
+#define WATERPAL_FIRMWARE_VERSION 1 // Increase for every release -- the update server picks the patch from this version to its newest
+// TODO: Replace with your update server and the public key from "waterpal_ota_patch.py keygen"
+const char WATERPAL_OTA_HOST[] = "updates.example.com";
+#define WATERPAL_OTA_PORT 443
+const char WATERPAL_OTA_PATH[] = "/ota";
+const char WATERPAL_OTA_PUBLIC_KEY[] =
+  "-----BEGIN PUBLIC KEY-----\n"
+  "REPLACE-ME\n"
+  "-----END PUBLIC KEY-----\n";
+#define WATERPAL_OTA_CHECK_INTERVAL_S (7 * 24 * (60l * 60l)) // How often to ask for an update (a download in progress carries on every wake)
+#define WATERPAL_OTA_MAX_BYTES_PER_WAKE (32 * 1024l) // Patch bytes to download per wake -- about 30 s at 9600 baud
+#define WATERPAL_OTA_CONFIRM_ATTEMPTS 6 // Failed GPRS connects before going back from new firmware that never reached the network
+
 // WATERPAL_USE_GPS: Whether or not to use the GPS module to get the device's location.
 //  If set to true, the device will attempt to get the GPS location and send it in an SMS message.
 //  If set to false, the device will skip the GPS location step.
@@ -60,9 +166,26 @@ const uint32_t WATERPAL_HTTP_TIMEOUT_MS = 60 * 1000;
 // WATERPAL_SMS_RETRY_CNT: How many times to retry sending an SMS message
 #define WATERPAL_SMS_RETRY_CNT 10
 
-// WATERPAL_SMS_SHORT_RETRY_CNT: How many times to retry sending a short SMS message
+// WATERPAL_SMS_SHORT_RETRY_CNT: How many times to retry sending a short SMS message (the fallback report shares them across its recipients)
 #define WATERPAL_SMS_SHORT_RETRY_CNT 10
 
+// WATERPAL_SMS_RETRY_BUDGET: How many retries the alert and regular SMS share in one send pass, across every message and recipient
+#define WATERPAL_SMS_RETRY_BUDGET 10
+
+// WATERPAL_SMS_PACKET_VERSION: Format of the regular report SMS.
+// 1: Decimal CSV ("1,IMEI,count,R,..."). The short fallback is the first 14 characters of "rIMEIcount,water,battery,temperature".
+// 2: Packed into GSM 7-bit characters (see waterpal_sms_codec.h), dropping the least important fields if it doesn't fit.
+#define WATERPAL_SMS_PACKET_VERSION 2
+#define WATERPAL_SMS_MAX_CHARS 160 // One SMS segment
+#define WATERPAL_SMS_SHORT_MAX_CHARS 14 // Short fallback packet
+
+// WATERPAL_USE_SMS_BINARY: Send the regular reports as 8-bit binary SMS in PDU mode (see waterpal_sms_pdu.h) instead of text.
+// The data is one byte of payload encoding, then the pending reports encoded as in waterpal_payload.h. A backlog of reports goes out together,
+//  split into concatenated SMS if it needs more than 140 bytes. The receiving number has to be able to take binary SMS.
+#define WATERPAL_USE_SMS_BINARY false
+#define WATERPAL_SMS_BINARY_ENCODING PAYLOAD_ENCODING_CBOR_HEATSHRINK
+#define WATERPAL_SMS_BINARY_MAX_PARTS 4 // Max concatenated SMS per binary message
+
 // How frequently do we want to send an SMS message?
 // 22 hours after midnight
 //#define SMS_DAILY_SEND_INTERVAL (22 * (60l * 60l)) // 22 hours in seconds
@@ -74,6 +197,38 @@ const uint32_t WATERPAL_HTTP_TIMEOUT_MS = 60 * 1000;
 // WATERPAL_LOW_USAGE_THRESHOLD: Threshold for low water usage (in seconds) to send an urgent SMS.
 #define WATERPAL_LOW_USAGE_THRESHOLD (10 * 60l) // 10 minutes
 
+// **********
+// Wake Scheduler Configuration (see waterpal_scheduler.h)
+// **********
+
+// Each task may run up to its tolerance before it is due, so that tasks falling due close together (or close to a float switch wake)
+//  share one wake. Tolerances are capped at half the task's period.
+#define WATERPAL_SENSOR_READ_TOLERANCE_S (10 * 60l) // A sensor reading a few minutes early doesn't matter
+#define WATERPAL_REPORT_TOLERANCE_S (5 * 60l)
+// The extended self-check (cell info, GPS, weekly GPRS data). This used to run on every 8th SMS.
+#define WATERPAL_EXTENDED_CHECK_INTERVAL_S (8 * SMS_DAILY_SEND_INTERVAL)
+#define WATERPAL_EXTENDED_CHECK_TOLERANCE_S (WATERPAL_EXTENDED_CHECK_INTERVAL_S / 4)
+// How often to refresh the GPS fix that the extended check sends (only with WATERPAL_USE_GPS)
+#define WATERPAL_GPS_INTERVAL_S WATERPAL_EXTENDED_CHECK_INTERVAL_S
+#define WATERPAL_GPS_TOLERANCE_S (WATERPAL_GPS_INTERVAL_S / 4)
+// How often to power up the modem and check for incoming SMS. With a tolerance of half the interval, this rides along with a report
+//  whenever one is close.
+#define WATERPAL_CONFIG_POLL_INTERVAL_S SMS_DAILY_SEND_INTERVAL
+#define WATERPAL_CONFIG_POLL_TOLERANCE_S (WATERPAL_CONFIG_POLL_INTERVAL_S / 2)
+
+// **********
+// Clock Drift Configuration (see waterpal_drift.h)
+// **********
+
+#define WATERPAL_DRIFT_MAX_ERROR_S 30 // Power up the modem to resync once the clock might be off by this many seconds
+#define WATERPAL_DRIFT_INITIAL_ERROR_PPM 1000.0f // Assumed RTC error until the first fit (the internal RC slow clock can be this far off)
+#define WATERPAL_DRIFT_MIN_ERROR_PPM 5.0f // Never trust the fit more than this -- the RTC rate moves with temperature
+#define WATERPAL_DRIFT_MAX_PPM 50000.0f // Anything bigger means the clock was set from elsewhere, so the fit starts over
+#define WATERPAL_DRIFT_MIN_FIT_INTERVAL_S (6 * 60l * 60l) // Sync points closer together than this are too coarse (1 s resolution) to fit
+#define WATERPAL_DRIFT_FIT_HISTORY_S (7 * 24l * 60l * 60l) // How much sync history the estimate averages over
+#define WATERPAL_DRIFT_MIN_SYNC_INTERVAL_S (60 * 60l)
+#define WATERPAL_DRIFT_MAX_SYNC_INTERVAL_S (7 * 24l * 60l * 60l)
+
 // **********
 // Float Sensor and Extra Sensor Configuration
 // **********
@@ -89,6 +244,13 @@ Note: you can only use pins that are RTC GPIOs with this wake-up source. Here’
 */
 #define WATERPAL_FLOAT_SWITCH_INPUT_PIN GPIO_NUM_34
 #define WATERPAL_FLOAT_SWITCH_INVERT false // Set to true to invert the input pin value
+
+// Water input channels, as { float switch pin, invert, name } (see waterpal_channels.h). Channel 0 is the pump with the handle counter,
+//  which the flow sessions, usage buckets and stroke fields are about. Up to three more (a second pump, an overflow switch, ...) each
+//  get their own usage time and flow count fields. Every pin has to be an RTC GPIO (from the list above), since they all wake us.
+#define WATERPAL_WATER_CHANNELS { { WATERPAL_FLOAT_SWITCH_INPUT_PIN, WATERPAL_FLOAT_SWITCH_INVERT, "pump" } }
+#define WATERPAL_WATER_DEBOUNCE_READS 5 // Reads of every channel per wake, 50 ms apart; each channel takes its majority (odd, so there's no tie)
+#define WATERPAL_WAKE_POLL_S (5 * 60l) // Longest deep sleep when a float switch can't be a wake source (see waterpal_wake.h)
 #define WATERPAL_DHTPIN 32
 
 // **********
@@ -100,18 +262,47 @@ Note: you can only use pins that are RTC GPIOs with this wake-up source. Here’
 #define WATERPAL_COUNTER_SDA_PIN 21
 #define WATERPAL_COUNTER_SCL_PIN 22
 #define WATERPAL_COUNTER_RST_PIN 33
-#define WATERPAL_COUNTER_LOOP_PIN 35
+#define WATERPAL_COUNTER_LOOP_PIN 35 // The S-35770's LOOP output, which changes level each time the count wraps. Must be an RTC GPIO (it wakes us), or -1.
 #define WATERPAL_COUNTER_I2C_SPEED_HZ 100000
 #define WATERPAL_COUNTER_MAX_COUNT 16777216UL
+#define WATERPAL_COUNTER_FAIL_STREAK_ERROR 3 // Failed reads in a row before a counter logs ERROR_COUNTER_FAIL
+
+// Every S-35770 on the bus, as { I2C address, LOOP pin }. The first one is the pump handle's, which the stroke accounting uses; any
+//  others are read alongside it and only counted. The S-35770's address is fixed, so more than one needs an I2C address translator.
+#define WATERPAL_COUNTERS { { WATERPAL_COUNTER_I2C_ADDRESS, WATERPAL_COUNTER_LOOP_PIN } }
 #define WATERPAL_MIN_DRY_DRAIN_TIME_S (4 * 60l) // Default to 240 seconds for pump to drain completely dry.
 
-#define NUM_EXTRA_SENSORS 2 // The number of extra sensors to read. Here, we have a humidity and temperature sensor.
-#define NUM_EXTRA_SENSOR_READS_PER_DAY 24 // How many readings do we want to log per day? Here, we log every hour.
+// Active-flow monitoring (see waterpal_flow_monitor.h): while the water runs, stay in light sleep and read the counter every
+//  WATERPAL_FLOW_MONITOR_SAMPLE_MS instead of deep sleeping until the flow stops, to log each session's stroke-rate profile.
+//  The currents are estimates, for the energy the monitoring costs (reported as flow_monitor_uah).
+#define WATERPAL_USE_FLOW_MONITOR true
+#define WATERPAL_FLOW_MONITOR_SAMPLE_MS 1000 // Time between counter reads
+#define WATERPAL_FLOW_MONITOR_WINDOW_S 10 // Stroke rates are taken over windows this long
+#define WATERPAL_FLOW_MONITOR_BUDGET_S (60 * 60l) // Most time to spend monitoring per report period (e.g. if the float switch sticks on)
+#define WATERPAL_ACTIVE_CURRENT_UA 30000 // Draw while awake with the modem off
+#define WATERPAL_LIGHT_SLEEP_CURRENT_UA 800 // Draw in light sleep
+
+// Extra sensors are listed in the registry in waterpal_sensors.h; these switch them on and off (a disabled sensor compiles to nothing)
+#define WATERPAL_USE_DHT true // Humidity and temperature
+#define NUM_EXTRA_SENSOR_READS_PER_DAY 24 // How many DHT readings do we want to log per day? Here, we log every hour.
+
+// Solar panel voltage and current (see the README task list). The T-SIM7000G has the panel voltage on GPIO 36 through a 2:1 divider.
+#define WATERPAL_USE_SOLAR_VOLTAGE false
+#define WATERPAL_SOLAR_VOLTAGE_PIN 36
+#define WATERPAL_SOLAR_VOLTAGE_DIVIDER 2
+#define WATERPAL_USE_SOLAR_CURRENT false
+#define WATERPAL_SOLAR_CURRENT_PIN 39
+#define WATERPAL_SOLAR_CURRENT_MA_PER_MV 1.0f // Current-sense amplifier output scale
+#define WATERPAL_SOLAR_READ_INTERVAL_S (60 * 60l)
 
 // NOTE: Uncomment the correct line for the DHT sensor you are using.
 #define WATERPAL_DHTTYPE DHT11    // DHT 11
 //#define WATERPAL_DHTTYPE DHT22  // DHT 22 (AM2302), AM2321
 //#define WATERPAL_DHTTYPE DHT21  // DHT 21 (AM2301)
+#define WATERPAL_DHT_POWER_PIN 18 // GPIO that supplies the DHT's VCC, so it's only powered while being read (-1 if it's wired to 3.3V)
+#define WATERPAL_DHT_WARMUP_MS 1000 // From power-on to the first conversion: 1 s for a DHT11, 2 s for a DHT22 / DHT21
+#define WATERPAL_DHT_READ_ATTEMPTS 3 // Conversions to try (each one gives both humidity and temperature) before giving up on a reading
+#define WATERPAL_DHT_RETRY_INTERVAL_MS 1000 // Minimum time between conversions: 1 s for a DHT11, 2 s for a DHT22 / DHT21
 
 // **********
 // T-SIM 7000g Pin Allocation
@@ -130,7 +321,7 @@ Note: you can only use pins that are RTC GPIOs with this wake-up source. Here’
 
 // 23 - VSPI_MOSI
 // 19 - VSPI_MISO
-// 18 - VSPI_SCK
+// 18 - VSPI_SCK, used for the DHT's VCC (WATERPAL_DHT_POWER_PIN)
 // 05 - VSPI_SS
 
 // 21 - Wire SDA
@@ -139,7 +330,7 @@ Note: you can only use pins that are RTC GPIOs with this wake-up source. Here’
 // 26 - Modem (SIM7000G) TX
 // 27 - Modem (SIM7000G) RX
 
-// 32 -
+// 32 - DHT data (WATERPAL_DHTPIN)
 // 33 -
 // 34 - 
 // 35 - 
@@ -0,0 +1,73 @@
+// waterpal_delta.h: Delta reports -- only the fields that moved since the copy the receiver already has
+
+#ifndef WATERPAL_DELTA_H
+#define WATERPAL_DELTA_H
+
+#include <Arduino.h>
+#include "waterpal_config.h"
+#include "waterpal_report.h"
+#include "waterpal_schema.h"
+
+// With WATERPAL_USE_DELTA_REPORTS, a compact (CBOR) report can leave out every field that is within its delta_threshold
+//  (waterpal_schema.h) of the receiver's copy, and names that copy by its sequence number (PAYLOAD_REPORT_KEY_BASE).
+// The receiver fills in the missing fields from that record, so the "baseline" we compare against is what the receiver
+//  reconstructed, not what we measured: a value that creeps up by less than its threshold each day still gets sent
+//  once it has drifted past the threshold in total. Each channel keeps the baseline of the newest report it has delivered
+//  (see outbox_delta_begin() in waterpal_outbox.h), and every WATERPAL_DELTA_KEYFRAME_INTERVAL reports go out in full.
+
+// Does this report have to go out in full?
+bool delta_is_keyframe(const dailyReport& report, const dailyReport& baseline)
+{
+  return baseline.seq == 0 ||
+    report.seq <= baseline.seq ||
+    report.seq - baseline.seq >= WATERPAL_DELTA_KEYFRAME_INTERVAL ||
+    report.seq % WATERPAL_DELTA_KEYFRAME_INTERVAL == 0;
+}
+
+// Does a delta report against the baseline need to carry this field?
+bool delta_field_changed(const reportField& field, const dailyReport& report, const dailyReport& baseline)
+{
+  if (field.delta_threshold == REPORT_DELTA_ALWAYS)
+  {
+    return true;
+  }
+  int64_t diff = schema_get_value(report, field) - schema_get_value(baseline, field);
+  return diff > field.delta_threshold || diff < -(int64_t)field.delta_threshold;
+}
+
+// Set a field of the report from an int64 (the inverse of schema_get_value())
+void delta_set_value(dailyReport& report, const reportField& field, int64_t val)
+{
+  uint8_t* p = (uint8_t*)&report + field.offset;
+  switch (field.type)
+  {
+    case REPORT_FIELD_TYPE_INT:
+      *(int*)p = val;
+      break;
+    case REPORT_FIELD_TYPE_INT64:
+      *(int64_t*)p = val;
+      break;
+    case REPORT_FIELD_TYPE_UINT32:
+      *(uint32_t*)p = val;
+      break;
+  }
+}
+
+// Update the baseline to what the receiver will have once it gets the report (in full if keyframe, otherwise as a delta)
+void delta_apply(dailyReport& baseline, const dailyReport& report, bool keyframe)
+{
+  if (keyframe)
+  {
+    baseline = report;
+    return;
+  }
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    if (delta_field_changed(report_fields[i], report, baseline))
+    {
+      delta_set_value(baseline, report_fields[i], schema_get_value(report, report_fields[i]));
+    }
+  }
+}
+
+#endif // WATERPAL_DELTA_H
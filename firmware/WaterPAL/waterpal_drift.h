@@ -0,0 +1,151 @@
+// waterpal_drift.h: Model of the RTC's frequency error, so that the clock keeps time between syncs with the modem
+// The RTC runs fast or slow by some ppm. Each sync point (CCLK from the modem, or a GPS fix) shows the error that built up since the
+//  last one, which refines the ppm estimate. Every boot then takes the predicted error out of the clock (before anything is
+//  timestamped), sleeps are stretched to match, and the modem only has to resync once the error might exceed WATERPAL_DRIFT_MAX_ERROR_S.
+#ifndef WATERPAL_DRIFT_H
+#define WATERPAL_DRIFT_H
+
+#include <esp_attr.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "waterpal_config.h"
+
+volatile RTC_DATA_ATTR float drift_ppm = 0;                                      // Estimated RTC error: positive if it runs fast
+volatile RTC_DATA_ATTR float drift_error_ppm = WATERPAL_DRIFT_INITIAL_ERROR_PPM; // How far off that estimate might still be
+volatile RTC_DATA_ATTR float drift_fit_weight_s = 0;         // Seconds of sync history behind the estimate
+volatile RTC_DATA_ATTR int64_t drift_fit_start_s = 0;        // Sync point that the next fit measures from
+volatile RTC_DATA_ATTR int64_t drift_pending_error_us = 0;   // Error taken out by syncs since then (too close together to fit on their own)
+volatile RTC_DATA_ATTR int64_t drift_last_sync_s = 0;        // Time of the most recent sync point
+volatile RTC_DATA_ATTR int64_t drift_last_correction_us = 0; // Clock time when the correction was last applied
+volatile RTC_DATA_ATTR int32_t drift_utc_offset_s = 0;       // Local time minus UTC, from the last CCLK (for GPS fixes, which are UTC)
+volatile RTC_DATA_ATTR uint32_t drift_sync_count = 0;
+
+int64_t drift_now_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000ll + tv.tv_usec;
+}
+
+void drift_set_now_us(int64_t t_us)
+{
+  struct timeval tv;
+  tv.tv_sec = t_us / 1000000ll;
+  tv.tv_usec = t_us % 1000000ll;
+  settimeofday(&tv, NULL);
+}
+
+// Take out the error that built up since the last correction. Called once per boot, before anything is timestamped.
+void drift_apply_correction()
+{
+  int64_t now_us = drift_now_us();
+  int64_t elapsed_us = now_us - drift_last_correction_us;
+  if (drift_sync_count < 2 || drift_last_correction_us == 0 || elapsed_us <= 0)
+  {
+    // No rate to correct with yet (or the clock went backwards under us)
+    drift_last_correction_us = now_us;
+    return;
+  }
+
+  int64_t correction_us = -(int64_t)(elapsed_us * (double)drift_ppm / 1e6);
+  drift_set_now_us(now_us + correction_us);
+  drift_last_correction_us = now_us + correction_us;
+
+  Serial.println(">> TIME DRIFT: Corrected the clock by " + String((long)(correction_us / 1000)) + " ms (" + String(drift_ppm, 1) + " ppm over " + String((long)(elapsed_us / 1000000ll)) + " s)");
+}
+
+// The timer wakes us after this many RTC microseconds, so a fast RTC needs a longer count to sleep for seconds of real time
+uint64_t drift_sleep_us(int64_t seconds)
+{
+  if (seconds <= 0)
+  {
+    return 0;
+  }
+  return (uint64_t)(seconds * 1000000ll * (1.0 + (double)drift_ppm / 1e6));
+}
+
+// Record a sync point and set the clock to true_s. Returns the error that the model didn't predict (true time minus clock), in seconds.
+int64_t drift_sync(int64_t true_s, const char* source)
+{
+  drift_apply_correction();
+  int64_t error_us = drift_now_us() - true_s * 1000000ll; // Positive if the clock is ahead
+  drift_set_now_us(true_s * 1000000ll);
+  drift_last_correction_us = true_s * 1000000ll;
+
+  if (drift_sync_count == 0)
+  {
+    Serial.println(">> TIME DRIFT: First time setting time (from " + String(source) + ") -- no drift calculation needed.");
+    drift_fit_start_s = true_s;
+  }
+  else
+  {
+    int64_t elapsed_s = true_s - drift_fit_start_s;
+    int64_t fit_error_us = error_us + drift_pending_error_us;
+    // Error per second is the ppm that the estimate is off by
+    float residual_ppm = elapsed_s > 0 ? fit_error_us / (float)elapsed_s : 0;
+
+    Serial.println(">> TIME DRIFT: Drift between " + String(source) + " and system time: " + String((long)(error_us / 1000)) + " ms");
+
+    if (elapsed_s <= 0 || fabs(residual_ppm) > WATERPAL_DRIFT_MAX_PPM)
+    {
+      // The clock was set from somewhere else (or the time source jumped), so start the fit over
+      Serial.println(">> TIME DRIFT: Implausible drift -- starting the fit over");
+      drift_fit_weight_s = 0;
+      drift_error_ppm = WATERPAL_DRIFT_INITIAL_ERROR_PPM;
+      drift_fit_start_s = true_s;
+      drift_pending_error_us = 0;
+    }
+    else if (elapsed_s < WATERPAL_DRIFT_MIN_FIT_INTERVAL_S)
+    {
+      // Too soon after the last fit for a 1 s resolution time source to say much about the rate; carry the error into the next fit
+      drift_pending_error_us = fit_error_us;
+    }
+    else
+    {
+      // Time-weighted running average, forgetting history older than WATERPAL_DRIFT_FIT_HISTORY_S
+      float weight = elapsed_s / (drift_fit_weight_s + elapsed_s);
+      drift_ppm += residual_ppm * weight;
+      drift_error_ppm += (fabs(residual_ppm) - drift_error_ppm) * weight;
+      if (drift_error_ppm < WATERPAL_DRIFT_MIN_ERROR_PPM)
+      {
+        drift_error_ppm = WATERPAL_DRIFT_MIN_ERROR_PPM;
+      }
+      drift_fit_weight_s = fmin(drift_fit_weight_s + elapsed_s, WATERPAL_DRIFT_FIT_HISTORY_S);
+      drift_fit_start_s = true_s;
+      drift_pending_error_us = 0;
+
+      Serial.println(">> TIME DRIFT: RTC error " + String(drift_ppm, 1) + " ppm (+/- " + String(drift_error_ppm, 1) + " ppm)");
+    }
+  }
+
+  drift_last_sync_s = true_s;
+  drift_sync_count++;
+
+  return -(error_us / 1000000ll);
+}
+
+// How far off the clock might be by now_s, in seconds (the time sources have 1 s resolution)
+float drift_predicted_error_s(int64_t now_s)
+{
+  return drift_error_ppm / 1e6f * (now_s - drift_last_sync_s) + 1;
+}
+
+// When the predicted error reaches WATERPAL_DRIFT_MAX_ERROR_S. If that has passed (or we've never synced), retry after
+//  WATERPAL_DRIFT_MIN_SYNC_INTERVAL_S rather than straight away, in case the time source is down.
+int64_t drift_next_sync_s(int64_t now_s)
+{
+  int64_t next_sync_s = now_s + WATERPAL_DRIFT_MIN_SYNC_INTERVAL_S;
+  if (drift_sync_count > 0)
+  {
+    int64_t interval_s = (WATERPAL_DRIFT_MAX_ERROR_S - 1) * 1e6f / drift_error_ppm;
+    interval_s = constrain(interval_s, (int64_t)WATERPAL_DRIFT_MIN_SYNC_INTERVAL_S, (int64_t)WATERPAL_DRIFT_MAX_SYNC_INTERVAL_S);
+    if (drift_last_sync_s + interval_s > now_s)
+    {
+      next_sync_s = drift_last_sync_s + interval_s;
+    }
+  }
+  return next_sync_s;
+}
+
+#endif // WATERPAL_DRIFT_H
@@ -18,6 +18,8 @@ volatile RTC_DATA_ATTR int64_t last_error_time_s = 0; // Time of the last error
 #define ERROR_BATTERY_READ 7
 #define ERROR_TIMESTAMP_FAIL 8 // Failed to parse timestamp
 #define ERROR_GPRS_FAIL 9 // Failed to send data via GPRS
+#define ERROR_OTA_FAIL 10 // Firmware update failed (or was rolled back)
+#define ERROR_COUNTER_FAIL 11 // A stroke counter failed several reads in a row
 
 String getError()
 {
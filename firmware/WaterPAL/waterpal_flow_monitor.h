@@ -0,0 +1,181 @@
+// waterpal_flow_monitor.h: Active-flow monitoring -- while the water runs, light sleep between frequent handle counter reads
+// Otherwise the counter is only read when the float switch or a scheduled task wakes us, so all we know of a session's pumping is its
+//  average rate. With WATERPAL_USE_FLOW_MONITOR, a wake that finds the water running doesn't go straight back to deep sleep: it
+//  light-sleeps, reads the counter every WATERPAL_FLOW_MONITOR_SAMPLE_MS, and takes the stroke rate over each
+//  WATERPAL_FLOW_MONITOR_WINDOW_S window. Once a float switch changes (which also ends the light sleep early), the next task comes
+//  due, or the period's budget is used up, it deep sleeps as usual -- and the float switch wakes it again straight away if the water
+//  has stopped, so the session ends through the usual edge logging.
+// Each session gets its peak and median window rate (the median is the P-squared estimate from waterpal_stats.h), and after a dry
+//  start, the time to flow: how long the dry-start strokes took at the session's first measured rate (we're in deep sleep while
+//  priming, so that's an estimate).
+// The report has the period's monitoring time and an estimate of the charge it took, from the time awake and in light sleep.
+#ifndef WATERPAL_FLOW_MONITOR_H
+#define WATERPAL_FLOW_MONITOR_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include <esp_sleep.h>
+#include "waterpal_channels.h"
+#include "waterpal_config.h"
+#include "waterpal_flowlog.h"
+#include "waterpal_handle_counter.h"
+#include "waterpal_report.h"
+#include "waterpal_stats.h"
+#include "waterpal_usage.h"
+#include "waterpal_watchdog.h"
+
+#if WATERPAL_USE_FLOW_MONITOR && WATERPAL_USE_HANDLE_COUNTER
+
+// The running session's stroke rates (strokes per minute, one per window). A window never spans a deep sleep, when we can't tell
+//  when the strokes happened.
+RTC_DATA_ATTR statsAccumulator<uint16_t, 1> flow_monitor_rates;
+volatile RTC_DATA_ATTR uint16_t flow_monitor_first_rate = 0;
+
+// This report period's monitoring
+volatile RTC_DATA_ATTR uint64_t flow_monitor_active_ms = 0;
+volatile RTC_DATA_ATTR uint64_t flow_monitor_sleep_ms = 0;
+
+int64_t flow_monitor_now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000ll + tv.tv_usec / 1000;
+}
+
+bool flow_monitor_budget_left()
+{
+  return flow_monitor_active_ms + flow_monitor_sleep_ms < WATERPAL_FLOW_MONITOR_BUDGET_S * 1000ull;
+}
+
+void flow_monitor_add_rate(uint32_t strokes_per_min)
+{
+  uint16_t rate = strokes_per_min > UINT16_MAX ? UINT16_MAX : strokes_per_min;
+  if (flow_monitor_rates.count == 0)
+  {
+    flow_monitor_first_rate = rate;
+  }
+  flow_monitor_rates.add(rate);
+  Serial.println("Flow monitor: " + String(rate) + " strokes/min (window " + String(flow_monitor_rates.count) + ")");
+}
+
+// Called just before deep sleep: if the water is running, monitor it until it stops or until_s (the next scheduled wake)
+void flow_monitor_run(int water_sensor_value, time_t until_s)
+{
+  if (!handle_counter_water_is_flowing(water_sensor_value) || !handle_counter_has_reading())
+  {
+    return;
+  }
+  if (!flow_monitor_budget_left())
+  {
+    Serial.println("Flow monitor: this period's " + String(WATERPAL_FLOW_MONITOR_BUDGET_S) + " s budget is used up");
+    return;
+  }
+
+  Serial.println("Flow monitor: sampling the handle counter every " + String(WATERPAL_FLOW_MONITOR_SAMPLE_MS) + " ms until the water stops");
+
+  // Besides the timer, any float switch changing ends a light sleep
+  water_channels_enable_light_sleep_wakeup();
+
+  int64_t window_start_ms = 0; // 0 until the first read opens a window
+  uint32_t window_strokes = 0;
+  uint32_t awake_since_ms = millis();
+  for (;;)
+  {
+    watchdog_pet();
+
+    int64_t now_ms = flow_monitor_now_ms();
+    if (handle_counter_update(true))
+    {
+      uint32_t delta = handle_counter_get_last_delta();
+      usage_log_strokes(delta, true, now_ms / 1000);
+      if (window_start_ms == 0)
+      {
+        // The strokes up to this read were before the monitoring started
+        window_start_ms = now_ms;
+        window_strokes = 0;
+      }
+      else
+      {
+        window_strokes += delta;
+        if (now_ms - window_start_ms >= WATERPAL_FLOW_MONITOR_WINDOW_S * 1000ll)
+        {
+          flow_monitor_add_rate((uint32_t)(window_strokes * 60000ull / (now_ms - window_start_ms)));
+          window_start_ms = now_ms;
+          window_strokes = 0;
+        }
+      }
+    }
+
+    flow_monitor_active_ms += millis() - awake_since_ms;
+
+    if (water_channels_changed())
+    {
+      // The pump's water stopped, or another channel changed and has to be logged
+      Serial.println("Flow monitor: a float switch changed");
+      break;
+    }
+    if (now_ms / 1000 >= until_s)
+    {
+      Serial.println("Flow monitor: stopping for the next scheduled wake");
+      break;
+    }
+    if (!flow_monitor_budget_left())
+    {
+      Serial.println("Flow monitor: stopping, the period's budget is used up");
+      break;
+    }
+
+    Serial.flush();
+    uint32_t sleep_start_ms = millis();
+    esp_sleep_enable_timer_wakeup(WATERPAL_FLOW_MONITOR_SAMPLE_MS * 1000ull);
+    esp_light_sleep_start();
+    awake_since_ms = millis();
+    flow_monitor_sleep_ms += awake_since_ms - sleep_start_ms;
+  }
+
+  water_channels_disable_light_sleep_wakeup();
+}
+
+void flow_monitor_session_start()
+{
+  flow_monitor_rates.reset();
+  flow_monitor_first_rate = 0;
+}
+
+// The session that just ended gets its stroke-rate profile (all 0 if it was never monitored for a full window)
+void flow_monitor_session_end(flowSession& session)
+{
+  session.rate_peak_per_min = lroundf(flow_monitor_rates.high());
+  session.rate_median_per_min = lroundf(flow_monitor_rates.median());
+  session.time_to_flow_s = session.dry_start && flow_monitor_first_rate > 0 ? session.dry_start_strokes * 60ull / flow_monitor_first_rate : 0;
+}
+
+void flow_monitor_fill_report(dailyReport& report)
+{
+  report.flow_monitor_s = (flow_monitor_active_ms + flow_monitor_sleep_ms) / 1000;
+  report.flow_monitor_uah = (flow_monitor_active_ms * WATERPAL_ACTIVE_CURRENT_UA + flow_monitor_sleep_ms * WATERPAL_LIGHT_SLEEP_CURRENT_UA) / 3600000ull;
+}
+
+void flow_monitor_start_period()
+{
+  flow_monitor_active_ms = 0;
+  flow_monitor_sleep_ms = 0;
+}
+
+void flow_monitor_print()
+{
+  Serial.println("  Flow monitoring: " + String((uint32_t)flow_monitor_active_ms) + " ms awake, " + String((uint32_t)flow_monitor_sleep_ms) + " ms in light sleep");
+}
+
+#else
+
+void flow_monitor_run(int water_sensor_value, time_t until_s) {}
+void flow_monitor_session_start() {}
+void flow_monitor_session_end(flowSession& session) { session.rate_peak_per_min = 0; session.rate_median_per_min = 0; session.time_to_flow_s = 0; }
+void flow_monitor_fill_report(dailyReport& report) { report.flow_monitor_s = 0; report.flow_monitor_uah = 0; }
+void flow_monitor_start_period() {}
+void flow_monitor_print() {}
+
+#endif // WATERPAL_USE_FLOW_MONITOR && WATERPAL_USE_HANDLE_COUNTER
+
+#endif // WATERPAL_FLOW_MONITOR_H
@@ -0,0 +1,280 @@
+// waterpal_flowlog.h: Log of flow sessions (each time the water ran), kept in an RTC ring buffer until it goes out with an upload
+// A session is its start time, how long the water ran, the handle strokes while it ran, (after a qualifying dry start, see
+//  waterpal_handle_counter.h) the strokes it took to get it running, and its stroke-rate profile (see waterpal_flow_monitor.h).
+//  Each one is stored as seven varints, with the start time as the gap since the previous session's start, so a session takes about
+//  7-12 bytes and a day's worth fit in a few hundred. When the ring is full the oldest sessions are dropped.
+// The report's session count and dry-start totals are summed from the sessions as they are logged, so they stay exact even if the
+//  sessions themselves drop out of the ring before they are uploaded. (Water usage time and flowing strokes are split across report
+//  periods rather than counted when a session ends; see waterpal_usage.h.)
+#ifndef WATERPAL_FLOWLOG_H
+#define WATERPAL_FLOWLOG_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include "waterpal_config.h"
+#include "waterpal_report.h"
+#include "waterpal_text.h"
+#include "waterpal_varint.h"
+
+#define FLOWLOG_MAX_RECORD_BYTES (VARINT_MAX_BYTES + 6 * 5) // A 64-bit varint and six 32-bit ones
+
+typedef struct flowSession
+{
+  int64_t start_s;
+  uint32_t duration_s;
+  uint32_t flowing_strokes;   // Handle strokes while the water ran
+  bool dry_start;             // Whether the session followed a qualifying dry start
+  uint32_t dry_start_strokes; // Strokes from the dry start until the water ran
+  uint16_t rate_peak_per_min;   // Highest stroke rate while the water ran (0 if it wasn't monitored)
+  uint16_t rate_median_per_min; // Median stroke rate
+  uint32_t time_to_flow_s;      // Estimated time from the dry start until the water ran (0 if unknown)
+} flowSession;
+
+// Totals of the sessions logged since the last report. Plain data, so it can live in RTC memory.
+typedef struct flowTotals
+{
+  uint32_t first_id; // ID of the period's first session
+  uint32_t session_count;
+  uint32_t dry_start_count;
+  uint64_t dry_start_stroke_total;
+  uint32_t dry_start_stroke_max;
+  uint16_t rate_peak_per_min;
+} flowTotals;
+
+RTC_DATA_ATTR uint8_t flowlog_buf[WATERPAL_FLOWLOG_BYTES];
+volatile RTC_DATA_ATTR uint16_t flowlog_head = 0;       // Offset of the oldest record
+volatile RTC_DATA_ATTR uint16_t flowlog_used = 0;       // Bytes in use
+volatile RTC_DATA_ATTR uint16_t flowlog_count = 0;      // Sessions in the ring
+volatile RTC_DATA_ATTR uint32_t flowlog_first_id = 0;   // ID of the oldest session in the ring (IDs count up from 0 since power-on)
+volatile RTC_DATA_ATTR int64_t flowlog_base_s = 0;      // Start time that the oldest session's gap counts from
+volatile RTC_DATA_ATTR int64_t flowlog_last_start_s = 0; // Start time of the newest session
+volatile RTC_DATA_ATTR uint32_t flowlog_dropped_count = 0; // Sessions pushed out of a full ring
+RTC_DATA_ATTR flowTotals flowlog_period;
+
+// A report's sessions, re-encoded for an upload (see flowlog_encode_report())
+uint8_t flowlog_encode_buffer[WATERPAL_FLOWLOG_BYTES + FLOWLOG_MAX_RECORD_BYTES];
+
+// Read a varint at offset pos from the oldest record, moving pos past it
+uint64_t flowlog_get_varint(uint16_t& pos)
+{
+  uint64_t val = 0;
+  for (int shift = 0; pos < flowlog_used && shift < 64; shift += 7)
+  {
+    uint8_t b = flowlog_buf[(flowlog_head + pos) % WATERPAL_FLOWLOG_BYTES];
+    pos++;
+    val |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+    {
+      break;
+    }
+  }
+  return val;
+}
+
+// Walks the ring from the oldest session
+typedef struct flowlogCursor
+{
+  uint16_t pos;
+  uint32_t id;
+  int64_t start_s;
+} flowlogCursor;
+
+void flowlog_begin(flowlogCursor& c)
+{
+  c.pos = 0;
+  c.id = flowlog_first_id;
+  c.start_s = flowlog_base_s;
+}
+
+bool flowlog_next(flowlogCursor& c, flowSession& session)
+{
+  if (c.id - flowlog_first_id >= flowlog_count)
+  {
+    return false;
+  }
+  c.start_s += flowlog_get_varint(c.pos);
+  session.start_s = c.start_s;
+  session.duration_s = flowlog_get_varint(c.pos);
+  session.flowing_strokes = flowlog_get_varint(c.pos);
+  uint32_t dry = flowlog_get_varint(c.pos); // 0 if there was no dry start, otherwise the strokes plus one
+  session.dry_start = dry > 0;
+  session.dry_start_strokes = dry > 0 ? dry - 1 : 0;
+  session.rate_peak_per_min = flowlog_get_varint(c.pos);
+  session.rate_median_per_min = flowlog_get_varint(c.pos);
+  session.time_to_flow_s = flowlog_get_varint(c.pos);
+  c.id++;
+  return true;
+}
+
+void flowlog_drop_oldest()
+{
+  flowlogCursor c;
+  flowSession session;
+  flowlog_begin(c);
+  if (!flowlog_next(c, session))
+  {
+    return;
+  }
+  flowlog_head = (flowlog_head + c.pos) % WATERPAL_FLOWLOG_BYTES;
+  flowlog_used -= c.pos;
+  flowlog_count--;
+  flowlog_first_id++;
+  flowlog_base_s = session.start_s;
+  flowlog_dropped_count++;
+}
+
+void flowlog_add(const flowSession& session)
+{
+  if (flowlog_count == 0)
+  {
+    flowlog_base_s = flowlog_last_start_s;
+  }
+
+  // A clock that was set back can put a session before the previous one; it's logged as starting at the same time
+  uint64_t gap_s = session.start_s > flowlog_last_start_s ? session.start_s - flowlog_last_start_s : 0;
+  uint8_t record[FLOWLOG_MAX_RECORD_BYTES];
+  size_t len = varint_put(record, 0, gap_s);
+  len = varint_put(record, len, session.duration_s);
+  len = varint_put(record, len, session.flowing_strokes);
+  len = varint_put(record, len, session.dry_start ? (uint64_t)session.dry_start_strokes + 1 : 0);
+  len = varint_put(record, len, session.rate_peak_per_min);
+  len = varint_put(record, len, session.rate_median_per_min);
+  len = varint_put(record, len, session.time_to_flow_s);
+
+  while (flowlog_used + len > WATERPAL_FLOWLOG_BYTES)
+  {
+    flowlog_drop_oldest();
+  }
+  for (size_t i = 0; i < len; i++)
+  {
+    flowlog_buf[(flowlog_head + flowlog_used + i) % WATERPAL_FLOWLOG_BYTES] = record[i];
+  }
+  flowlog_used += len;
+  flowlog_count++;
+  flowlog_last_start_s += gap_s;
+
+  flowlog_period.session_count++;
+  if (session.rate_peak_per_min > flowlog_period.rate_peak_per_min)
+  {
+    flowlog_period.rate_peak_per_min = session.rate_peak_per_min;
+  }
+  if (session.dry_start)
+  {
+    flowlog_period.dry_start_count++;
+    flowlog_period.dry_start_stroke_total += session.dry_start_strokes;
+    if (session.dry_start_strokes > flowlog_period.dry_start_stroke_max)
+    {
+      flowlog_period.dry_start_stroke_max = session.dry_start_strokes;
+    }
+  }
+
+  Serial.println("Logged flow session #" + String(flowlog_first_id + flowlog_count - 1) + ": " + String(session.duration_s) + " s, " + String(session.flowing_strokes) + " strokes (" + String(len) + " bytes, " + String(flowlog_count) + " sessions in " + String(flowlog_used) + " of " + String(WATERPAL_FLOWLOG_BYTES) + " bytes)");
+}
+
+uint32_t flowlog_to_report_value(uint64_t value)
+{
+  return value > 0xFFFFFFFFULL ? 0xFFFFFFFFUL : (uint32_t)value;
+}
+
+// The period's totals go into the report
+void flowlog_fill_report(dailyReport& report)
+{
+  report.dry_start_count = flowlog_period.dry_start_count;
+  report.dry_start_stroke_total = flowlog_to_report_value(flowlog_period.dry_start_stroke_total);
+  report.dry_start_stroke_avg = flowlog_period.dry_start_count > 0 ? report.dry_start_stroke_total / flowlog_period.dry_start_count : 0;
+  report.dry_start_stroke_max = flowlog_period.dry_start_stroke_max;
+  report.flow_session_count = flowlog_period.session_count;
+  report.flow_session_first_id = flowlog_period.first_id;
+  report.flow_rate_peak_per_min = flowlog_period.rate_peak_per_min;
+}
+
+void flowlog_start_period()
+{
+  memset(&flowlog_period, 0, sizeof(flowlog_period));
+  flowlog_period.first_id = flowlog_first_id + flowlog_count;
+}
+
+// Is this session one of the report's? (IDs wrap around, so compare by distance)
+bool flowlog_in_report(uint32_t id, const dailyReport& report)
+{
+  return id - report.flow_session_first_id < report.flow_session_count;
+}
+
+// Encode the report's sessions that are still in the ring into flowlog_encode_buffer, in the ring's format except that the first
+//  start time is how long before the report it was. Returns the number of bytes (0 if there are none).
+size_t flowlog_encode_report(const dailyReport& report)
+{
+  flowlogCursor c;
+  flowSession session;
+  size_t len = 0;
+  int64_t prev_start_s = 0;
+  flowlog_begin(c);
+  while (flowlog_next(c, session))
+  {
+    if (!flowlog_in_report(c.id - 1, report))
+    {
+      continue;
+    }
+    int64_t gap_s = len == 0 ? report.timestamp_s - session.start_s : session.start_s - prev_start_s;
+    len = varint_put(flowlog_encode_buffer, len, gap_s > 0 ? gap_s : 0);
+    len = varint_put(flowlog_encode_buffer, len, session.duration_s);
+    len = varint_put(flowlog_encode_buffer, len, session.flowing_strokes);
+    len = varint_put(flowlog_encode_buffer, len, session.dry_start ? (uint64_t)session.dry_start_strokes + 1 : 0);
+    len = varint_put(flowlog_encode_buffer, len, session.rate_peak_per_min);
+    len = varint_put(flowlog_encode_buffer, len, session.rate_median_per_min);
+    len = varint_put(flowlog_encode_buffer, len, session.time_to_flow_s);
+    prev_start_s = session.start_s;
+  }
+  return len;
+}
+
+// JSON: ,"sessions":[[start,duration,flowing strokes,dry-start strokes (-1 if none),peak rate,median rate,time to flow],...] --
+//  nothing if the report has none left
+void flowlog_write_json(textWriter& w, const dailyReport& report)
+{
+  flowlogCursor c;
+  flowSession session;
+  bool first = true;
+  flowlog_begin(c);
+  while (flowlog_next(c, session))
+  {
+    if (!flowlog_in_report(c.id - 1, report))
+    {
+      continue;
+    }
+    text_put(w, first ? ",\"sessions\":[[" : ",[");
+    text_put_int(w, session.start_s);
+    text_put_char(w, ',');
+    text_put_uint(w, session.duration_s);
+    text_put_char(w, ',');
+    text_put_uint(w, session.flowing_strokes);
+    text_put_char(w, ',');
+    text_put_int(w, session.dry_start ? (int64_t)session.dry_start_strokes : -1);
+    text_put_char(w, ',');
+    text_put_uint(w, session.rate_peak_per_min);
+    text_put_char(w, ',');
+    text_put_uint(w, session.rate_median_per_min);
+    text_put_char(w, ',');
+    text_put_uint(w, session.time_to_flow_s);
+    text_put_char(w, ']');
+    first = false;
+  }
+  if (!first)
+  {
+    text_put_char(w, ']');
+  }
+}
+
+void flowlog_print()
+{
+  flowlogCursor c;
+  flowSession session;
+  Serial.println("  Flow sessions (" + String(flowlog_count) + " in " + String(flowlog_used) + " bytes, " + String(flowlog_dropped_count) + " dropped):");
+  flowlog_begin(c);
+  while (flowlog_next(c, session))
+  {
+    Serial.println("    #" + String(c.id - 1) + ": start " + String((long)session.start_s) + ", " + String(session.duration_s) + " s, " + String(session.flowing_strokes) + " strokes" + (session.dry_start ? ", dry start " + String(session.dry_start_strokes) + " strokes" : "") + (session.rate_peak_per_min > 0 ? ", " + String(session.rate_median_per_min) + " (peak " + String(session.rate_peak_per_min) + ") strokes/min" : ""));
+  }
+}
+
+#endif // WATERPAL_FLOWLOG_H
@@ -12,13 +12,22 @@
 #include <ArduinoHttpClient.h>
 #include <UrlEncode.h>
 #include <TinyGsmClient.h>
+#include "waterpal_http_timing.h"
+#include "waterpal_transport.h"
+#include "waterpal_report.h"
+#include "waterpal_schema.h"
+#include "waterpal_payload.h"
+#include "waterpal_flowlog.h"
+#include "waterpal_usage.h"
+#include "waterpal_outbox.h"
 
 // Server details
 const char server[] = "script.google.com";
 const int port = 443;
 
 TinyGsmClientSecure client(modem, 0);
-HttpClient http(client, server, port);
+TransportClient transport(client, HTTP_ENDPOINT_WATERPAL);
+HttpClient http(transport, server, port);
 
 #if WATERPAL_USE_DESIGNOUTREACH_HTTP
 // Server details for Design Outreach servers
@@ -27,10 +36,12 @@ const int port_designoutreach = 443;
 
 // NOTE: "To have more than one client of any type, you need to create them on different sockets." c.f. https://github.com/vshymanskyy/TinyGSM/issues/292#issuecomment-496014840
 TinyGsmClientSecure client_designoutreach(modem, 1);
-HttpClient http_designoutreach(client_designoutreach, server_designoutreach, port_designoutreach);
+TransportClient transport_designoutreach(client_designoutreach, HTTP_ENDPOINT_DESIGNOUTREACH);
+HttpClient http_designoutreach(transport_designoutreach, server_designoutreach, port_designoutreach);
 #endif
 
 int gprs_connected = 0;
+int gprs_connect_fail_count = 0; // Failed connects this wake
 
 int gprs_connect()
 {
@@ -51,6 +62,7 @@ int gprs_connect()
   if (!modem.waitForNetwork(45L * 1000L))
   {
     Serial.println(F("Failed to wait for network"));
+    gprs_connect_fail_count++;
     return 0;
   }
 
@@ -62,6 +74,7 @@ int gprs_connect()
   if (!modem.isNetworkConnected())
   {
     Serial.println(F("Network failed to connect"));
+    gprs_connect_fail_count++;
     return 0;
   }
   gprs_connected = 1;
@@ -96,6 +109,13 @@ int gprs_disconnect()
     return 1;
   }
   
+  // Close any connections that were kept alive for reuse during this wake
+  http.stop();
+  #if WATERPAL_USE_DESIGNOUTREACH_HTTP
+  http_designoutreach.stop();
+  #endif // WATERPAL_USE_DESIGNOUTREACH_HTTP
+  transport_print_stats();
+
   Serial.println(F("GPRS disconnecting..."));
   if (!modem.gprsDisconnect())
   {
@@ -110,168 +130,224 @@ int gprs_disconnect()
   return 1;
 }
 
-/* Weekly data parameters:
-    data.IMEI,           // IMEI
-    data.totalSMSCount,  // total SMS send count
-    data.GPSLat,         // GPS Latitude
-    data.GPSLong,        // GPS Longitude
-    data.CPSI            // CPSI information (debug string)
-*/
-int gprs_send_data_weekly(String imei, int totalSMSCount, float GPSLat, float GPSLong, String CPSI)
+// Prepare for a request on the given endpoint: note whether the connection is being reused, and apply the learned response timeout.
+// The total timeout is enforced by gprs_read_response(): HttpClient's own setTimeout() only bounds each read, so it gets the
+//  response timeout -- a stall that long in the middle of a response is as bad as one before it.
+void gprs_begin_request(HttpClient& http_client, TransportClient& transport_client)
 {
-  watchdog_pet();
+  int endpoint = transport_client.endpoint();
+  transport_begin_request(transport_client);
 
-  // Send data to the server in the style of:
-  //  https://script.google.com/macros/s/AKfycbzc-xMFUDC5eisYN_rSOkV5UM0mTLd9s9ssqyqLW0LbzR1giPq5MqnKENSFYLHzFPvGUg/exec?IMEI=123456789012345&totalSMSCount=100&GPSLat=37.7749&GPSLong=-122.4194&CPSI=123456789012345
-  //            /macros/s/AKfycbzc-xMFUDC5eisYN_rSOkV5UM0mTLd9s9ssqyqLW0LbzR1giPq5MqnKENSFYLHzFPvGUg/exec
-  // https://script.googleusercontent.com/macros/echo?user_content_key=tBLjPdLV768fRCXKnjybjSXHf8MDnv_7F6gm3tw1v6mIub01mNvPjKVLpRw3ddWZdpdlS5wBAVhdh60BKs31Ik2H4B8R9ymWOJmA1Yb3SEsKFZqtv3DaNYcMrmhZHmUMWojr9NvTBuBLhyHCd5hHa6_AjzMEeZLPwpHOTeu5EjB0sDqZoFgVb03d_qyaNh157TCeshrO4LuhD7gWIsDLt-QjiL-BjcmvNbraE5--3IeBon6lfM2ckhzqF8ZARUsqutNVihpc7C-Dib38DDsdM26OZQqZIj2ott0usYC-tSid4Enrv_t2Gr_uf3VRE-HNrS-LTtTpPlJNUnnJM1QN20H9g71u62u-n7kaGU_oWbcdlBr5LOSoHPnkWsEC9MTFUaUDoaBHoGk_xGmh2k5VgZ6Y3U2YOVIIJ80TIiRQSQUay_phO-_QvOQv5e2uqcfSBUbgkya8KRuQ7MvWEirwyfiCQdLX5wkT-NG1O8mQJDo&lib=M4gCo7tC_8DJRAzIeZQdTh9nsRX4jpA1g
-  // Prepare the URL
-  // String url = "/macros/echo?user_content_key=tBLjPdLV768fRCXKnjybjSXHf8MDnv_7F6gm3tw1v6mIub01mNvPjKVLpRw3ddWZdpdlS5wBAVhdh60BKs31Ik2H4B8R9ymWOJmA1Yb3SEsKFZqtv3DaNYcMrmhZHmUMWojr9NvTBuBLhyHCd5hHa6_AjzMEeZLPwpHOTeu5EjB0sDqZoFgVb03d_qyaNh157TCeshrO4LuhD7gWIsDLt-QjiL-BjcmvNbraE5--3IeBon6lfM2ckhzqF8ZARUsqutNVihpc7C-Dib38DDsdM26OZQqZIj2ott0usYC-tSid4Enrv_t2Gr_uf3VRE-HNrS-LTtTpPlJNUnnJM1QN20H9g71u62u-n7kaGU_oWbcdlBr5LOSoHPnkWsEC9MTFUaUDoaBHoGk_xGmh2k5VgZ6Y3U2YOVIIJ80TIiRQSQUay_phO-_QvOQv5e2uqcfSBUbgkya8KRuQ7MvWEirwyfiCQdLX5wkT-NG1O8mQJDo&lib=M4gCo7tC_8DJRAzIeZQdTh9nsRX4jpA1g&";
-  String url = "/macros/s/AKfycbzc-xMFUDC5eisYN_rSOkV5UM0mTLd9s9ssqyqLW0LbzR1giPq5MqnKENSFYLHzFPvGUg/exec?";
-  url += "IMEI=" + imei;
-  url += "&totalSMSCount=" + String(totalSMSCount);
-  url += "&GPSLat=" + String(GPSLat, 6);
-  url += "&GPSLong=" + String(GPSLong, 6);
-  url += "&CPSI=" + urlEncode(CPSI);
+  uint32_t response_timeout_ms = http_timing_get_timeout_ms(endpoint, HTTP_PHASE_FIRST_BYTE);
+  uint32_t total_timeout_ms = http_timing_get_timeout_ms(endpoint, HTTP_PHASE_TOTAL);
+  Serial.println("Using timeouts for [" + String(http_endpoint_names[endpoint]) + "]: response " + String(response_timeout_ms) + " ms, total " + String(total_timeout_ms) + " ms");
 
-  Serial.print(F("Requesting URL: "));
-  Serial.println(url);
+  http_client.setHttpResponseTimeout(response_timeout_ms);
+  http_client.setTimeout(response_timeout_ms);
+}
 
-  // Set our device timeout
-  http.setHttpResponseTimeout(WATERPAL_HTTP_TIMEOUT_MS);
+// Whether the request that started at request_start_ms has used up its total timeout
+bool gprs_total_timed_out(int endpoint, uint32_t request_start_ms)
+{
+  return millis() - request_start_ms >= http_timing_get_timeout_ms(endpoint, HTTP_PHASE_TOTAL);
+}
 
-  // Send the request
-  int err = http.get(url);
+// Record the timings of a request that got a response. One that ran past the total timeout (the body was cut short, or the
+//  connection closed without draining it) counts as a timeout.
+void gprs_record_timing(int endpoint, uint32_t request_start_ms, uint32_t first_byte_ms)
+{
+  uint32_t total_ms = millis() - request_start_ms;
+  http_timing_record(endpoint, HTTP_PHASE_FIRST_BYTE, first_byte_ms);
+  if (gprs_total_timed_out(endpoint, request_start_ms))
+  {
+    http_timing_record_timeout(endpoint, HTTP_PHASE_TOTAL, total_ms);
+  }
+  else
+  {
+    http_timing_record(endpoint, HTTP_PHASE_TOTAL, total_ms);
+  }
+}
 
-  if (err != 0)
+// Throw away the rest of a response so that the connection can be reused. Returns false if it didn't all arrive before the total timeout.
+bool gprs_drain_response(HttpClient& http_client, int endpoint, int length, uint32_t request_start_ms)
+{
+  uint8_t buf[64];
+  int remaining = length;
+  while (remaining > 0 && !http_client.endOfBodyReached())
   {
-    Serial.print(F("HTTP GET failed, error: "));
-    Serial.println(err);
-    return 0;
+    watchdog_pet();
+    if (gprs_total_timed_out(endpoint, request_start_ms))
+    {
+      return false;
+    }
+    int bytes_read = http_client.read(buf, remaining < (int)sizeof(buf) ? remaining : sizeof(buf));
+    if (bytes_read > 0)
+    {
+      remaining -= bytes_read;
+    }
+    else
+    {
+      delay(10);
+    }
   }
+  return true;
+}
 
-  // Read the status code and body of the response
-  int status = http.responseStatusCode();
-  Serial.print(F("Response status code: "));
-  Serial.println(status);
-  if (status < 0)
+// Read a response body into body, up to the total timeout. Returns false if it timed out.
+bool gprs_read_body(HttpClient& http_client, int endpoint, uint32_t request_start_ms, String& body)
+{
+  int length = http_client.contentLength();
+  if (length > 0)
   {
-    Serial.println("Response " + String(status) + " from server. Waiting and trying again...");
-    delay(1000);
-    return 0;
+    body.reserve(length);
+  }
+  uint8_t buf[64];
+  while (!http_client.endOfBodyReached() && (length < 0 || (int)body.length() < length))
+  {
+    watchdog_pet();
+    if (gprs_total_timed_out(endpoint, request_start_ms))
+    {
+      return false;
+    }
+    int bytes_read = http_client.read(buf, sizeof(buf));
+    if (bytes_read > 0)
+    {
+      for (int i = 0; i < bytes_read; i++)
+      {
+        body += (char)buf[i];
+      }
+    }
+    else if (!http_client.connected())
+    {
+      break;
+    }
+    else
+    {
+      delay(10);
+    }
   }
+  return true;
+}
+
+// Read the response to a request that has already been sent on the given endpoint.
+// Only the status line matters for an upload, so unless the caller passes a body String to fill in, we stop as soon as we know the status:
+//  a short body (up to WATERPAL_HTTP_DRAIN_MAX_BYTES) is read and discarded so the connection can be reused, and anything longer
+//  (or of unknown length) is cut off by closing the socket, since that costs less than receiving it.
+// Returns 1 if the server answered with one of the accepted status codes, or 0 on failure (in which case the connection is closed so that a retry starts clean).
+int gprs_read_response(HttpClient& http_client, int endpoint, int ok_status, int alt_ok_status, uint32_t request_start_ms, uint32_t request_sent_ms, String* body)
+{
+  watchdog_pet();
 
-  Serial.println(F("Response Headers:"));
-  while (http.headerAvailable())
+  // Read the status code of the response
+  int status = http_client.responseStatusCode();
+  uint32_t first_byte_ms = millis() - request_sent_ms;
+  Serial.print("Response status code [" + String(http_endpoint_names[endpoint]) + "]: ");
+  Serial.println(status);
+  if (status < 0)
   {
-    String headerName = http.readHeaderName();
-    if (http.headerAvailable())
+    if (status == HTTP_ERROR_TIMED_OUT)
     {
-      String headerValue = http.readHeaderValue();
-      Serial.println("    " + headerName + " : " + headerValue);
+      http_timing_record_timeout(endpoint, HTTP_PHASE_FIRST_BYTE, first_byte_ms);
     }
+    http_client.stop();
+    transport_end_request(endpoint);
+    Serial.println("Response " + String(status) + " from server. Waiting and trying again...");
+    delay(1000);
+    return 0;
   }
 
   watchdog_pet();
 
-  // Accept 200 or 302 as a valid response code.
-  if (status != 200 && status != 302)
+  if (status != ok_status && status != alt_ok_status)
   {
-    Serial.print(F("HTTP GET returned invalid response code: "));
+    Serial.print(F("HTTP request returned invalid response code: "));
     Serial.println(status);
+    http_client.stop();
+    transport_end_request(endpoint);
     return 0;
   }
 
-  int length = http.contentLength();
-  if (length >= 0) {
-    Serial.print(F("Content length is: "));
-    Serial.println(length);
-  }
-  if (http.isResponseChunked()) {
-    Serial.println(F("The response is chunked"));
+  if (body == NULL)
+  {
+    // Status only
+    http_client.skipResponseHeaders();
+    int length = http_client.contentLength();
+    if (length >= 0 && length <= WATERPAL_HTTP_DRAIN_MAX_BYTES && !http_client.isResponseChunked() && gprs_drain_response(http_client, endpoint, length, request_start_ms))
+    {
+      // Leave the connection open so that later requests in this wake can reuse it. It gets closed in gprs_disconnect().
+    }
+    else
+    {
+      Serial.println("Closing connection without reading the response body (length: " + String(length) + ")");
+      http_client.stop();
+    }
   }
+  else
+  {
+    Serial.println(F("Response Headers:"));
+    while (http_client.headerAvailable())
+    {
+      String headerName = http_client.readHeaderName();
+      if (http_client.headerAvailable())
+      {
+        String headerValue = http_client.readHeaderValue();
+        Serial.println("    " + headerName + " : " + headerValue);
+      }
+    }
 
-  String body = http.responseBody();
-  Serial.println(F("Response:"));
-  Serial.println(body);
+    watchdog_pet();
 
-  Serial.print(F("Body length is: "));
-  Serial.println(body.length());
+    if (!gprs_read_body(http_client, endpoint, request_start_ms, *body))
+    {
+      // Cut short, so whatever the caller wanted from it may be missing
+      Serial.println("Response body [" + String(http_endpoint_names[endpoint]) + "] didn't arrive before the total timeout");
+      gprs_record_timing(endpoint, request_start_ms, first_byte_ms);
+      http_client.stop();
+      transport_end_request(endpoint);
+      return 0;
+    }
+    Serial.print(F("Body length is: "));
+    Serial.println(body->length());
+  }
 
-  // Close the connection
-  http.stop();
-  Serial.println(F("Server disconnected"));
+  gprs_record_timing(endpoint, request_start_ms, first_byte_ms);
+  transport_end_request(endpoint);
 
   watchdog_pet();
 
   return 1;
 }
 
-
-/* Daily data parameters:
-    data.IMEI,                             // IMEI
-    data.totalSMSCount,                    // total SMS send count
-    data.dailyWaterUsageTime,              // daily water usage time (s)
-    data.detectedClockTimeDrift,           // detected clock time drift
-    data.temperatureLow,                   // temp low
-    data.temperatureAvg,                   // temp avg
-    data.temperatureHigh,                  // temp high
-    data.humidityLow,                      // humidity low
-    data.humidityAvg,                      // humidity avg
-    data.humidityHigh,                     // humidity high
-    data.signalStrength,                   // signal strength (%)
-    data.batteryChargeStatus,              // battery charge status
-    data.batteryChargePercent,             // battery charge (%)
-    data.batteryVoltage,                   // battery voltage (mV)
-    data.bootCount,                        // boot count
-    data.handleStrokesTotal,               // all handle strokes during report period
-    data.handleStrokesFlowingTotal,        // handle strokes while water was flowing
-    data.handleStrokesFlowingPerMin,       // handle strokes per flowing-water minute
-    data.dryStartCount,                    // qualifying dry starts during report period
-    data.dryStartStrokeTotal,              // dry-start strokes across qualifying dry starts
-    data.dryStartStrokeAvg,                // average dry-start strokes
-    data.dryStartStrokeMax                 // max dry-start strokes
-    */
-  int gprs_send_data_daily(String imei, int totalSMSCount, int dailyWaterUsageTime, int detectedClockTimeDrift, int temperatureLow, int temperatureAvg, int temperatureHigh, int humidityLow, int humidityAvg, int humidityHigh, int signalStrength, int batteryChargeStatus, int batteryChargePercent, int batteryVoltage, int bootCount, uint32_t handleStrokesTotal, uint32_t handleStrokesFlowingTotal, uint32_t handleStrokesFlowingPerMin, uint32_t dryStartCount, uint32_t dryStartStrokeTotal, uint32_t dryStartStrokeAvg, uint32_t dryStartStrokeMax)
+/* Weekly data parameters:
+    data.IMEI,           // IMEI
+    data.totalSMSCount,  // total SMS send count
+    data.GPSLat,         // GPS Latitude
+    data.GPSLong,        // GPS Longitude
+    data.CPSI            // CPSI information (debug string)
+*/
+int gprs_send_data_weekly(String imei, int totalSMSCount, float GPSLat, float GPSLong, String CPSI)
 {
   watchdog_pet();
 
   // Send data to the server in the style of:
-  //  https://script.google.com/macros/s/AKfycbzc-xMFUDC5eisYN_rSOkV5UM0mTLd9s9ssqyqLW0LbzR1giPq5MqnKENSFYLHzFPvGUg/exec?IMEI=123456789012345&totalSMSCount=100&dailyWaterUsageTime=3600&detectedClockTimeDrift=5
-
+  //  https://script.google.com/macros/s/AKfycbzc-xMFUDC5eisYN_rSOkV5UM0mTLd9s9ssqyqLW0LbzR1giPq5MqnKENSFYLHzFPvGUg/exec?IMEI=123456789012345&totalSMSCount=100&GPSLat=37.7749&GPSLong=-122.4194&CPSI=123456789012345
+  //            /macros/s/AKfycbzc-xMFUDC5eisYN_rSOkV5UM0mTLd9s9ssqyqLW0LbzR1giPq5MqnKENSFYLHzFPvGUg/exec
+  // https://script.googleusercontent.com/macros/echo?user_content_key=tBLjPdLV768fRCXKnjybjSXHf8MDnv_7F6gm3tw1v6mIub01mNvPjKVLpRw3ddWZdpdlS5wBAVhdh60BKs31Ik2H4B8R9ymWOJmA1Yb3SEsKFZqtv3DaNYcMrmhZHmUMWojr9NvTBuBLhyHCd5hHa6_AjzMEeZLPwpHOTeu5EjB0sDqZoFgVb03d_qyaNh157TCeshrO4LuhD7gWIsDLt-QjiL-BjcmvNbraE5--3IeBon6lfM2ckhzqF8ZARUsqutNVihpc7C-Dib38DDsdM26OZQqZIj2ott0usYC-tSid4Enrv_t2Gr_uf3VRE-HNrS-LTtTpPlJNUnnJM1QN20H9g71u62u-n7kaGU_oWbcdlBr5LOSoHPnkWsEC9MTFUaUDoaBHoGk_xGmh2k5VgZ6Y3U2YOVIIJ80TIiRQSQUay_phO-_QvOQv5e2uqcfSBUbgkya8KRuQ7MvWEirwyfiCQdLX5wkT-NG1O8mQJDo&lib=M4gCo7tC_8DJRAzIeZQdTh9nsRX4jpA1g
   // Prepare the URL
+  // String url = "/macros/echo?user_content_key=tBLjPdLV768fRCXKnjybjSXHf8MDnv_7F6gm3tw1v6mIub01mNvPjKVLpRw3ddWZdpdlS5wBAVhdh60BKs31Ik2H4B8R9ymWOJmA1Yb3SEsKFZqtv3DaNYcMrmhZHmUMWojr9NvTBuBLhyHCd5hHa6_AjzMEeZLPwpHOTeu5EjB0sDqZoFgVb03d_qyaNh157TCeshrO4LuhD7gWIsDLt-QjiL-BjcmvNbraE5--3IeBon6lfM2ckhzqF8ZARUsqutNVihpc7C-Dib38DDsdM26OZQqZIj2ott0usYC-tSid4Enrv_t2Gr_uf3VRE-HNrS-LTtTpPlJNUnnJM1QN20H9g71u62u-n7kaGU_oWbcdlBr5LOSoHPnkWsEC9MTFUaUDoaBHoGk_xGmh2k5VgZ6Y3U2YOVIIJ80TIiRQSQUay_phO-_QvOQv5e2uqcfSBUbgkya8KRuQ7MvWEirwyfiCQdLX5wkT-NG1O8mQJDo&lib=M4gCo7tC_8DJRAzIeZQdTh9nsRX4jpA1g&";
   String url = "/macros/s/AKfycbzc-xMFUDC5eisYN_rSOkV5UM0mTLd9s9ssqyqLW0LbzR1giPq5MqnKENSFYLHzFPvGUg/exec?";
   url += "IMEI=" + imei;
   url += "&totalSMSCount=" + String(totalSMSCount);
-  url += "&dailyWaterUsageTime=" + String(dailyWaterUsageTime);
-  url += "&detectedClockTimeDrift=" + String(detectedClockTimeDrift);
-  url += "&temperatureLow=" + String(temperatureLow);
-  url += "&temperatureAvg=" + String(temperatureAvg);
-  url += "&temperatureHigh=" + String(temperatureHigh);
-  url += "&humidityLow=" + String(humidityLow);
-  url += "&humidityAvg=" + String(humidityAvg);
-  url += "&humidityHigh=" + String(humidityHigh);
-  url += "&signalStrength=" + String(signalStrength);
-  url += "&batteryChargeStatus=" + String(batteryChargeStatus);
-  url += "&batteryChargePercent=" + String(batteryChargePercent);
-  url += "&batteryVoltage=" + String(batteryVoltage);
-  url += "&bootCount=" + String(bootCount);
-  url += "&handle_strokes_total=" + String(handleStrokesTotal);
-  url += "&handle_strokes_flowing_total=" + String(handleStrokesFlowingTotal);
-  url += "&handle_strokes_flowing_per_min=" + String(handleStrokesFlowingPerMin);
-  url += "&dry_start_count=" + String(dryStartCount);
-  url += "&dry_start_stroke_total=" + String(dryStartStrokeTotal);
-  url += "&dry_start_stroke_avg=" + String(dryStartStrokeAvg);
-  url += "&dry_start_stroke_max=" + String(dryStartStrokeMax);
-
-  Serial.print(F("Requesting URL: "));
-  Serial.println(url);
+  url += "&GPSLat=" + String(GPSLat, 6);
+  url += "&GPSLong=" + String(GPSLong, 6);
+  url += "&CPSI=" + urlEncode(CPSI);
 
   Serial.print(F("Requesting URL: "));
   Serial.println(url);
 
-  // Set our device timeout
-  http.setHttpResponseTimeout(WATERPAL_HTTP_TIMEOUT_MS);
+  // Set our device timeout (the connection itself is opened, or reused, by the transport)
+  uint32_t request_start_ms = millis();
+  gprs_begin_request(http, transport);
 
   // Send the request
   int err = http.get(url);
@@ -280,193 +356,282 @@ int gprs_send_data_weekly(String imei, int totalSMSCount, float GPSLat, float GP
   {
     Serial.print(F("HTTP GET failed, error: "));
     Serial.println(err);
+    http.stop();
     return 0;
   }
 
-  // Read the status code and body of the response
-  int status = http.responseStatusCode();
-  Serial.print(F("Response status code: "));
-  Serial.println(status);
-  if (status < 0)
+  // Accept 200 or 302 as a valid response code.
+  return gprs_read_response(http, HTTP_ENDPOINT_WATERPAL, 200, 302, request_start_ms, millis(), NULL);
+}
+
+// **********
+// Daily report requests
+// **********
+
+// Each of these only sends the request for a daily report -- the upload scheduler in waterpal_upload.h reads the responses.
+// They return 1 if the request was sent, or 0 on failure.
+
+int gprs_request_daily(HttpClient& http_client, const dailyReport& report)
+{
+  watchdog_pet();
+
+  // Send data to the server in the style of:
+  //  https://script.google.com/macros/s/AKfycbzc-xMFUDC5eisYN_rSOkV5UM0mTLd9s9ssqyqLW0LbzR1giPq5MqnKENSFYLHzFPvGUg/exec?IMEI=123456789012345&totalSMSCount=100&dailyWaterUsageTime=3600&detectedClockTimeDrift=5
+
+  // Prepare the URL (the query parameters are the fields in waterpal_schema.h)
+  textWriter w;
+  text_init(w, schema_text_buffer, sizeof(schema_text_buffer));
+  text_put(w, "/macros/s/AKfycbzc-xMFUDC5eisYN_rSOkV5UM0mTLd9s9ssqyqLW0LbzR1giPq5MqnKENSFYLHzFPvGUg/exec?");
+  schema_write_query(w, report);
+  text_put(w, "&usageBuckets=");
+  usage_write_text(w, report);
+  http_timing_append_url_params(w);
+  transport_append_url_params(w);
+  if (w.overflow)
   {
-    Serial.println("Response " + String(status) + " from server. Waiting and trying again...");
-    delay(1000);
+    Serial.println("URL does not fit in " + String(sizeof(schema_text_buffer)) + " bytes");
     return 0;
   }
 
-  Serial.println(F("Response Headers:"));
-  while (http.headerAvailable())
+  Serial.print("Requesting URL (" + String(w.len) + " bytes): ");
+  Serial.println(w.buf);
+
+  // Send the request
+  int err = http_client.get(w.buf);
+
+  if (err != 0)
   {
-    String headerName = http.readHeaderName();
-    if (http.headerAvailable())
+    Serial.print(F("HTTP GET failed, error: "));
+    Serial.println(err);
+    http_client.stop();
+    return 0;
+  }
+
+  return 1;
+}
+
+// The JSON body of a batch request into w: {"IMEI":...,"reports":[{...},...]}
+void gprs_write_batch_json(textWriter& w, const dailyReport* reports, int num_reports, bool with_sessions)
+{
+  text_init(w, schema_text_buffer, sizeof(schema_text_buffer));
+  text_put(w, "{\"IMEI\":\"");
+  text_put(w, reports[0].imei);
+  text_put(w, "\",\"reports\":[");
+  for (int i = 0; i < num_reports; i++)
+  {
+    text_put(w, i > 0 ? ",{" : "{");
+    schema_write_json_fields(w, reports[i]);
+    text_put(w, ",\"usageBuckets\":\"");
+    usage_write_text(w, reports[i]);
+    text_put_char(w, '"');
+    if (with_sessions)
     {
-      String headerValue = http.readHeaderValue();
-      Serial.println("    " + headerName + " : " + headerValue);
+      flowlog_write_json(w, reports[i]);
     }
+    text_put_char(w, '}');
   }
+  text_put(w, "]}");
+}
+
+// Send several reports to the WaterPAL endpoint as a single POST with a JSON array of reports (for UPLOAD_MODE_BATCHED).
+//  The keys match the query parameters of gprs_request_daily(), including the report sequence number and timestamp so that the server can order and de-duplicate them.
+// Returns the number of reports in the request -- the first ones, as many as fit -- or 0 if it wasn't sent.
+int gprs_request_batch(HttpClient& http_client, const dailyReport* reports, int num_reports)
+{
   watchdog_pet();
 
-  // Accept 200 or 302 as a valid response code.
-  if (status != 200 && status != 302)
+  // Each report carries its flow sessions, unless that makes the batch too big (the totals are in the reports either way).
+  //  If it's still too big, the last reports wait for the next request.
+  textWriter w;
+  int num_sent = num_reports;
+  bool with_sessions = true;
+  for (;;)
   {
-    Serial.print(F("HTTP GET returned invalid response code: "));
-    Serial.println(status);
+    gprs_write_batch_json(w, reports, num_sent, with_sessions);
+    if (!w.overflow)
+    {
+      break;
+    }
+    if (with_sessions)
+    {
+      with_sessions = false;
+    }
+    else if (num_sent > 1)
+    {
+      num_sent--;
+      with_sessions = true;
+    }
+    else
+    {
+      Serial.println("Report does not fit in " + String(sizeof(schema_text_buffer)) + " bytes");
+      return 0;
+    }
+  }
+  if (num_sent < num_reports || !with_sessions)
+  {
+    Serial.println("Batch of " + String(num_reports) + " reports does not fit in " + String(sizeof(schema_text_buffer)) + " bytes -- sending " + String(num_sent) + (with_sessions ? "" : " without flow sessions"));
+  }
+
+  Serial.print("Prepared batch of " + String(num_sent) + " reports (length: ");
+  Serial.print(w.len);
+  Serial.println(F("):"));
+  Serial.println(w.buf);
+
+  http_client.beginRequest();
+  int err = http_client.post("/macros/s/AKfycbzc-xMFUDC5eisYN_rSOkV5UM0mTLd9s9ssqyqLW0LbzR1giPq5MqnKENSFYLHzFPvGUg/exec");
+  if (err != 0)
+  {
+    Serial.print(F("HTTP POST failed, error: "));
+    Serial.println(err);
+    http_client.stop();
     return 0;
   }
+  http_client.sendHeader("Content-Type", "application/json");
+  http_client.sendHeader("Content-Length", w.len);
+
+  http_client.beginBody();
+  http_client.write((const uint8_t*)w.buf, w.len);
+  http_client.endRequest();
+
+  watchdog_pet();
+
+  return num_sent;
+}
+
 
+// Same as gprs_request_batch, but the reports are sent as compact CBOR (optionally compressed), per WATERPAL_PAYLOAD_ENCODING_WATERPAL.
+int gprs_request_batch_compact(HttpClient& http_client, const dailyReport* reports, int num_reports)
+{
+  watchdog_pet();
 
-  int length = http.contentLength();
-  if (length >= 0) {
-    Serial.print(F("Content length is: "));
-    Serial.println(length);
+  // As many of the reports as fit (each attempt starts over from the receiver's delta baseline)
+  const uint8_t* payload;
+  size_t payload_len = 0;
+  int num_sent = num_reports;
+  while (num_sent > 0 && (payload_len = payload_encode(reports, num_sent, WATERPAL_PAYLOAD_ENCODING_WATERPAL, outbox_delta_begin(HTTP_ENDPOINT_WATERPAL), &payload, true)) == 0)
+  {
+    num_sent--;
   }
-  if (http.isResponseChunked()) {
-    Serial.println(F("The response is chunked"));
+  if (payload_len == 0)
+  {
+    return 0;
   }
 
-  String body = http.responseBody();
-  Serial.println(F("Response:"));
-  Serial.println(body);
+  String url = "/macros/s/AKfycbzc-xMFUDC5eisYN_rSOkV5UM0mTLd9s9ssqyqLW0LbzR1giPq5MqnKENSFYLHzFPvGUg/exec";
 
-  Serial.print(F("Body length is: "));
-  Serial.println(body.length());
+  http_client.beginRequest();
+  int err = http_client.post(url);
+  if (err != 0)
+  {
+    Serial.print(F("HTTP POST failed, error: "));
+    Serial.println(err);
+    http_client.stop();
+    return 0;
+  }
+  http_client.sendHeader("Content-Type", "application/cbor");
+  if (WATERPAL_PAYLOAD_ENCODING_WATERPAL == PAYLOAD_ENCODING_CBOR_HEATSHRINK)
+  {
+    http_client.sendHeader("Content-Encoding", "x-heatshrink");
+  }
+  http_client.sendHeader("Content-Length", payload_len);
 
-  // Close the connection
-  http.stop();
-  Serial.println(F("Server disconnected"));
+  http_client.beginBody();
+  http_client.write(payload, payload_len);
+  http_client.endRequest();
 
   watchdog_pet();
 
-  return 1;
+  return num_sent;
+}
+
+int gprs_request_daily_compact(HttpClient& http_client, const dailyReport& report)
+{
+  return gprs_request_batch_compact(http_client, &report, 1);
 }
 
 #if WATERPAL_USE_DESIGNOUTREACH_HTTP
 
 const char header_a[] = { 0x30, 0x36, 0x64, 0x65, 0x37, 0x37, 0x65, 0x34, 0x37, 0x30, 0x35, 0x37, 0x32, 0x30, 0x35, 0x31, 0x61, 0x33, 0x33, 0x30, 0x63, 0x33, 0x62, 0x39, 0x32, 0x30, 0x33, 0x61, 0x34, 0x64, 0x31, 0x32, 0x00 };
 
-int gprs_post_data_daily_designoutreach(String imei, int totalSMSCount, int dailyWaterUsageTime, int detectedClockTimeDrift, int temperatureLow, int temperatureAvg, int temperatureHigh, int humidityLow, int humidityAvg, int humidityHigh, int signalStrength, int batteryChargeStatus, int batteryChargePercent, float batteryVoltage, int bootCount, uint32_t handleStrokesTotal, uint32_t handleStrokesFlowingTotal, uint32_t handleStrokesFlowingPerMin, uint32_t dryStartCount, uint32_t dryStartStrokeTotal, uint32_t dryStartStrokeAvg, uint32_t dryStartStrokeMax)
+int gprs_request_daily_designoutreach(HttpClient& http_client, const dailyReport& report)
 {
   watchdog_pet();
 
-  // Get the time of the request
+  // Use the time that the report was made, since it may be going out late from the outbox
   timeval tv;
-  gettimeofday(&tv, NULL);
+  tv.tv_sec = report.timestamp_s;
+  tv.tv_usec = 0;
   String time_iso8601 = timevalToISO8601(tv);
 
   // NOTE: Convert liters per hour into gallons per day.
   // 1 liter = 0.264172 gallons
-  // dailyWaterUsageTime is in seconds
+  // water_usage_time_s is in seconds
   // Assuming 950 liters is transferred in 1 hr of water usage, convert to total gallons for the day's usage
-  float gallons = ((dailyWaterUsageTime * WATERPAL_LITERS_PER_HR) * 0.264172) / 3600;
-
-  // Create the JSON payload
-  String jsonPayload = "{";
-  jsonPayload += "\"sensor_id\": \"" + imei + "\", ";
-  jsonPayload += "\"Imei_number\": \"" + imei + "\", ";
-
-  jsonPayload += "\"timestamp\": \"" + time_iso8601 + "\", ";
-
-  jsonPayload += "\"daily_water_usage_second\": " + String(dailyWaterUsageTime) + ", ";
-  jsonPayload += "\"battery_voltage\": " + String(batteryVoltage) + ", ";
-  jsonPayload += "\"gallons\": " + String(gallons) + ", ";
-  jsonPayload += "\"period\": \"24 Hours\", ";
-  jsonPayload += "\"boot_count\": \"" + String(bootCount) + "\", ";
-  jsonPayload += "\"battery_charge\": \"" + String(batteryChargePercent) + "\", ";
-  jsonPayload += "\"signal_strength\": \"" + String(signalStrength) + "\", ";
-  jsonPayload += "\"humid\": \"" + String(humidityAvg) + "\", ";  // Using avg humidity as the example only has one field
-  jsonPayload += "\"temperature\": \"" + String(temperatureAvg) + "\", ";  // Using avg temperature
-  jsonPayload += "\"detected_clock\": \"" + String(detectedClockTimeDrift) + "\", ";
-  jsonPayload += "\"handle_strokes_total\": " + String(handleStrokesTotal) + ", ";
-  jsonPayload += "\"handle_strokes_flowing_total\": " + String(handleStrokesFlowingTotal) + ", ";
-  jsonPayload += "\"handle_strokes_flowing_per_min\": " + String(handleStrokesFlowingPerMin) + ", ";
-  jsonPayload += "\"dry_start_count\": " + String(dryStartCount) + ", ";
-  jsonPayload += "\"dry_start_stroke_total\": " + String(dryStartStrokeTotal) + ", ";
-  jsonPayload += "\"dry_start_stroke_avg\": " + String(dryStartStrokeAvg) + ", ";
-  jsonPayload += "\"dry_start_stroke_max\": " + String(dryStartStrokeMax) + ", ";
-  jsonPayload += "\"total_sms_count\": \"" + String(totalSMSCount) + "\" ";
-  jsonPayload += "}";
+  float gallons = ((report.water_usage_time_s * WATERPAL_LITERS_PER_HR) * 0.264172) / 3600;
+
+  // Create the JSON payload. Design Outreach has its own keys (and quotes some of the numbers), so this doesn't go through the schema.
+  textWriter w;
+  text_init(w, schema_text_buffer, sizeof(schema_text_buffer));
+  text_put(w, "{\"sensor_id\": \""); text_put(w, report.imei);
+  text_put(w, "\", \"Imei_number\": \""); text_put(w, report.imei);
+
+  text_put(w, "\", \"timestamp\": \""); text_put(w, time_iso8601.c_str());
+  text_put(w, "\", \"seq\": "); text_put_uint(w, report.seq); // Same for every resend, so the server can de-duplicate
+
+  text_put(w, ", \"daily_water_usage_second\": "); text_put_int(w, report.water_usage_time_s);
+  text_put(w, ", \"battery_voltage\": "); text_put_int(w, report.battery_voltage_mv);
+  text_printf(w, ", \"gallons\": %.2f", gallons);
+  text_put(w, ", \"period\": \"24 Hours\"");
+  text_put(w, ", \"boot_count\": \""); text_put_int(w, report.boot_count);
+  text_put(w, "\", \"battery_charge\": \""); text_put_int(w, report.battery_charge_pct);
+  text_put(w, "\", \"signal_strength\": \""); text_put_int(w, report.signal_strength);
+  text_put(w, "\", \"humid\": \""); text_put_int(w, report.humidity_avg); // Using avg humidity as the example only has one field
+  text_put(w, "\", \"temperature\": \""); text_put_int(w, report.temperature_avg); // Using avg temperature
+  text_put(w, "\", \"detected_clock\": \""); text_put_int(w, report.clock_drift_s);
+  text_put(w, "\", \"handle_strokes_total\": "); text_put_uint(w, report.handle_strokes_total);
+  text_put(w, ", \"handle_strokes_flowing_total\": "); text_put_uint(w, report.handle_strokes_flowing_total);
+  text_put(w, ", \"handle_strokes_flowing_per_min\": "); text_put_uint(w, report.handle_strokes_flowing_per_min);
+  text_put(w, ", \"dry_start_count\": "); text_put_uint(w, report.dry_start_count);
+  text_put(w, ", \"dry_start_stroke_total\": "); text_put_uint(w, report.dry_start_stroke_total);
+  text_put(w, ", \"dry_start_stroke_avg\": "); text_put_uint(w, report.dry_start_stroke_avg);
+  text_put(w, ", \"dry_start_stroke_max\": "); text_put_uint(w, report.dry_start_stroke_max);
+  text_put(w, ", \"total_sms_count\": \""); text_put_int(w, report.total_sms_count);
+  text_put(w, "\" }");
+  if (w.overflow)
+  {
+    Serial.println("JSON payload does not fit in " + String(sizeof(schema_text_buffer)) + " bytes");
+    return 0;
+  }
 
   Serial.print(F("Prepared JSON payload (length: "));
-  Serial.print(jsonPayload.length());
+  Serial.print(w.len);
   Serial.println(F("):"));
-  Serial.println(jsonPayload);
+  Serial.println(w.buf);
 
   // Define the endpoint URL (without query parameters now)
-  String url = "ulcs/usagedata";
+  const char* url = "ulcs/usagedata";
 
   Serial.print(F("Requesting POST to URL: "));
   Serial.println(url);
 
-  // Set our device timeout
-  http_designoutreach.setHttpResponseTimeout(WATERPAL_HTTP_TIMEOUT_MS);
-
   // Add authentication header
-  http_designoutreach.beginRequest();
-  http_designoutreach.post(url);
-  http_designoutreach.sendHeader("Content-Type", "application/json");
-  http_designoutreach.sendHeader("Key", header_a);
-  http_designoutreach.sendHeader("Content-Length", jsonPayload.length());
-
-  // Send the JSON payload
-  http_designoutreach.beginBody();
-  http_designoutreach.print(jsonPayload);
-  http_designoutreach.endRequest();
-
-  watchdog_pet();
-
-  // Read the status code and body of the response
-  int status = http_designoutreach.responseStatusCode();
-  Serial.print("Response status code: ");
-  Serial.println(status);
-  if (status < 0)
-  {
-    Serial.println("Response " + String(status) + " from server. Waiting and trying again...");
-    delay(1000);
-    return 0;
-  }
-
-  watchdog_pet();
-
-  Serial.println("Response Headers:");
-  while (http_designoutreach.headerAvailable())
-  {
-    String headerName = http_designoutreach.readHeaderName();
-    if (http_designoutreach.headerAvailable())
-    {
-      String headerValue = http_designoutreach.readHeaderValue();
-      Serial.println("    " + headerName + " : " + headerValue);
-    }
-  }
-
-  watchdog_pet();
-
-  // Accept 200 or 201 as a valid response code for POST
-  if (status != 200 && status != 201)
+  http_client.beginRequest();
+  int err = http_client.post(url);
+  if (err != 0)
   {
-    Serial.print(F("HTTP POST returned invalid response code: "));
-    Serial.println(status);
+    Serial.print(F("HTTP POST failed, error: "));
+    Serial.println(err);
+    http_client.stop();
     return 0;
   }
+  http_client.sendHeader("Content-Type", "application/json");
+  http_client.sendHeader("Key", header_a);
+  http_client.sendHeader("Content-Length", w.len);
 
-  int length = http_designoutreach.contentLength();
-  if (length >= 0) {
-    Serial.print(F("Content length is: "));
-    Serial.println(length);
-  }
-  if (http_designoutreach.isResponseChunked()) {
-    Serial.println(F("The response is chunked"));
-  }
-
-  String body = http_designoutreach.responseBody();
-  Serial.print(F("Response body length is: "));
-  Serial.println(body.length());
-
-  Serial.println(F("Response:"));
-  Serial.println(body);
-
-  // Close the connection
-  http_designoutreach.stop();
-  Serial.println(F("Server disconnected"));
+  // Send the JSON payload
+  http_client.beginBody();
+  http_client.write((const uint8_t*)w.buf, w.len);
+  http_client.endRequest();
 
   watchdog_pet();
 
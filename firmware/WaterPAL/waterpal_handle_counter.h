@@ -1,4 +1,9 @@
-// waterpal_handle_counter.h: Handle stroke counter functions and aggregate accounting
+// waterpal_handle_counter.h: S-35770 stroke counter driver, and the handle stroke accounting built on it
+// The counters (WATERPAL_COUNTERS) are read together once a wake by a counterBus. A count only goes up to 24 bits, so each counter's
+//  LOOP output -- which changes level every time the count wraps -- wakes us from deep sleep, and there is never more than one wrap
+//  between reads: the LOOP level says whether there was one, so even a full 2^24 strokes between reads is counted exactly.
+// Strokes while the water runs, and the dry-start strokes before it, are counted per flow session and logged with the session
+//  (see waterpal_flowlog.h), which sums them for the report. Only the all-strokes total is kept here.
 
 #ifndef WATERPAL_HANDLE_COUNTER_H
 #define WATERPAL_HANDLE_COUNTER_H
@@ -6,114 +11,294 @@
 #include <Arduino.h>
 #include <Wire.h>
 #include "waterpal_config.h"
+#include "waterpal_error_logging.h"
+#include "waterpal_wake.h"
 
 #if WATERPAL_USE_HANDLE_COUNTER
 
-volatile RTC_DATA_ATTR bool handle_counter_has_reading = false;
-volatile RTC_DATA_ATTR uint32_t handle_counter_last_raw = 0;
+#define COUNTER_NO_LOOP_PIN -1
+#define COUNTER_HANDLE 0 // The pump handle's counter
 
-volatile RTC_DATA_ATTR uint64_t handle_strokes_total = 0;
-volatile RTC_DATA_ATTR uint64_t handle_strokes_flowing_total = 0;
-volatile RTC_DATA_ATTR uint64_t dry_start_stroke_total = 0;
-volatile RTC_DATA_ATTR uint32_t dry_start_stroke_max = 0;
-volatile RTC_DATA_ATTR uint32_t dry_start_count = 0;
+// Results of a counter read
+#define COUNTER_READ_FAIL 0
+#define COUNTER_READ_FIRST 1 // The first reading since power-on: nothing to count yet
+#define COUNTER_READ_OK 2
 
-volatile RTC_DATA_ATTR uint64_t dry_start_candidate_strokes = 0;
-volatile RTC_DATA_ATTR bool dry_start_candidate_valid = false;
-volatile RTC_DATA_ATTR int64_t last_water_flow_end_time_s = 0;
-volatile RTC_DATA_ATTR uint32_t handle_counter_read_fail_count = 0;
-
-bool handle_counter_water_is_flowing(int water_sensor_value)
+typedef struct counterConfig
 {
-  return water_sensor_value != WATERPAL_FLOAT_SWITCH_INVERT;
-}
+  uint8_t i2c_address;
+  int8_t loop_pin;
+} counterConfig;
 
-void handle_counter_setup()
+// Per-counter state. Plain data, so it can live in RTC memory.
+typedef struct counterState
 {
-  Wire.begin(WATERPAL_COUNTER_SDA_PIN, WATERPAL_COUNTER_SCL_PIN);
-  Wire.setClock(WATERPAL_COUNTER_I2C_SPEED_HZ);
+  bool has_reading;
+  uint8_t loop_level;         // LOOP level at the last read
+  uint32_t last_raw;
+  uint64_t total;             // Strokes since power-on
+  uint32_t wrap_count;
+  uint32_t read_count;
+  uint32_t fail_count;        // Failed reads since power-on
+  uint32_t period_fail_count; // ... and this report period
+  uint16_t fail_streak;       // Failed reads in a row
+} counterState;
+
+const counterConfig counter_configs[] = WATERPAL_COUNTERS;
+#define COUNTER_NUM (sizeof(counter_configs) / sizeof(counter_configs[0]))
+
+RTC_DATA_ATTR counterState counter_states[COUNTER_NUM];
+
+class counterBus
+{
+public:
+  counterBus(TwoWire& wire, const counterConfig* configs, counterState* states, int num)
+    : wire(wire), configs(configs), states(states), num(num)
+  {
+  }
+
+  void begin()
+  {
+    wire.begin(WATERPAL_COUNTER_SDA_PIN, WATERPAL_COUNTER_SCL_PIN);
+    wire.setClock(WATERPAL_COUNTER_I2C_SPEED_HZ);
 
 #if WATERPAL_COUNTER_RST_PIN >= 0
-  pinMode(WATERPAL_COUNTER_RST_PIN, OUTPUT);
-  digitalWrite(WATERPAL_COUNTER_RST_PIN, HIGH);
+    pinMode(WATERPAL_COUNTER_RST_PIN, OUTPUT);
+    digitalWrite(WATERPAL_COUNTER_RST_PIN, HIGH);
 #endif
 
-#if WATERPAL_COUNTER_LOOP_PIN >= 0
-  pinMode(WATERPAL_COUNTER_LOOP_PIN, INPUT);
-#endif
-}
+    for (int i = 0; i < num; i++)
+    {
+      if (configs[i].loop_pin != COUNTER_NO_LOOP_PIN)
+      {
+        pinMode(configs[i].loop_pin, INPUT);
+      }
+    }
+  }
 
-bool handle_counter_read_raw(uint32_t *count)
-{
-  if (count == NULL)
+  // Read every counter, back to back. results[i] is a COUNTER_READ_* and deltas[i] the strokes since counter i's last read.
+  //  Returns the number of counters that were read.
+  int read_all(uint8_t* results, uint32_t* deltas)
   {
-    return false;
+    int num_read = 0;
+    for (int i = 0; i < num; i++)
+    {
+      results[i] = read(i, &deltas[i]);
+      num_read += results[i] != COUNTER_READ_FAIL;
+    }
+    return num_read;
   }
 
-  uint8_t bytes_read = Wire.requestFrom((uint8_t)WATERPAL_COUNTER_I2C_ADDRESS, (uint8_t)3);
-  if (bytes_read != 3)
+  uint8_t read(int i, uint32_t* delta)
   {
-    handle_counter_read_fail_count++;
-    return false;
+    counterState& s = states[i];
+    *delta = 0;
+
+    // LOOP on either side of the count: if it changed in between, the count wrapped while we read it, so read it again
+    int loop_level = read_loop(i);
+    uint32_t raw;
+    bool ok = read_raw(configs[i].i2c_address, &raw);
+    if (ok && read_loop(i) != loop_level)
+    {
+      loop_level = read_loop(i);
+      ok = read_raw(configs[i].i2c_address, &raw);
+    }
+    if (!ok)
+    {
+      s.fail_count++;
+      s.period_fail_count++;
+      s.fail_streak++;
+      Serial.println("Counter " + String(i) + " read failed (" + String(s.fail_streak) + " in a row, " + String(s.fail_count) + " of " + String(s.read_count + s.fail_count) + ")");
+      if (s.fail_streak == WATERPAL_COUNTER_FAIL_STREAK_ERROR)
+      {
+        logError(ERROR_COUNTER_FAIL);
+      }
+      return COUNTER_READ_FAIL;
+    }
+    s.read_count++;
+    s.fail_streak = 0;
+
+    uint8_t result = COUNTER_READ_FIRST;
+    if (s.has_reading)
+    {
+      *delta = delta_of(s, raw, loop_level);
+      s.total += *delta;
+      result = COUNTER_READ_OK;
+    }
+    s.has_reading = true;
+    s.last_raw = raw;
+    if (loop_level >= 0)
+    {
+      s.loop_level = loop_level;
+    }
+    return result;
   }
 
-  uint32_t value = ((uint32_t)Wire.read() << 16);
-  value |= ((uint32_t)Wire.read() << 8);
-  value |= (uint32_t)Wire.read();
-  *count = value & 0xFFFFFFUL;
-  return true;
-}
+  bool has_reading(int i)
+  {
+    return states[i].has_reading;
+  }
 
-uint32_t handle_counter_delta_24bit(uint32_t previous_count, uint32_t current_count)
-{
-  // Handles a single 24-bit S-35770 wrap between ESP32 wakeups. Multiple wraps between reads require LOOP tracking.
-  if (current_count >= previous_count)
+  // Each LOOP pin wakes us as soon as it leaves the level it had at the last read. A pin that can't be watched in this sleep (see
+  //  waterpal_wake.h) is read at the next wake anyway, and a wrap is only missed if a second one comes before that.
+  void add_wake_pins(wakePlan& plan)
   {
-    return current_count - previous_count;
+    for (int i = 0; i < num; i++)
+    {
+      if (configs[i].loop_pin != COUNTER_NO_LOOP_PIN && states[i].has_reading)
+      {
+        wake_plan_add(plan, configs[i].loop_pin, !states[i].loop_level, false);
+      }
+    }
   }
 
-  return (WATERPAL_COUNTER_MAX_COUNT - previous_count) + current_count;
+  uint32_t period_fail_count()
+  {
+    uint32_t fail_count = 0;
+    for (int i = 0; i < num; i++)
+    {
+      fail_count += states[i].period_fail_count;
+    }
+    return fail_count;
+  }
+
+  void start_period()
+  {
+    for (int i = 0; i < num; i++)
+    {
+      states[i].period_fail_count = 0;
+    }
+  }
+
+  void print()
+  {
+    for (int i = 0; i < num; i++)
+    {
+      const counterState& s = states[i];
+      Serial.println("  Counter " + String(i) + " (I2C " + String(configs[i].i2c_address) + "): " + String((uint32_t)s.total) + " strokes, " + String(s.wrap_count) + " wraps, " + String(s.read_count) + " reads, " + String(s.fail_count) + " failed (" + String(s.period_fail_count) + " this period)");
+    }
+  }
+
+private:
+  TwoWire& wire;
+  const counterConfig* configs;
+  counterState* states;
+  int num;
+
+  int read_loop(int i)
+  {
+    return configs[i].loop_pin != COUNTER_NO_LOOP_PIN ? digitalRead(configs[i].loop_pin) : -1;
+  }
+
+  bool read_raw(uint8_t i2c_address, uint32_t* count)
+  {
+    uint8_t bytes_read = wire.requestFrom(i2c_address, (uint8_t)3);
+    if (bytes_read != 3)
+    {
+      return false;
+    }
+
+    uint32_t value = ((uint32_t)wire.read() << 16);
+    value |= ((uint32_t)wire.read() << 8);
+    value |= (uint32_t)wire.read();
+    *count = value & 0xFFFFFFUL;
+    return true;
+  }
+
+  // Strokes from the last read to raw. With a LOOP pin, a changed level is exactly one wrap (we wake on every change), and a count
+  //  that went down without one means the counter was reset. Without a LOOP pin, a count that went down is taken as one wrap.
+  uint32_t delta_of(counterState& s, uint32_t raw, int loop_level)
+  {
+    bool wrapped = loop_level >= 0 ? loop_level != s.loop_level : raw < s.last_raw;
+    if (wrapped)
+    {
+      s.wrap_count++;
+      return (uint32_t)(WATERPAL_COUNTER_MAX_COUNT - s.last_raw + raw);
+    }
+    if (raw < s.last_raw)
+    {
+      Serial.println("Counter went from " + String(s.last_raw) + " to " + String(raw) + " without a LOOP change -- it was reset");
+      return raw;
+    }
+    return raw - s.last_raw;
+  }
+};
+
+counterBus counter_bus(Wire, counter_configs, counter_states, COUNTER_NUM);
+
+volatile RTC_DATA_ATTR uint64_t handle_strokes_total = 0;
+volatile RTC_DATA_ATTR uint64_t handle_strokes_session = 0; // Strokes since the water started running
+volatile RTC_DATA_ATTR bool session_dry_start = false;      // Whether the water started running after a qualifying dry start
+volatile RTC_DATA_ATTR uint64_t session_dry_start_strokes = 0;
+
+volatile RTC_DATA_ATTR uint64_t dry_start_candidate_strokes = 0;
+volatile RTC_DATA_ATTR bool dry_start_candidate_valid = false;
+volatile RTC_DATA_ATTR int64_t last_water_flow_end_time_s = 0;
+uint32_t handle_counter_last_delta = 0; // Strokes found by this wake's read
+
+bool handle_counter_water_is_flowing(int water_sensor_value)
+{
+  return water_sensor_value != WATERPAL_FLOAT_SWITCH_INVERT;
+}
+
+void handle_counter_setup()
+{
+  counter_bus.begin();
+}
+
+bool handle_counter_has_reading()
+{
+  return counter_bus.has_reading(COUNTER_HANDLE);
 }
 
+// Read all of the counters, and account for the handle's strokes
 bool handle_counter_update(bool previous_water_was_flowing)
 {
-  uint32_t current_raw = 0;
-  if (!handle_counter_read_raw(&current_raw))
+  uint8_t results[COUNTER_NUM];
+  uint32_t deltas[COUNTER_NUM];
+  counter_bus.read_all(results, deltas);
+
+  handle_counter_last_delta = 0;
+  if (results[COUNTER_HANDLE] == COUNTER_READ_FAIL)
   {
     Serial.println("Handle counter read failed");
     return false;
   }
 
-  if (!handle_counter_has_reading)
+  if (results[COUNTER_HANDLE] == COUNTER_READ_FIRST)
   {
-    handle_counter_last_raw = current_raw;
-    handle_counter_has_reading = true;
     dry_start_candidate_strokes = 0;
     dry_start_candidate_valid = true;
-    Serial.println("Handle counter initialized at raw count " + String(current_raw));
+    Serial.println("Handle counter initialized at raw count " + String(counter_states[COUNTER_HANDLE].last_raw));
     return true;
   }
 
-  uint32_t delta = handle_counter_delta_24bit(handle_counter_last_raw, current_raw);
-  handle_counter_last_raw = current_raw;
+  uint32_t delta = deltas[COUNTER_HANDLE];
+  handle_counter_last_delta = delta;
 
   handle_strokes_total += delta;
   if (previous_water_was_flowing)
   {
-    handle_strokes_flowing_total += delta;
+    handle_strokes_session += delta;
   }
   else if (dry_start_candidate_valid)
   {
     dry_start_candidate_strokes += delta;
   }
 
-  Serial.println("Handle counter raw: " + String(current_raw) + " delta: " + String(delta) + " total: " + String((uint32_t)handle_strokes_total));
+  Serial.println("Handle counter raw: " + String(counter_states[COUNTER_HANDLE].last_raw) + " delta: " + String(delta) + " total: " + String((uint32_t)handle_strokes_total));
   return true;
 }
 
+// Before deep sleep: wake on the next LOOP change
+void handle_counter_add_wake_pins(wakePlan& plan)
+{
+  counter_bus.add_wake_pins(plan);
+}
+
 void handle_counter_log_water_state_change(bool water_is_flowing, int64_t now_s)
 {
-  if (!handle_counter_has_reading)
+  if (!handle_counter_has_reading())
   {
     return;
   }
@@ -121,20 +306,17 @@ void handle_counter_log_water_state_change(bool water_is_flowing, int64_t now_s)
   if (water_is_flowing)
   {
     bool dry_start_qualified = last_water_flow_end_time_s == 0 || now_s - last_water_flow_end_time_s >= WATERPAL_MIN_DRY_DRAIN_TIME_S;
-    if (dry_start_candidate_valid && dry_start_qualified)
+    session_dry_start = dry_start_candidate_valid && dry_start_qualified;
+    session_dry_start_strokes = session_dry_start ? dry_start_candidate_strokes : 0;
+    if (session_dry_start)
     {
-      dry_start_stroke_total += dry_start_candidate_strokes;
-      if (dry_start_candidate_strokes > dry_start_stroke_max)
-      {
-        dry_start_stroke_max = dry_start_candidate_strokes > 0xFFFFFFFFULL ? 0xFFFFFFFFUL : (uint32_t)dry_start_candidate_strokes;
-      }
-      dry_start_count++;
       Serial.println("Dry start counted with " + String((uint32_t)dry_start_candidate_strokes) + " strokes");
     }
     else
     {
       Serial.println("Water flow started before dry-drain threshold; dry start not counted");
     }
+    handle_strokes_session = 0;
     dry_start_candidate_strokes = 0;
     dry_start_candidate_valid = false;
   }
@@ -161,60 +343,55 @@ uint32_t handle_counter_get_handle_strokes_total()
   return handle_counter_to_report_value(handle_strokes_total);
 }
 
-uint32_t handle_counter_get_handle_strokes_flowing_total()
+uint32_t handle_counter_get_last_delta()
 {
-  return handle_counter_to_report_value(handle_strokes_flowing_total);
+  return handle_counter_last_delta;
 }
 
-uint32_t handle_counter_get_dry_start_count()
+// The flow session that just ended: its strokes, and whether it followed a dry start (and how many strokes that took)
+uint32_t handle_counter_get_session_strokes()
 {
-  return dry_start_count;
+  return handle_counter_to_report_value(handle_strokes_session);
 }
 
-uint32_t handle_counter_get_dry_start_stroke_total()
+bool handle_counter_get_session_dry_start(uint32_t *dry_start_strokes)
 {
-  return handle_counter_to_report_value(dry_start_stroke_total);
+  *dry_start_strokes = handle_counter_to_report_value(session_dry_start_strokes);
+  return session_dry_start;
 }
 
-uint32_t handle_counter_get_dry_start_stroke_avg()
+uint32_t handle_counter_get_read_fail_count()
 {
-  uint32_t report_dry_start_count = handle_counter_get_dry_start_count();
-  if (report_dry_start_count == 0)
-  {
-    return 0;
-  }
-
-  return handle_counter_get_dry_start_stroke_total() / report_dry_start_count;
+  return counter_bus.period_fail_count();
 }
 
-uint32_t handle_counter_get_dry_start_stroke_max()
+void handle_counter_print()
 {
-  return dry_start_stroke_max;
+  counter_bus.print();
 }
 
 void handle_counter_mark_report_sent()
 {
   handle_strokes_total = 0;
-  handle_strokes_flowing_total = 0;
-  dry_start_stroke_total = 0;
-  dry_start_stroke_max = 0;
-  dry_start_count = 0;
+  counter_bus.start_period();
 }
 
 #else
 
 bool handle_counter_water_is_flowing(int water_sensor_value) { return water_sensor_value != WATERPAL_FLOAT_SWITCH_INVERT; }
 void handle_counter_setup() {}
+bool handle_counter_has_reading() { return false; }
 bool handle_counter_update(bool previous_water_was_flowing) { return false; }
+void handle_counter_add_wake_pins(wakePlan& plan) {}
 void handle_counter_log_water_state_change(bool water_is_flowing, int64_t now_s) {}
 uint32_t handle_counter_get_handle_strokes_total() { return 0; }
-uint32_t handle_counter_get_handle_strokes_flowing_total() { return 0; }
-uint32_t handle_counter_get_dry_start_count() { return 0; }
-uint32_t handle_counter_get_dry_start_stroke_total() { return 0; }
-uint32_t handle_counter_get_dry_start_stroke_avg() { return 0; }
-uint32_t handle_counter_get_dry_start_stroke_max() { return 0; }
+uint32_t handle_counter_get_last_delta() { return 0; }
+uint32_t handle_counter_get_session_strokes() { return 0; }
+bool handle_counter_get_session_dry_start(uint32_t *dry_start_strokes) { *dry_start_strokes = 0; return false; }
+uint32_t handle_counter_get_read_fail_count() { return 0; }
+void handle_counter_print() {}
 void handle_counter_mark_report_sent() {}
 
 #endif // WATERPAL_USE_HANDLE_COUNTER
 
-#endif // WATERPAL_HANDLE_COUNTER_H
\ No newline at end of file
+#endif // WATERPAL_HANDLE_COUNTER_H
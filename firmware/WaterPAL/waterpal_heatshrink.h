@@ -0,0 +1,104 @@
+// waterpal_heatshrink.h: Small LZSS compressor that produces heatshrink-compatible output
+
+#ifndef WATERPAL_HEATSHRINK_H
+#define WATERPAL_HEATSHRINK_H
+
+#include <Arduino.h>
+
+// Output can be decoded by the stock heatshrink decoder (https://github.com/atomicobject/heatshrink) with these parameters:
+//  window_sz2 = HEATSHRINK_WINDOW_BITS, lookahead_sz2 = HEATSHRINK_LOOKAHEAD_BITS
+// Our payloads are only a few hundred bytes, so a brute-force match search is fast enough and needs no index memory.
+#define HEATSHRINK_WINDOW_BITS 8
+#define HEATSHRINK_LOOKAHEAD_BITS 4
+#define HEATSHRINK_WINDOW_SIZE (1 << HEATSHRINK_WINDOW_BITS)
+#define HEATSHRINK_LOOKAHEAD_SIZE (1 << HEATSHRINK_LOOKAHEAD_BITS)
+// A back-reference costs 1 + window + lookahead bits, versus 9 bits per literal byte
+#define HEATSHRINK_MIN_MATCH (((1 + HEATSHRINK_WINDOW_BITS + HEATSHRINK_LOOKAHEAD_BITS) / 9) + 1)
+
+typedef struct heatshrinkBitWriter
+{
+  uint8_t* buf;
+  size_t size;
+  size_t len;
+  uint8_t bit_mask; // Next bit to fill in the current byte (MSB first)
+  bool overflow;
+} heatshrinkBitWriter;
+
+void heatshrink_put_bits(heatshrinkBitWriter& w, uint32_t bits, int num_bits)
+{
+  for (int i = num_bits - 1; i >= 0; i--)
+  {
+    if (w.bit_mask == 0x80)
+    {
+      if (w.len >= w.size)
+      {
+        w.overflow = true;
+        return;
+      }
+      w.buf[w.len++] = 0;
+    }
+    if (bits & (1UL << i))
+    {
+      w.buf[w.len - 1] |= w.bit_mask;
+    }
+    w.bit_mask >>= 1;
+    if (w.bit_mask == 0)
+    {
+      w.bit_mask = 0x80;
+    }
+  }
+}
+
+// Compress in_len bytes from in into out. Returns the compressed length, or 0 if it didn't fit in out_size bytes.
+size_t heatshrink_compress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_size)
+{
+  heatshrinkBitWriter w = { out, out_size, 0, 0x80, false };
+
+  size_t pos = 0;
+  while (pos < in_len && !w.overflow)
+  {
+    // Find the longest match in the window behind us
+    size_t best_len = 0;
+    size_t best_offset = 0;
+    size_t max_len = in_len - pos < HEATSHRINK_LOOKAHEAD_SIZE ? in_len - pos : HEATSHRINK_LOOKAHEAD_SIZE;
+    size_t window_start = pos > HEATSHRINK_WINDOW_SIZE ? pos - HEATSHRINK_WINDOW_SIZE : 0;
+    for (size_t candidate = window_start; candidate < pos; candidate++)
+    {
+      size_t len = 0;
+      while (len < max_len && in[candidate + len] == in[pos + len])
+      {
+        len++;
+      }
+      if (len > best_len)
+      {
+        best_len = len;
+        best_offset = pos - candidate;
+        if (len == max_len)
+        {
+          break;
+        }
+      }
+    }
+
+    if (best_len >= HEATSHRINK_MIN_MATCH)
+    {
+      // Back-reference: tag bit 0, then (offset - 1) and (length - 1)
+      heatshrink_put_bits(w, 0, 1);
+      heatshrink_put_bits(w, best_offset - 1, HEATSHRINK_WINDOW_BITS);
+      heatshrink_put_bits(w, best_len - 1, HEATSHRINK_LOOKAHEAD_BITS);
+      pos += best_len;
+    }
+    else
+    {
+      // Literal: tag bit 1, then the byte
+      heatshrink_put_bits(w, 1, 1);
+      heatshrink_put_bits(w, in[pos], 8);
+      pos++;
+    }
+  }
+
+  // Any unused bits in the last byte are left as zero, which the decoder ignores
+  return w.overflow ? 0 : w.len;
+}
+
+#endif // WATERPAL_HEATSHRINK_H
@@ -0,0 +1,136 @@
+// waterpal_http_timing.h: Per-endpoint HTTP timing history and learned timeouts
+
+#ifndef WATERPAL_HTTP_TIMING_H
+#define WATERPAL_HTTP_TIMING_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include "waterpal_config.h"
+#include "waterpal_text.h"
+
+// Endpoints that we track timings for
+#define HTTP_ENDPOINT_WATERPAL 0
+#define HTTP_ENDPOINT_DESIGNOUTREACH 1
+#define HTTP_NUM_ENDPOINTS 2
+
+// Request phases that we time (and time out) separately
+#define HTTP_PHASE_CONNECT 0    // Opening the socket (including the TLS handshake)
+#define HTTP_PHASE_FIRST_BYTE 1 // From request sent until the status line arrives
+#define HTTP_PHASE_TOTAL 2      // From start of request until the body has been read
+#define HTTP_NUM_PHASES 3
+
+const char* http_endpoint_names[HTTP_NUM_ENDPOINTS] = { "wp", "do" };
+
+// Ring buffer of the most recent timings (ms) for each endpoint and phase. A request that timed out goes in at the timeout it hit,
+//  since it took at least that long -- so once an endpoint slows down past its learned timeout, the timeout grows (doubling with
+//  the default percentile and margin) until requests get through again, instead of every request timing out with nothing learned.
+// Phases are recorded independently, since a request on a reused connection has no connect phase.
+volatile RTC_DATA_ATTR uint32_t http_timing_history_ms[HTTP_NUM_ENDPOINTS][HTTP_NUM_PHASES][WATERPAL_HTTP_TIMING_HISTORY];
+volatile RTC_DATA_ATTR uint8_t http_timing_history_count[HTTP_NUM_ENDPOINTS][HTTP_NUM_PHASES];
+volatile RTC_DATA_ATTR uint8_t http_timing_history_next[HTTP_NUM_ENDPOINTS][HTTP_NUM_PHASES];
+
+// Number of requests that hit a timeout, for each endpoint and phase
+volatile RTC_DATA_ATTR uint32_t http_timeout_count[HTTP_NUM_ENDPOINTS][HTTP_NUM_PHASES];
+
+const char* http_phase_names[HTTP_NUM_PHASES] = { "connect", "first byte", "total" };
+
+void http_timing_record(int endpoint, int phase, uint32_t elapsed_ms)
+{
+  uint8_t slot = http_timing_history_next[endpoint][phase];
+  http_timing_history_ms[endpoint][phase][slot] = elapsed_ms;
+
+  http_timing_history_next[endpoint][phase] = (slot + 1) % WATERPAL_HTTP_TIMING_HISTORY;
+  if (http_timing_history_count[endpoint][phase] < WATERPAL_HTTP_TIMING_HISTORY)
+  {
+    http_timing_history_count[endpoint][phase]++;
+  }
+
+  Serial.println("HTTP timing [" + String(http_endpoint_names[endpoint]) + "] " + String(http_phase_names[phase]) + ": " + String(elapsed_ms) + " ms");
+}
+
+// A request that ran into the phase's timeout after elapsed_ms
+void http_timing_record_timeout(int endpoint, int phase, uint32_t elapsed_ms)
+{
+  http_timeout_count[endpoint][phase]++;
+  Serial.println("HTTP timeout [" + String(http_endpoint_names[endpoint]) + "] " + String(http_phase_names[phase]) + " (count: " + String(http_timeout_count[endpoint][phase]) + ")");
+  http_timing_record(endpoint, phase, elapsed_ms);
+}
+
+// Returns the WATERPAL_HTTP_TIMEOUT_PERCENTILE'th percentile of the recorded samples, or 0 if we don't have enough history yet.
+uint32_t http_timing_get_percentile_ms(int endpoint, int phase)
+{
+  int count = http_timing_history_count[endpoint][phase];
+  if (count < WATERPAL_HTTP_TIMING_MIN_SAMPLES)
+  {
+    return 0;
+  }
+
+  // Insertion sort a copy -- the history is only a handful of samples long
+  uint32_t sorted[WATERPAL_HTTP_TIMING_HISTORY];
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t val = http_timing_history_ms[endpoint][phase][i];
+    int j = i;
+    while (j > 0 && sorted[j - 1] > val)
+    {
+      sorted[j] = sorted[j - 1];
+      j--;
+    }
+    sorted[j] = val;
+  }
+
+  // Nearest-rank percentile
+  int rank = (count * WATERPAL_HTTP_TIMEOUT_PERCENTILE + 99) / 100;
+  if (rank < 1)
+  {
+    rank = 1;
+  }
+  return sorted[rank - 1];
+}
+
+// The timeout to use for the given endpoint and phase: a margin over the recent high percentile, clamped to a sane floor and ceiling.
+uint32_t http_timing_get_timeout_ms(int endpoint, int phase)
+{
+  uint32_t percentile_ms = http_timing_get_percentile_ms(endpoint, phase);
+  if (percentile_ms == 0)
+  {
+    // Not enough history to learn from yet, so be generous.
+    return WATERPAL_HTTP_TIMEOUT_MS;
+  }
+
+  uint32_t timeout_ms = (uint32_t)(((uint64_t)percentile_ms * WATERPAL_HTTP_TIMEOUT_MARGIN_PCT) / 100);
+  if (timeout_ms < WATERPAL_HTTP_TIMEOUT_MIN_MS)
+  {
+    timeout_ms = WATERPAL_HTTP_TIMEOUT_MIN_MS;
+  }
+  if (timeout_ms > WATERPAL_HTTP_TIMEOUT_MS)
+  {
+    timeout_ms = WATERPAL_HTTP_TIMEOUT_MS;
+  }
+  return timeout_ms;
+}
+
+uint32_t http_timing_get_timeout_count(int endpoint)
+{
+  uint32_t total = 0;
+  for (int phase = 0; phase < HTTP_NUM_PHASES; phase++)
+  {
+    total += http_timeout_count[endpoint][phase];
+  }
+  return total;
+}
+
+// Append the learned timeouts and timeout counts for every endpoint to a URL query string
+void http_timing_append_url_params(textWriter& w)
+{
+  for (int endpoint = 0; endpoint < HTTP_NUM_ENDPOINTS; endpoint++)
+  {
+    const char* name = http_endpoint_names[endpoint];
+    text_put(w, "&http_"); text_put(w, name); text_put(w, "_connect_timeout_ms="); text_put_uint(w, http_timing_get_timeout_ms(endpoint, HTTP_PHASE_CONNECT));
+    text_put(w, "&http_"); text_put(w, name); text_put(w, "_response_timeout_ms="); text_put_uint(w, http_timing_get_timeout_ms(endpoint, HTTP_PHASE_FIRST_BYTE));
+    text_put(w, "&http_"); text_put(w, name); text_put(w, "_total_timeout_ms="); text_put_uint(w, http_timing_get_timeout_ms(endpoint, HTTP_PHASE_TOTAL));
+    text_put(w, "&http_"); text_put(w, name); text_put(w, "_timeout_count="); text_put_uint(w, http_timing_get_timeout_count(endpoint));
+  }
+}
+
+#endif // WATERPAL_HTTP_TIMING_H
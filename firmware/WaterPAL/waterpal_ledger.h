@@ -0,0 +1,113 @@
+// waterpal_ledger.h: Delivery ledger -- server acknowledgements, and deciding when a report still needs to go out by SMS
+
+#ifndef WATERPAL_LEDGER_H
+#define WATERPAL_LEDGER_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include "waterpal_config.h"
+#include "waterpal_report.h"
+#include "waterpal_outbox.h"
+
+// The outbox is the ledger: every report has a sequence number, and each channel records the newest one it has delivered
+//  (channels deliver in order). Resends carry the same sequence number, so the server can dedupe on (IMEI, seq).
+// This file adds what counts as "delivered" for an HTTP endpoint, and uses the ledger to keep SMS to a fallback / heartbeat.
+
+#define LEDGER_REPORT_ID_LEN 40
+
+// Last report ID that each endpoint acknowledged
+RTC_DATA_ATTR char ledger_report_id[HTTP_NUM_ENDPOINTS][LEDGER_REPORT_ID_LEN];
+volatile RTC_DATA_ATTR int64_t ledger_last_sms_time_s = 0; // Report time of the last regular SMS that went out
+
+// Find "key": value in a flat JSON object and copy the value (without quotes). Returns false if the key isn't there.
+bool ledger_json_find_value(const String& body, const char* key, String& value)
+{
+  int pos = body.indexOf("\"" + String(key) + "\"");
+  if (pos < 0)
+  {
+    return false;
+  }
+  pos = body.indexOf(':', pos + strlen(key) + 2);
+  if (pos < 0)
+  {
+    return false;
+  }
+  pos++;
+  while (pos < (int)body.length() && (body[pos] == ' ' || body[pos] == '"'))
+  {
+    pos++;
+  }
+  int end = pos;
+  while (end < (int)body.length() && body[end] != '"' && body[end] != ',' && body[end] != '}' && body[end] != ' ')
+  {
+    end++;
+  }
+  if (end == pos)
+  {
+    return false;
+  }
+  value = body.substring(pos, end);
+  return true;
+}
+
+// Check the acknowledgement in a response body for UPLOAD_ACK_REPORT_ID endpoints: it has to carry the server's report ID ("id"),
+//  and may carry the sequence number of the newest report the server stored ("seq"), in which case only reports up to that are delivered.
+// On success, lowers *delivered_seq to what the server acknowledged and returns true.
+bool ledger_parse_ack(int endpoint, const String& body, uint32_t* delivered_seq)
+{
+  String report_id;
+  if (!ledger_json_find_value(body, "id", report_id))
+  {
+    Serial.println("No report ID in response from [" + String(http_endpoint_names[endpoint]) + "]");
+    return false;
+  }
+  strncpy(ledger_report_id[endpoint], report_id.c_str(), LEDGER_REPORT_ID_LEN - 1);
+  ledger_report_id[endpoint][LEDGER_REPORT_ID_LEN - 1] = '\0';
+
+  String seq;
+  if (ledger_json_find_value(body, "seq", seq))
+  {
+    uint32_t acked_seq = seq.toInt();
+    if (acked_seq < *delivered_seq)
+    {
+      *delivered_seq = acked_seq;
+    }
+  }
+
+  Serial.println("[" + String(http_endpoint_names[endpoint]) + "] acknowledged report #" + String(*delivered_seq) + " as ID " + String(ledger_report_id[endpoint]));
+  return true;
+}
+
+// Has any network channel (HTTP or CoAP) delivered this report?
+bool ledger_delivered_by_network(uint32_t seq)
+{
+  for (int channel = 0; channel < OUTBOX_NUM_CHANNELS; channel++)
+  {
+    if (channel != OUTBOX_CHANNEL_SMS && outbox_channel_in_use(channel) && outbox_sent_seq[channel] >= seq)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Does this report still need a regular SMS, under WATERPAL_SMS_POLICY?
+bool ledger_sms_needed(const dailyReport& report)
+{
+  if (WATERPAL_SMS_POLICY == SMS_POLICY_ALWAYS || !ledger_delivered_by_network(report.seq))
+  {
+    return true;
+  }
+
+  // Delivered over the network. A heartbeat still goes out for the newest report if it has been long enough since the last SMS.
+  return WATERPAL_SMS_POLICY == SMS_POLICY_HEARTBEAT &&
+    report.seq == outbox_next_seq - 1 &&
+    report.timestamp_s - ledger_last_sms_time_s >= WATERPAL_SMS_HEARTBEAT_INTERVAL_S;
+}
+
+void ledger_sms_sent(const dailyReport& report)
+{
+  ledger_last_sms_time_s = report.timestamp_s;
+}
+
+#endif // WATERPAL_LEDGER_H
@@ -4,6 +4,7 @@
 #include <TinyGsmClient.h> //  Purpose:  header file in the TinyGSM library, for communicating with various GSM modules. The library provides an abstraction layer that simplifies the process of sending AT commands.
 #include "waterpal_error_logging.h"
 #include "waterpal_clock.h"
+#include "waterpal_drift.h"
 #include "waterpal_watchdog.h"
 
 // These functions are all related to the modem, and are used to interact with it in various ways. They are all part of the firmware for the WaterPAL device, which is designed to monitor water usage and send SMS messages with relevant data. The functions are used to gather information from the modem, send messages, and manage the modem's power state.
@@ -443,10 +444,6 @@ int8_t modem_setLocalTimeFromCCLK() {
   modem.sendAT("+CCLK?");
   if (modem.waitResponse("+CCLK:") != 1) { return 0; }
 
-  // Request the current system time so that we can calculate the drift between the modem's time and the system time.
-  struct timeval tv_orig;
-  gettimeofday(&tv_orig, NULL);
-
   // Receive the timestamp string from the modem
   String timestamp = SerialAT.readString();
   timestamp.trim();
@@ -469,25 +466,17 @@ int8_t modem_setLocalTimeFromCCLK() {
   // TODO: How to populate timeinfo.tm_isdst properly?
   //  NOTE: Most developing countries do not use DST, so we can default to 0 for now.
 
-  // Set the system time
+  // Set the system time, and record the sync point for the drift model (which needs the clock reading from before it's set)
   time_t t_of_day = mktime(&timeinfo);
-  struct timeval tv_new;
-  tv_new.tv_sec = t_of_day;
-  tv_new.tv_usec = 0;
-  settimeofday(&tv_new, NULL); // Update the RTC with the new time epoch offset.
+  bool first_sync = (drift_sync_count == 0);
+  int64_t time_diff_s = drift_sync(t_of_day, "modem");
+  drift_utc_offset_s = -timezone_quarterHourOffset * 15 * 60l;
 
   int8_t res = modem.waitResponse(); // Clear the OK
 
-  // Only calculate drift if this is not our first time waking up
-  if (bootCount > 1) {
-    // Calculate the offset between the modem's time and the original system time
-    int64_t time_diff_s = tv_new.tv_sec - tv_orig.tv_sec;
-
-    Serial.println(">> TIME DRIFT: Drift between modem and system time: " + String(time_diff_s) + " seconds");
-
+  // What's left after the drift model's correction
+  if (!first_sync) {
     last_time_drift_val_s = time_diff_s;
-  } else {
-    Serial.println(">> TIME DRIFT: First time setting time from modem -- no drift calculation needed.");
   }
 
   watchdog_pet();
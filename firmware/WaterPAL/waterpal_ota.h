@@ -0,0 +1,942 @@
+// waterpal_ota.h: Firmware updates over GPRS, as signed binary delta patches streamed into the other app partition
+
+#ifndef WATERPAL_OTA_H
+#define WATERPAL_OTA_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pk.h>
+#include <ArduinoHttpClient.h>
+#include <LittleFS.h>
+#include "waterpal_config.h"
+#include "waterpal_text.h"
+#include "waterpal_drift.h"
+#include "waterpal_gprs.h"
+#include "waterpal_handle_counter.h"
+#include "waterpal_outbox.h"
+#include "waterpal_scheduler.h"
+
+// A full image is about a megabyte, which at 9600 baud is far more modem time (and data) than a wake can afford. Instead, the
+//  update server keeps a patch from each firmware version it knows about to its newest one, and we only download the patch.
+//
+// 1. Every WATERPAL_OTA_CHECK_INTERVAL_S, we ask for <path>/manifest?version=<WATERPAL_FIRMWARE_VERSION>. No update is a 204.
+//    The manifest is a few "key=value" lines (from, to, patch_size, image_size, image_sha256), then "sig=" with an ECDSA P-256
+//    signature (DER, hex) over every byte before that line. We check it against WATERPAL_OTA_PUBLIC_KEY before using anything in it.
+// 2. We download <path>/patch/<from>-<to>.wpd, at most WATERPAL_OTA_MAX_BYTES_PER_WAKE bytes per wake, and apply it as it
+//    arrives: the new image is built from the running partition and the patch, and written into the next update partition.
+//    RAM use is a few small buffers, whatever the image size.
+// 3. The decoder state is checkpointed into RTC memory every time the output buffer goes to flash. On the next wake, the download
+//    resumes from the checkpoint with an HTTP Range request. Anything written after the checkpoint is written again with the same
+//    bytes, which flash allows without an erase (programming only clears bits). A power cut loses RTC memory, so the download starts over.
+// 4. Once the image is complete, we hash the whole partition and compare it with the signed image_sha256, then make it the boot
+//    partition. A restart reloads every RTC_DATA_ATTR variable, so it only happens on the way to sleep from a report wake -- the
+//    period's accumulators have just started over -- once the outbox has nothing left in RTC memory and no water is running.
+//    The state that outlives a report period (counters, drift model, schedule, HTTP timings) is handed over through flash.
+// 5. The new firmware boots in the "pending verify" state, and confirms itself once it has connected to GPRS (ota_confirm_boot()).
+//    If it crashes or hangs first (the watchdog resets it), the bootloader goes back to the previous firmware. This needs a
+//    bootloader built with CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE. Waking from deep sleep goes through the bootloader too, which
+//    would also roll back an image still pending verify, so one that reached sleep without reaching the network is marked valid
+//    and goes on trial instead: after WATERPAL_OTA_CONFIRM_ATTEMPTS failed GPRS connects, we switch back to the previous firmware
+//    ourselves, at the next report wake.
+//
+// Patch format (see firmware/utils/waterpal_ota_patch.py, which makes them):
+//  "WPD1" | old image size (uint32 LE) | new image size (uint32 LE) | ops until the new image is complete
+// Each op starts with its type and the number of output bytes it makes (unsigned LEB128 varint):
+//  OTA_OP_COPY:   source offset change (zigzag varint), then copy that many bytes of the running image from the source offset
+//  OTA_OP_ADD:    source offset change, then pairs of <zero run varint> <literal length varint> <literal bytes> until the op is done.
+//                 Each output byte is the running image's byte plus the patch byte (mod 256), and a zero run means the bytes are
+//                 unchanged -- that's what lets moved code with shifted addresses patch cheaply.
+//  OTA_OP_INSERT: the bytes themselves
+// The source offset carries on from where the previous COPY or ADD op stopped.
+
+#define OTA_PATCH_MAGIC "WPD1"
+#define OTA_PATCH_HEADER_LEN 12
+
+#define OTA_OP_COPY 1
+#define OTA_OP_ADD 2
+#define OTA_OP_INSERT 3
+
+// What the decoder does next. The steps before OTA_STEP_COPY read patch bytes; those from OTA_STEP_COPY on make output
+//  from the running image without reading any.
+#define OTA_STEP_HEADER 0
+#define OTA_STEP_OP 1
+#define OTA_STEP_LEN 2
+#define OTA_STEP_SRC 3
+#define OTA_STEP_ZERO_RUN 4
+#define OTA_STEP_LITERAL_LEN 5
+#define OTA_STEP_LITERAL 6
+#define OTA_STEP_INSERT 7
+#define OTA_STEP_COPY 8
+#define OTA_STEP_ZERO_COPY 9
+
+#define OTA_STATUS_IDLE 0
+#define OTA_STATUS_DOWNLOADING 1
+#define OTA_STATUS_READY 2 // Verified and set as the boot partition, waiting for a restart
+
+#define OTA_FLASH_SECTOR_SIZE 4096
+#define OTA_OUT_BUFFER_SIZE 256
+#define OTA_SOURCE_CACHE_SIZE 256
+#define OTA_READ_BUFFER_SIZE 512
+#define OTA_MANIFEST_MAX_BYTES 1024
+#define OTA_SIGNATURE_MAX_BYTES 80
+
+typedef struct otaManifest
+{
+  uint32_t from_version;
+  uint32_t to_version;
+  uint32_t patch_size;
+  uint32_t image_size;
+  uint8_t image_sha256[32];
+} otaManifest;
+
+// Everything the patch decoder needs to carry on from where it stopped
+typedef struct otaPatchState
+{
+  uint8_t step;           // OTA_STEP_*
+  uint8_t op;             // OTA_OP_* being decoded
+  uint8_t varint_shift;
+  uint32_t varint;        // Varint being read
+  uint32_t op_remaining;  // Output bytes left in the op
+  uint32_t run_remaining; // Bytes left in the current zero run, literal, insert or copy
+  uint32_t src;           // Offset in the running image
+  uint32_t patch_offset;  // Patch bytes consumed
+  uint32_t out_offset;    // Output bytes written to flash
+  uint32_t old_size;
+  uint8_t header[OTA_PATCH_HEADER_LEN];
+} otaPatchState;
+
+volatile RTC_DATA_ATTR uint8_t ota_status = OTA_STATUS_IDLE;
+volatile RTC_DATA_ATTR int64_t ota_last_check_time_s = 0;
+volatile RTC_DATA_ATTR bool ota_trial = false;                  // Running new firmware that hasn't reached the network yet
+volatile RTC_DATA_ATTR uint32_t ota_trial_fail_count = 0;       // Failed GPRS connects since it first booted
+RTC_DATA_ATTR otaManifest ota_manifest;
+RTC_DATA_ATTR otaPatchState ota_checkpoint; // Decoder state when the output was last written to flash
+
+// Working state for this wake
+otaPatchState ota_state;
+const esp_partition_t* ota_source_partition = NULL;
+const esp_partition_t* ota_target_partition = NULL;
+uint8_t ota_out_buffer[OTA_OUT_BUFFER_SIZE];
+size_t ota_out_len = 0;
+uint8_t ota_source_cache[OTA_SOURCE_CACHE_SIZE];
+uint32_t ota_source_cache_offset = 0;
+size_t ota_source_cache_len = 0;
+bool ota_error = false;
+
+// The update server shares the WaterPAL endpoint's socket (the modem only has two TLS sockets), so close that connection first
+HttpClient ota_http(client, WATERPAL_OTA_HOST, WATERPAL_OTA_PORT);
+
+void ota_fail(const String& message)
+{
+  Serial.println("OTA: " + message);
+  logError(ERROR_OTA_FAIL);
+  ota_error = true;
+}
+
+// Abandon the update, so the next check starts over
+void ota_reset()
+{
+  ota_status = OTA_STATUS_IDLE;
+  memset(&ota_checkpoint, 0, sizeof(ota_checkpoint));
+}
+
+// **********
+// Patch decoder
+// **********
+
+// Byte of the running image at an offset, read through a small cache
+bool ota_source_byte(uint32_t offset, uint8_t& b)
+{
+  if (offset >= ota_state.old_size || offset >= ota_source_partition->size)
+  {
+    ota_fail("Patch reads past the end of the running image (offset " + String(offset) + ")");
+    return false;
+  }
+  if (offset < ota_source_cache_offset || offset >= ota_source_cache_offset + ota_source_cache_len)
+  {
+    ota_source_cache_offset = offset;
+    ota_source_cache_len = min((size_t)OTA_SOURCE_CACHE_SIZE, (size_t)(ota_source_partition->size - offset));
+    if (esp_partition_read(ota_source_partition, offset, ota_source_cache, ota_source_cache_len) != ESP_OK)
+    {
+      ota_source_cache_len = 0;
+      ota_fail("Failed to read the running image");
+      return false;
+    }
+  }
+  b = ota_source_cache[offset - ota_source_cache_offset];
+  return true;
+}
+
+// Write out the output buffer (erasing each sector as we reach it), and checkpoint
+bool ota_flush()
+{
+  if (ota_out_len == 0)
+  {
+    return true;
+  }
+  if (ota_state.out_offset % OTA_FLASH_SECTOR_SIZE == 0 &&
+      esp_partition_erase_range(ota_target_partition, ota_state.out_offset, OTA_FLASH_SECTOR_SIZE) != ESP_OK)
+  {
+    ota_fail("Failed to erase the update partition at " + String(ota_state.out_offset));
+    return false;
+  }
+  if (esp_partition_write(ota_target_partition, ota_state.out_offset, ota_out_buffer, ota_out_len) != ESP_OK)
+  {
+    ota_fail("Failed to write the update partition at " + String(ota_state.out_offset));
+    return false;
+  }
+  ota_state.out_offset += ota_out_len;
+  ota_out_len = 0;
+  ota_checkpoint = ota_state;
+  return true;
+}
+
+// Output one byte of the new image. The decoder state must already be past it, so that a checkpoint taken here is consistent.
+bool ota_emit(uint8_t b)
+{
+  if (ota_state.out_offset + ota_out_len >= ota_manifest.image_size)
+  {
+    ota_fail("Patch makes more than " + String(ota_manifest.image_size) + " bytes");
+    return false;
+  }
+  ota_out_buffer[ota_out_len++] = b;
+  return ota_out_len < OTA_OUT_BUFFER_SIZE || ota_flush();
+}
+
+// Start reading a varint
+void ota_begin_varint(uint8_t step)
+{
+  ota_state.step = step;
+  ota_state.varint = 0;
+  ota_state.varint_shift = 0;
+}
+
+// Make the output that doesn't need patch bytes (copies and zero runs)
+bool ota_patch_run()
+{
+  while (!ota_error && (ota_state.step == OTA_STEP_COPY || ota_state.step == OTA_STEP_ZERO_COPY))
+  {
+    if (ota_state.run_remaining == 0)
+    {
+      if (ota_state.step == OTA_STEP_COPY || ota_state.op_remaining == 0)
+      {
+        ota_state.step = OTA_STEP_OP;
+      }
+      else
+      {
+        ota_begin_varint(OTA_STEP_LITERAL_LEN);
+      }
+      continue;
+    }
+    uint8_t b;
+    if (!ota_source_byte(ota_state.src, b))
+    {
+      return false;
+    }
+    ota_state.src++;
+    ota_state.run_remaining--;
+    ota_state.op_remaining--;
+    if (!ota_emit(b))
+    {
+      return false;
+    }
+  }
+  return !ota_error;
+}
+
+// Feed one patch byte to the decoder
+bool ota_patch_feed(uint8_t b)
+{
+  ota_state.patch_offset++;
+
+  switch (ota_state.step)
+  {
+    case OTA_STEP_HEADER:
+      ota_state.header[ota_state.patch_offset - 1] = b;
+      if (ota_state.patch_offset == OTA_PATCH_HEADER_LEN)
+      {
+        uint32_t new_size;
+        memcpy(&ota_state.old_size, ota_state.header + 4, 4);
+        memcpy(&new_size, ota_state.header + 8, 4);
+        if (memcmp(ota_state.header, OTA_PATCH_MAGIC, 4) != 0 || new_size != ota_manifest.image_size)
+        {
+          ota_fail("Not a patch for this update");
+          return false;
+        }
+        ota_state.step = OTA_STEP_OP;
+      }
+      return true;
+
+    case OTA_STEP_OP:
+      if (b != OTA_OP_COPY && b != OTA_OP_ADD && b != OTA_OP_INSERT)
+      {
+        ota_fail("Unknown patch op " + String(b) + " at " + String(ota_state.patch_offset - 1));
+        return false;
+      }
+      ota_state.op = b;
+      ota_begin_varint(OTA_STEP_LEN);
+      return true;
+
+    case OTA_STEP_LEN:
+    case OTA_STEP_SRC:
+    case OTA_STEP_ZERO_RUN:
+    case OTA_STEP_LITERAL_LEN:
+      ota_state.varint |= (uint32_t)(b & 0x7F) << ota_state.varint_shift;
+      ota_state.varint_shift += 7;
+      if (b & 0x80)
+      {
+        if (ota_state.varint_shift >= 35)
+        {
+          ota_fail("Bad varint in patch");
+          return false;
+        }
+        return true;
+      }
+      break;
+
+    case OTA_STEP_LITERAL:
+    case OTA_STEP_INSERT:
+    {
+      uint8_t out = b;
+      if (ota_state.step == OTA_STEP_LITERAL)
+      {
+        uint8_t old;
+        if (!ota_source_byte(ota_state.src, old))
+        {
+          return false;
+        }
+        out = old + b;
+        ota_state.src++;
+      }
+      ota_state.run_remaining--;
+      ota_state.op_remaining--;
+      if (ota_state.run_remaining == 0)
+      {
+        if (ota_state.op == OTA_OP_ADD && ota_state.op_remaining > 0)
+        {
+          ota_begin_varint(OTA_STEP_ZERO_RUN);
+        }
+        else
+        {
+          ota_state.step = OTA_STEP_OP;
+        }
+      }
+      return ota_emit(out);
+    }
+
+  }
+
+  // A varint is complete
+  uint32_t val = ota_state.varint;
+  switch (ota_state.step)
+  {
+    case OTA_STEP_LEN:
+      if (val == 0 || val > ota_manifest.image_size - ota_state.out_offset - ota_out_len)
+      {
+        ota_fail("Bad op length " + String(val));
+        return false;
+      }
+      ota_state.op_remaining = val;
+      if (ota_state.op == OTA_OP_INSERT)
+      {
+        ota_state.run_remaining = val;
+        ota_state.step = OTA_STEP_INSERT;
+      }
+      else
+      {
+        ota_begin_varint(OTA_STEP_SRC);
+      }
+      break;
+
+    case OTA_STEP_SRC:
+      ota_state.src += (int32_t)((val >> 1) ^ -(int32_t)(val & 1)); // Zigzag
+      if (ota_state.op == OTA_OP_COPY)
+      {
+        ota_state.run_remaining = ota_state.op_remaining;
+        ota_state.step = OTA_STEP_COPY;
+      }
+      else
+      {
+        ota_begin_varint(OTA_STEP_ZERO_RUN);
+      }
+      break;
+
+    case OTA_STEP_ZERO_RUN:
+      if (val > ota_state.op_remaining)
+      {
+        ota_fail("Bad zero run " + String(val));
+        return false;
+      }
+      ota_state.run_remaining = val;
+      ota_state.step = OTA_STEP_ZERO_COPY;
+      break;
+
+    case OTA_STEP_LITERAL_LEN:
+      if (val == 0 || val > ota_state.op_remaining)
+      {
+        ota_fail("Bad literal length " + String(val));
+        return false;
+      }
+      ota_state.run_remaining = val;
+      ota_state.step = OTA_STEP_LITERAL;
+      break;
+  }
+  return ota_patch_run();
+}
+
+// **********
+// Manifest
+// **********
+
+bool ota_manifest_get(const String& body, const char* key, String& value)
+{
+  String text = "\n" + body;
+  String prefix = "\n" + String(key) + "=";
+  int start = text.indexOf(prefix);
+  if (start < 0)
+  {
+    return false;
+  }
+  start += prefix.length();
+  int end = text.indexOf('\n', start);
+  value = text.substring(start, end < 0 ? text.length() : end);
+  value.trim();
+  return true;
+}
+
+int ota_hex_digit(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Decode hex into out. Returns the number of bytes, or -1 if it isn't hex or doesn't fit.
+int ota_hex_decode(const String& hex, uint8_t* out, size_t size)
+{
+  if (hex.length() % 2 != 0 || hex.length() / 2 > size)
+  {
+    return -1;
+  }
+  for (size_t i = 0; i < hex.length() / 2; i++)
+  {
+    int hi = ota_hex_digit(hex[2 * i]);
+    int lo = ota_hex_digit(hex[2 * i + 1]);
+    if (hi < 0 || lo < 0)
+    {
+      return -1;
+    }
+    out[i] = (hi << 4) | lo;
+  }
+  return hex.length() / 2;
+}
+
+// Check the signature over the first signed_len bytes of the manifest
+bool ota_verify_signature(const char* signed_text, size_t signed_len, const uint8_t* sig, size_t sig_len)
+{
+  uint8_t hash[32];
+  if (mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const unsigned char*)signed_text, signed_len, hash) != 0)
+  {
+    return false;
+  }
+
+  mbedtls_pk_context pk;
+  mbedtls_pk_init(&pk);
+  int res = mbedtls_pk_parse_public_key(&pk, (const unsigned char*)WATERPAL_OTA_PUBLIC_KEY, sizeof(WATERPAL_OTA_PUBLIC_KEY));
+  if (res != 0)
+  {
+    Serial.println("OTA: Can't parse WATERPAL_OTA_PUBLIC_KEY (" + String(res) + ")");
+  }
+  else
+  {
+    res = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, hash, sizeof(hash), sig, sig_len);
+  }
+  mbedtls_pk_free(&pk);
+  return res == 0;
+}
+
+// Check and parse a manifest. Returns false (and leaves ota_manifest alone) unless it is signed and describes an update we can apply.
+bool ota_parse_manifest(const String& body, otaManifest& manifest)
+{
+  int sig_start = body.indexOf("\nsig=");
+  String sig_hex;
+  uint8_t sig[OTA_SIGNATURE_MAX_BYTES];
+  int sig_len;
+  if (sig_start < 0 || !ota_manifest_get(body, "sig", sig_hex) || (sig_len = ota_hex_decode(sig_hex, sig, sizeof(sig))) <= 0)
+  {
+    Serial.println("OTA: Manifest isn't signed");
+    return false;
+  }
+  if (!ota_verify_signature(body.c_str(), sig_start + 1, sig, sig_len))
+  {
+    Serial.println("OTA: Bad manifest signature");
+    return false;
+  }
+
+  String from, to, patch_size, image_size, image_sha256;
+  if (!ota_manifest_get(body, "from", from) || !ota_manifest_get(body, "to", to) ||
+      !ota_manifest_get(body, "patch_size", patch_size) || !ota_manifest_get(body, "image_size", image_size) ||
+      !ota_manifest_get(body, "image_sha256", image_sha256) ||
+      ota_hex_decode(image_sha256, manifest.image_sha256, sizeof(manifest.image_sha256)) != sizeof(manifest.image_sha256))
+  {
+    Serial.println("OTA: Manifest is missing fields");
+    return false;
+  }
+  manifest.from_version = from.toInt();
+  manifest.to_version = to.toInt();
+  manifest.patch_size = patch_size.toInt();
+  manifest.image_size = image_size.toInt();
+
+  // The signature stops a forged patch, but not an old genuine one being replayed, so only ever move forward
+  if (manifest.from_version != WATERPAL_FIRMWARE_VERSION || manifest.to_version <= WATERPAL_FIRMWARE_VERSION)
+  {
+    Serial.println("OTA: Manifest is for " + from + " -> " + to + ", but we're running " + String(WATERPAL_FIRMWARE_VERSION));
+    return false;
+  }
+  if (manifest.patch_size < OTA_PATCH_HEADER_LEN || manifest.image_size == 0 || manifest.image_size > ota_target_partition->size)
+  {
+    Serial.println("OTA: Image of " + image_size + " bytes doesn't fit in the update partition");
+    return false;
+  }
+  return true;
+}
+
+// Ask the server whether there's an update for this version. Returns true if it gave us a manifest we accept.
+bool ota_fetch_manifest()
+{
+  char url[128];
+  textWriter w;
+  text_init(w, url, sizeof(url));
+  text_put(w, WATERPAL_OTA_PATH);
+  text_put(w, "/manifest?version=");
+  text_put_uint(w, WATERPAL_FIRMWARE_VERSION);
+  Serial.println("OTA: Checking for an update: " + String(url));
+
+  ota_http.setHttpResponseTimeout(WATERPAL_HTTP_TIMEOUT_MS);
+  ota_http.setTimeout(WATERPAL_HTTP_TIMEOUT_MS);
+  if (ota_http.get(url) != 0)
+  {
+    ota_http.stop();
+    Serial.println("OTA: Failed to connect to the update server");
+    return false;
+  }
+  int status = ota_http.responseStatusCode();
+  if (status != 200)
+  {
+    ota_http.stop();
+    Serial.println(status == 204 ? "OTA: No update" : "OTA: Manifest request returned " + String(status));
+    return false;
+  }
+  int length = ota_http.contentLength();
+  if (length > OTA_MANIFEST_MAX_BYTES)
+  {
+    ota_http.stop();
+    Serial.println("OTA: Manifest is too long (" + String(length) + " bytes)");
+    return false;
+  }
+  String body = ota_http.responseBody();
+  ota_http.stop();
+
+  watchdog_pet();
+
+  otaManifest manifest;
+  if (!ota_parse_manifest(body, manifest))
+  {
+    logError(ERROR_OTA_FAIL);
+    return false;
+  }
+  ota_manifest = manifest;
+  Serial.println("OTA: Update " + String(manifest.from_version) + " -> " + String(manifest.to_version) + ": " + String(manifest.patch_size) + " byte patch, " + String(manifest.image_size) + " byte image");
+  return true;
+}
+
+// **********
+// Download and install
+// **********
+
+// Hash the new image in the update partition and compare it with the signed hash
+bool ota_verify_image()
+{
+  mbedtls_md_context_t ctx;
+  mbedtls_md_init(&ctx);
+  bool ok = (mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0) == 0 && mbedtls_md_starts(&ctx) == 0);
+  for (uint32_t offset = 0; ok && offset < ota_manifest.image_size; offset += OTA_OUT_BUFFER_SIZE)
+  {
+    watchdog_pet();
+    size_t len = min((uint32_t)OTA_OUT_BUFFER_SIZE, ota_manifest.image_size - offset);
+    ok = (esp_partition_read(ota_target_partition, offset, ota_out_buffer, len) == ESP_OK &&
+          mbedtls_md_update(&ctx, ota_out_buffer, len) == 0);
+  }
+  uint8_t hash[32];
+  ok = ok && mbedtls_md_finish(&ctx, hash) == 0;
+  mbedtls_md_free(&ctx);
+  return ok && memcmp(hash, ota_manifest.image_sha256, sizeof(hash)) == 0;
+}
+
+// The patch is all in: check the image and make it the boot partition
+void ota_install()
+{
+  if (!ota_verify_image())
+  {
+    ota_fail("New image doesn't match the signed hash");
+    ota_reset();
+    return;
+  }
+  esp_err_t err = esp_ota_set_boot_partition(ota_target_partition);
+  if (err != ESP_OK)
+  {
+    ota_fail("Failed to set the boot partition: " + String(esp_err_to_name(err)));
+    ota_reset();
+    return;
+  }
+  ota_status = OTA_STATUS_READY;
+  Serial.println("OTA: Firmware " + String(ota_manifest.to_version) + " verified and installed in " + String(ota_target_partition->label) + ", restarting into it after the next report");
+}
+
+// Download (more of) the patch, applying it as it arrives
+void ota_download()
+{
+  ota_state = ota_checkpoint;
+  ota_out_len = 0;
+  ota_source_cache_len = 0;
+  ota_error = false;
+  uint32_t resume_offset = ota_state.patch_offset;
+
+  char url[128];
+  textWriter w;
+  text_init(w, url, sizeof(url));
+  text_put(w, WATERPAL_OTA_PATH);
+  text_put(w, "/patch/");
+  text_put_uint(w, ota_manifest.from_version);
+  text_put_char(w, '-');
+  text_put_uint(w, ota_manifest.to_version);
+  text_put(w, ".wpd");
+  Serial.println("OTA: Downloading " + String(url) + " from byte " + String(resume_offset) + " of " + String(ota_manifest.patch_size));
+
+  ota_http.setHttpResponseTimeout(WATERPAL_HTTP_TIMEOUT_MS);
+  ota_http.setTimeout(WATERPAL_HTTP_TIMEOUT_MS);
+  ota_http.beginRequest();
+  if (ota_http.get(url) != 0)
+  {
+    ota_http.stop();
+    Serial.println("OTA: Failed to connect to the update server");
+    return;
+  }
+  if (resume_offset > 0)
+  {
+    char range[32];
+    snprintf(range, sizeof(range), "bytes=%lu-", (unsigned long)resume_offset);
+    ota_http.sendHeader("Range", range);
+  }
+  ota_http.endRequest();
+
+  int status = ota_http.responseStatusCode();
+  if (status != (resume_offset > 0 ? 206 : 200))
+  {
+    ota_http.stop();
+    Serial.println("OTA: Patch request returned " + String(status));
+    if (status == 404 || status == 416)
+    {
+      // The server has moved on to another release -- start again from its manifest
+      ota_reset();
+    }
+    return;
+  }
+  ota_http.skipResponseHeaders();
+
+  // Carry on with any copy that the checkpoint was in the middle of
+  ota_patch_run();
+
+  uint8_t buf[OTA_READ_BUFFER_SIZE];
+  uint32_t budget = WATERPAL_OTA_MAX_BYTES_PER_WAKE;
+  uint32_t start_ms = millis();
+  while (!ota_error && ota_state.patch_offset < ota_manifest.patch_size && ota_state.patch_offset - resume_offset < budget)
+  {
+    watchdog_pet();
+    if (millis() - start_ms >= WATERPAL_HTTP_TIMEOUT_MS || (!ota_http.connected() && !ota_http.available()))
+    {
+      Serial.println("OTA: Download stalled");
+      break;
+    }
+    size_t want = min((uint32_t)sizeof(buf), min(ota_manifest.patch_size - ota_state.patch_offset, budget - (ota_state.patch_offset - resume_offset)));
+    int bytes_read = ota_http.read(buf, want);
+    if (bytes_read <= 0)
+    {
+      delay(10);
+      continue;
+    }
+    start_ms = millis();
+    for (int i = 0; i < bytes_read && !ota_error; i++)
+    {
+      ota_patch_feed(buf[i]);
+    }
+  }
+  ota_http.stop();
+
+  if (ota_error)
+  {
+    ota_reset();
+    return;
+  }
+  if (ota_state.patch_offset < ota_manifest.patch_size)
+  {
+    // Whatever came in after the last checkpoint gets downloaded again next time
+    Serial.println("OTA: Downloaded " + String(ota_state.patch_offset - resume_offset) + " bytes, resuming from " + String(ota_checkpoint.patch_offset) + " of " + String(ota_manifest.patch_size) + " next wake");
+    return;
+  }
+  if (ota_state.step != OTA_STEP_OP || ota_state.out_offset + ota_out_len != ota_manifest.image_size || !ota_flush())
+  {
+    ota_fail("Patch ended before the image was complete");
+    ota_reset();
+    return;
+  }
+  ota_install();
+}
+
+// Check for and download updates. Call with GPRS connected, after the reports have gone out.
+void ota_poll()
+{
+  int64_t now = time(NULL);
+
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  esp_ota_img_states_t state;
+  if (ota_status == OTA_STATUS_READY || ota_trial ||
+      (esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY))
+  {
+    return;
+  }
+  ota_source_partition = running;
+  ota_target_partition = esp_ota_get_next_update_partition(NULL);
+  if (ota_target_partition == NULL)
+  {
+    Serial.println("OTA: No update partition");
+    return;
+  }
+
+  // Free up the shared socket
+  http.stop();
+
+  if (ota_status == OTA_STATUS_IDLE)
+  {
+    if (ota_last_check_time_s != 0 && now - ota_last_check_time_s < WATERPAL_OTA_CHECK_INTERVAL_S)
+    {
+      return;
+    }
+    ota_last_check_time_s = now;
+    if (!ota_fetch_manifest())
+    {
+      return;
+    }
+    memset(&ota_checkpoint, 0, sizeof(ota_checkpoint));
+    ota_status = OTA_STATUS_DOWNLOADING;
+  }
+
+  watchdog_pet();
+  ota_download();
+}
+
+// **********
+// Restart handoff
+// **********
+
+// The state that has to outlive a restart, written to flash just before it and read back on the way up. The layout is checked
+//  with OTA_HANDOFF_MAGIC and the size: change the magic if any of these change, so a newer firmware doesn't misread an older
+//  one's handoff (it just starts these over, as after a power loss).
+#define OTA_HANDOFF_PATH "/ota_handoff.bin"
+#define OTA_HANDOFF_MAGIC 0x57504831 // "WPH1"
+
+typedef struct otaHandoff
+{
+  uint32_t magic;
+  uint32_t size;
+#if WATERPAL_USE_HANDLE_COUNTER
+  counterState counter_states[COUNTER_NUM];
+#endif // WATERPAL_USE_HANDLE_COUNTER
+  float drift_ppm;
+  float drift_error_ppm;
+  float drift_fit_weight_s;
+  int64_t drift_fit_start_s;
+  int64_t drift_pending_error_us;
+  int64_t drift_last_sync_s;
+  int64_t drift_last_correction_us;
+  int32_t drift_utc_offset_s;
+  uint32_t drift_sync_count;
+  schedTask sched_tasks[SCHED_NUM_TASKS];
+  bool sched_initialized;
+  uint32_t http_timing_history_ms[HTTP_NUM_ENDPOINTS][HTTP_NUM_PHASES][WATERPAL_HTTP_TIMING_HISTORY];
+  uint8_t http_timing_history_count[HTTP_NUM_ENDPOINTS][HTTP_NUM_PHASES];
+  uint8_t http_timing_history_next[HTTP_NUM_ENDPOINTS][HTTP_NUM_PHASES];
+  int64_t ota_last_check_time_s;
+} otaHandoff;
+
+void ota_write_handoff()
+{
+  otaHandoff h;
+  memset(&h, 0, sizeof(h));
+  h.magic = OTA_HANDOFF_MAGIC;
+  h.size = sizeof(h);
+#if WATERPAL_USE_HANDLE_COUNTER
+  memcpy(h.counter_states, counter_states, sizeof(h.counter_states));
+#endif // WATERPAL_USE_HANDLE_COUNTER
+  h.drift_ppm = drift_ppm;
+  h.drift_error_ppm = drift_error_ppm;
+  h.drift_fit_weight_s = drift_fit_weight_s;
+  h.drift_fit_start_s = drift_fit_start_s;
+  h.drift_pending_error_us = drift_pending_error_us;
+  h.drift_last_sync_s = drift_last_sync_s;
+  h.drift_last_correction_us = drift_last_correction_us;
+  h.drift_utc_offset_s = drift_utc_offset_s;
+  h.drift_sync_count = drift_sync_count;
+  memcpy(h.sched_tasks, sched_tasks, sizeof(h.sched_tasks));
+  h.sched_initialized = sched_initialized;
+  memcpy(h.http_timing_history_ms, (const void*)http_timing_history_ms, sizeof(h.http_timing_history_ms));
+  memcpy(h.http_timing_history_count, (const void*)http_timing_history_count, sizeof(h.http_timing_history_count));
+  memcpy(h.http_timing_history_next, (const void*)http_timing_history_next, sizeof(h.http_timing_history_next));
+  h.ota_last_check_time_s = ota_last_check_time_s;
+
+  File file;
+  if (!LittleFS.begin(true) || !(file = LittleFS.open(OTA_HANDOFF_PATH, "w")))
+  {
+    Serial.println("OTA: Failed to write the restart handoff -- the counters, drift model and schedule start over");
+    return;
+  }
+  file.write((const uint8_t*)&h, sizeof(h));
+  file.close();
+}
+
+// Call on the way up from a power-on or restart, before the clock is set: pick up where the firmware that restarted left off
+void ota_read_handoff()
+{
+  if (!LittleFS.begin(true) || !LittleFS.exists(OTA_HANDOFF_PATH))
+  {
+    return;
+  }
+  otaHandoff h;
+  File file = LittleFS.open(OTA_HANDOFF_PATH, "r");
+  bool valid = file && file.read((uint8_t*)&h, sizeof(h)) == sizeof(h) && h.magic == OTA_HANDOFF_MAGIC && h.size == sizeof(h);
+  if (file)
+  {
+    file.close();
+  }
+  LittleFS.remove(OTA_HANDOFF_PATH);
+
+  // Only a restart hands anything over -- after a power loss, the file is from some earlier restart
+  if (!valid || esp_reset_reason() != ESP_RST_SW)
+  {
+    return;
+  }
+
+#if WATERPAL_USE_HANDLE_COUNTER
+  memcpy(counter_states, h.counter_states, sizeof(h.counter_states));
+#endif // WATERPAL_USE_HANDLE_COUNTER
+  drift_ppm = h.drift_ppm;
+  drift_error_ppm = h.drift_error_ppm;
+  drift_fit_weight_s = h.drift_fit_weight_s;
+  drift_fit_start_s = h.drift_fit_start_s;
+  drift_pending_error_us = h.drift_pending_error_us;
+  drift_last_sync_s = h.drift_last_sync_s;
+  drift_last_correction_us = h.drift_last_correction_us;
+  drift_utc_offset_s = h.drift_utc_offset_s;
+  drift_sync_count = h.drift_sync_count;
+  memcpy(sched_tasks, h.sched_tasks, sizeof(h.sched_tasks));
+  sched_initialized = h.sched_initialized;
+  memcpy((void*)http_timing_history_ms, h.http_timing_history_ms, sizeof(h.http_timing_history_ms));
+  memcpy((void*)http_timing_history_count, h.http_timing_history_count, sizeof(h.http_timing_history_count));
+  memcpy((void*)http_timing_history_next, h.http_timing_history_next, sizeof(h.http_timing_history_next));
+  ota_last_check_time_s = h.ota_last_check_time_s;
+  Serial.println("OTA: Picked up the counters, drift model and schedule from before the restart");
+}
+
+void ota_restart()
+{
+  ota_write_handoff();
+  watchdog_disable();
+  esp_restart();
+}
+
+// **********
+// Boot confirmation and rollback
+// **********
+
+bool ota_report_sent = false; // Whether this wake's report has gone into the outbox (and the period's accumulators started over)
+
+bool ota_pending_verify()
+{
+  esp_ota_img_states_t state;
+  return esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY;
+}
+
+// The new firmware has reached the network, so keep it
+void ota_confirm_boot()
+{
+  if (ota_pending_verify())
+  {
+    esp_ota_mark_app_valid_cancel_rollback();
+  }
+  else if (!ota_trial)
+  {
+    return;
+  }
+  Serial.println("OTA: Firmware " + String(WATERPAL_FIRMWARE_VERSION) + " confirmed");
+  ota_trial = false;
+  ota_trial_fail_count = 0;
+}
+
+// Call once the report has gone into the outbox and the accumulators have started over
+void ota_report_done()
+{
+  ota_report_sent = true;
+}
+
+// Call on the way to sleep: restart into a newly installed update, or go back from one that can't reach the network
+void ota_before_sleep(bool water_running)
+{
+  if (ota_pending_verify())
+  {
+    // We got this far, but the next wake would roll back (see above): keep the firmware on trial instead
+    Serial.println("OTA: Firmware " + String(WATERPAL_FIRMWARE_VERSION) + " hasn't reached the network yet -- on trial for " + String(WATERPAL_OTA_CONFIRM_ATTEMPTS) + " GPRS connects");
+    esp_ota_mark_app_valid_cancel_rollback();
+    ota_trial = true;
+    ota_trial_fail_count = 0;
+  }
+  if (ota_trial)
+  {
+    ota_trial_fail_count += gprs_connect_fail_count;
+  }
+
+  bool restart_due = ota_status == OTA_STATUS_READY || (ota_trial && ota_trial_fail_count >= WATERPAL_OTA_CONFIRM_ATTEMPTS);
+  if (!restart_due)
+  {
+    return;
+  }
+  if (!ota_report_sent || outbox_count > 0 || water_running)
+  {
+    Serial.println("OTA: Restart waiting for a report wake with no reports in RTC memory (" + String(outbox_count) + " now) and no water running");
+    return;
+  }
+
+  if (ota_status == OTA_STATUS_READY)
+  {
+    Serial.println("OTA: Restarting into firmware " + String(ota_manifest.to_version));
+    ota_restart();
+    return;
+  }
+
+  const esp_partition_t* previous = esp_ota_get_next_update_partition(NULL);
+  Serial.println("OTA: Firmware " + String(WATERPAL_FIRMWARE_VERSION) + " failed " + String(ota_trial_fail_count) + " GPRS connects -- going back to the previous firmware");
+  logError(ERROR_OTA_FAIL);
+  if (previous == NULL || esp_ota_set_boot_partition(previous) != ESP_OK)
+  {
+    Serial.println("OTA: No previous firmware to go back to");
+    ota_trial = false;
+    return;
+  }
+  ota_trial = false;
+  ota_restart();
+}
+
+#endif // WATERPAL_OTA_H
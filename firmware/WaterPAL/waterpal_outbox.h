@@ -0,0 +1,445 @@
+// waterpal_outbox.h: Durable store-and-forward outbox holding one record per report period until every channel has delivered it
+
+#ifndef WATERPAL_OUTBOX_H
+#define WATERPAL_OUTBOX_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include "waterpal_config.h"
+#include "waterpal_report.h"
+#include "waterpal_http_timing.h"
+
+#if WATERPAL_USE_OUTBOX_FLASH
+#include <LittleFS.h>
+#endif // WATERPAL_USE_OUTBOX_FLASH
+
+// Every report period is snapshotted into the outbox, and each channel (every HTTP endpoint, CoAP and SMS) delivers the
+//  records in sequence order, remembering the newest one it has delivered. A record is removed once every channel in use has it.
+//
+// The newest WATERPAL_OUTBOX_SIZE records live in RTC memory. When that fills up, the oldest record spills over into a ring
+//  of WATERPAL_OUTBOX_FLASH_SIZE slots in a LittleFS file, so the flash always holds the oldest records and the RTC the newest.
+//  Only when both are full is the oldest record dropped.
+
+// Delivery channels. HTTP endpoints use their HTTP_ENDPOINT_* index.
+#define OUTBOX_CHANNEL_COAP HTTP_NUM_ENDPOINTS
+#define OUTBOX_CHANNEL_SMS (HTTP_NUM_ENDPOINTS + 1)
+#define OUTBOX_NUM_CHANNELS (HTTP_NUM_ENDPOINTS + 2)
+
+RTC_DATA_ATTR dailyReport outbox_reports[WATERPAL_OUTBOX_SIZE];
+volatile RTC_DATA_ATTR int outbox_count = 0;
+volatile RTC_DATA_ATTR uint32_t outbox_next_seq = 1; // Sequence number for the next report
+volatile RTC_DATA_ATTR uint32_t outbox_dropped_count = 0; // Reports that were pushed out of a full outbox before being delivered everywhere
+volatile RTC_DATA_ATTR uint32_t outbox_sent_seq[OUTBOX_NUM_CHANNELS]; // Newest report that each channel has delivered
+
+#if WATERPAL_USE_DELTA_REPORTS
+// Delta report baselines (see waterpal_delta.h): what each channel's receiver has for the newest report it got,
+//  and what it will have once the reports being sent now are delivered
+RTC_DATA_ATTR dailyReport outbox_delta_baseline[OUTBOX_NUM_CHANNELS];
+dailyReport outbox_delta_pending[OUTBOX_NUM_CHANNELS];
+#endif
+
+bool outbox_channel_in_use(int channel)
+{
+  switch (channel)
+  {
+    case HTTP_ENDPOINT_WATERPAL:
+      return WATERPAL_USE_GPRS && WATERPAL_USE_WATERPAL_HTTP;
+    case HTTP_ENDPOINT_DESIGNOUTREACH:
+      return WATERPAL_USE_GPRS && WATERPAL_USE_DESIGNOUTREACH_HTTP;
+    case OUTBOX_CHANNEL_COAP:
+      return WATERPAL_USE_GPRS && WATERPAL_USE_COAP;
+    case OUTBOX_CHANNEL_SMS:
+      return true;
+  }
+  return false;
+}
+
+// **********
+// Flash spillover
+// **********
+
+#if WATERPAL_USE_OUTBOX_FLASH
+
+#define OUTBOX_FLASH_PATH "/outbox.bin"
+#define OUTBOX_FLASH_MAGIC 0x57504F37 // "WPO7" -- change if dailyReport changes, so old files are discarded
+
+typedef struct outboxFlashHeader
+{
+  uint32_t magic;
+  uint16_t head;  // Slot of the oldest record
+  uint16_t count; // Number of records
+} outboxFlashHeader;
+
+bool outbox_flash_mounted = false;
+outboxFlashHeader outbox_flash_header;
+
+bool outbox_flash_write_header(File& file)
+{
+  file.seek(0);
+  return file.write((const uint8_t*)&outbox_flash_header, sizeof(outbox_flash_header)) == sizeof(outbox_flash_header);
+}
+
+size_t outbox_flash_slot_offset(int slot)
+{
+  return sizeof(outboxFlashHeader) + slot * sizeof(dailyReport);
+}
+
+// Read the i'th oldest record in flash
+bool outbox_flash_read(int i, dailyReport& report)
+{
+  File file = LittleFS.open(OUTBOX_FLASH_PATH, "r");
+  if (!file)
+  {
+    return false;
+  }
+  file.seek(outbox_flash_slot_offset((outbox_flash_header.head + i) % WATERPAL_OUTBOX_FLASH_SIZE));
+  bool success = file.read((uint8_t*)&report, sizeof(report)) == sizeof(report);
+  file.close();
+  return success;
+}
+
+// Mount the filesystem and load the ring header, creating an empty ring if there isn't a valid one. Returns false if flash isn't usable.
+bool outbox_flash_begin()
+{
+  if (outbox_flash_mounted)
+  {
+    return true;
+  }
+
+  if (!LittleFS.begin(true))
+  {
+    Serial.println("Failed to mount LittleFS for the outbox");
+    return false;
+  }
+
+  File file = LittleFS.open(OUTBOX_FLASH_PATH, "r");
+  bool valid = file && file.read((uint8_t*)&outbox_flash_header, sizeof(outbox_flash_header)) == sizeof(outbox_flash_header) &&
+    outbox_flash_header.magic == OUTBOX_FLASH_MAGIC && outbox_flash_header.head < WATERPAL_OUTBOX_FLASH_SIZE &&
+    outbox_flash_header.count <= WATERPAL_OUTBOX_FLASH_SIZE &&
+    file.size() == sizeof(outboxFlashHeader) + WATERPAL_OUTBOX_FLASH_SIZE * sizeof(dailyReport);
+  if (file)
+  {
+    file.close();
+  }
+
+  if (!valid)
+  {
+    // Lay out the whole ring up front, so that every slot can be written in place
+    Serial.println("Creating outbox file in flash");
+    file = LittleFS.open(OUTBOX_FLASH_PATH, "w");
+    if (!file)
+    {
+      Serial.println("Failed to create outbox file");
+      return false;
+    }
+    outbox_flash_header.magic = OUTBOX_FLASH_MAGIC;
+    outbox_flash_header.head = 0;
+    outbox_flash_header.count = 0;
+    outbox_flash_write_header(file);
+    dailyReport empty;
+    memset(&empty, 0, sizeof(empty));
+    for (int i = 0; i < WATERPAL_OUTBOX_FLASH_SIZE; i++)
+    {
+      file.write((const uint8_t*)&empty, sizeof(empty));
+    }
+    file.close();
+  }
+
+  outbox_flash_mounted = true;
+
+  // After a power loss the RTC sequence counter starts over, so carry on from the records that survived in flash
+  dailyReport newest;
+  if (outbox_flash_header.count > 0 && outbox_flash_read(outbox_flash_header.count - 1, newest) && newest.seq >= outbox_next_seq)
+  {
+    outbox_next_seq = newest.seq + 1;
+    Serial.println("Restored " + String(outbox_flash_header.count) + " reports from flash, next report is #" + String(outbox_next_seq));
+  }
+
+  return true;
+}
+
+int outbox_flash_count()
+{
+  if (!outbox_flash_begin())
+  {
+    return 0;
+  }
+  return outbox_flash_header.count;
+}
+
+// Append a record after the newest one in flash. If the ring is full, the oldest record in it is dropped.
+bool outbox_flash_push(const dailyReport& report)
+{
+  if (!outbox_flash_begin())
+  {
+    return false;
+  }
+
+  File file = LittleFS.open(OUTBOX_FLASH_PATH, "r+");
+  if (!file)
+  {
+    return false;
+  }
+
+  if (outbox_flash_header.count >= WATERPAL_OUTBOX_FLASH_SIZE)
+  {
+    Serial.println("Outbox flash full -- dropping oldest report");
+    outbox_flash_header.head = (outbox_flash_header.head + 1) % WATERPAL_OUTBOX_FLASH_SIZE;
+    outbox_flash_header.count--;
+    outbox_dropped_count++;
+  }
+
+  file.seek(outbox_flash_slot_offset((outbox_flash_header.head + outbox_flash_header.count) % WATERPAL_OUTBOX_FLASH_SIZE));
+  bool success = file.write((const uint8_t*)&report, sizeof(report)) == sizeof(report);
+  if (success)
+  {
+    outbox_flash_header.count++;
+  }
+  success = outbox_flash_write_header(file) && success;
+  file.close();
+  return success;
+}
+
+// Drop the oldest num_reports records from flash
+void outbox_flash_remove_oldest(int num_reports)
+{
+  if (num_reports <= 0 || !outbox_flash_begin())
+  {
+    return;
+  }
+  if (num_reports > outbox_flash_header.count)
+  {
+    num_reports = outbox_flash_header.count;
+  }
+
+  outbox_flash_header.head = (outbox_flash_header.head + num_reports) % WATERPAL_OUTBOX_FLASH_SIZE;
+  outbox_flash_header.count -= num_reports;
+
+  File file = LittleFS.open(OUTBOX_FLASH_PATH, "r+");
+  if (file)
+  {
+    outbox_flash_write_header(file);
+    file.close();
+  }
+}
+
+// Sequence numbers have to keep increasing across a power loss (the server de-duplicates on them), so a block of them is
+//  reserved in flash at a time: after a power loss we carry on from the end of the last reserved block.
+#define OUTBOX_SEQ_PATH "/outbox_seq.bin"
+#define OUTBOX_SEQ_BLOCK 64
+
+volatile RTC_DATA_ATTR uint32_t outbox_seq_reserved = 0; // Sequence numbers below this are reserved (0 until the first report after power-on)
+
+void outbox_reserve_seq()
+{
+  if (outbox_next_seq < outbox_seq_reserved || !outbox_flash_begin())
+  {
+    return;
+  }
+
+  if (outbox_seq_reserved == 0)
+  {
+    File file = LittleFS.open(OUTBOX_SEQ_PATH, "r");
+    uint32_t stored_seq = 0;
+    if (file && file.read((uint8_t*)&stored_seq, sizeof(stored_seq)) == sizeof(stored_seq) && stored_seq > outbox_next_seq)
+    {
+      outbox_next_seq = stored_seq;
+      Serial.println("Continuing sequence numbers from flash: next report is #" + String(outbox_next_seq));
+    }
+    if (file)
+    {
+      file.close();
+    }
+  }
+
+  outbox_seq_reserved = outbox_next_seq + OUTBOX_SEQ_BLOCK;
+  File file = LittleFS.open(OUTBOX_SEQ_PATH, "w");
+  if (file)
+  {
+    file.write((const uint8_t*)&outbox_seq_reserved, sizeof(outbox_seq_reserved));
+    file.close();
+  }
+}
+
+#else
+
+// NOTE: Without flash, sequence numbers start over after a power loss.
+void outbox_reserve_seq() {}
+int outbox_flash_count() { return 0; }
+bool outbox_flash_read(int i, dailyReport& report) { return false; }
+bool outbox_flash_push(const dailyReport& report) { return false; }
+void outbox_flash_remove_oldest(int num_reports) {}
+
+#endif // WATERPAL_USE_OUTBOX_FLASH
+
+// **********
+// Outbox
+// **********
+
+// Total records waiting, in flash and RTC memory
+int outbox_total_count()
+{
+  return outbox_flash_count() + outbox_count;
+}
+
+// Read the i'th oldest record (flash first, then RTC memory)
+bool outbox_get(int i, dailyReport& report)
+{
+  int flash_count = outbox_flash_count();
+  if (i < flash_count)
+  {
+    return outbox_flash_read(i, report);
+  }
+  i -= flash_count;
+  if (i < 0 || i >= outbox_count)
+  {
+    return false;
+  }
+  report = outbox_reports[i];
+  return true;
+}
+
+// Sequence number of the i'th oldest record (or 0 if there is none)
+uint32_t outbox_get_seq(int i)
+{
+  int flash_count = outbox_flash_count();
+  if (i >= flash_count)
+  {
+    return (i - flash_count < outbox_count) ? outbox_reports[i - flash_count].seq : 0;
+  }
+  dailyReport report;
+  return outbox_flash_read(i, report) ? report.seq : 0;
+}
+
+// Index of the oldest record newer than the given sequence number (or outbox_total_count() if there are none)
+int outbox_find_after(uint32_t seq)
+{
+  int total = outbox_total_count();
+  int i = 0;
+  while (i < total && outbox_get_seq(i) <= seq)
+  {
+    i++;
+  }
+  return i;
+}
+
+// Number of records that a channel still has to deliver
+int outbox_pending_count(int channel)
+{
+  return outbox_total_count() - outbox_find_after(outbox_sent_seq[channel]);
+}
+
+// Copy up to max_reports of the oldest records that the channel hasn't delivered yet into reports, in order. Returns how many were copied.
+int outbox_read_pending(int channel, dailyReport* reports, int max_reports)
+{
+  int total = outbox_total_count();
+  int first = outbox_find_after(outbox_sent_seq[channel]);
+  int num_reports = 0;
+  while (num_reports < max_reports && first + num_reports < total && outbox_get(first + num_reports, reports[num_reports]))
+  {
+    num_reports++;
+  }
+  return num_reports;
+}
+
+// Drop the oldest num_reports records from RTC memory
+void outbox_remove_oldest(int num_reports)
+{
+  if (num_reports <= 0)
+  {
+    return;
+  }
+  if (num_reports > outbox_count)
+  {
+    num_reports = outbox_count;
+  }
+
+  memmove(&outbox_reports[0], &outbox_reports[num_reports], (outbox_count - num_reports) * sizeof(dailyReport));
+  outbox_count -= num_reports;
+}
+
+// Give the report the next sequence number and store a copy of it. If RTC memory is full, its oldest record moves to flash (or is dropped).
+uint32_t outbox_add(dailyReport& report)
+{
+  outbox_reserve_seq();
+  report.seq = outbox_next_seq++;
+
+  if (outbox_count >= WATERPAL_OUTBOX_SIZE)
+  {
+    if (outbox_flash_push(outbox_reports[0]))
+    {
+      Serial.println("Moved report #" + String(outbox_reports[0].seq) + " to flash (" + String(outbox_flash_count()) + " of " + String(WATERPAL_OUTBOX_FLASH_SIZE) + ")");
+    }
+    else
+    {
+      Serial.println("Outbox full -- dropping oldest report #" + String(outbox_reports[0].seq));
+      outbox_dropped_count++;
+    }
+    outbox_remove_oldest(1);
+  }
+
+  outbox_reports[outbox_count] = report;
+  outbox_count++;
+
+  Serial.println("Added report #" + String(report.seq) + " to outbox (" + String(outbox_total_count()) + " waiting)");
+  return report.seq;
+}
+
+// Mark everything through the given sequence number as delivered on a channel
+void outbox_mark_sent(int channel, uint32_t seq)
+{
+  if (seq > outbox_sent_seq[channel])
+  {
+    outbox_sent_seq[channel] = seq;
+  }
+#if WATERPAL_USE_DELTA_REPORTS
+  // If the receiver now has everything we encoded, it has the pending baseline. If it only has some of it, the old baseline
+  //  is still a report that it has, so deltas against it still work.
+  if (outbox_delta_pending[channel].seq != 0 && seq >= outbox_delta_pending[channel].seq)
+  {
+    outbox_delta_baseline[channel] = outbox_delta_pending[channel];
+    outbox_delta_pending[channel].seq = 0;
+  }
+#endif
+}
+
+// Start encoding reports for a channel: returns the baseline to pass to payload_encode(), or NULL if delta reports are off
+dailyReport* outbox_delta_begin(int channel)
+{
+#if WATERPAL_USE_DELTA_REPORTS
+  outbox_delta_pending[channel] = outbox_delta_baseline[channel];
+  return &outbox_delta_pending[channel];
+#else
+  return NULL;
+#endif
+}
+
+// Drop every record that all of the channels in use have delivered
+void outbox_trim()
+{
+  uint32_t delivered_seq = UINT32_MAX;
+  for (int channel = 0; channel < OUTBOX_NUM_CHANNELS; channel++)
+  {
+    if (outbox_channel_in_use(channel) && outbox_sent_seq[channel] < delivered_seq)
+    {
+      delivered_seq = outbox_sent_seq[channel];
+    }
+  }
+
+  // The flash holds the oldest records, so it is trimmed first
+  int num_delivered = outbox_find_after(delivered_seq);
+  int num_flash = outbox_flash_count();
+  if (num_delivered > 0)
+  {
+    outbox_flash_remove_oldest(num_delivered < num_flash ? num_delivered : num_flash);
+    outbox_remove_oldest(num_delivered - num_flash);
+    Serial.println("Removed " + String(num_delivered) + " delivered reports from outbox (" + String(outbox_total_count()) + " remaining)");
+  }
+}
+
+bool outbox_is_full()
+{
+  return outbox_count >= WATERPAL_OUTBOX_SIZE;
+}
+
+#endif // WATERPAL_OUTBOX_H
@@ -0,0 +1,176 @@
+// waterpal_payload.h: Compact (CBOR, optionally heatshrink-compressed) encoding of reports for GPRS uploads
+
+#ifndef WATERPAL_PAYLOAD_H
+#define WATERPAL_PAYLOAD_H
+
+#include <Arduino.h>
+#include "waterpal_config.h"
+#include "waterpal_report.h"
+#include "waterpal_schema.h"
+#include "waterpal_delta.h"
+#include "waterpal_cbor.h"
+#include "waterpal_heatshrink.h"
+#include "waterpal_flowlog.h"
+#include "waterpal_usage.h"
+
+// The payload is a CBOR map of { 0: IMEI, 1: [report, ...] }, where each report is a map keyed by the field's index in report_fields[]
+//  (waterpal_schema.h) instead of its name. Keep fields.md and firmware/utils/waterpal_decode.py in sync with the schema.
+// A delta report (see waterpal_delta.h) only has the fields that changed, plus PAYLOAD_REPORT_KEY_BASE: the sequence number of the report it is relative to.
+// Batched uploads also give each report its flow sessions (see waterpal_flowlog.h) as a byte string under PAYLOAD_REPORT_KEY_SESSIONS.
+// A report with any water usage has its usage by time of day (see waterpal_usage.h) as a byte string under PAYLOAD_REPORT_KEY_USAGE.
+#define PAYLOAD_KEY_IMEI 0
+#define PAYLOAD_KEY_REPORTS 1
+#define PAYLOAD_REPORT_KEY_BASE -1
+#define PAYLOAD_REPORT_KEY_SESSIONS -2
+#define PAYLOAD_REPORT_KEY_USAGE -3
+
+uint8_t payload_buffer[WATERPAL_COMPACT_PAYLOAD_MAX];
+uint8_t payload_compressed_buffer[WATERPAL_COMPACT_PAYLOAD_MAX];
+
+// Size and timing of the last compact payload, for comparing encodings
+size_t payload_last_cbor_bytes = 0;
+size_t payload_last_encoded_bytes = 0;
+uint32_t payload_last_encode_us = 0;
+int payload_last_num_deltas = 0;
+
+// The byte strings that go in a report's map after its fields: sessions_len is the length of the report's sessions in
+//  flowlog_encode_buffer, or 0 to leave them out, and likewise usage_len for usage_encode_buffer
+int payload_num_report_extras(size_t sessions_len, size_t usage_len)
+{
+  return (sessions_len > 0) + (usage_len > 0);
+}
+
+void payload_encode_report_extras(cborWriter& w, size_t sessions_len, size_t usage_len)
+{
+  if (sessions_len > 0)
+  {
+    cbor_put_int(w, PAYLOAD_REPORT_KEY_SESSIONS);
+    cbor_put_bytes(w, flowlog_encode_buffer, sessions_len);
+  }
+  if (usage_len > 0)
+  {
+    cbor_put_int(w, PAYLOAD_REPORT_KEY_USAGE);
+    cbor_put_bytes(w, usage_encode_buffer, usage_len);
+  }
+}
+
+void payload_encode_report_cbor(cborWriter& w, const dailyReport& report, size_t sessions_len, size_t usage_len)
+{
+  cbor_put_map(w, REPORT_NUM_FIELDS + payload_num_report_extras(sessions_len, usage_len));
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    cbor_put_uint(w, i);
+    cbor_put_int(w, schema_get_value(report, report_fields[i]));
+  }
+  payload_encode_report_extras(w, sessions_len, usage_len);
+}
+
+void payload_encode_report_delta_cbor(cborWriter& w, const dailyReport& report, const dailyReport& baseline, size_t sessions_len, size_t usage_len)
+{
+  int num_changed = 0;
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    num_changed += delta_field_changed(report_fields[i], report, baseline);
+  }
+
+  cbor_put_map(w, num_changed + 1 + payload_num_report_extras(sessions_len, usage_len));
+  cbor_put_int(w, PAYLOAD_REPORT_KEY_BASE);
+  cbor_put_uint(w, baseline.seq);
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    if (delta_field_changed(report_fields[i], report, baseline))
+    {
+      cbor_put_uint(w, i);
+      cbor_put_int(w, schema_get_value(report, report_fields[i]));
+    }
+  }
+  payload_encode_report_extras(w, sessions_len, usage_len);
+}
+
+// Encode the reports with the given encoding. On success, points *payload at the encoded bytes and returns their length; returns 0 if they didn't fit.
+// If baseline isn't NULL, reports go out as deltas against it where they can (each against the one before it), and it is updated
+//  to what the receiver will have after the last report.
+// With with_sessions, each report also carries its flow sessions -- unless that doesn't fit, in which case they're left out.
+size_t payload_encode(const dailyReport* reports, int num_reports, int encoding, dailyReport* baseline, const uint8_t** payload, bool with_sessions = false)
+{
+  uint32_t start_us = micros();
+
+  dailyReport initial_baseline;
+  if (baseline != NULL)
+  {
+    initial_baseline = *baseline;
+  }
+
+  cborWriter w;
+  for (;;)
+  {
+    payload_last_num_deltas = 0;
+    cbor_init(w, payload_buffer, sizeof(payload_buffer));
+    cbor_put_map(w, 2);
+    cbor_put_uint(w, PAYLOAD_KEY_IMEI);
+    cbor_put_text(w, reports[0].imei);
+    cbor_put_uint(w, PAYLOAD_KEY_REPORTS);
+    cbor_put_array(w, num_reports);
+    for (int i = 0; i < num_reports; i++)
+    {
+      size_t sessions_len = with_sessions ? flowlog_encode_report(reports[i]) : 0;
+      size_t usage_len = usage_encode(reports[i]);
+      if (baseline == NULL)
+      {
+        payload_encode_report_cbor(w, reports[i], sessions_len, usage_len);
+        continue;
+      }
+      bool keyframe = delta_is_keyframe(reports[i], *baseline);
+      if (keyframe)
+      {
+        payload_encode_report_cbor(w, reports[i], sessions_len, usage_len);
+      }
+      else
+      {
+        payload_encode_report_delta_cbor(w, reports[i], *baseline, sessions_len, usage_len);
+        payload_last_num_deltas++;
+      }
+      delta_apply(*baseline, reports[i], keyframe);
+    }
+
+    if (!w.overflow || !with_sessions)
+    {
+      break;
+    }
+    Serial.println("Compact payload of " + String(num_reports) + " reports with flow sessions does not fit in " + String(sizeof(payload_buffer)) + " bytes -- leaving the sessions out");
+    with_sessions = false;
+    if (baseline != NULL)
+    {
+      *baseline = initial_baseline;
+    }
+  }
+
+  if (w.overflow)
+  {
+    Serial.println("Compact payload of " + String(num_reports) + " reports does not fit in " + String(sizeof(payload_buffer)) + " bytes");
+    return 0;
+  }
+
+  size_t len = w.len;
+  *payload = payload_buffer;
+  payload_last_cbor_bytes = w.len;
+
+  if (encoding == PAYLOAD_ENCODING_CBOR_HEATSHRINK)
+  {
+    len = heatshrink_compress(payload_buffer, w.len, payload_compressed_buffer, sizeof(payload_compressed_buffer));
+    if (len == 0)
+    {
+      Serial.println("Compressed payload does not fit in " + String(sizeof(payload_compressed_buffer)) + " bytes");
+      return 0;
+    }
+    *payload = payload_compressed_buffer;
+  }
+
+  payload_last_encoded_bytes = len;
+  payload_last_encode_us = micros() - start_us;
+
+  Serial.println("Encoded " + String(num_reports) + " reports (" + String(payload_last_num_deltas) + " as deltas): " + String(payload_last_cbor_bytes) + " bytes CBOR, " + String(payload_last_encoded_bytes) + " bytes on the wire, in " + String(payload_last_encode_us) + " us");
+  return len;
+}
+
+#endif // WATERPAL_PAYLOAD_H
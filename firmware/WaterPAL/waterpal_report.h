@@ -0,0 +1,54 @@
+// waterpal_report.h: The per-period report that gets sent over every channel (SMS and GPRS)
+
+#ifndef WATERPAL_REPORT_H
+#define WATERPAL_REPORT_H
+
+#include <Arduino.h>
+#include "waterpal_config.h"
+
+#define REPORT_WATER_CHANNELS_MAX 4 // Water input channels the report has fields for (see waterpal_channels.h)
+
+// All of the values that go out in a regular (daily) report. See fields.md for descriptions.
+typedef struct dailyReport
+{
+  uint32_t seq;                   // Report sequence number (assigned when the report is added to the outbox)
+  char imei[16];                  // IMEI (base64 encoded)
+  int64_t timestamp_s;            // Time that the report was made (seconds since epoch)
+  int64_t total_sms_count;        // Total SMS send count
+  int64_t water_usage_time_s;     // Water usage time (s) during the report period
+  int64_t clock_drift_s;          // Detected clock time drift (s)
+  int temperature_low;            // Temperature C (low)
+  int temperature_avg;            // Temperature C (avg)
+  int temperature_high;           // Temperature C (high)
+  int humidity_low;               // Humidity (low)
+  int humidity_avg;               // Humidity (avg)
+  int humidity_high;              // Humidity (high)
+  int signal_strength;            // Signal strength %
+  int battery_charge_status;      // Battery charge status
+  int battery_charge_pct;         // Battery charge %
+  int battery_voltage_mv;         // Battery voltage (mV)
+  int64_t boot_count;             // Boot count
+  uint32_t handle_strokes_total;            // All handle strokes during the report period
+  uint32_t handle_strokes_flowing_total;    // Handle strokes while water was flowing
+  uint32_t handle_strokes_flowing_per_min;  // Handle strokes per flowing-water minute
+  uint32_t dry_start_count;                 // Qualifying dry starts during the report period
+  uint32_t dry_start_stroke_total;          // Dry-start strokes across qualifying dry starts
+  uint32_t dry_start_stroke_avg;            // Average dry-start strokes
+  uint32_t dry_start_stroke_max;            // Max dry-start strokes
+  int solar_voltage_avg_mv;       // Solar panel voltage (mV, avg)
+  int solar_voltage_high_mv;      // Solar panel voltage (mV, high)
+  int solar_current_avg_ma;       // Solar panel current (mA, avg)
+  int solar_current_high_ma;      // Solar panel current (mA, high)
+  uint32_t flow_session_count;    // Flow sessions (times the water ran) that ended during the report period
+  uint32_t flow_session_first_id; // ID of the period's first session in the flow log (see waterpal_flowlog.h); not sent
+  uint32_t flow_rate_peak_per_min; // Highest stroke rate in the period's sessions (see waterpal_flow_monitor.h)
+  uint32_t flow_monitor_s;         // Time spent monitoring flows (s)
+  uint32_t flow_monitor_uah;       // Estimated charge the monitoring took (uAh)
+  uint32_t counter_read_fail_count; // Failed stroke counter reads, across all counters (see waterpal_handle_counter.h)
+  uint32_t channel_usage_s[REPORT_WATER_CHANNELS_MAX - 1];    // Water usage time (s) on channels 1 and up (see waterpal_channels.h)
+  uint32_t channel_flow_count[REPORT_WATER_CHANNELS_MAX - 1]; // Flows that ended on channels 1 and up
+  uint16_t usage_bucket_s[WATERPAL_USAGE_BUCKETS];       // Water usage time (s) by time of day (see waterpal_usage.h)
+  uint16_t usage_bucket_strokes[WATERPAL_USAGE_BUCKETS]; // Handle strokes by time of day
+} dailyReport;
+
+#endif // WATERPAL_REPORT_H
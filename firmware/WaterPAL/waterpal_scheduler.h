@@ -0,0 +1,190 @@
+// waterpal_scheduler.h: Wake scheduler for the periodic and one-shot housekeeping tasks (sensor reads, reports, extended checks, ...)
+// Each task has a due time and a tolerance: it may run up to tolerance_s before it is due. Every wake (timer or float switch) runs the
+//  tasks that are due, plus any whose window has opened and that would otherwise need a wake of their own. The next timer wake is the
+//  earliest due time -- so tasks that fall due close together share one wake, and one modem power-up.
+#ifndef WATERPAL_SCHEDULER_H
+#define WATERPAL_SCHEDULER_H
+
+#include <esp_attr.h>
+#include <time.h>
+
+#include "waterpal_config.h"
+
+// Task IDs, in the order that they run when they share a wake (sensors are read before the report that summarizes them,
+//  and a GPS fix is taken before the extended check that sends it)
+#define SCHED_TASK_SENSOR_READ 0
+#define SCHED_TASK_GPS 1
+#define SCHED_TASK_EXTENDED_CHECK 2
+#define SCHED_TASK_REPORT 3
+#define SCHED_TASK_CONFIG_POLL 4
+#define SCHED_TASK_TIME_SYNC 5 // One-shot, rescheduled from the drift model (see waterpal_drift.h)
+#define SCHED_NUM_TASKS 6
+
+#define SCHED_DAY_S (24l * 60l * 60l)
+
+const char* const sched_task_names[SCHED_NUM_TASKS] = {"sensor read", "GPS", "extended check", "report", "config poll", "time sync"};
+
+typedef struct
+{
+  int64_t next_due_s;   // 0 if the task isn't scheduled
+  uint32_t period_s;    // 0 for a one-shot task
+  uint32_t tolerance_s; // How early the task may run
+} schedTask;
+
+// The "queue" is a fixed array scanned for the earliest due time -- with a handful of tasks that beats keeping a heap in order
+RTC_DATA_ATTR schedTask sched_tasks[SCHED_NUM_TASKS];
+volatile RTC_DATA_ATTR bool sched_initialized = false;
+
+// Periods up to a day are slots counted from local midnight (e.g. every hour on the hour), and start over at the next midnight.
+//  A period of 22 hours gives one slot a day, at 22:00. Longer periods just follow on from the previous due time.
+// Slots count the time elapsed since midnight, so on the days the clocks change hourly slots stay on the hour, and that
+//  22:00 slot comes at 23:00 (spring) or 21:00 (autumn) local time.
+int64_t sched_slot_after(int64_t t, uint32_t period_s)
+{
+  if (period_s > SCHED_DAY_S)
+  {
+    return t + period_s;
+  }
+
+  time_t t_local = t;
+  struct tm midnight;
+  localtime_r(&t_local, &midnight);
+  midnight.tm_hour = 0;
+  midnight.tm_min = 0;
+  midnight.tm_sec = 0;
+  midnight.tm_isdst = -1;
+  int64_t prev_midnight = mktime(&midnight);
+  midnight.tm_mday++;
+  midnight.tm_isdst = -1; // mktime() set it for today's midnight, which may be on the other side of a DST change
+  int64_t next_midnight = mktime(&midnight);
+
+  int64_t slot = prev_midnight + ((t - prev_midnight) / period_s + 1) * period_s;
+  if (slot > next_midnight)
+  {
+    slot = next_midnight + period_s;
+  }
+  return slot;
+}
+
+// The tolerance is capped at half the period, so a task that ran early isn't immediately due again
+void sched_set(int task, int64_t due_s, uint32_t period_s, uint32_t tolerance_s)
+{
+  if (period_s > 0 && tolerance_s > period_s / 2)
+  {
+    tolerance_s = period_s / 2;
+  }
+  sched_tasks[task].next_due_s = due_s;
+  sched_tasks[task].period_s = period_s;
+  sched_tasks[task].tolerance_s = tolerance_s;
+}
+
+// A periodic task, either due straight away or at its next slot
+void sched_every(int task, int64_t now, uint32_t period_s, uint32_t tolerance_s, bool run_now)
+{
+  sched_set(task, run_now ? now : sched_slot_after(now, period_s), period_s, tolerance_s);
+}
+
+// A task that runs once, at due_s (or up to tolerance_s before)
+void sched_once(int task, int64_t due_s, uint32_t tolerance_s)
+{
+  sched_set(task, due_s, 0, tolerance_s);
+}
+
+void sched_cancel(int task)
+{
+  sched_tasks[task].next_due_s = 0;
+}
+
+bool sched_window_is_open(int task, int64_t now)
+{
+  return sched_tasks[task].next_due_s > 0 && sched_tasks[task].next_due_s - sched_tasks[task].tolerance_s <= now;
+}
+
+// A task runs once it is due, or early (within its window) if nothing else would wake us before it's due. A task with a wide
+//  tolerance then runs at the last wake before it is due, not at the first wake after its window opens.
+bool sched_is_runnable(int task, int64_t now)
+{
+  if (!sched_window_is_open(task, now))
+  {
+    return false;
+  }
+  if (sched_tasks[task].next_due_s <= now)
+  {
+    return true;
+  }
+  for (int other = 0; other < SCHED_NUM_TASKS; other++)
+  {
+    if (other != task && sched_tasks[other].next_due_s > 0 && !sched_window_is_open(other, now) && sched_tasks[other].next_due_s <= sched_tasks[task].next_due_s)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the first runnable task (in run order), or -1 if there are none
+int sched_next_runnable(int64_t now)
+{
+  for (int task = 0; task < SCHED_NUM_TASKS; task++)
+  {
+    if (sched_is_runnable(task, now))
+    {
+      return task;
+    }
+  }
+  return -1;
+}
+
+// Call once the task has run. A one-shot task is done; a periodic task moves on to its next slot after the one it just served, or
+//  (if we were late, e.g. the clock jumped or the device was busy) after the current time. Any slot whose window has already opened
+//  counts as served by this run, rather than running the task twice back to back.
+void sched_task_done(int task, int64_t now)
+{
+  schedTask& t = sched_tasks[task];
+  if (t.period_s == 0)
+  {
+    t.next_due_s = 0;
+    return;
+  }
+
+  int64_t next_due_s = sched_slot_after(t.next_due_s > now ? t.next_due_s : now, t.period_s);
+  while (next_due_s - t.tolerance_s <= now)
+  {
+    next_due_s = sched_slot_after(next_due_s, t.period_s);
+  }
+  t.next_due_s = next_due_s;
+}
+
+// The next timer wake: the earliest due time, so that no task runs late. Tasks whose window opens by then run in the same wake.
+int64_t sched_next_wake(int64_t now)
+{
+  int64_t next_wake_s = 0;
+  for (int task = 0; task < SCHED_NUM_TASKS; task++)
+  {
+    if (sched_tasks[task].next_due_s > 0 && (next_wake_s == 0 || sched_tasks[task].next_due_s < next_wake_s))
+    {
+      next_wake_s = sched_tasks[task].next_due_s;
+    }
+  }
+  if (next_wake_s == 0)
+  {
+    next_wake_s = now + SCHED_DAY_S;
+  }
+  return next_wake_s < now ? now : next_wake_s;
+}
+
+void sched_print(int64_t now)
+{
+  int64_t next_wake_s = sched_next_wake(now);
+  Serial.println("  Scheduled tasks:");
+  for (int task = 0; task < SCHED_NUM_TASKS; task++)
+  {
+    if (sched_tasks[task].next_due_s == 0)
+    {
+      continue;
+    }
+    Serial.println("    " + String(sched_task_names[task]) + ": due " + String(sched_tasks[task].next_due_s) + " (delta: " + String(sched_tasks[task].next_due_s - now) + ", tolerance: " + String(sched_tasks[task].tolerance_s) + ")" + (sched_is_runnable(task, next_wake_s) ? " -- runs at the next wake" : ""));
+  }
+}
+
+#endif // WATERPAL_SCHEDULER_H
@@ -0,0 +1,141 @@
+// waterpal_schema.h: Field schema for the daily report, and the text encoders built on it (SMS, URL query, JSON)
+
+#ifndef WATERPAL_SCHEMA_H
+#define WATERPAL_SCHEMA_H
+
+#include <Arduino.h>
+#include <stddef.h>
+#include "waterpal_config.h"
+#include "waterpal_report.h"
+#include "waterpal_text.h"
+
+// Every encoder walks this table instead of spelling out the fields, so a new field only has to be added here (and in fields.md).
+// The order is the wire order: it is the order of the query parameters, JSON keys and SMS values,
+//  and a field's index is its CBOR key (see waterpal_payload.h), so only ever append to it.
+#define REPORT_FIELD_TYPE_INT 0
+#define REPORT_FIELD_TYPE_INT64 1
+#define REPORT_FIELD_TYPE_UINT32 2
+
+#define REPORT_DELTA_ALWAYS 0xFFFF // delta_threshold for fields that every delta report carries
+
+typedef struct reportField
+{
+  const char* name;         // Query parameter / JSON key
+  uint8_t type;             // REPORT_FIELD_TYPE_*
+  uint8_t sms_priority;     // Sent in the SMS "R" packet if non-zero. 1 is the most important -- a packet that doesn't fit drops fields from the other end (see waterpal_sms_codec.h).
+  uint16_t delta_threshold; // In a delta report, only sent if it moved by more than this since the receiver's copy (see waterpal_delta.h)
+  uint16_t offset;          // Offset in dailyReport
+} reportField;
+
+#define REPORT_FIELD(name, member, type, sms_priority, delta_threshold) { name, type, sms_priority, delta_threshold, offsetof(dailyReport, member) }
+
+constexpr reportField report_fields[] = {
+  REPORT_FIELD("seq",                            seq,                            REPORT_FIELD_TYPE_UINT32,  0, REPORT_DELTA_ALWAYS),
+  REPORT_FIELD("timestamp",                      timestamp_s,                    REPORT_FIELD_TYPE_INT64,   0, REPORT_DELTA_ALWAYS),
+  REPORT_FIELD("totalSMSCount",                  total_sms_count,                REPORT_FIELD_TYPE_INT64,   0,                   0), // In the SMS header instead
+  REPORT_FIELD("dailyWaterUsageTime",            water_usage_time_s,             REPORT_FIELD_TYPE_INT64,   1,                   0),
+  REPORT_FIELD("detectedClockTimeDrift",         clock_drift_s,                  REPORT_FIELD_TYPE_INT64,   7,                   2),
+  REPORT_FIELD("temperatureLow",                 temperature_low,                REPORT_FIELD_TYPE_INT,    17,                   1),
+  REPORT_FIELD("temperatureAvg",                 temperature_avg,                REPORT_FIELD_TYPE_INT,     3,                   1),
+  REPORT_FIELD("temperatureHigh",                temperature_high,               REPORT_FIELD_TYPE_INT,    18,                   1),
+  REPORT_FIELD("humidityLow",                    humidity_low,                   REPORT_FIELD_TYPE_INT,    19,                   2),
+  REPORT_FIELD("humidityAvg",                    humidity_avg,                   REPORT_FIELD_TYPE_INT,    11,                   2),
+  REPORT_FIELD("humidityHigh",                   humidity_high,                  REPORT_FIELD_TYPE_INT,    20,                   2),
+  REPORT_FIELD("signalStrength",                 signal_strength,                REPORT_FIELD_TYPE_INT,     5,                   5),
+  REPORT_FIELD("batteryChargeStatus",            battery_charge_status,          REPORT_FIELD_TYPE_INT,    12,                   0),
+  REPORT_FIELD("batteryChargePercent",           battery_charge_pct,             REPORT_FIELD_TYPE_INT,     2,                   2),
+  REPORT_FIELD("batteryVoltage",                 battery_voltage_mv,             REPORT_FIELD_TYPE_INT,     6,                  30),
+  REPORT_FIELD("bootCount",                      boot_count,                     REPORT_FIELD_TYPE_INT64,   8,                   0),
+  REPORT_FIELD("handle_strokes_total",           handle_strokes_total,           REPORT_FIELD_TYPE_UINT32,  4,                   0),
+  REPORT_FIELD("handle_strokes_flowing_total",   handle_strokes_flowing_total,   REPORT_FIELD_TYPE_UINT32, 10,                   0),
+  REPORT_FIELD("handle_strokes_flowing_per_min", handle_strokes_flowing_per_min, REPORT_FIELD_TYPE_UINT32, 13,                   0),
+  REPORT_FIELD("dry_start_count",                dry_start_count,                REPORT_FIELD_TYPE_UINT32,  9,                   0),
+  REPORT_FIELD("dry_start_stroke_total",         dry_start_stroke_total,         REPORT_FIELD_TYPE_UINT32, 16,                   0),
+  REPORT_FIELD("dry_start_stroke_avg",           dry_start_stroke_avg,           REPORT_FIELD_TYPE_UINT32, 14,                   0),
+  REPORT_FIELD("dry_start_stroke_max",           dry_start_stroke_max,           REPORT_FIELD_TYPE_UINT32, 15,                   0),
+  REPORT_FIELD("solarVoltageAvg",                solar_voltage_avg_mv,           REPORT_FIELD_TYPE_INT,     0,                 100),
+  REPORT_FIELD("solarVoltageHigh",               solar_voltage_high_mv,          REPORT_FIELD_TYPE_INT,     0,                 100),
+  REPORT_FIELD("solarCurrentAvg",                solar_current_avg_ma,           REPORT_FIELD_TYPE_INT,     0,                  10),
+  REPORT_FIELD("solarCurrentHigh",               solar_current_high_ma,          REPORT_FIELD_TYPE_INT,     0,                  10),
+  REPORT_FIELD("flow_session_count",             flow_session_count,             REPORT_FIELD_TYPE_UINT32,  0,                   0),
+  REPORT_FIELD("flow_rate_peak_per_min",         flow_rate_peak_per_min,         REPORT_FIELD_TYPE_UINT32,  0,                   0),
+  REPORT_FIELD("flow_monitor_s",                 flow_monitor_s,                 REPORT_FIELD_TYPE_UINT32,  0,                   0),
+  REPORT_FIELD("flow_monitor_uah",               flow_monitor_uah,               REPORT_FIELD_TYPE_UINT32,  0,                   0),
+  REPORT_FIELD("counter_read_fail_count",        counter_read_fail_count,        REPORT_FIELD_TYPE_UINT32,  0,                   0),
+  REPORT_FIELD("channel1_usage_s",               channel_usage_s[0],             REPORT_FIELD_TYPE_UINT32,  0,                   0),
+  REPORT_FIELD("channel1_flow_count",            channel_flow_count[0],          REPORT_FIELD_TYPE_UINT32,  0,                   0),
+  REPORT_FIELD("channel2_usage_s",               channel_usage_s[1],             REPORT_FIELD_TYPE_UINT32,  0,                   0),
+  REPORT_FIELD("channel2_flow_count",            channel_flow_count[1],          REPORT_FIELD_TYPE_UINT32,  0,                   0),
+  REPORT_FIELD("channel3_usage_s",               channel_usage_s[2],             REPORT_FIELD_TYPE_UINT32,  0,                   0),
+  REPORT_FIELD("channel3_flow_count",            channel_flow_count[2],          REPORT_FIELD_TYPE_UINT32,  0,                   0),
+};
+
+#define REPORT_NUM_FIELDS (sizeof(report_fields) / sizeof(report_fields[0]))
+
+// Buffer for text-encoded reports (URL queries and JSON bodies). Requests are built and sent one at a time, so one buffer is shared.
+char schema_text_buffer[WATERPAL_REPORT_TEXT_MAX];
+
+int64_t schema_get_value(const dailyReport& report, const reportField& field)
+{
+  const uint8_t* p = (const uint8_t*)&report + field.offset;
+  switch (field.type)
+  {
+    case REPORT_FIELD_TYPE_INT:
+      return *(const int*)p;
+    case REPORT_FIELD_TYPE_INT64:
+      return *(const int64_t*)p;
+    case REPORT_FIELD_TYPE_UINT32:
+      return *(const uint32_t*)p;
+  }
+  return 0;
+}
+
+// Version 1 SMS "R" (or "A") packet: 1,IMEI,total SMS count,R,<values of the SMS fields, in schema order>
+void schema_write_sms(textWriter& w, const dailyReport& report, char type)
+{
+  // Header: version, IMEI, SMS count, packet type
+  text_put(w, "1,");
+  text_put(w, report.imei);
+  text_put_char(w, ',');
+  text_put_int(w, report.total_sms_count);
+  text_put_char(w, ',');
+  text_put_char(w, type);
+
+  // Body
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    if (report_fields[i].sms_priority != 0)
+    {
+      text_put_char(w, ',');
+      text_put_int(w, schema_get_value(report, report_fields[i]));
+    }
+  }
+}
+
+// URL query parameters: IMEI=...&seq=...&timestamp=...
+void schema_write_query(textWriter& w, const dailyReport& report)
+{
+  text_put(w, "IMEI=");
+  text_put(w, report.imei);
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    text_put_char(w, '&');
+    text_put(w, report_fields[i].name);
+    text_put_char(w, '=');
+    text_put_int(w, schema_get_value(report, report_fields[i]));
+  }
+}
+
+// The members of a JSON object: "seq":...,"timestamp":...
+void schema_write_json_fields(textWriter& w, const dailyReport& report)
+{
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    text_put(w, i == 0 ? "\"" : ",\"");
+    text_put(w, report_fields[i].name);
+    text_put(w, "\":");
+    text_put_int(w, schema_get_value(report, report_fields[i]));
+  }
+}
+
+#endif // WATERPAL_SCHEMA_H
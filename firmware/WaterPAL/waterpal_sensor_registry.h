@@ -0,0 +1,249 @@
+// waterpal_sensor_registry.h: Compile-time registry of the extra sensors (temperature, humidity, solar panel, ...)
+// A sensor is a struct that describes itself to the registry:
+//   static constexpr bool enabled;                // Disabled sensors are dropped from the registry, so they compile to nothing
+//   static constexpr const char* name;
+//   static constexpr int8_t power_pin;            // GPIO that switches the sensor's supply, or SENSOR_NO_POWER_PIN
+//   static constexpr uint16_t warmup_ms;          // Time from power-on (or setup) until the first valid reading
+//   static constexpr uint32_t period_s;           // Sampling period (slots from midnight, as for the scheduler's tasks)
+//   typedef statsAccumulator<T, SCALE> statsType; // How its readings are accumulated (see waterpal_stats.h)
+//   static constexpr int dailyReport::* report_low;  // Report fields for the period's min / mean / max (nullptr to leave one out)
+//   static constexpr int dailyReport::* report_avg;
+//   static constexpr int dailyReport::* report_high;
+//   static void setup();                          // After power-on, before the warm-up wait
+//   static float read();                          // NAN if the reading failed
+// Sensors are registered once, in the sensorRegistryOf<...> list in waterpal_sensors.h; the registry schedules, samples,
+//  accumulates and reports all of them. The report fields also need an entry in waterpal_schema.h (and fields.md).
+#ifndef WATERPAL_SENSOR_REGISTRY_H
+#define WATERPAL_SENSOR_REGISTRY_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include <math.h>
+#include <type_traits>
+
+#include "waterpal_report.h"
+#include "waterpal_scheduler.h"
+#include "waterpal_stats.h"
+#include "waterpal_watchdog.h"
+
+#define SENSOR_NO_POWER_PIN -1
+
+// Which sensors were powered up this wake, and when. Not in RTC memory: the sensors lose power in deep sleep anyway.
+bool sensor_powered_up = false;
+uint32_t sensor_power_up_ms = 0;
+uint32_t sensor_due_mask = 0;
+
+// Per-sensor state that lives in RTC memory: a chain of plain structs (no constructors, so a wake doesn't reinitialize them)
+template <typename... Sensors>
+struct sensorState
+{
+};
+
+template <typename S, typename... Rest>
+struct sensorState<S, Rest...>
+{
+  typename S::statsType stats;
+  int64_t last_sample_s;
+  sensorState<Rest...> rest;
+};
+
+template <typename... Sensors>
+struct sensorList
+{
+};
+
+// sensorRegistryOf<...>::type is the registry of the enabled sensors in the list
+template <typename Kept, typename... Sensors>
+struct sensorFilter
+{
+  typedef Kept type;
+};
+
+template <typename... Kept, typename S, typename... Rest>
+struct sensorFilter<sensorList<Kept...>, S, Rest...>
+{
+  typedef typename std::conditional<S::enabled,
+    typename sensorFilter<sensorList<Kept..., S>, Rest...>::type,
+    typename sensorFilter<sensorList<Kept...>, Rest...>::type>::type type;
+};
+
+template <typename List>
+struct sensorRegistry;
+
+template <typename... Sensors>
+struct sensorRegistryOf
+{
+  typedef sensorRegistry<typename sensorFilter<sensorList<>, Sensors...>::type> type;
+};
+
+template <typename... Sensors>
+struct sensorRegistry<sensorList<Sensors...>>
+{
+  typedef sensorState<Sensors...> state;
+
+  static constexpr int count = sizeof...(Sensors);
+  static_assert(count <= 32, "sensor_due_mask has one bit per sensor");
+
+  // The sensor-read task runs at the shortest period, and each sensor samples when its own slot comes up
+  static constexpr uint32_t min_period_s()
+  {
+    uint32_t period_s = 0;
+    for (uint32_t p : {Sensors::period_s..., (uint32_t)0})
+    {
+      if (p > 0 && (period_s == 0 || p < period_s))
+      {
+        period_s = p;
+      }
+    }
+    return period_s;
+  }
+
+  // Calls fn(Sensor type tag, that sensor's state) for each sensor in turn
+  template <typename Fn>
+  static void for_each(state& s, Fn fn)
+  {
+    for_each_in(s, fn);
+  }
+
+  template <typename Fn>
+  static void for_each_in(sensorState<>& s, Fn fn)
+  {
+  }
+
+  template <typename S, typename... Rest, typename Fn>
+  static void for_each_in(sensorState<S, Rest...>& s, Fn fn)
+  {
+    fn((S*)nullptr, s);
+    for_each_in(s.rest, fn);
+  }
+
+  // Due once its next slot's window opens, like a scheduled task
+  template <typename S, typename... Rest>
+  static bool is_due(const sensorState<S, Rest...>& s, int64_t now)
+  {
+    return s.last_sample_s == 0 || sched_slot_after(s.last_sample_s, S::period_s) - WATERPAL_SENSOR_READ_TOLERANCE_S <= now;
+  }
+
+  // Power up and set up every sensor that's due. Called early in the wake when a sensor read is coming up, so that the warm-up runs
+  //  alongside the rest of the wake's work instead of in a delay loop; sample() does it itself otherwise.
+  static void power_up(state& st, int64_t now)
+  {
+    sensor_due_mask = 0;
+    int i = 0;
+    for_each(st, [&](auto* sensor, auto& s) {
+      typedef typename std::remove_pointer<decltype(sensor)>::type S;
+      if (is_due(s, now))
+      {
+        sensor_due_mask |= 1ul << i;
+        if (S::power_pin != SENSOR_NO_POWER_PIN)
+        {
+          pinMode(S::power_pin, OUTPUT);
+          digitalWrite(S::power_pin, HIGH);
+        }
+        S::setup();
+      }
+      i++;
+    });
+    sensor_powered_up = true;
+    sensor_power_up_ms = millis();
+  }
+
+  static void power_down(state& st)
+  {
+    for_each(st, [&](auto* sensor, auto& s) {
+      typedef typename std::remove_pointer<decltype(sensor)>::type S;
+      if (S::power_pin != SENSOR_NO_POWER_PIN)
+      {
+        digitalWrite(S::power_pin, LOW);
+      }
+    });
+    sensor_powered_up = false;
+  }
+
+  // Wait out whatever is left of the longest warm-up among the due sensors, read them, and power them back down
+  static int sample(state& st, int64_t now)
+  {
+    if (!sensor_powered_up)
+    {
+      power_up(st, now);
+    }
+
+    uint16_t warmup_ms = 0;
+    int i = 0;
+    for_each(st, [&](auto* sensor, auto& s) {
+      typedef typename std::remove_pointer<decltype(sensor)>::type S;
+      if ((sensor_due_mask & (1ul << i)) && S::warmup_ms > warmup_ms)
+      {
+        warmup_ms = S::warmup_ms;
+      }
+      i++;
+    });
+
+    if (millis() - sensor_power_up_ms < warmup_ms)
+    {
+      Serial.println("   > Waiting " + String(warmup_ms - (millis() - sensor_power_up_ms)) + " ms for the sensors to warm up");
+    }
+    while (millis() - sensor_power_up_ms < warmup_ms)
+    {
+      watchdog_pet();
+      delay(10);
+    }
+
+    int num_read = 0;
+    i = 0;
+    for_each(st, [&](auto* sensor, auto& s) {
+      typedef typename std::remove_pointer<decltype(sensor)>::type S;
+      if (sensor_due_mask & (1ul << i))
+      {
+        watchdog_pet();
+        float value = S::read();
+        Serial.println("   > Sensor reading: " + String(S::name) + ": " + String(value, 2) + " (reading " + String(s.stats.count + 1) + ")");
+        s.stats.add(value);
+        s.last_sample_s = now;
+        num_read++;
+      }
+      i++;
+    });
+
+    power_down(st);
+
+    return num_read;
+  }
+
+  // The period's statistics go into the report fields that each sensor names
+  static void fill_report(state& st, dailyReport& report)
+  {
+    for_each(st, [&](auto* sensor, auto& s) {
+      typedef typename std::remove_pointer<decltype(sensor)>::type S;
+      if (S::report_low != nullptr)
+      {
+        report.*(S::report_low) = lroundf(s.stats.low());
+      }
+      if (S::report_avg != nullptr)
+      {
+        report.*(S::report_avg) = lroundf(s.stats.mean());
+      }
+      if (S::report_high != nullptr)
+      {
+        report.*(S::report_high) = lroundf(s.stats.high());
+      }
+    });
+  }
+
+  static void reset(state& st)
+  {
+    for_each(st, [&](auto* sensor, auto& s) {
+      s.stats.reset();
+    });
+  }
+
+  static void print(state& st)
+  {
+    for_each(st, [&](auto* sensor, auto& s) {
+      typedef typename std::remove_pointer<decltype(sensor)>::type S;
+      Serial.println("  " + String(S::name) + " (" + String(s.stats.count) + " readings): Min: " + String(s.stats.low(), 2) + " - Median: " + String(s.stats.median(), 2) + " - Avg: " + String(s.stats.mean(), 2) + " - Max: " + String(s.stats.high(), 2) + " - Std dev: " + String(s.stats.stddev(), 2));
+    });
+  }
+};
+
+#endif // WATERPAL_SENSOR_REGISTRY_H
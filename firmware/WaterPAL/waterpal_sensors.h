@@ -1,4 +1,4 @@
-// waterpal_sensors.h: Extra sensor functions for reading and storing data
+// waterpal_sensors.h: Extra sensor functions for reading and storing data, and the list of sensors in the registry
 
 #ifndef WATERPAL_SENSORS_H
 #define WATERPAL_SENSORS_H
@@ -6,6 +6,7 @@
 // Extra Sensors: DHT11 / DHT22
 #include "DHT.h"
 #include "waterpal_config.h"
+#include "waterpal_sensor_registry.h"
 
 // NOTE: Set DHT pin and type in waterpal_config.h
 #define DHTPIN WATERPAL_DHTPIN
@@ -13,68 +14,144 @@
 
 DHT dht(DHTPIN, DHTTYPE);
 
+// One DHT conversion gives both humidity and temperature, so the registry's two DHT sensors share a reading
+bool dht_have_reading = false;
+float dht_humidity = NAN;
+float dht_temp_c = NAN;
+
+// After power-on (the data line's pull-up needs setting up again, too)
 void sensors_setup()
 {
     dht.begin();
+    dht_have_reading = false;
 }
 
-float sensors_read_humidity()
+// Reads humidity and temperature from a single conversion. The library checks each frame against its checksum, so a failed read is
+//  NAN rather than a plausible-looking 0; it's retried after the sensor's minimum interval between conversions.
+void sensors_read_dht()
 {
-    float humidity = dht.readHumidity();
-    // Ensure it's not NaN
-    if (isnan(humidity))
+    if (dht_have_reading)
     {
-        return 0;
+        return;
     }
-    return humidity;
-}
+    dht_have_reading = true;
+    dht_humidity = NAN;
+    dht_temp_c = NAN;
 
-float sensors_read_humidity_retry()
-{
-    float humidity = 0;
-    for (int i = 0; i < 10; i++)
+    for (int attempt = 0; attempt < WATERPAL_DHT_READ_ATTEMPTS; attempt++)
     {
         watchdog_pet();
 
-        humidity = sensors_read_humidity();
-        if (humidity > 0 && humidity <= 100)
+        if (attempt > 0)
         {
-            return humidity;
+            Serial.println("Failed to read the DHT, retrying...");
+            uint32_t start_ms = millis();
+            while (millis() - start_ms < WATERPAL_DHT_RETRY_INTERVAL_MS)
+            {
+                watchdog_pet();
+                delay(10);
+            }
+        }
+
+        if (dht.read(true))
+        {
+            // Not forced, so these decode the frame that was just read rather than starting another conversion
+            dht_humidity = dht.readHumidity();
+            dht_temp_c = dht.readTemperature();
+            break;
         }
-        Serial.println("Failed to get humidity, retrying...");
-        delay(100);
     }
-    return humidity;
-}
 
-float sensors_read_temp_c()
-{
-    float temp_c = dht.readTemperature();
-    // Ensure it's not NaN
-    if (isnan(temp_c))
+    if (WATERPAL_DHT_POWER_PIN != SENSOR_NO_POWER_PIN)
     {
-        return 0;
+        // Otherwise the pull-up would keep powering the sensor through its data pin once its supply is switched off
+        pinMode(DHTPIN, INPUT);
     }
-    return temp_c;
 }
 
-float sensors_read_temp_c_retry()
+float sensors_read_humidity()
 {
-    float temp_c = 0;
-    for (int i = 0; i < 10; i++)
-    {
-        watchdog_pet();
-        
-        temp_c = sensors_read_temp_c();
-        // Note that the sensor can return 0 if it fails to read the temperature, which is also a valid temperature, so we'll just re-read 10 times if it happens to be exactly freezing.
-        if (temp_c != 0)
-        {
-            return temp_c;
-        }
-        Serial.println("Failed to get temperature, retrying...");
-        delay(100);
-    }
-    return temp_c;
+    sensors_read_dht();
+    return dht_humidity;
 }
 
+float sensors_read_temp_c()
+{
+    sensors_read_dht();
+    return dht_temp_c;
+}
+
+// **********
+// Sensor registry (see waterpal_sensor_registry.h)
+// **********
+
+struct dhtHumiditySensor
+{
+    static constexpr bool enabled = WATERPAL_USE_DHT && NUM_EXTRA_SENSOR_READS_PER_DAY > 0;
+    static constexpr const char* name = "Humidity (%)";
+    static constexpr int8_t power_pin = WATERPAL_DHT_POWER_PIN;
+    static constexpr uint16_t warmup_ms = WATERPAL_DHT_POWER_PIN != SENSOR_NO_POWER_PIN ? WATERPAL_DHT_WARMUP_MS : 0;
+    static constexpr uint32_t period_s = EXTRA_SENSOR_READ_INTERVAL;
+    typedef statsAccumulator<int16_t, 10> statsType; // Tenths of a percent
+    static constexpr int dailyReport::* report_low = &dailyReport::humidity_low;
+    static constexpr int dailyReport::* report_avg = &dailyReport::humidity_avg;
+    static constexpr int dailyReport::* report_high = &dailyReport::humidity_high;
+    static void setup() { sensors_setup(); }
+    static float read() { return sensors_read_humidity(); }
+};
+
+struct dhtTemperatureSensor
+{
+    static constexpr bool enabled = WATERPAL_USE_DHT && NUM_EXTRA_SENSOR_READS_PER_DAY > 0;
+    static constexpr const char* name = "Temperature (C)";
+    static constexpr int8_t power_pin = WATERPAL_DHT_POWER_PIN;
+    static constexpr uint16_t warmup_ms = WATERPAL_DHT_POWER_PIN != SENSOR_NO_POWER_PIN ? WATERPAL_DHT_WARMUP_MS : 0;
+    static constexpr uint32_t period_s = EXTRA_SENSOR_READ_INTERVAL;
+    typedef statsAccumulator<int16_t, 10> statsType; // Tenths of a degree
+    static constexpr int dailyReport::* report_low = &dailyReport::temperature_low;
+    static constexpr int dailyReport::* report_avg = &dailyReport::temperature_avg;
+    static constexpr int dailyReport::* report_high = &dailyReport::temperature_high;
+    static void setup() { sensors_setup(); }
+    static float read() { return sensors_read_temp_c(); }
+};
+
+// Solar panel voltage, through a resistor divider to an ADC pin
+struct solarVoltageSensor
+{
+    static constexpr bool enabled = WATERPAL_USE_SOLAR_VOLTAGE;
+    static constexpr const char* name = "Solar voltage (mV)";
+    static constexpr int8_t power_pin = SENSOR_NO_POWER_PIN;
+    static constexpr uint16_t warmup_ms = 0;
+    static constexpr uint32_t period_s = WATERPAL_SOLAR_READ_INTERVAL_S;
+    typedef statsAccumulator<int16_t, 1> statsType;
+    static constexpr int dailyReport::* report_low = nullptr;
+    static constexpr int dailyReport::* report_avg = &dailyReport::solar_voltage_avg_mv;
+    static constexpr int dailyReport::* report_high = &dailyReport::solar_voltage_high_mv;
+    static void setup() { pinMode(WATERPAL_SOLAR_VOLTAGE_PIN, INPUT); }
+    static float read() { return analogReadMilliVolts(WATERPAL_SOLAR_VOLTAGE_PIN) * WATERPAL_SOLAR_VOLTAGE_DIVIDER; }
+};
+
+// Solar panel current, from a current-sense amplifier's output on an ADC pin
+struct solarCurrentSensor
+{
+    static constexpr bool enabled = WATERPAL_USE_SOLAR_CURRENT;
+    static constexpr const char* name = "Solar current (mA)";
+    static constexpr int8_t power_pin = SENSOR_NO_POWER_PIN;
+    static constexpr uint16_t warmup_ms = 0;
+    static constexpr uint32_t period_s = WATERPAL_SOLAR_READ_INTERVAL_S;
+    typedef statsAccumulator<int16_t, 1> statsType;
+    static constexpr int dailyReport::* report_low = nullptr;
+    static constexpr int dailyReport::* report_avg = &dailyReport::solar_current_avg_ma;
+    static constexpr int dailyReport::* report_high = &dailyReport::solar_current_high_ma;
+    static void setup() { pinMode(WATERPAL_SOLAR_CURRENT_PIN, INPUT); }
+    static float read() { return analogReadMilliVolts(WATERPAL_SOLAR_CURRENT_PIN) * WATERPAL_SOLAR_CURRENT_MA_PER_MV; }
+};
+
+// Every extra sensor, in reading order. A new sensor only needs its struct above and an entry here (plus its report fields).
+typedef sensorRegistryOf<dhtHumiditySensor, dhtTemperatureSensor, solarVoltageSensor, solarCurrentSensor>::type extraSensors;
+
+// No readings are kept, so the RTC state is a fixed size per sensor however many readings a report period has: the 40-byte
+//  int16_t accumulator and the last sample time (see tests/stats_check.cpp for its accuracy against the exact statistics)
+static_assert(sizeof(extraSensors::state) <= extraSensors::count * 48 + 8, "Each extra sensor should only add its accumulator and sample time to RTC memory");
+
 #endif // WATERPAL_SENSORS_H
\ No newline at end of file
@@ -0,0 +1,147 @@
+// waterpal_sms_codec.h: Version 2 of the regular SMS report -- the report packed into as few GSM 7-bit characters as possible
+
+#ifndef WATERPAL_SMS_CODEC_H
+#define WATERPAL_SMS_CODEC_H
+
+#include <Arduino.h>
+#include "waterpal_config.h"
+#include "waterpal_report.h"
+#include "waterpal_schema.h"
+#include "waterpal_text.h"
+
+// Packet layout (see fields.md, and firmware/utils/waterpal_sms_decode.py for the decoder):
+//  <version '2'><type><IMEI base64>,<SMS count><presence><values...>
+// Everything after the comma is a varint: each character is one base64 digit holding 5 bits of the value (least significant first),
+//  with the 6th bit set if more digits follow. Base64 digits and the comma are all single septets in the GSM 7-bit default alphabet,
+//  so the character count is the septet count.
+// Values are zigzag encoded (so small negative numbers stay short), and come in sms_priority order (waterpal_schema.h).
+// The presence varint has one bit per field kept, in the same order, set if the value is non-zero (zero values aren't sent),
+//  plus a sentinel bit above them so the decoder knows how many fields were kept: if the packet is too long,
+//  fields are dropped starting from the least important, and the decoder reports those as missing rather than zero.
+#define SMS_CODEC_VERSION '2'
+#define SMS_PACKET_REGULAR 'R' // Full IMEI and SMS count
+#define SMS_PACKET_ALERT 'A'   // Same as 'R', for a report that also raises the low water usage alert (version 1 packets use it too)
+#define SMS_PACKET_SHORT 'r'   // Last 2 characters of the IMEI, and the SMS count mod 32 (one digit)
+
+#define SMS_CODEC_MAX_FIELDS 32
+
+// sms_priority has to run from 1 to the number of SMS fields, each used once: a gap would leave a slot of
+//  sms_codec_fields_by_priority()'s fields[] unset
+constexpr bool sms_codec_priorities_valid()
+{
+  size_t num_fields = 0;
+  for (const reportField& field : report_fields)
+  {
+    num_fields += field.sms_priority > 0;
+  }
+  for (size_t priority = 1; priority <= num_fields; priority++)
+  {
+    int uses = 0;
+    for (const reportField& field : report_fields)
+    {
+      uses += field.sms_priority == priority;
+    }
+    if (uses != 1)
+    {
+      return false;
+    }
+  }
+  return num_fields <= SMS_CODEC_MAX_FIELDS;
+}
+static_assert(sms_codec_priorities_valid(), "sms_priority in report_fields[] has to run from 1 to the number of SMS fields with no gaps or repeats");
+
+const char sms_codec_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void sms_codec_put_varint(textWriter& w, uint64_t val)
+{
+  do
+  {
+    uint8_t bits = val & 0x1F;
+    val >>= 5;
+    text_put_char(w, sms_codec_alphabet[(val > 0 ? 0x20 : 0) | bits]);
+  } while (val > 0);
+}
+
+uint64_t sms_codec_zigzag(int64_t val)
+{
+  return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+// Fill fields[] with the schema index of each SMS field, most important first. Returns the number of fields.
+// sms_priority runs from 1 to the number of SMS fields, with no gaps (see sms_codec_priorities_valid()).
+int sms_codec_fields_by_priority(uint8_t* fields)
+{
+  int num_fields = 0;
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    int priority = report_fields[i].sms_priority;
+    if (priority > 0 && priority <= SMS_CODEC_MAX_FIELDS)
+    {
+      fields[priority - 1] = i;
+      num_fields = max(num_fields, priority);
+    }
+  }
+  return num_fields;
+}
+
+// Encode a report as a version 2 packet of the given type into buf, keeping it to max_chars characters by dropping the least important fields.
+// Returns the packet length, or 0 if even the header doesn't fit.
+size_t sms_codec_encode(char* buf, size_t size, const dailyReport& report, char type, size_t max_chars)
+{
+  uint8_t fields[SMS_CODEC_MAX_FIELDS];
+  int num_fields = sms_codec_fields_by_priority(fields);
+
+  for (int num_kept = num_fields; num_kept >= 0; num_kept--)
+  {
+    textWriter w;
+    text_init(w, buf, size);
+
+    // Header
+    text_put_char(w, SMS_CODEC_VERSION);
+    text_put_char(w, type);
+    size_t imei_len = strlen(report.imei);
+    if (type == SMS_PACKET_SHORT && imei_len > 2)
+    {
+      text_put(w, report.imei + imei_len - 2);
+    }
+    else
+    {
+      text_put(w, report.imei);
+    }
+    text_put_char(w, ',');
+    sms_codec_put_varint(w, type == SMS_PACKET_SHORT ? report.total_sms_count % 32 : report.total_sms_count);
+
+    // Body
+    uint64_t presence = 1ULL << num_kept;
+    for (int i = 0; i < num_kept; i++)
+    {
+      if (schema_get_value(report, report_fields[fields[i]]) != 0)
+      {
+        presence |= 1ULL << i;
+      }
+    }
+    sms_codec_put_varint(w, presence);
+    for (int i = 0; i < num_kept; i++)
+    {
+      int64_t val = schema_get_value(report, report_fields[fields[i]]);
+      if (val != 0)
+      {
+        sms_codec_put_varint(w, sms_codec_zigzag(val));
+      }
+    }
+
+    if (!w.overflow && w.len <= max_chars)
+    {
+      if (num_kept < num_fields)
+      {
+        Serial.println("SMS packet kept " + String(num_kept) + " of " + String(num_fields) + " fields to fit in " + String(max_chars) + " characters");
+      }
+      return w.len;
+    }
+  }
+
+  buf[0] = '\0';
+  return 0;
+}
+
+#endif // WATERPAL_SMS_CODEC_H
@@ -0,0 +1,162 @@
+// waterpal_sms_outbox.h: Text SMS queued for one send pass -- one copy per recipient, in priority order, with one retry budget
+
+#ifndef WATERPAL_SMS_OUTBOX_H
+#define WATERPAL_SMS_OUTBOX_H
+
+#include <Arduino.h>
+#include <TinyGsmClient.h>
+#include "waterpal_config.h"
+
+// WATERPAL_DEST_PHONE_NUMBERS and WATERPAL_URGENT_PHONE_NUMBERS usually overlap (by default they're the same numbers).
+// Recipients are the union of both lists with duplicates removed, and each message is addressed to a set of them,
+//  so nobody gets the same message twice. Messages go out most urgent first, and every retry comes out of one budget
+//  for the whole pass -- if the network is down, we give up once instead of once per message per recipient.
+
+#define SMS_PRIORITY_URGENT 0
+#define SMS_PRIORITY_REGULAR 1
+#define SMS_NUM_PRIORITIES 2
+
+#define SMS_OUTBOX_MAX_MESSAGES 6
+#define SMS_OUTBOX_MAX_RECIPIENTS 16
+#define SMS_OUTBOX_TEXT_LEN 256
+
+typedef struct smsOutboxMessage
+{
+  char text[SMS_OUTBOX_TEXT_LEN];
+  uint8_t priority;    // SMS_PRIORITY_*
+  uint16_t recipients; // Bit per entry in sms_outbox_numbers
+  uint16_t sent;       // Recipients that have it
+} smsOutboxMessage;
+
+smsOutboxMessage sms_outbox_messages[SMS_OUTBOX_MAX_MESSAGES];
+int sms_outbox_count = 0;
+
+const char* sms_outbox_numbers[SMS_OUTBOX_MAX_RECIPIENTS];
+int sms_outbox_num_numbers = 0;
+uint16_t sms_outbox_dest_mask = 0;   // Recipients from WATERPAL_DEST_PHONE_NUMBERS
+uint16_t sms_outbox_urgent_mask = 0; // Recipients from WATERPAL_URGENT_PHONE_NUMBERS
+
+// Add the numbers to the recipient list (if they aren't already on it), and return their recipient bits
+uint16_t sms_outbox_add_numbers(const char* const* numbers, int num_numbers)
+{
+  uint16_t mask = 0;
+  for (int i = 0; i < num_numbers; i++)
+  {
+    int r = 0;
+    while (r < sms_outbox_num_numbers && strcmp(sms_outbox_numbers[r], numbers[i]) != 0)
+    {
+      r++;
+    }
+    if (r == sms_outbox_num_numbers)
+    {
+      if (sms_outbox_num_numbers == SMS_OUTBOX_MAX_RECIPIENTS)
+      {
+        Serial.println("Too many SMS recipients -- skipping " + String(numbers[i]));
+        continue;
+      }
+      sms_outbox_numbers[sms_outbox_num_numbers++] = numbers[i];
+    }
+    mask |= 1 << r;
+  }
+  return mask;
+}
+
+// Start a new send pass with an empty queue
+void sms_outbox_begin()
+{
+  sms_outbox_count = 0;
+  sms_outbox_num_numbers = 0;
+  sms_outbox_dest_mask = sms_outbox_add_numbers(WATERPAL_DEST_PHONE_NUMBERS, sizeof(WATERPAL_DEST_PHONE_NUMBERS) / sizeof(WATERPAL_DEST_PHONE_NUMBERS[0]));
+  sms_outbox_urgent_mask = sms_outbox_add_numbers(WATERPAL_URGENT_PHONE_NUMBERS, sizeof(WATERPAL_URGENT_PHONE_NUMBERS) / sizeof(WATERPAL_URGENT_PHONE_NUMBERS[0]));
+}
+
+bool sms_outbox_is_full()
+{
+  return sms_outbox_count == SMS_OUTBOX_MAX_MESSAGES;
+}
+
+// Queue a message. Returns its index, or -1 if the queue is full or it has no recipients.
+int sms_outbox_add(const char* text, int priority, uint16_t recipients)
+{
+  if (sms_outbox_is_full() || recipients == 0)
+  {
+    return -1;
+  }
+  smsOutboxMessage& message = sms_outbox_messages[sms_outbox_count];
+  strncpy(message.text, text, SMS_OUTBOX_TEXT_LEN - 1);
+  message.text[SMS_OUTBOX_TEXT_LEN - 1] = '\0';
+  message.priority = priority;
+  message.recipients = recipients;
+  message.sent = 0;
+  return sms_outbox_count++;
+}
+
+// The recipients of the message that haven't got it
+uint16_t sms_outbox_undelivered(int index)
+{
+  const smsOutboxMessage& message = sms_outbox_messages[index];
+  return message.recipients & ~message.sent;
+}
+
+// Has every recipient of the message got it?
+bool sms_outbox_delivered(int index)
+{
+  return sms_outbox_undelivered(index) == 0;
+}
+
+// Send everything in the queue, most urgent first (in the order queued within a priority).
+// Failed sends are retried while retries_left lasts, each retry taking one from it -- pass the same counter to every
+//  sms_outbox_send() of a pass so they share the budget. Returns true if every message reached every recipient.
+bool sms_outbox_send(int& retries_left)
+{
+  for (int priority = 0; priority < SMS_NUM_PRIORITIES; priority++)
+  {
+    for (int i = 0; i < sms_outbox_count; i++)
+    {
+      smsOutboxMessage& message = sms_outbox_messages[i];
+      if (message.priority != priority)
+      {
+        continue;
+      }
+
+      Serial.println("Sending SMS to " + String(__builtin_popcount(message.recipients & ~message.sent)) + " numbers: '" + String(message.text) + "'");
+      for (int r = 0; r < sms_outbox_num_numbers; r++)
+      {
+        uint16_t bit = 1 << r;
+        if (!(message.recipients & bit) || (message.sent & bit))
+        {
+          continue;
+        }
+
+        while (true)
+        {
+          watchdog_pet();
+
+          if (modem.sendSMS(sms_outbox_numbers[r], message.text))
+          {
+            Serial.println(" SMS message sent successfully to number " + String(sms_outbox_numbers[r]));
+            message.sent |= bit;
+            break;
+          }
+
+          if (retries_left <= 0)
+          {
+            Serial.println(" Failed to send SMS message to number " + String(sms_outbox_numbers[r]) + ", and the retry budget is used up");
+            logError(ERROR_SMS_FAIL); //, "Failed to send SMS message");
+            return false;
+          }
+          retries_left--;
+
+          int signal_quality = modem_get_signal_quality();
+
+          Serial.println(" Failed to send SMS message to number " + String(sms_outbox_numbers[r]) + ". Signal quality: " + String(signal_quality) + ". Retrying... (" + String(retries_left) + " retries left)");
+
+          delay(1000);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+#endif // WATERPAL_SMS_OUTBOX_H
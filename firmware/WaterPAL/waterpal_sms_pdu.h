@@ -0,0 +1,195 @@
+// waterpal_sms_pdu.h: 8-bit binary SMS, sent in PDU mode and split into concatenated parts when needed
+
+#ifndef WATERPAL_SMS_PDU_H
+#define WATERPAL_SMS_PDU_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include <TinyGsmClient.h>
+#include "waterpal_config.h"
+
+// Text mode (+CMGF=1, which TinyGsm's sendSMS() uses) only carries 160 7-bit characters per message. In PDU mode (+CMGF=0)
+//  we hand the modem the whole SMS-SUBMIT TPDU as hex, which lets us send 140 bytes of raw binary per message (TP-DCS 8-bit data).
+// Longer data is split into parts that each carry a concatenation user data header (IEI 0x00: reference, total parts, part number),
+//  leaving 134 bytes per part. The receiving phone or gateway reassembles them. See firmware/utils/waterpal_sms_pdu.py.
+
+#define SMS_PDU_MAX_DATA 140          // User data bytes in a single SMS
+#define SMS_PDU_CONCAT_UDH_LEN 6      // UDHL + the 5 byte concatenation element
+#define SMS_PDU_MAX_PART_DATA (SMS_PDU_MAX_DATA - SMS_PDU_CONCAT_UDH_LEN)
+#define SMS_PDU_MAX_NUMBER_DIGITS 20
+
+#define SMS_PDU_FIRST_OCTET_SUBMIT 0x01 // TP-MTI SMS-SUBMIT, no validity period
+#define SMS_PDU_FIRST_OCTET_UDHI 0x40   // User data starts with a header
+#define SMS_PDU_TOA_INTERNATIONAL 0x91
+#define SMS_PDU_TOA_UNKNOWN 0x81
+#define SMS_PDU_DCS_8BIT 0x04
+
+// Concatenated message reference, so the receiver doesn't mix up parts of different messages
+volatile RTC_DATA_ATTR uint8_t sms_pdu_reference = 0;
+
+// SMSC length byte + TPDU (first octet, MR, DA, PID, DCS, UDL, UD), as hex
+char sms_pdu_hex[2 * (1 + 4 + 1 + SMS_PDU_MAX_NUMBER_DIGITS / 2 + 3 + SMS_PDU_MAX_DATA) + 1];
+
+void sms_pdu_put_octet(char* hex, size_t& pos, uint8_t octet)
+{
+  const char* digits = "0123456789ABCDEF";
+  hex[pos++] = digits[octet >> 4];
+  hex[pos++] = digits[octet & 0x0F];
+}
+
+// Build the PDU for one SMS into sms_pdu_hex. If parts > 1, it carries a concatenation header for part (1-based) of parts.
+// Returns the TPDU length in octets (what +CMGS wants, which excludes the SMSC field), or 0 if the number or data don't fit.
+int sms_pdu_build(const char* number, const uint8_t* data, size_t len, uint8_t reference, uint8_t part, uint8_t parts)
+{
+  bool international = (number[0] == '+');
+  if (international)
+  {
+    number++;
+  }
+  size_t num_digits = strlen(number);
+  size_t udh_len = (parts > 1) ? SMS_PDU_CONCAT_UDH_LEN : 0;
+  if (num_digits > SMS_PDU_MAX_NUMBER_DIGITS || len + udh_len > SMS_PDU_MAX_DATA)
+  {
+    return 0;
+  }
+
+  size_t pos = 0;
+  sms_pdu_put_octet(sms_pdu_hex, pos, 0x00); // Use the SMSC stored in the SIM
+
+  sms_pdu_put_octet(sms_pdu_hex, pos, SMS_PDU_FIRST_OCTET_SUBMIT | (udh_len > 0 ? SMS_PDU_FIRST_OCTET_UDHI : 0));
+  sms_pdu_put_octet(sms_pdu_hex, pos, 0x00); // TP-MR (the modem fills it in)
+
+  // TP-DA: digit count, type of address, then the digits as swapped nibbles (padded with F)
+  sms_pdu_put_octet(sms_pdu_hex, pos, num_digits);
+  sms_pdu_put_octet(sms_pdu_hex, pos, international ? SMS_PDU_TOA_INTERNATIONAL : SMS_PDU_TOA_UNKNOWN);
+  for (size_t i = 0; i < num_digits; i += 2)
+  {
+    sms_pdu_hex[pos++] = (i + 1 < num_digits) ? number[i + 1] : 'F';
+    sms_pdu_hex[pos++] = number[i];
+  }
+
+  sms_pdu_put_octet(sms_pdu_hex, pos, 0x00); // TP-PID
+  sms_pdu_put_octet(sms_pdu_hex, pos, SMS_PDU_DCS_8BIT);
+  sms_pdu_put_octet(sms_pdu_hex, pos, len + udh_len); // TP-UDL (octets, for 8-bit data)
+
+  if (udh_len > 0)
+  {
+    sms_pdu_put_octet(sms_pdu_hex, pos, SMS_PDU_CONCAT_UDH_LEN - 1); // UDHL
+    sms_pdu_put_octet(sms_pdu_hex, pos, 0x00); // IEI: concatenated message, 8-bit reference
+    sms_pdu_put_octet(sms_pdu_hex, pos, 0x03); // IEDL
+    sms_pdu_put_octet(sms_pdu_hex, pos, reference);
+    sms_pdu_put_octet(sms_pdu_hex, pos, parts);
+    sms_pdu_put_octet(sms_pdu_hex, pos, part);
+  }
+  for (size_t i = 0; i < len; i++)
+  {
+    sms_pdu_put_octet(sms_pdu_hex, pos, data[i]);
+  }
+  sms_pdu_hex[pos] = '\0';
+
+  return pos / 2 - 1;
+}
+
+// Number of SMS needed for len bytes of data
+int sms_pdu_num_parts(size_t len)
+{
+  if (len <= SMS_PDU_MAX_DATA)
+  {
+    return 1;
+  }
+  return (len + SMS_PDU_MAX_PART_DATA - 1) / SMS_PDU_MAX_PART_DATA;
+}
+
+// Send the PDU in sms_pdu_hex. The modem is back in text mode afterwards, whether or not it went out.
+bool sms_pdu_send(int tpdu_len)
+{
+  bool success = false;
+  modem.sendAT("+CMGF=0");
+  if (modem.waitResponse() == 1)
+  {
+    modem.sendAT("+CMGS=", tpdu_len);
+    if (modem.waitResponse(">") == 1)
+    {
+      modem.stream.print(sms_pdu_hex);
+      modem.stream.write((char)0x1A); // Ctrl-Z
+      modem.stream.flush();
+      success = (modem.waitResponse(60000L) == 1);
+    }
+    else
+    {
+      modem.stream.write((char)0x1B); // Esc: cancels the prompt, in case it turns up late
+      modem.stream.flush();
+    }
+  }
+
+  // Back to text mode for everything else
+  modem.sendAT("+CMGF=1");
+  modem.waitResponse();
+  return success;
+}
+
+// Send binary data to one number, as concatenated parts if needed. Each part is retried up to num_retries times.
+bool sms_pdu_send_binary(const char* number, const uint8_t* data, size_t len, const int num_retries)
+{
+  int parts = sms_pdu_num_parts(len);
+  if (parts > WATERPAL_SMS_BINARY_MAX_PARTS)
+  {
+    Serial.println(" Binary SMS of " + String(len) + " bytes needs " + String(parts) + " parts (max " + String(WATERPAL_SMS_BINARY_MAX_PARTS) + ")");
+    return false;
+  }
+  uint8_t reference = sms_pdu_reference++;
+
+  for (int part = 1; part <= parts; part++)
+  {
+    size_t offset = (parts == 1) ? 0 : (part - 1) * SMS_PDU_MAX_PART_DATA;
+    size_t part_len = min(len - offset, (size_t)((parts == 1) ? SMS_PDU_MAX_DATA : SMS_PDU_MAX_PART_DATA));
+    int tpdu_len = sms_pdu_build(number, data + offset, part_len, reference, part, parts);
+    if (tpdu_len == 0)
+    {
+      return false;
+    }
+
+    int retry_cnt = 0;
+    while (!sms_pdu_send(tpdu_len))
+    {
+      watchdog_pet();
+      retry_cnt++;
+      if (retry_cnt >= num_retries)
+      {
+        return false;
+      }
+      int signal_quality = modem_get_signal_quality();
+      Serial.println(" Failed to send binary SMS part " + String(part) + " of " + String(parts) + " to number " + String(number) + ". Signal quality: " + String(signal_quality) + ". Retrying... (attempt " + String(retry_cnt) + " of " + String(num_retries) + ")");
+      delay(1000);
+    }
+  }
+  return true;
+}
+
+// Binary counterpart of modem_broadcast_sms()
+bool sms_pdu_broadcast_binary(const uint8_t* data, size_t len, const int num_retries = 10)
+{
+  bool error = false;
+
+  const int num_phone_numbers = sizeof(WATERPAL_DEST_PHONE_NUMBERS) / sizeof(WATERPAL_DEST_PHONE_NUMBERS[0]);
+
+  Serial.println("Broadcasting " + String(len) + " byte binary SMS (" + String(sms_pdu_num_parts(len)) + " parts) to " + String(num_phone_numbers) + " numbers");
+
+  for (int i = 0; i < num_phone_numbers; i++)
+  {
+    watchdog_pet();
+    if (sms_pdu_send_binary(WATERPAL_DEST_PHONE_NUMBERS[i], data, len, num_retries))
+    {
+      Serial.println(" Binary SMS sent successfully to number " + String(WATERPAL_DEST_PHONE_NUMBERS[i]) + " [" + String(i) + "]");
+    }
+    else
+    {
+      logError(ERROR_SMS_FAIL); //, "Failed to send SMS message");
+      error = true;
+    }
+  }
+
+  return !error;
+}
+
+#endif // WATERPAL_SMS_PDU_H
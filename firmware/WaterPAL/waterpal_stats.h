@@ -0,0 +1,173 @@
+// waterpal_stats.h: Streaming statistics for sensor readings, kept in RTC memory without storing the samples
+// A statsAccumulator takes one reading at a time and keeps the count, min, max, mean and variance (from exact integer sums), plus an
+//  approximate median (the P-squared algorithm: five markers that track the min, quartiles, median and max). Readings are quantized
+//  to fixed point, 1/SCALE of a unit, in the integer type T -- so the size is fixed no matter how many readings there are.
+#ifndef WATERPAL_STATS_H
+#define WATERPAL_STATS_H
+
+#include <Arduino.h>
+#include <limits>
+#include <type_traits>
+#include <math.h>
+#include <string.h>
+
+#define STATS_NUM_MARKERS 5
+
+// Plain data (no constructor), so it can live in RTC memory and starts out zeroed, which is the same as reset()
+template <typename T, int32_t SCALE>
+struct statsAccumulator
+{
+  // The sums are exact for up to UINT16_MAX readings (where count stops) of a 16-bit T. sum_q only needs 64 bits for a uint16_t:
+  //  UINT16_MAX readings of an int16_t fit in 32.
+  static_assert(sizeof(T) <= 2, "statsAccumulator's sums are sized for 16-bit readings");
+  typedef typename std::conditional<(int64_t)UINT16_MAX * std::numeric_limits<T>::max() <= INT32_MAX, int32_t, int64_t>::type sumType;
+
+  int64_t sum_sq_q;
+  sumType sum_q;
+  uint16_t count;
+  T min_q;
+  T max_q;
+  T marker_q[STATS_NUM_MARKERS];          // Marker heights. Until there are 5 readings, just the sorted readings.
+  uint16_t marker_pos[STATS_NUM_MARKERS]; // Marker positions (1-based ranks)
+
+  void reset()
+  {
+    memset(this, 0, sizeof(*this));
+  }
+
+  static T quantize(float value)
+  {
+    float q = roundf(value * SCALE);
+    const float lowest = (float)std::numeric_limits<T>::min();
+    const float highest = (float)std::numeric_limits<T>::max();
+    return (T)(q < lowest ? lowest : (q > highest ? highest : q));
+  }
+
+  // Where marker i should be after count readings: the min, quartiles, median and max
+  float desired_pos(int i) const
+  {
+    return 1 + (count - 1) * (i / 4.0f);
+  }
+
+  // P-squared's piecewise-parabolic prediction of marker i's height after moving it by d (+1 or -1)
+  float parabolic(int i, int d) const
+  {
+    float n_prev = marker_pos[i - 1], n = marker_pos[i], n_next = marker_pos[i + 1];
+    return marker_q[i] + d / (n_next - n_prev) *
+      ((n - n_prev + d) * (marker_q[i + 1] - marker_q[i]) / (n_next - n) +
+       (n_next - n - d) * (marker_q[i] - marker_q[i - 1]) / (n - n_prev));
+  }
+
+  void add(float value)
+  {
+    if (isnan(value) || count == UINT16_MAX)
+    {
+      return;
+    }
+    T q = quantize(value);
+
+    if (count == 0 || q < min_q)
+    {
+      min_q = q;
+    }
+    if (count == 0 || q > max_q)
+    {
+      max_q = q;
+    }
+    sum_q += q;
+    sum_sq_q += (int64_t)q * q;
+
+    if (count < STATS_NUM_MARKERS)
+    {
+      // Insertion sort of the first few readings
+      int i = count;
+      while (i > 0 && marker_q[i - 1] > q)
+      {
+        marker_q[i] = marker_q[i - 1];
+        i--;
+      }
+      marker_q[i] = q;
+      marker_pos[count] = count + 1;
+      count++;
+      return;
+    }
+
+    // Find the cell that the reading falls in (stretching the end markers if it's a new min or max), and move the markers above it up
+    int k;
+    if (q < marker_q[0])
+    {
+      marker_q[0] = q;
+      k = 0;
+    }
+    else if (q >= marker_q[STATS_NUM_MARKERS - 1])
+    {
+      marker_q[STATS_NUM_MARKERS - 1] = q;
+      k = STATS_NUM_MARKERS - 2;
+    }
+    else
+    {
+      k = 0;
+      while (q >= marker_q[k + 1])
+      {
+        k++;
+      }
+    }
+    for (int i = k + 1; i < STATS_NUM_MARKERS; i++)
+    {
+      marker_pos[i]++;
+    }
+    count++;
+
+    // Nudge the middle markers towards their desired positions
+    for (int i = 1; i < STATS_NUM_MARKERS - 1; i++)
+    {
+      float d = desired_pos(i) - marker_pos[i];
+      if ((d >= 1 && marker_pos[i + 1] - marker_pos[i] > 1) || (d <= -1 && marker_pos[i - 1] - marker_pos[i] < -1))
+      {
+        int step = d > 0 ? 1 : -1;
+        float height = parabolic(i, step);
+        if (!(marker_q[i - 1] < height && height < marker_q[i + 1]))
+        {
+          // Fall back to linear when the parabola overshoots a neighbour
+          height = marker_q[i] + step * (float)(marker_q[i + step] - marker_q[i]) / (marker_pos[i + step] - marker_pos[i]);
+        }
+        marker_q[i] = (T)roundf(height);
+        marker_pos[i] += step;
+      }
+    }
+  }
+
+  // Every statistic is 0 until there is at least one reading
+  float low() const { return count > 0 ? (float)min_q / SCALE : 0; }
+  float high() const { return count > 0 ? (float)max_q / SCALE : 0; }
+  float mean() const { return count > 0 ? (float)sum_q / count / SCALE : 0; }
+
+  // Sample variance, from the exact integer sums
+  float variance() const
+  {
+    if (count < 2)
+    {
+      return 0;
+    }
+    double sum = sum_q;
+    return (float)((sum_sq_q - sum * sum / count) / (count - 1) / ((double)SCALE * SCALE));
+  }
+
+  float stddev() const { return sqrtf(variance()); }
+
+  float median() const
+  {
+    if (count == 0)
+    {
+      return 0;
+    }
+    if (count < STATS_NUM_MARKERS)
+    {
+      // Still exact
+      return (count % 2 == 1 ? (float)marker_q[count / 2] : (marker_q[count / 2 - 1] + marker_q[count / 2]) / 2.0f) / SCALE;
+    }
+    return (float)marker_q[STATS_NUM_MARKERS / 2] / SCALE;
+  }
+};
+
+#endif // WATERPAL_STATS_H
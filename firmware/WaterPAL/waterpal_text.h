@@ -0,0 +1,96 @@
+// waterpal_text.h: Minimal text writer into a caller-provided buffer (no heap use)
+
+#ifndef WATERPAL_TEXT_H
+#define WATERPAL_TEXT_H
+
+#include <Arduino.h>
+
+typedef struct textWriter
+{
+  char* buf;
+  size_t size;
+  size_t len;
+  bool overflow; // Set if anything didn't fit -- the output is truncated in that case
+} textWriter;
+
+// The buffer is always kept NUL-terminated
+void text_init(textWriter& w, char* buf, size_t size)
+{
+  w.buf = buf;
+  w.size = size;
+  w.len = 0;
+  w.overflow = false;
+  if (size > 0)
+  {
+    buf[0] = '\0';
+  }
+}
+
+void text_put_char(textWriter& w, char c)
+{
+  if (w.len + 1 >= w.size)
+  {
+    w.overflow = true;
+    return;
+  }
+  w.buf[w.len++] = c;
+  w.buf[w.len] = '\0';
+}
+
+void text_put(textWriter& w, const char* str)
+{
+  while (*str != '\0')
+  {
+    text_put_char(w, *str++);
+  }
+}
+
+void text_put_uint(textWriter& w, uint64_t val)
+{
+  char digits[20];
+  int num_digits = 0;
+  do
+  {
+    digits[num_digits++] = '0' + (val % 10);
+    val /= 10;
+  } while (val > 0);
+
+  while (num_digits > 0)
+  {
+    text_put_char(w, digits[--num_digits]);
+  }
+}
+
+void text_put_int(textWriter& w, int64_t val)
+{
+  if (val < 0)
+  {
+    text_put_char(w, '-');
+    text_put_uint(w, (uint64_t)0 - (uint64_t)val);
+    return;
+  }
+  text_put_uint(w, (uint64_t)val);
+}
+
+// For anything else (e.g. floats)
+void text_printf(textWriter& w, const char* format, ...)
+{
+  if (w.len + 1 >= w.size)
+  {
+    w.overflow = true;
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(w.buf + w.len, w.size - w.len, format, args);
+  va_end(args);
+  if (n < 0 || (size_t)n >= w.size - w.len)
+  {
+    w.overflow = true;
+    w.len = w.size - 1;
+    return;
+  }
+  w.len += n;
+}
+
+#endif // WATERPAL_TEXT_H
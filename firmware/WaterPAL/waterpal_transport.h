@@ -0,0 +1,157 @@
+// waterpal_transport.h: Connection-reusing transport under the HTTP clients, with handshake and byte accounting
+
+#ifndef WATERPAL_TRANSPORT_H
+#define WATERPAL_TRANSPORT_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include <TinyGsmClient.h>
+#include "waterpal_http_timing.h"
+
+// NOTE: TLS is terminated inside the SIM7000G, and the modem is powered off between wakes, so there is no TLS session ticket / ID
+//  that we could export and cache in RTC memory for resumption. The savings come from keeping each socket open for every request
+//  to that endpoint within a wake (e.g. the weekly and daily uploads), and only closing them when GPRS is torn down.
+
+// Cumulative (since power-on) transport statistics for each endpoint
+volatile RTC_DATA_ATTR uint32_t transport_handshake_count[HTTP_NUM_ENDPOINTS]; // New connections (full TLS handshakes)
+volatile RTC_DATA_ATTR uint32_t transport_reuse_count[HTTP_NUM_ENDPOINTS];     // Requests sent over an already-open connection
+volatile RTC_DATA_ATTR uint32_t transport_bytes_sent[HTTP_NUM_ENDPOINTS];
+volatile RTC_DATA_ATTR uint32_t transport_bytes_received[HTTP_NUM_ENDPOINTS];
+volatile RTC_DATA_ATTR uint32_t transport_last_request_rx_bytes[HTTP_NUM_ENDPOINTS]; // Bytes received for the most recent request
+
+// transport_bytes_received at the start of the current request on each endpoint
+uint32_t transport_request_rx_start[HTTP_NUM_ENDPOINTS];
+
+// Wraps a TinyGSM secure socket so that HttpClient connects through our learned connect timeout, and so that every byte is counted.
+class TransportClient : public Client
+{
+public:
+  TransportClient(TinyGsmClientSecure& secure_client, int endpoint) : _client(secure_client), _endpoint(endpoint) {}
+
+  int connect(IPAddress ip, uint16_t port) override
+  {
+    return _count_handshake(_client.connect(ip, port));
+  }
+
+  int connect(const char* host, uint16_t port) override
+  {
+    uint32_t timeout_ms = http_timing_get_timeout_ms(_endpoint, HTTP_PHASE_CONNECT);
+    uint32_t start_ms = millis();
+    int res = _client.connect(host, port, (timeout_ms + 999) / 1000);
+    uint32_t elapsed_ms = millis() - start_ms;
+
+    if (res > 0)
+    {
+      http_timing_record(_endpoint, HTTP_PHASE_CONNECT, elapsed_ms);
+    }
+    else
+    {
+      Serial.println("Failed to connect to " + String(host) + " after " + String(elapsed_ms) + " ms");
+      if (elapsed_ms >= timeout_ms)
+      {
+        http_timing_record_timeout(_endpoint, HTTP_PHASE_CONNECT, elapsed_ms);
+      }
+    }
+    return _count_handshake(res);
+  }
+
+  size_t write(uint8_t b) override
+  {
+    size_t written = _client.write(b);
+    transport_bytes_sent[_endpoint] += written;
+    return written;
+  }
+
+  size_t write(const uint8_t* buf, size_t size) override
+  {
+    size_t written = _client.write(buf, size);
+    transport_bytes_sent[_endpoint] += written;
+    return written;
+  }
+
+  int available() override { return _client.available(); }
+
+  int read() override
+  {
+    int b = _client.read();
+    if (b >= 0)
+    {
+      transport_bytes_received[_endpoint]++;
+    }
+    return b;
+  }
+
+  int read(uint8_t* buf, size_t size) override
+  {
+    int bytes_read = _client.read(buf, size);
+    if (bytes_read > 0)
+    {
+      transport_bytes_received[_endpoint] += bytes_read;
+    }
+    return bytes_read;
+  }
+
+  int peek() override { return _client.peek(); }
+  void flush() override { _client.flush(); }
+  void stop() override { _client.stop(); }
+  uint8_t connected() override { return _client.connected(); }
+  operator bool() override { return _client.connected(); }
+
+  int endpoint() { return _endpoint; }
+
+private:
+  int _count_handshake(int res)
+  {
+    if (res > 0)
+    {
+      transport_handshake_count[_endpoint]++;
+      Serial.println("Opened new connection for [" + String(http_endpoint_names[_endpoint]) + "] (handshakes: " + String(transport_handshake_count[_endpoint]) + ")");
+    }
+    return res;
+  }
+
+  TinyGsmClientSecure& _client;
+  int _endpoint;
+};
+
+// Called at the start of every request so that we can tell how often a connection was reused
+void transport_begin_request(TransportClient& transport)
+{
+  transport_request_rx_start[transport.endpoint()] = transport_bytes_received[transport.endpoint()];
+  if (transport.connected())
+  {
+    transport_reuse_count[transport.endpoint()]++;
+    Serial.println("Reusing open connection for [" + String(http_endpoint_names[transport.endpoint()]) + "] (reused: " + String(transport_reuse_count[transport.endpoint()]) + ")");
+  }
+}
+
+// Called once the response to a request has been handled (or abandoned)
+void transport_end_request(int endpoint)
+{
+  transport_last_request_rx_bytes[endpoint] = transport_bytes_received[endpoint] - transport_request_rx_start[endpoint];
+  Serial.println("Received " + String(transport_last_request_rx_bytes[endpoint]) + " bytes for request to [" + String(http_endpoint_names[endpoint]) + "]");
+}
+
+void transport_print_stats()
+{
+  for (int endpoint = 0; endpoint < HTTP_NUM_ENDPOINTS; endpoint++)
+  {
+    Serial.println("Transport [" + String(http_endpoint_names[endpoint]) + "]: handshakes " + String(transport_handshake_count[endpoint]) + ", reused " + String(transport_reuse_count[endpoint]) + ", sent " + String(transport_bytes_sent[endpoint]) + " bytes, received " + String(transport_bytes_received[endpoint]) + " bytes");
+  }
+}
+
+// Append the handshake and byte counts for every endpoint to a URL query string
+void transport_append_url_params(textWriter& w)
+{
+  for (int endpoint = 0; endpoint < HTTP_NUM_ENDPOINTS; endpoint++)
+  {
+    const char* name = http_endpoint_names[endpoint];
+    text_put(w, "&net_"); text_put(w, name); text_put(w, "_handshakes="); text_put_uint(w, transport_handshake_count[endpoint]);
+    text_put(w, "&net_"); text_put(w, name); text_put(w, "_reused="); text_put_uint(w, transport_reuse_count[endpoint]);
+    text_put(w, "&net_"); text_put(w, name); text_put(w, "_tx_bytes="); text_put_uint(w, transport_bytes_sent[endpoint]);
+    text_put(w, "&net_"); text_put(w, name); text_put(w, "_rx_bytes="); text_put_uint(w, transport_bytes_received[endpoint]);
+    text_put(w, "&net_"); text_put(w, name); text_put(w, "_last_rx_bytes="); text_put_uint(w, transport_last_request_rx_bytes[endpoint]);
+  }
+}
+
+#endif // WATERPAL_TRANSPORT_H
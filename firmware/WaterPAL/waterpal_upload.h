@@ -0,0 +1,261 @@
+// waterpal_upload.h: Upload scheduler that delivers the outbox to every configured HTTP endpoint concurrently
+
+#ifndef WATERPAL_UPLOAD_H
+#define WATERPAL_UPLOAD_H
+
+#include <Arduino.h>
+#include "waterpal_gprs.h"
+#include "waterpal_report.h"
+#include "waterpal_outbox.h"
+#include "waterpal_ledger.h"
+
+// Each endpoint lives on its own modem socket (mux), so we can send every request first and then wait for all of the responses at once.
+// TinyGSM buffers incoming data per socket, so the responses are multiplexed over the single UART and we service whichever one arrives first.
+
+// Sends (but does not wait for the response to) a report request on the given HTTP client. Returns 1 if the request was sent.
+typedef int (*upload_request_fn)(HttpClient& http_client, const dailyReport& report);
+// Same, but for several reports in a single request (UPLOAD_MODE_BATCHED). Returns the number of reports in the request:
+//  the first ones, as many as fit.
+typedef int (*upload_batch_fn)(HttpClient& http_client, const dailyReport* reports, int num_reports);
+
+typedef struct uploadEndpoint
+{
+  HttpClient* http;
+  TransportClient* transport;
+  upload_request_fn send_request;
+  upload_batch_fn send_batch; // NULL if the endpoint doesn't accept batches
+  int mode;                   // UPLOAD_MODE_PER_PERIOD or UPLOAD_MODE_BATCHED (see waterpal_config.h)
+  int ok_status;              // HTTP status codes that mean the upload was accepted
+  int alt_ok_status;
+  int ack_mode;               // UPLOAD_ACK_STATUS or UPLOAD_ACK_REPORT_ID (see waterpal_config.h)
+} uploadEndpoint;
+
+// To add an endpoint: give it a new socket (TinyGsmClientSecure mux), TransportClient and HttpClient in waterpal_gprs.h,
+//  an HTTP_ENDPOINT_* index and name in waterpal_http_timing.h, a request function, and a row here.
+uploadEndpoint upload_endpoints[] = {
+  // Accept 200 or 302 as a valid response code.
+#if WATERPAL_USE_WATERPAL_HTTP
+#if WATERPAL_PAYLOAD_ENCODING_WATERPAL == PAYLOAD_ENCODING_TEXT
+  { &http, &transport, gprs_request_daily, gprs_request_batch, WATERPAL_UPLOAD_MODE_WATERPAL, 200, 302, WATERPAL_ACK_MODE_WATERPAL },
+#else
+  { &http, &transport, gprs_request_daily_compact, gprs_request_batch_compact, WATERPAL_UPLOAD_MODE_WATERPAL, 200, 302, WATERPAL_ACK_MODE_WATERPAL },
+#endif
+#endif // WATERPAL_USE_WATERPAL_HTTP
+#if WATERPAL_USE_DESIGNOUTREACH_HTTP
+  // Accept 200 or 201 as a valid response code for POST
+  { &http_designoutreach, &transport_designoutreach, gprs_request_daily_designoutreach, NULL, UPLOAD_MODE_PER_PERIOD, 200, 201, WATERPAL_ACK_MODE_DESIGNOUTREACH },
+#endif // WATERPAL_USE_DESIGNOUTREACH_HTTP
+};
+
+#define UPLOAD_NUM_ENDPOINTS (sizeof(upload_endpoints) / sizeof(upload_endpoints[0]))
+
+// States for each endpoint during one upload round
+#define UPLOAD_STATE_PENDING 0  // Still needs to be sent (this round or a later retry)
+#define UPLOAD_STATE_WAITING 1  // Request sent, waiting for the response
+#define UPLOAD_STATE_DONE 2     // Server accepted the upload (or there was nothing to send)
+#define UPLOAD_STATE_SKIPPED 3  // Batched endpoint that isn't due to send yet
+
+// Response bodies for UPLOAD_ACK_REPORT_ID endpoints
+String upload_response_body[UPLOAD_NUM_ENDPOINTS];
+
+// Run one round: send the request to every pending endpoint, then service the responses in whatever order they arrive.
+// A batch that doesn't all fit in one request is cut short, and num_reports updated to what went out.
+void upload_round(const dailyReport** reports, int* num_reports, uint8_t* states)
+{
+  uint32_t request_start_ms[UPLOAD_NUM_ENDPOINTS];
+  uint32_t request_sent_ms[UPLOAD_NUM_ENDPOINTS];
+
+  // Send all of the requests first
+  for (int i = 0; i < UPLOAD_NUM_ENDPOINTS; i++)
+  {
+    if (states[i] != UPLOAD_STATE_PENDING)
+    {
+      continue;
+    }
+
+    uploadEndpoint& endpoint = upload_endpoints[i];
+    request_start_ms[i] = millis();
+    gprs_begin_request(*endpoint.http, *endpoint.transport);
+    int sent;
+    if (endpoint.send_batch != NULL && endpoint.mode == UPLOAD_MODE_BATCHED)
+    {
+      sent = endpoint.send_batch(*endpoint.http, reports[i], num_reports[i]);
+      num_reports[i] = sent > 0 ? sent : num_reports[i];
+    }
+    else
+    {
+      sent = endpoint.send_request(*endpoint.http, *reports[i]);
+    }
+    if (sent)
+    {
+      request_sent_ms[i] = millis();
+      states[i] = UPLOAD_STATE_WAITING;
+    }
+  }
+
+  // Then wait for the responses, handling each as soon as its first bytes arrive
+  bool waiting = true;
+  while (waiting)
+  {
+    watchdog_pet();
+
+    waiting = false;
+    for (int i = 0; i < UPLOAD_NUM_ENDPOINTS; i++)
+    {
+      if (states[i] != UPLOAD_STATE_WAITING)
+      {
+        continue;
+      }
+
+      uploadEndpoint& endpoint = upload_endpoints[i];
+      int endpoint_index = endpoint.transport->endpoint();
+
+      if (endpoint.transport->available() > 0)
+      {
+        // Only keep the body if it carries the acknowledgement
+        String* body = NULL;
+        if (endpoint.ack_mode == UPLOAD_ACK_REPORT_ID)
+        {
+          upload_response_body[i] = "";
+          body = &upload_response_body[i];
+        }
+        int success = gprs_read_response(*endpoint.http, endpoint_index, endpoint.ok_status, endpoint.alt_ok_status, request_start_ms[i], request_sent_ms[i], body);
+        states[i] = success ? UPLOAD_STATE_DONE : UPLOAD_STATE_PENDING;
+      }
+      else if (millis() - request_sent_ms[i] >= http_timing_get_timeout_ms(endpoint_index, HTTP_PHASE_FIRST_BYTE))
+      {
+        Serial.println("No response from [" + String(http_endpoint_names[endpoint_index]) + "] before timeout");
+        http_timing_record_timeout(endpoint_index, HTTP_PHASE_FIRST_BYTE, millis() - request_sent_ms[i]);
+        endpoint.http->stop();
+        transport_end_request(endpoint_index);
+        states[i] = UPLOAD_STATE_PENDING;
+      }
+      else
+      {
+        waiting = true;
+      }
+    }
+
+    if (waiting)
+    {
+      delay(10);
+    }
+  }
+}
+
+// Reports that each endpoint is sending this round, copied out of the outbox
+dailyReport upload_reports[UPLOAD_NUM_ENDPOINTS][WATERPAL_UPLOAD_BATCH_MAX];
+
+// Decide what each endpoint should send next: the oldest reports in the outbox that it hasn't delivered yet -- as many as fit
+//  in one request for UPLOAD_MODE_BATCHED endpoints, otherwise one at a time. Batched endpoints wait until enough have piled up.
+// Returns the number of endpoints that have something to send.
+int upload_select_reports(const dailyReport** reports, int* num_reports, uint8_t* states, const int* failures)
+{
+  int num_pending = 0;
+  for (int i = 0; i < UPLOAD_NUM_ENDPOINTS; i++)
+  {
+    uploadEndpoint& endpoint = upload_endpoints[i];
+    int endpoint_index = endpoint.transport->endpoint();
+    reports[i] = upload_reports[i];
+    num_reports[i] = 0;
+
+    int backlog = outbox_pending_count(endpoint_index);
+    if (failures[i] >= WATERPAL_HTTP_RETRY_CNT || backlog == 0)
+    {
+      states[i] = UPLOAD_STATE_DONE;
+      continue;
+    }
+
+    if (endpoint.mode == UPLOAD_MODE_BATCHED && backlog < WATERPAL_UPLOAD_BATCH_PERIODS && !outbox_is_full())
+    {
+      Serial.println("Batching for [" + String(http_endpoint_names[endpoint_index]) + "]: " + String(backlog) + " of " + String(WATERPAL_UPLOAD_BATCH_PERIODS) + " reports queued");
+      states[i] = UPLOAD_STATE_SKIPPED;
+      continue;
+    }
+
+    // A per-period endpoint gets one report per request (its server may only take GETs), and works through the backlog a request at a time
+    bool batch = endpoint.send_batch != NULL && endpoint.mode == UPLOAD_MODE_BATCHED;
+    num_reports[i] = outbox_read_pending(endpoint_index, upload_reports[i], batch ? WATERPAL_UPLOAD_BATCH_MAX : 1);
+    states[i] = num_reports[i] > 0 ? UPLOAD_STATE_PENDING : UPLOAD_STATE_DONE;
+    if (num_reports[i] > 0)
+    {
+      num_pending++;
+    }
+  }
+  return num_pending;
+}
+
+// Deliver everything in the outbox that the HTTP endpoints haven't received yet, oldest first. Each endpoint keeps its connection
+//  open between requests, and batched endpoints get the backlog in as few requests as possible.
+// A request that fails is retried up to WATERPAL_HTTP_RETRY_CNT times, after which that endpoint gives up until the next report.
+// Returns the number of endpoints that are fully caught up (batched endpoints that aren't due yet count as caught up).
+int upload_flush_outbox()
+{
+  const dailyReport* reports[UPLOAD_NUM_ENDPOINTS];
+  int num_reports[UPLOAD_NUM_ENDPOINTS];
+  uint8_t states[UPLOAD_NUM_ENDPOINTS];
+  int failures[UPLOAD_NUM_ENDPOINTS];
+  memset(failures, 0, sizeof(failures));
+
+  while (upload_select_reports(reports, num_reports, states, failures) > 0)
+  {
+    upload_round(reports, num_reports, states);
+
+    for (int i = 0; i < UPLOAD_NUM_ENDPOINTS; i++)
+    {
+      int endpoint_index = upload_endpoints[i].transport->endpoint();
+      const char* name = http_endpoint_names[endpoint_index];
+      if (num_reports[i] == 0)
+      {
+        continue;
+      }
+
+      // Whatever the server says it stored, only the reports in this request can have been delivered by it
+      uint32_t last_sent_seq = reports[i][num_reports[i] - 1].seq;
+      uint32_t delivered_seq = last_sent_seq;
+      if (states[i] == UPLOAD_STATE_DONE && upload_endpoints[i].ack_mode == UPLOAD_ACK_REPORT_ID &&
+          (!ledger_parse_ack(endpoint_index, upload_response_body[i], &delivered_seq) || delivered_seq < reports[i][0].seq))
+      {
+        // Accepted, but not acknowledged
+        states[i] = UPLOAD_STATE_PENDING;
+      }
+      if (delivered_seq > last_sent_seq)
+      {
+        delivered_seq = last_sent_seq;
+      }
+
+      if (states[i] == UPLOAD_STATE_DONE)
+      {
+        Serial.println("Sent " + String(num_reports[i]) + " report(s) successfully via GPRS to [" + String(name) + "]");
+        outbox_mark_sent(endpoint_index, delivered_seq);
+      }
+      else
+      {
+        failures[i]++;
+        if (failures[i] < WATERPAL_HTTP_RETRY_CNT)
+        {
+          Serial.println("Retrying failed upload to [" + String(name) + "]. Retry #" + String(failures[i]));
+        }
+        else
+        {
+          Serial.println("Failed to send daily data via GPRS to [" + String(name) + "]. No more retries!");
+          logError(ERROR_GPRS_FAIL); // , "Failed to send data via GPRS");
+        }
+      }
+    }
+  }
+
+  outbox_trim();
+
+  int num_done = 0;
+  for (int i = 0; i < UPLOAD_NUM_ENDPOINTS; i++)
+  {
+    if (failures[i] < WATERPAL_HTTP_RETRY_CNT)
+    {
+      num_done++;
+    }
+  }
+  return num_done;
+}
+
+#endif // WATERPAL_UPLOAD_H
@@ -0,0 +1,213 @@
+// waterpal_usage.h: Water usage time and handle strokes by time of day, split exactly across bucket and report period boundaries
+// The day is divided into WATERPAL_USAGE_BUCKETS buckets from local midnight (hourly by default). Flow time is credited when the
+//  water stops, and at report time for a flow that is still running -- each span split at the bucket boundaries it crosses -- so a
+//  flow from 21:50 to 22:10 puts 10 minutes in each hour, and in each report period either side of a 22:00 report.
+// Strokes are only known when the counter is read (each wake), so the strokes read at the end of a flow are spread evenly over the
+//  time since the previous read (integer shares that add up exactly). Strokes while dry are the priming before a flow, or pumping
+//  after it stopped, and go into the bucket they were read in.
+#ifndef WATERPAL_USAGE_H
+#define WATERPAL_USAGE_H
+
+#include <Arduino.h>
+#include <esp_attr.h>
+#include <time.h>
+#include "waterpal_config.h"
+#include "waterpal_report.h"
+#include "waterpal_text.h"
+#include "waterpal_varint.h"
+
+#define USAGE_BUCKET_S ((24l * 60l * 60l) / WATERPAL_USAGE_BUCKETS)
+
+static_assert((24l * 60l * 60l) % WATERPAL_USAGE_BUCKETS == 0, "WATERPAL_USAGE_BUCKETS must divide the day evenly");
+static_assert(USAGE_BUCKET_S <= UINT16_MAX, "Each bucket's usage goes out as 16 bits");
+
+// This report period's totals
+RTC_DATA_ATTR uint32_t usage_bucket_s[WATERPAL_USAGE_BUCKETS];
+RTC_DATA_ATTR uint32_t usage_bucket_strokes[WATERPAL_USAGE_BUCKETS];
+volatile RTC_DATA_ATTR uint64_t usage_flowing_strokes = 0;
+
+volatile RTC_DATA_ATTR int64_t usage_credited_until_s = 0; // How far the running flow has been credited (0 if the water isn't running)
+volatile RTC_DATA_ATTR int64_t usage_last_read_s = 0;      // When the handle counter was last read
+
+// Bucket (by local time of day) that t falls in, and the time that bucket ends
+int usage_bucket_of(int64_t t, int64_t* bucket_end_s)
+{
+  time_t t_local = t;
+  struct tm timeinfo;
+  localtime_r(&t_local, &timeinfo);
+  long second_of_day = timeinfo.tm_hour * 3600l + timeinfo.tm_min * 60l + timeinfo.tm_sec;
+  *bucket_end_s = t + USAGE_BUCKET_S - second_of_day % USAGE_BUCKET_S;
+  return (second_of_day / USAGE_BUCKET_S) % WATERPAL_USAGE_BUCKETS;
+}
+
+// Credit flow time from from_s to to_s, split at the bucket boundaries
+void usage_credit_time(int64_t from_s, int64_t to_s)
+{
+  while (from_s < to_s)
+  {
+    int64_t bucket_end_s;
+    int bucket = usage_bucket_of(from_s, &bucket_end_s);
+    int64_t end_s = bucket_end_s < to_s ? bucket_end_s : to_s;
+    usage_bucket_s[bucket] += end_s - from_s;
+    from_s = end_s;
+  }
+}
+
+// Spread strokes evenly over from_s to to_s. Each bucket gets the strokes due by its end, less those already handed out, so the
+//  shares always add up to the total.
+void usage_credit_strokes(uint32_t strokes, int64_t from_s, int64_t to_s)
+{
+  int64_t bucket_end_s;
+  if (from_s >= to_s)
+  {
+    usage_bucket_strokes[usage_bucket_of(to_s, &bucket_end_s)] += strokes;
+    return;
+  }
+
+  uint32_t credited = 0;
+  int64_t t = from_s;
+  while (t < to_s)
+  {
+    int bucket = usage_bucket_of(t, &bucket_end_s);
+    int64_t end_s = bucket_end_s < to_s ? bucket_end_s : to_s;
+    uint32_t due = (uint32_t)((uint64_t)strokes * (end_s - from_s) / (to_s - from_s));
+    usage_bucket_strokes[bucket] += due - credited;
+    credited = due;
+    t = end_s;
+  }
+}
+
+// After each handle counter read: the strokes since the previous read, and whether the water was running all that time
+void usage_log_strokes(uint32_t strokes, bool water_was_flowing, int64_t now_s)
+{
+  if (water_was_flowing)
+  {
+    usage_flowing_strokes += strokes;
+    usage_credit_strokes(strokes, usage_last_read_s > 0 ? usage_last_read_s : now_s, now_s);
+  }
+  else
+  {
+    usage_credit_strokes(strokes, now_s, now_s);
+  }
+  usage_last_read_s = now_s;
+}
+
+void usage_flow_started(int64_t now_s)
+{
+  usage_credited_until_s = now_s;
+}
+
+void usage_flow_ended(int64_t now_s)
+{
+  // Nothing to credit for a flow that was already running at power-on, as we don't know when it started
+  if (usage_credited_until_s > 0)
+  {
+    usage_credit_time(usage_credited_until_s, now_s);
+  }
+  usage_credited_until_s = 0;
+}
+
+uint64_t usage_total_s()
+{
+  uint64_t total_s = 0;
+  for (int i = 0; i < WATERPAL_USAGE_BUCKETS; i++)
+  {
+    total_s += usage_bucket_s[i];
+  }
+  return total_s;
+}
+
+uint16_t usage_to_report_value(uint32_t value)
+{
+  return value > UINT16_MAX ? UINT16_MAX : (uint16_t)value;
+}
+
+// The period's usage goes into the report. A flow that's still running is credited up to now, and the rest of it goes in the next period.
+void usage_fill_report(dailyReport& report, int64_t now_s)
+{
+  if (usage_credited_until_s > 0 && now_s > usage_credited_until_s)
+  {
+    usage_credit_time(usage_credited_until_s, now_s);
+    usage_credited_until_s = now_s;
+  }
+
+  uint64_t total_s = usage_total_s();
+  report.water_usage_time_s = total_s;
+  report.handle_strokes_flowing_total = usage_flowing_strokes > 0xFFFFFFFFULL ? 0xFFFFFFFFUL : (uint32_t)usage_flowing_strokes;
+  report.handle_strokes_flowing_per_min = total_s > 0 ? report.handle_strokes_flowing_total * 60ULL / total_s : 0;
+  for (int i = 0; i < WATERPAL_USAGE_BUCKETS; i++)
+  {
+    report.usage_bucket_s[i] = usage_to_report_value(usage_bucket_s[i]);
+    report.usage_bucket_strokes[i] = usage_to_report_value(usage_bucket_strokes[i]);
+  }
+}
+
+void usage_start_period()
+{
+  memset(usage_bucket_s, 0, sizeof(usage_bucket_s));
+  memset(usage_bucket_strokes, 0, sizeof(usage_bucket_strokes));
+  usage_flowing_strokes = 0;
+}
+
+// **********
+// Serialization
+// **********
+
+uint8_t usage_encode_buffer[1 + (WATERPAL_USAGE_BUCKETS + 7) / 8 + WATERPAL_USAGE_BUCKETS * 2 * 3];
+
+bool usage_bucket_is_empty(const dailyReport& report, int i)
+{
+  return report.usage_bucket_s[i] == 0 && report.usage_bucket_strokes[i] == 0;
+}
+
+// Compact form, into usage_encode_buffer: the number of buckets, a bitmap of the non-empty ones (bucket 0 is the low bit of the first
+//  byte), then the seconds and strokes of each non-empty bucket as varints. Returns the length, or 0 if every bucket is empty.
+size_t usage_encode(const dailyReport& report)
+{
+  size_t bitmap_len = (WATERPAL_USAGE_BUCKETS + 7) / 8;
+  size_t len = 1 + bitmap_len;
+  memset(usage_encode_buffer, 0, len);
+  usage_encode_buffer[0] = WATERPAL_USAGE_BUCKETS;
+  for (int i = 0; i < WATERPAL_USAGE_BUCKETS; i++)
+  {
+    if (!usage_bucket_is_empty(report, i))
+    {
+      usage_encode_buffer[1 + i / 8] |= 1 << (i % 8);
+      len = varint_put(usage_encode_buffer, len, report.usage_bucket_s[i]);
+      len = varint_put(usage_encode_buffer, len, report.usage_bucket_strokes[i]);
+    }
+  }
+  return len > 1 + bitmap_len ? len : 0;
+}
+
+// Text form, for the URL query and JSON: a comma-separated list of seconds:strokes per bucket, empty for an empty bucket
+void usage_write_text(textWriter& w, const dailyReport& report)
+{
+  for (int i = 0; i < WATERPAL_USAGE_BUCKETS; i++)
+  {
+    if (i > 0)
+    {
+      text_put_char(w, ',');
+    }
+    if (!usage_bucket_is_empty(report, i))
+    {
+      text_put_uint(w, report.usage_bucket_s[i]);
+      text_put_char(w, ':');
+      text_put_uint(w, report.usage_bucket_strokes[i]);
+    }
+  }
+}
+
+void usage_print()
+{
+  Serial.println("  Water usage by time of day (" + String(WATERPAL_USAGE_BUCKETS) + " buckets):");
+  for (int i = 0; i < WATERPAL_USAGE_BUCKETS; i++)
+  {
+    if (usage_bucket_s[i] > 0 || usage_bucket_strokes[i] > 0)
+    {
+      Serial.println("    " + String(i) + ": " + String(usage_bucket_s[i]) + " s, " + String(usage_bucket_strokes[i]) + " strokes");
+    }
+  }
+}
+
+#endif // WATERPAL_USAGE_H
@@ -0,0 +1,22 @@
+// waterpal_varint.h: Unsigned LEB128 varints (7 bits per byte, low bits first, high bit set on every byte but the last)
+
+#ifndef WATERPAL_VARINT_H
+#define WATERPAL_VARINT_H
+
+#include <Arduino.h>
+
+#define VARINT_MAX_BYTES 10
+
+// Append val at buf[len]; returns the new length. The caller makes sure there is room for VARINT_MAX_BYTES.
+size_t varint_put(uint8_t* buf, size_t len, uint64_t val)
+{
+  while (val >= 0x80)
+  {
+    buf[len++] = (uint8_t)(val | 0x80);
+    val >>= 7;
+  }
+  buf[len++] = (uint8_t)val;
+  return len;
+}
+
+#endif // WATERPAL_VARINT_H
@@ -0,0 +1,89 @@
+// waterpal_wake.h: Deep-sleep wake sources for pins that should wake us as soon as they change (float switches, counter LOOP outputs)
+// Each pin is added with the level that should wake it -- the opposite of the level it has now. The ESP32 has two pin wake sources:
+//  ext0, one pin at either level, and ext1, a set of pins that wakes on any of them high or on all of them low. So every pin waiting
+//  to go high shares ext1 (ANY_HIGH), and ext0 takes the first pin waiting to go low. If no pin is waiting to go high, ext1 takes the
+//  rest of the pins waiting to go low, as ALL_LOW -- exact for one pin; with more, the wake only comes once they all have.
+// Pins are added most important first. A pin that can't wake us (and asked to be polled) caps the sleep at WATERPAL_WAKE_POLL_S.
+#ifndef WATERPAL_WAKE_H
+#define WATERPAL_WAKE_H
+
+#include <Arduino.h>
+#include <esp_sleep.h>
+#include "waterpal_config.h"
+
+#define WAKE_MAX_PINS 8
+
+typedef struct wakePlan
+{
+  uint8_t num;
+  int8_t pins[WAKE_MAX_PINS];
+  uint8_t levels[WAKE_MAX_PINS]; // Level that should wake us
+  bool poll[WAKE_MAX_PINS];      // Whether to poll the pin if it can't wake us
+} wakePlan;
+
+void wake_plan_init(wakePlan& plan)
+{
+  plan.num = 0;
+}
+
+void wake_plan_add(wakePlan& plan, int pin, int level, bool poll)
+{
+  if (plan.num >= WAKE_MAX_PINS)
+  {
+    Serial.println("  Too many wake pins -- GPIO " + String(pin) + " left out");
+    return;
+  }
+  plan.pins[plan.num] = pin;
+  plan.levels[plan.num] = level ? HIGH : LOW;
+  plan.poll[plan.num] = poll;
+  plan.num++;
+}
+
+// Set up ext0 and ext1. Returns false if a pin that wants polling can't wake us.
+bool wake_plan_apply(const wakePlan& plan)
+{
+  uint64_t rise_mask = 0;
+  uint64_t fall_mask = 0; // Pins waiting to go low, after the one on ext0
+  int num_fall = 0;
+  bool poll_fall = false;
+  int ext0_pin = -1;
+  for (int i = 0; i < plan.num; i++)
+  {
+    if (plan.levels[i] == HIGH)
+    {
+      rise_mask |= 1ull << plan.pins[i];
+    }
+    else if (ext0_pin < 0)
+    {
+      ext0_pin = plan.pins[i];
+    }
+    else
+    {
+      fall_mask |= 1ull << plan.pins[i];
+      num_fall++;
+      poll_fall |= plan.poll[i];
+    }
+  }
+
+  if (ext0_pin >= 0)
+  {
+    esp_sleep_enable_ext0_wakeup((gpio_num_t)ext0_pin, LOW);
+  }
+  if (rise_mask != 0)
+  {
+    esp_sleep_enable_ext1_wakeup(rise_mask, ESP_EXT1_WAKEUP_ANY_HIGH);
+  }
+  else if (fall_mask != 0)
+  {
+    esp_sleep_enable_ext1_wakeup(fall_mask, ESP_EXT1_WAKEUP_ALL_LOW);
+  }
+
+  bool all_watched = num_fall == 0 || (rise_mask == 0 && num_fall == 1);
+  if (!all_watched)
+  {
+    Serial.println("  " + String(num_fall) + " pins waiting to go low can't each wake us" + (poll_fall ? " -- polling" : ""));
+  }
+  return all_watched || !poll_fall;
+}
+
+#endif // WATERPAL_WAKE_H
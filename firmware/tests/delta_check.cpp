@@ -0,0 +1,178 @@
+// delta_check.cpp: Sizes of full and delta compact reports (waterpal_payload.h, waterpal_delta.h) over four weeks of daily reports
+// Prints the bytes and binary SMS parts with and without deltas, one and four reports per message, for CBOR and CBOR+heatshrink,
+//  and checks that a delta report is never bigger than the full one, that keyframes come every WATERPAL_DELTA_KEYFRAME_INTERVAL
+//  reports, and that what the receiver reconstructs is within each field's threshold of what was measured.
+// With a directory argument, it also writes the four-per-message heatshrink payloads there (NN.bin), and the reports the receiver
+//  should end up with (expected.json, in the format of waterpal_decode.py's --state file) -- "make" checks them with the decoder.
+#include <random>
+#include <string>
+
+#include "waterpal_payload.h"
+
+#define NUM_REPORTS 28
+
+// User data bytes per binary SMS, as for sms_pdu_num_parts() in waterpal_sms_pdu.h
+#define SMS_MAX_DATA 140
+#define SMS_MAX_PART_DATA 134
+
+int failures = 0;
+
+void expect(bool ok, const char* what, int seq)
+{
+  if (!ok)
+  {
+    printf("FAIL: %s (report %d)\n", what, seq);
+    failures++;
+  }
+}
+
+// The binary SMS carries the encoding in a byte before the payload
+int sms_parts(size_t payload_len)
+{
+  size_t len = payload_len + 1;
+  return len <= SMS_MAX_DATA ? 1 : (len + SMS_MAX_PART_DATA - 1) / SMS_MAX_PART_DATA;
+}
+
+// Daily reports from a pump in steady use: most fields wander a little from day to day, the counters don't repeat
+void make_reports(dailyReport* reports)
+{
+  std::mt19937 rng(3);
+  for (int i = 0; i < NUM_REPORTS; i++)
+  {
+    dailyReport& r = reports[i];
+    r = {};
+    r.seq = 100 + i;
+    strcpy(r.imei, "6lDdCiRp6AbC");
+    r.timestamp_s = 1760000000 + 86400ll * i;
+    r.total_sms_count = 40 + i;
+    r.water_usage_time_s = 3000 + rng() % 1500;
+    r.clock_drift_s = rng() % 3;
+    r.temperature_low = 18 + rng() % 2;
+    r.temperature_avg = 24 + rng() % 2;
+    r.temperature_high = 31 + rng() % 3;
+    r.humidity_low = 40 + rng() % 3;
+    r.humidity_avg = 55 + rng() % 3;
+    r.humidity_high = 70 + rng() % 3;
+    r.signal_strength = 60 + rng() % 8;
+    r.battery_charge_status = 1;
+    r.battery_charge_pct = 90 - i / 4;
+    r.battery_voltage_mv = 4000 - i * 3;
+    r.boot_count = 500 + i;
+    r.handle_strokes_total = 2000 + rng() % 800;
+    r.handle_strokes_flowing_total = r.handle_strokes_total - 200;
+    r.handle_strokes_flowing_per_min = 40 + rng() % 5;
+    r.dry_start_count = 5 + rng() % 4;
+    r.dry_start_stroke_total = 60 + rng() % 30;
+    r.dry_start_stroke_avg = 9 + rng() % 3;
+    r.dry_start_stroke_max = 20 + rng() % 6;
+    r.flow_session_count = 10 + rng() % 6;
+    r.usage_bucket_s[6] = r.water_usage_time_s / 2;
+    r.usage_bucket_strokes[6] = r.handle_strokes_total / 2;
+  }
+}
+
+void write_state_record(FILE* f, const dailyReport& report, bool first)
+{
+  fprintf(f, "%s\"%u\": {", first ? "" : ", ", report.seq);
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    fprintf(f, "%s\"%s\": %lld", i == 0 ? "" : ", ", report_fields[i].name, (long long)schema_get_value(report, report_fields[i]));
+  }
+  fprintf(f, "}");
+}
+
+int main(int argc, char** argv)
+{
+  const char* out_dir = argc > 1 ? argv[1] : NULL;
+  dailyReport reports[NUM_REPORTS];
+  make_reports(reports);
+
+  printf("%d daily reports             full              delta\n", NUM_REPORTS);
+  for (int per_message : {1, 4})
+  {
+    for (int encoding : {PAYLOAD_ENCODING_CBOR, PAYLOAD_ENCODING_CBOR_HEATSHRINK})
+    {
+      bool write = out_dir != NULL && per_message == 4 && encoding == PAYLOAD_ENCODING_CBOR_HEATSHRINK;
+      FILE* expected = NULL;
+      if (write)
+      {
+        expected = fopen((std::string(out_dir) + "/expected.json").c_str(), "w");
+        if (expected == NULL)
+        {
+          printf("Can't write to %s\n", out_dir);
+          return 1;
+        }
+        fprintf(expected, "{\"%s\": {", reports[0].imei);
+      }
+
+      size_t full_bytes = 0, delta_bytes = 0;
+      int full_parts = 0, delta_parts = 0, keyframes = 0;
+      dailyReport baseline = {};
+      dailyReport receiver = {};
+      for (int i = 0; i < NUM_REPORTS; i += per_message)
+      {
+        const uint8_t* payload;
+        size_t len = payload_encode(reports + i, per_message, encoding, NULL, &payload);
+        full_bytes += len;
+        full_parts += sms_parts(len);
+
+        size_t full_len = len;
+        len = payload_encode(reports + i, per_message, encoding, &baseline, &payload);
+        delta_bytes += len;
+        delta_parts += sms_parts(len);
+        keyframes += per_message - payload_last_num_deltas;
+        expect(len > 0 && len <= full_len, "delta payload no bigger than the full one", reports[i].seq);
+
+        const dailyReport& last = reports[i + per_message - 1];
+        expect(baseline.seq == last.seq, "baseline follows the reports", last.seq);
+        for (size_t f = 0; f < REPORT_NUM_FIELDS; f++)
+        {
+          // Fields that every delta carries are exact, the rest within their threshold
+          const reportField& field = report_fields[f];
+          bool close = field.delta_threshold == REPORT_DELTA_ALWAYS ?
+            schema_get_value(last, field) == schema_get_value(baseline, field) : !delta_field_changed(field, last, baseline);
+          expect(close, field.name, last.seq);
+        }
+
+        if (write)
+        {
+          char path[256];
+          snprintf(path, sizeof(path), "%s/%02d.bin", out_dir, i / per_message);
+          FILE* f = fopen(path, "wb");
+          fwrite(payload, 1, len, f);
+          fclose(f);
+          // The receiver stores every report of the message, a delta filled in from the report before it
+          for (int j = i; j < i + per_message; j++)
+          {
+            delta_apply(receiver, reports[j], delta_is_keyframe(reports[j], receiver));
+            write_state_record(expected, receiver, j == 0);
+          }
+        }
+      }
+
+      printf("%d per message, %-15s %5zu B / %2d SMS    %5zu B / %2d SMS  (%d keyframes)\n", per_message,
+             encoding == PAYLOAD_ENCODING_CBOR ? "CBOR" : "CBOR+heatshrink", full_bytes, full_parts, delta_bytes, delta_parts, keyframes);
+      int expected_keyframes = 0;
+      for (int i = 0; i < NUM_REPORTS; i++)
+      {
+        expected_keyframes += (i == 0 || reports[i].seq % WATERPAL_DELTA_KEYFRAME_INTERVAL == 0);
+      }
+      expect(keyframes == expected_keyframes, "a keyframe every WATERPAL_DELTA_KEYFRAME_INTERVAL reports", 0);
+      expect(delta_bytes < full_bytes, "deltas save bytes", 0);
+
+      if (expected != NULL)
+      {
+        fprintf(expected, "}}\n");
+        fclose(expected);
+      }
+    }
+  }
+
+  if (failures > 0)
+  {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("delta_check passed\n");
+  return 0;
+}
@@ -0,0 +1,51 @@
+// Host stand-in for the Arduino core: just enough for the firmware headers that the checks include
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+#include <string>
+#include <algorithm>
+
+// Arduino's String, for the reference formatters and the firmware's log lines: decimal integers and concatenation
+class String
+{
+public:
+  String(const char* str = "") : s(str) {}
+  String(int v) : s(std::to_string(v)) {}
+  String(unsigned int v) : s(std::to_string(v)) {}
+  String(long v) : s(std::to_string(v)) {}
+  String(unsigned long v) : s(std::to_string(v)) {}
+  String(long long v) : s(std::to_string(v)) {}
+  String(unsigned long long v) : s(std::to_string(v)) {}
+  String& operator+=(const String& other) { s += other.s; return *this; }
+  const char* c_str() const { return s.c_str(); }
+  unsigned int length() const { return s.size(); }
+  friend String operator+(const String& a, const String& b) { return String((a.s + b.s).c_str()); }
+
+private:
+  std::string s;
+};
+
+// Serial output is dropped: the checks print their own results
+struct hostSerial
+{
+  void print(const String&) {}
+  void println(const String&) {}
+};
+inline hostSerial Serial;
+
+// The ESP32 core's min() and max() are std's
+using std::max;
+using std::min;
+
+static inline uint32_t micros() { return 0; }
+static inline void delay(uint32_t) {}
+
+#endif // HOST_ARDUINO_H
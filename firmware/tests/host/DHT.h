@@ -0,0 +1,9 @@
+// Host stand-in: the sensor types that waterpal_config.h names
+#ifndef HOST_DHT_H
+#define HOST_DHT_H
+
+#define DHT11 11
+#define DHT21 21
+#define DHT22 22
+
+#endif // HOST_DHT_H
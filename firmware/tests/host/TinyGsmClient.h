@@ -0,0 +1,46 @@
+// Host stand-in for TinyGsm: a modem that records the AT commands and raw bytes it is sent, and answers from a script
+#ifndef HOST_TINYGSMCLIENT_H
+#define HOST_TINYGSMCLIENT_H
+
+#include <Arduino.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+struct hostModemStream
+{
+  std::string written;
+  void print(const char* str) { written += str; }
+  void write(char c) { written += c; }
+  void flush() {}
+};
+
+class TinyGsm
+{
+public:
+  std::vector<std::string> commands; // Each sendAT(), without the "AT"
+  std::deque<int> responses;         // What the next waitResponse() calls return (1, for OK, once it runs out)
+  hostModemStream stream;
+
+  template <typename... Args>
+  void sendAT(Args... args)
+  {
+    std::string command;
+    ((command += String(args).c_str()), ...);
+    commands.push_back(command);
+  }
+
+  template <typename... Args>
+  int waitResponse(Args...)
+  {
+    if (responses.empty())
+    {
+      return 1;
+    }
+    int response = responses.front();
+    responses.pop_front();
+    return response;
+  }
+};
+
+#endif // HOST_TINYGSMCLIENT_H
@@ -0,0 +1,9 @@
+// Host stand-in: RTC memory is ordinary memory
+#ifndef HOST_ESP_ATTR_H
+#define HOST_ESP_ATTR_H
+
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#define IRAM_ATTR
+
+#endif // HOST_ESP_ATTR_H
@@ -0,0 +1,188 @@
+// payload_check.cpp: Size and encode time of the compact payloads (waterpal_payload.h, waterpal_heatshrink.h) against the JSON batch body
+// Encodes batches of 1, 3 and 6 daily reports as the text JSON body (as gprs_request_batch() builds it, without flow sessions), as CBOR
+//  and as CBOR+heatshrink, and prints their bytes and the host's encode time, then the biggest batch of full reports each encoding
+//  fits in its buffer. CBOR has to be smaller than the JSON, and heatshrink smaller again for a batch. The times are the host's,
+//  for comparing the encodings -- the ESP32 is much slower.
+// With a directory argument, it also writes each CBOR (bN.cbor) and heatshrink (bN.hs) payload there, and the JSON that
+//  waterpal_decode.py should decode them to (bN.json) -- "make" checks them with the decoder.
+#include <chrono>
+#include <random>
+#include <string>
+
+#include "waterpal_payload.h"
+
+#define NUM_REPORTS WATERPAL_UPLOAD_BATCH_MAX
+#define ENCODE_REPEATS 2000
+
+int failures = 0;
+
+void expect(bool ok, const char* what, int num_reports)
+{
+  if (!ok)
+  {
+    printf("FAIL: %s (%d reports)\n", what, num_reports);
+    failures++;
+  }
+}
+
+// Daily reports from a pump in steady use, with its water usage spread over the morning and evening buckets
+void make_reports(dailyReport* reports)
+{
+  std::mt19937 rng(5);
+  for (int i = 0; i < NUM_REPORTS; i++)
+  {
+    dailyReport& r = reports[i];
+    r = {};
+    r.seq = 300 + i;
+    strcpy(r.imei, "6lDdCiRp6AbC");
+    r.timestamp_s = 1760000000 + 86400ll * i;
+    r.total_sms_count = 80 + i;
+    r.water_usage_time_s = 2500 + rng() % 2000;
+    r.clock_drift_s = rng() % 5;
+    r.temperature_low = 17 + rng() % 3;
+    r.temperature_avg = 24 + rng() % 3;
+    r.temperature_high = 30 + rng() % 4;
+    r.humidity_low = 38 + rng() % 5;
+    r.humidity_avg = 55 + rng() % 5;
+    r.humidity_high = 70 + rng() % 5;
+    r.signal_strength = 55 + rng() % 15;
+    r.battery_charge_status = 1;
+    r.battery_charge_pct = 92 - i;
+    r.battery_voltage_mv = 4050 - i * 4;
+    r.boot_count = 900 + i;
+    r.handle_strokes_total = 1800 + rng() % 900;
+    r.handle_strokes_flowing_total = r.handle_strokes_total - 150;
+    r.handle_strokes_flowing_per_min = 38 + rng() % 6;
+    r.dry_start_count = 4 + rng() % 5;
+    r.dry_start_stroke_total = 50 + rng() % 40;
+    r.dry_start_stroke_avg = 9 + rng() % 3;
+    r.dry_start_stroke_max = 18 + rng() % 8;
+    r.flow_session_count = 9 + rng() % 7;
+    for (int hour : {6, 7, 8, 17, 18, 19})
+    {
+      r.usage_bucket_s[hour] = 200 + rng() % 400;
+      r.usage_bucket_strokes[hour] = 100 + rng() % 300;
+    }
+  }
+}
+
+// The JSON batch body, as gprs_request_batch() builds it when the flow sessions are left out
+size_t encode_json(const dailyReport* reports, int num_reports)
+{
+  textWriter w;
+  text_init(w, schema_text_buffer, sizeof(schema_text_buffer));
+  text_put(w, "{\"IMEI\":\"");
+  text_put(w, reports[0].imei);
+  text_put(w, "\",\"reports\":[");
+  for (int i = 0; i < num_reports; i++)
+  {
+    text_put(w, i > 0 ? ",{" : "{");
+    schema_write_json_fields(w, reports[i]);
+    text_put(w, ",\"usageBuckets\":\"");
+    usage_write_text(w, reports[i]);
+    text_put(w, "\"}");
+  }
+  text_put(w, "]}");
+  return w.overflow ? 0 : w.len;
+}
+
+// Host time per encode, in microseconds
+template <typename Fn>
+double time_us(Fn fn)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ENCODE_REPEATS; i++)
+  {
+    fn();
+  }
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / ENCODE_REPEATS;
+}
+
+void write_file(const std::string& path, const uint8_t* data, size_t len)
+{
+  FILE* f = fopen(path.c_str(), "wb");
+  fwrite(data, 1, len, f);
+  fclose(f);
+}
+
+// What waterpal_decode.py prints for the reports
+void write_expected(const std::string& path, const dailyReport* reports, int num_reports)
+{
+  FILE* f = fopen(path.c_str(), "w");
+  fprintf(f, "{\"IMEI\": \"%s\", \"reports\": [", reports[0].imei);
+  for (int i = 0; i < num_reports; i++)
+  {
+    fprintf(f, "%s{", i > 0 ? ", " : "");
+    for (size_t j = 0; j < REPORT_NUM_FIELDS; j++)
+    {
+      fprintf(f, "\"%s\": %lld, ", report_fields[j].name, (long long)schema_get_value(reports[i], report_fields[j]));
+    }
+    fprintf(f, "\"usageBuckets\": [");
+    for (int b = 0; b < WATERPAL_USAGE_BUCKETS; b++)
+    {
+      fprintf(f, "%s{\"seconds\": %u, \"strokes\": %u}", b > 0 ? ", " : "", reports[i].usage_bucket_s[b], reports[i].usage_bucket_strokes[b]);
+    }
+    fprintf(f, "]}");
+  }
+  fprintf(f, "]}\n");
+  fclose(f);
+}
+
+int main(int argc, char** argv)
+{
+  const char* out_dir = argc > 1 ? argv[1] : NULL;
+  dailyReport reports[NUM_REPORTS];
+  make_reports(reports);
+
+  printf("Reports      JSON             CBOR             CBOR+heatshrink\n");
+  for (int num_reports : {1, 3, 6})
+  {
+    size_t json_len = encode_json(reports, num_reports);
+    double json_us = time_us([&] { encode_json(reports, num_reports); });
+
+    const uint8_t* payload;
+    size_t cbor_len = payload_encode(reports, num_reports, PAYLOAD_ENCODING_CBOR, NULL, &payload);
+    double cbor_us = time_us([&] { payload_encode(reports, num_reports, PAYLOAD_ENCODING_CBOR, NULL, &payload); });
+    if (out_dir != NULL)
+    {
+      write_file(std::string(out_dir) + "/b" + std::to_string(num_reports) + ".cbor", payload, cbor_len);
+    }
+
+    size_t heatshrink_len = payload_encode(reports, num_reports, PAYLOAD_ENCODING_CBOR_HEATSHRINK, NULL, &payload);
+    double heatshrink_us = time_us([&] { payload_encode(reports, num_reports, PAYLOAD_ENCODING_CBOR_HEATSHRINK, NULL, &payload); });
+    if (out_dir != NULL)
+    {
+      write_file(std::string(out_dir) + "/b" + std::to_string(num_reports) + ".hs", payload, heatshrink_len);
+      write_expected(std::string(out_dir) + "/b" + std::to_string(num_reports) + ".json", reports, num_reports);
+    }
+
+    printf("%7d  %5zu B %6.1f us  %5zu B %6.1f us  %5zu B %6.1f us\n", num_reports,
+           json_len, json_us, cbor_len, cbor_us, heatshrink_len, heatshrink_us);
+    expect(json_len > 0 && cbor_len > 0 && heatshrink_len > 0, "everything fits", num_reports);
+    expect(payload_last_cbor_bytes == cbor_len, "the CBOR size is logged", num_reports);
+    expect(cbor_len < json_len, "CBOR is smaller than JSON", num_reports);
+    if (num_reports > 1)
+    {
+      expect(heatshrink_len < cbor_len, "heatshrink shrinks a batch", num_reports);
+    }
+  }
+
+  // Without deltas, a batch of WATERPAL_UPLOAD_BATCH_MAX reports may not fit
+  int max_json = 0, max_cbor = 0, max_heatshrink = 0;
+  for (int num_reports = 1; num_reports <= NUM_REPORTS; num_reports++)
+  {
+    const uint8_t* payload;
+    max_json = encode_json(reports, num_reports) > 0 ? num_reports : max_json;
+    max_cbor = payload_encode(reports, num_reports, PAYLOAD_ENCODING_CBOR, NULL, &payload) > 0 ? num_reports : max_cbor;
+    max_heatshrink = payload_encode(reports, num_reports, PAYLOAD_ENCODING_CBOR_HEATSHRINK, NULL, &payload) > 0 ? num_reports : max_heatshrink;
+  }
+  printf("Most reports that fit (of %d): JSON %d, CBOR %d, CBOR+heatshrink %d\n", NUM_REPORTS, max_json, max_cbor, max_heatshrink);
+
+  if (failures > 0)
+  {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("payload_check passed\n");
+  return 0;
+}
@@ -0,0 +1,240 @@
+// sched_check.cpp: Checks the wake scheduler (waterpal_scheduler.h) itself, in a time zone with daylight saving time
+// The slot arithmetic across midnight and both DST changes, the tolerance cap, and which tasks share a wake; then two weeks of
+//  wakes across the spring DST change, as in firmware/utils/waterpal_sched_sim.py, printing the timer wakes with and without the
+//  tolerances. No task may run late, or earlier than its (capped) tolerance, and the tolerances must not cost any wakes.
+#include <random>
+
+#include <Arduino.h>
+#include "waterpal_scheduler.h"
+
+#define H (60l * 60l)
+#define TASK_RUN_S 5 // How long a task keeps the device awake
+#define DAYS 14
+
+// The tasks the simulation schedules (the time sync is a one-shot, left out)
+#define SIM_NUM_TASKS SCHED_TASK_TIME_SYNC
+
+int failures = 0;
+
+void expect(bool ok, const char* what)
+{
+  if (!ok)
+  {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+// Local time (CET/CEST)
+int64_t local(int year, int month, int day, int hour, int min = 0, int sec = 0)
+{
+  struct tm t = {};
+  t.tm_year = year - 1900;
+  t.tm_mon = month - 1;
+  t.tm_mday = day;
+  t.tm_hour = hour;
+  t.tm_min = min;
+  t.tm_sec = sec;
+  t.tm_isdst = -1;
+  return mktime(&t);
+}
+
+void check_slots()
+{
+  // Hourly slots on the hour, a 22 hour period at 22:00, and slots restarting at midnight
+  expect(sched_slot_after(local(2026, 6, 1, 7, 0, 5), H) == local(2026, 6, 1, 8), "hourly slot");
+  expect(sched_slot_after(local(2026, 6, 1, 7), H) == local(2026, 6, 1, 8), "the slot after a slot");
+  expect(sched_slot_after(local(2026, 6, 1, 23, 30), H) == local(2026, 6, 2, 0), "hourly slot at midnight");
+  expect(sched_slot_after(local(2026, 6, 1, 7), 22 * H) == local(2026, 6, 1, 22), "22 hours at 22:00");
+  expect(sched_slot_after(local(2026, 6, 1, 22), 22 * H) == local(2026, 6, 2, 22), "22 hours at 22:00 the next day");
+  expect(sched_slot_after(local(2026, 6, 1, 23, 59, 59), 22 * H) == local(2026, 6, 2, 22), "22 hours just before midnight");
+  uint32_t seventh = SCHED_DAY_S / 7;
+  expect(sched_slot_after(local(2026, 6, 1, 0) + 7 * seventh, seventh) == local(2026, 6, 2, 0) + seventh, "a 7th of a day restarts at midnight");
+  expect(sched_slot_after(local(2026, 6, 1, 7), 176 * H) == local(2026, 6, 1, 7) + 176 * H, "long periods follow on");
+
+  // DST changes (at 02:00 CET on 29 March, 03:00 CEST on 25 October): slots count elapsed time from local midnight, so hourly slots
+  //  stay on the hour and a day still gets one 22 hour slot -- at 23:00 on the short day and 21:00 on the long one
+  expect(sched_slot_after(local(2026, 3, 29, 1, 30), H) == local(2026, 3, 29, 3), "hourly slot over the spring gap");
+  expect(sched_slot_after(local(2026, 3, 29, 22, 30), H) == local(2026, 3, 29, 23), "hourly slot before midnight after the spring change");
+  expect(sched_slot_after(local(2026, 3, 29, 23, 30), H) == local(2026, 3, 30, 0), "hourly slot at midnight after the spring change");
+  expect(sched_slot_after(local(2026, 3, 29, 7), 22 * H) == local(2026, 3, 29, 23), "22 hours on the short day");
+  expect(sched_slot_after(local(2026, 3, 29, 23), 22 * H) == local(2026, 3, 30, 22), "22 hours after the short day");
+  expect(sched_slot_after(local(2026, 10, 25, 7), 22 * H) == local(2026, 10, 25, 21), "22 hours on the long day");
+  expect(sched_slot_after(local(2026, 10, 25, 21), 22 * H) == local(2026, 10, 26, 22), "22 hours after the long day");
+  int64_t repeated = local(2026, 10, 25, 1) + H; // The first 02:00 (CEST); the second is an hour later
+  expect(sched_slot_after(repeated, H) == repeated + H && sched_slot_after(repeated + H, H) == repeated + 2 * H, "hourly slots through the repeated hour");
+  expect(sched_slot_after(local(2026, 10, 25, 23, 30), H) == local(2026, 10, 26, 0), "hourly slot at midnight after the autumn change");
+}
+
+void check_tolerance_cap()
+{
+  sched_set(SCHED_TASK_SENSOR_READ, 1000, H, 2 * H);
+  expect(sched_tasks[SCHED_TASK_SENSOR_READ].tolerance_s == H / 2, "tolerance capped at half the period");
+  sched_set(SCHED_TASK_SENSOR_READ, 1000, H, 600);
+  expect(sched_tasks[SCHED_TASK_SENSOR_READ].tolerance_s == 600, "tolerance under the cap");
+  sched_once(SCHED_TASK_TIME_SYNC, 1000, 2 * H);
+  expect(sched_tasks[SCHED_TASK_TIME_SYNC].tolerance_s == 2 * H, "a one-shot task's tolerance isn't capped");
+  sched_cancel(SCHED_TASK_SENSOR_READ);
+  sched_cancel(SCHED_TASK_TIME_SYNC);
+}
+
+void check_coalescing()
+{
+  int64_t t = local(2026, 6, 1, 12);
+
+  // The report is due first; the sensor read's window is open by then, and nothing else would wake us before it's due
+  sched_once(SCHED_TASK_REPORT, t + 100, 0);
+  sched_once(SCHED_TASK_SENSOR_READ, t + 400, 600);
+  expect(sched_next_wake(t) == t + 100, "wake at the earliest due time");
+  expect(sched_next_runnable(t + 100) == SCHED_TASK_SENSOR_READ, "a task whose window is open shares the wake (in run order)");
+  sched_task_done(SCHED_TASK_SENSOR_READ, t + 100);
+  expect(sched_next_runnable(t + 100) == SCHED_TASK_REPORT, "then the task that is due");
+  sched_task_done(SCHED_TASK_REPORT, t + 100);
+  expect(sched_next_runnable(t + 100) == -1 && sched_next_wake(t + 100) == t + 100 + SCHED_DAY_S, "nothing left");
+
+  // A task with a closed window would wake us before the sensor read is due, so the sensor read waits to share that wake
+  sched_once(SCHED_TASK_REPORT, t + 100, 0);
+  sched_once(SCHED_TASK_SENSOR_READ, t + 400, 600);
+  sched_once(SCHED_TASK_CONFIG_POLL, t + 200, 0);
+  sched_task_done(SCHED_TASK_REPORT, t + 100);
+  expect(sched_next_runnable(t + 100) == -1, "an open window waits for a wake that comes before it's due");
+  expect(sched_next_wake(t + 100) == t + 200, "wake for the next task that is due");
+  expect(sched_next_runnable(t + 200) == SCHED_TASK_SENSOR_READ, "and share it");
+  sched_task_done(SCHED_TASK_SENSOR_READ, t + 200);
+  sched_task_done(SCHED_TASK_CONFIG_POLL, t + 200);
+
+  // Without a tolerance, a task runs when it is due and no earlier
+  sched_once(SCHED_TASK_REPORT, t + 100, 0);
+  sched_once(SCHED_TASK_SENSOR_READ, t + 400, 0);
+  expect(sched_next_runnable(t + 100) == SCHED_TASK_REPORT, "due task runs");
+  sched_task_done(SCHED_TASK_REPORT, t + 100);
+  expect(sched_next_runnable(t + 100) == -1 && sched_next_wake(t + 100) == t + 400, "no tolerance, no early run");
+  sched_cancel(SCHED_TASK_SENSOR_READ);
+
+  // A periodic task that ran early moves past the slot it served
+  sched_set(SCHED_TASK_SENSOR_READ, local(2026, 6, 1, 13), H, 600);
+  sched_task_done(SCHED_TASK_SENSOR_READ, local(2026, 6, 1, 12, 52));
+  expect(sched_tasks[SCHED_TASK_SENSOR_READ].next_due_s == local(2026, 6, 1, 14), "an early run serves its slot");
+  sched_task_done(SCHED_TASK_SENSOR_READ, local(2026, 6, 1, 16, 55));
+  expect(sched_tasks[SCHED_TASK_SENSOR_READ].next_due_s == local(2026, 6, 1, 18), "a late run skips the slots it missed");
+  sched_cancel(SCHED_TASK_SENSOR_READ);
+}
+
+struct simResult
+{
+  int timer_wakes;
+  int float_wakes;
+  int runs[SIM_NUM_TASKS];
+  int64_t max_early_s; // How far ahead of its due time a task ran
+  bool late;           // A task ran after its due time, other than by the time the tasks before it in the wake took
+  bool too_early;      // A task ran earlier than its tolerance
+  bool off_due;        // A timer wake wasn't at a task's due time
+};
+
+// Two weeks of wakes from 07:00 on 22 March, with float switch wakes at random times in between if float_wakes
+simResult simulate(const uint32_t* periods, const uint32_t* tolerances, bool float_wakes)
+{
+  simResult result = {};
+  std::mt19937 rng(1);
+  int64_t now = local(2026, 3, 22, 7);
+  for (int task = 0; task < SIM_NUM_TASKS; task++)
+  {
+    sched_every(task, now, periods[task], tolerances[task], task == SCHED_TASK_SENSOR_READ || task == SCHED_TASK_REPORT);
+  }
+  int64_t end = now + DAYS * SCHED_DAY_S;
+  int64_t next_float = now + rng() % (4 * H);
+  bool timer_wake = false;
+  while (now < end)
+  {
+    int64_t wake_s = now;
+    bool any_due = false;
+    int task;
+    while ((task = sched_next_runnable(now)) >= 0)
+    {
+      const schedTask& t = sched_tasks[task];
+      result.runs[task]++;
+      any_due |= t.next_due_s == wake_s;
+      result.max_early_s = max(result.max_early_s, t.next_due_s - now);
+      result.too_early |= t.next_due_s - now > t.tolerance_s;
+      result.late |= t.next_due_s < wake_s;
+      now += TASK_RUN_S;
+      sched_task_done(task, now);
+    }
+    result.off_due |= timer_wake && !any_due;
+
+    int64_t wake = sched_next_wake(now);
+    timer_wake = !(float_wakes && next_float < wake);
+    if (timer_wake)
+    {
+      now = wake;
+      result.timer_wakes++;
+    }
+    else
+    {
+      now = next_float;
+      next_float += 600 + rng() % (8 * H);
+      result.float_wakes++;
+    }
+  }
+  for (int task = 0; task < SCHED_NUM_TASKS; task++)
+  {
+    sched_cancel(task);
+  }
+  return result;
+}
+
+void describe(const char* name, const simResult& result)
+{
+  printf("%-28s timer wakes %4d, float wakes %3d, runs:", name, result.timer_wakes, result.float_wakes);
+  for (int task = 0; task < SIM_NUM_TASKS; task++)
+  {
+    printf(" %s=%d", sched_task_names[task], result.runs[task]);
+  }
+  printf(" (max early %llds)\n", (long long)result.max_early_s);
+}
+
+int main()
+{
+  setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+  tzset();
+
+  check_slots();
+  check_tolerance_cap();
+  check_coalescing();
+
+  // Hourly sensor reads, reports at 22:00, an extended check and GPS fix every 8 reports, a config poll with each report
+  //  (the "field" scenarios of waterpal_sched_sim.py)
+  const uint32_t periods[SIM_NUM_TASKS] = {H, 176 * H, 176 * H, 22 * H, 22 * H};
+  const uint32_t tolerances[SIM_NUM_TASKS] = {600, 44 * H, 44 * H, 300, 11 * H};
+  const uint32_t no_tolerances[SIM_NUM_TASKS] = {};
+  for (bool float_wakes : {false, true})
+  {
+    simResult strict = simulate(periods, no_tolerances, float_wakes);
+    simResult tolerant = simulate(periods, tolerances, float_wakes);
+    describe(float_wakes ? "field+float, no tolerance" : "field, no tolerance", strict);
+    describe(float_wakes ? "field+float, tolerance" : "field, tolerance", tolerant);
+
+    expect(strict.max_early_s == 0, "no tolerance, no early runs");
+    for (const simResult& result : {strict, tolerant})
+    {
+      expect(!result.late, "no task runs late");
+      expect(!result.too_early, "no task runs earlier than its tolerance");
+      expect(!result.off_due, "every timer wake is at a due time");
+      expect(result.runs[SCHED_TASK_REPORT] == DAYS + 1, "a report a day, DST change or not");
+    }
+    // Same work for fewer wakes: each task runs as often (the wide GPS window may fit one more run in before the end)
+    for (int task = 0; task < SIM_NUM_TASKS; task++)
+    {
+      expect(strict.runs[task] <= tolerant.runs[task] && tolerant.runs[task] <= strict.runs[task] + 1, sched_task_names[task]);
+    }
+    expect(float_wakes ? tolerant.timer_wakes < strict.timer_wakes : tolerant.timer_wakes <= strict.timer_wakes, "tolerances save timer wakes");
+  }
+
+  if (failures > 0)
+  {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("sched_check passed\n");
+  return 0;
+}
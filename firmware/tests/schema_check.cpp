@@ -0,0 +1,301 @@
+// schema_check.cpp: Checks the schema's text encoders (waterpal_schema.h) against the hand-written formatters they replaced
+// The reference formatters below are the snprintf() SMS formatter and the String-built GET query and JSON batch body from before
+//  the schema, field for field, plus the fields that have been appended to the schema since (which the old formatters never had).
+//  Fixed reports, extreme values and random ones must all come out byte for byte the same, and a short buffer must be flagged.
+#include <random>
+#include <vector>
+#include <string>
+
+#include "waterpal_schema.h"
+
+int failures = 0;
+
+void expect_same(const char* what, const char* expected, const char* actual)
+{
+  if (strcmp(expected, actual) != 0)
+  {
+    printf("FAIL: %s\n  expected: %s\n  actual:   %s\n", what, expected, actual);
+    failures++;
+  }
+}
+
+// **********
+// Reference formatters
+// **********
+
+// The SMS formatter from before the schema (int64_t is long long on the ESP32, but not necessarily on the host)
+void old_format_report_sms(char* buf, size_t size, const dailyReport& report)
+{
+  snprintf(buf, size, "1,%s,%lld,R,%lld,%lld,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%lld,%lu,%lu,%lu,%lu,%lu,%lu,%lu",
+           report.imei,
+           (long long)report.total_sms_count,
+           (long long)report.water_usage_time_s,
+           (long long)report.clock_drift_s,
+           report.temperature_low,
+           report.temperature_avg,
+           report.temperature_high,
+           report.humidity_low,
+           report.humidity_avg,
+           report.humidity_high,
+           report.signal_strength,
+           report.battery_charge_status,
+           report.battery_charge_pct,
+           report.battery_voltage_mv,
+           (long long)report.boot_count,
+           (unsigned long)report.handle_strokes_total,
+           (unsigned long)report.handle_strokes_flowing_total,
+           (unsigned long)report.handle_strokes_flowing_per_min,
+           (unsigned long)report.dry_start_count,
+           (unsigned long)report.dry_start_stroke_total,
+           (unsigned long)report.dry_start_stroke_avg,
+           (unsigned long)report.dry_start_stroke_max);
+}
+
+// The fields appended since, as "name" and value pairs in schema order
+struct appendedField
+{
+  const char* name;
+  int64_t value;
+};
+
+std::vector<appendedField> appended_fields(const dailyReport& report)
+{
+  return {
+    {"solarVoltageAvg", report.solar_voltage_avg_mv},
+    {"solarVoltageHigh", report.solar_voltage_high_mv},
+    {"solarCurrentAvg", report.solar_current_avg_ma},
+    {"solarCurrentHigh", report.solar_current_high_ma},
+    {"flow_session_count", report.flow_session_count},
+    {"flow_rate_peak_per_min", report.flow_rate_peak_per_min},
+    {"flow_monitor_s", report.flow_monitor_s},
+    {"flow_monitor_uah", report.flow_monitor_uah},
+    {"counter_read_fail_count", report.counter_read_fail_count},
+    {"channel1_usage_s", report.channel_usage_s[0]},
+    {"channel1_flow_count", report.channel_flow_count[0]},
+    {"channel2_usage_s", report.channel_usage_s[1]},
+    {"channel2_flow_count", report.channel_flow_count[1]},
+    {"channel3_usage_s", report.channel_usage_s[2]},
+    {"channel3_flow_count", report.channel_flow_count[2]},
+  };
+}
+
+// The GET query from before the schema, then the appended fields
+String old_query(const dailyReport& report)
+{
+  String url = "";
+  url += "IMEI=" + String(report.imei);
+  url += "&seq=" + String(report.seq);
+  url += "&timestamp=" + String(report.timestamp_s);
+  url += "&totalSMSCount=" + String(report.total_sms_count);
+  url += "&dailyWaterUsageTime=" + String(report.water_usage_time_s);
+  url += "&detectedClockTimeDrift=" + String(report.clock_drift_s);
+  url += "&temperatureLow=" + String(report.temperature_low);
+  url += "&temperatureAvg=" + String(report.temperature_avg);
+  url += "&temperatureHigh=" + String(report.temperature_high);
+  url += "&humidityLow=" + String(report.humidity_low);
+  url += "&humidityAvg=" + String(report.humidity_avg);
+  url += "&humidityHigh=" + String(report.humidity_high);
+  url += "&signalStrength=" + String(report.signal_strength);
+  url += "&batteryChargeStatus=" + String(report.battery_charge_status);
+  url += "&batteryChargePercent=" + String(report.battery_charge_pct);
+  url += "&batteryVoltage=" + String(report.battery_voltage_mv);
+  url += "&bootCount=" + String(report.boot_count);
+  url += "&handle_strokes_total=" + String(report.handle_strokes_total);
+  url += "&handle_strokes_flowing_total=" + String(report.handle_strokes_flowing_total);
+  url += "&handle_strokes_flowing_per_min=" + String(report.handle_strokes_flowing_per_min);
+  url += "&dry_start_count=" + String(report.dry_start_count);
+  url += "&dry_start_stroke_total=" + String(report.dry_start_stroke_total);
+  url += "&dry_start_stroke_avg=" + String(report.dry_start_stroke_avg);
+  url += "&dry_start_stroke_max=" + String(report.dry_start_stroke_max);
+  for (const appendedField& field : appended_fields(report))
+  {
+    url += "&" + String(field.name) + "=" + String(field.value);
+  }
+  return url;
+}
+
+// One report's members in the JSON batch body from before the schema, then the appended fields
+String old_json_fields(const dailyReport& report)
+{
+  String jsonPayload = "";
+  jsonPayload += "\"seq\":" + String(report.seq);
+  jsonPayload += ",\"timestamp\":" + String(report.timestamp_s);
+  jsonPayload += ",\"totalSMSCount\":" + String(report.total_sms_count);
+  jsonPayload += ",\"dailyWaterUsageTime\":" + String(report.water_usage_time_s);
+  jsonPayload += ",\"detectedClockTimeDrift\":" + String(report.clock_drift_s);
+  jsonPayload += ",\"temperatureLow\":" + String(report.temperature_low);
+  jsonPayload += ",\"temperatureAvg\":" + String(report.temperature_avg);
+  jsonPayload += ",\"temperatureHigh\":" + String(report.temperature_high);
+  jsonPayload += ",\"humidityLow\":" + String(report.humidity_low);
+  jsonPayload += ",\"humidityAvg\":" + String(report.humidity_avg);
+  jsonPayload += ",\"humidityHigh\":" + String(report.humidity_high);
+  jsonPayload += ",\"signalStrength\":" + String(report.signal_strength);
+  jsonPayload += ",\"batteryChargeStatus\":" + String(report.battery_charge_status);
+  jsonPayload += ",\"batteryChargePercent\":" + String(report.battery_charge_pct);
+  jsonPayload += ",\"batteryVoltage\":" + String(report.battery_voltage_mv);
+  jsonPayload += ",\"bootCount\":" + String(report.boot_count);
+  jsonPayload += ",\"handle_strokes_total\":" + String(report.handle_strokes_total);
+  jsonPayload += ",\"handle_strokes_flowing_total\":" + String(report.handle_strokes_flowing_total);
+  jsonPayload += ",\"handle_strokes_flowing_per_min\":" + String(report.handle_strokes_flowing_per_min);
+  jsonPayload += ",\"dry_start_count\":" + String(report.dry_start_count);
+  jsonPayload += ",\"dry_start_stroke_total\":" + String(report.dry_start_stroke_total);
+  jsonPayload += ",\"dry_start_stroke_avg\":" + String(report.dry_start_stroke_avg);
+  jsonPayload += ",\"dry_start_stroke_max\":" + String(report.dry_start_stroke_max);
+  for (const appendedField& field : appended_fields(report))
+  {
+    jsonPayload += ",\"" + String(field.name) + "\":" + String(field.value);
+  }
+  return jsonPayload;
+}
+
+// **********
+// Reports
+// **********
+
+dailyReport fixed_report()
+{
+  dailyReport report = {};
+  report.seq = 7;
+  strcpy(report.imei, "ABCDEFGHIJ+/");
+  report.timestamp_s = 1700000000;
+  report.total_sms_count = 42;
+  report.water_usage_time_s = 3600;
+  report.clock_drift_s = -5;
+  report.temperature_low = -3;
+  report.temperature_avg = 20;
+  report.temperature_high = 31;
+  report.humidity_low = 10;
+  report.humidity_avg = 50;
+  report.humidity_high = 90;
+  report.signal_strength = 70;
+  report.battery_charge_status = 1;
+  report.battery_charge_pct = 88;
+  report.battery_voltage_mv = 4100;
+  report.boot_count = 123;
+  report.handle_strokes_total = 1000;
+  report.handle_strokes_flowing_total = 800;
+  report.handle_strokes_flowing_per_min = 35;
+  report.dry_start_count = 3;
+  report.dry_start_stroke_total = 21;
+  report.dry_start_stroke_avg = 7;
+  report.dry_start_stroke_max = 9;
+  report.solar_voltage_avg_mv = 5200;
+  report.solar_current_high_ma = 310;
+  report.flow_session_count = 12;
+  report.channel_usage_s[0] = 600;
+  report.channel_flow_count[0] = 2;
+  return report;
+}
+
+dailyReport extreme_report(bool low)
+{
+  dailyReport report = {};
+  strcpy(report.imei, "////////////+++");
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    uint8_t* p = (uint8_t*)&report + report_fields[i].offset;
+    switch (report_fields[i].type)
+    {
+      case REPORT_FIELD_TYPE_INT:
+        *(int*)p = low ? INT32_MIN : INT32_MAX;
+        break;
+      case REPORT_FIELD_TYPE_INT64:
+        *(int64_t*)p = low ? INT64_MIN : INT64_MAX;
+        break;
+      case REPORT_FIELD_TYPE_UINT32:
+        *(uint32_t*)p = low ? 0 : UINT32_MAX;
+        break;
+    }
+  }
+  return report;
+}
+
+dailyReport random_report(std::mt19937& rng)
+{
+  dailyReport report = fixed_report();
+  const int64_t magnitudes[] = {10, 1000, 100000, 10000000, 1000000000};
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    uint8_t* p = (uint8_t*)&report + report_fields[i].offset;
+    int64_t v = (int64_t)(rng() % (2 * magnitudes[rng() % 5])) - (int64_t)(rng() % 2 ? 0 : magnitudes[rng() % 5]);
+    switch (report_fields[i].type)
+    {
+      case REPORT_FIELD_TYPE_INT:
+        *(int*)p = (int)v;
+        break;
+      case REPORT_FIELD_TYPE_INT64:
+        *(int64_t*)p = v * (int64_t)(rng() % 1000);
+        break;
+      case REPORT_FIELD_TYPE_UINT32:
+        *(uint32_t*)p = (uint32_t)rng();
+        break;
+    }
+  }
+  return report;
+}
+
+void check_report(const char* name, const dailyReport& report)
+{
+  char expected[512];
+  char actual[512];
+  textWriter w;
+
+  old_format_report_sms(expected, sizeof(expected), report);
+  text_init(w, actual, sizeof(actual));
+  schema_write_sms(w, report, 'R');
+  expect_same(name, expected, actual);
+
+  text_init(w, schema_text_buffer, sizeof(schema_text_buffer));
+  schema_write_query(w, report);
+  expect_same(name, old_query(report).c_str(), schema_text_buffer);
+
+  text_init(w, schema_text_buffer, sizeof(schema_text_buffer));
+  schema_write_json_fields(w, report);
+  expect_same(name, old_json_fields(report).c_str(), schema_text_buffer);
+}
+
+int main()
+{
+  static_assert(REPORT_NUM_FIELDS == 23 + 15, "A field was added to the schema: add it to appended_fields() too");
+
+  dailyReport report = fixed_report();
+  check_report("fixed report", report);
+  check_report("lowest values", extreme_report(true));
+  check_report("highest values", extreme_report(false));
+  std::mt19937 rng(1);
+  for (int i = 0; i < 1000; i++)
+  {
+    check_report("random report", random_report(rng));
+  }
+
+  // A buffer that's too short is flagged, and holds as much as fits
+  char expected[512];
+  char tiny[20];
+  textWriter w;
+  old_format_report_sms(expected, sizeof(expected), report);
+  text_init(w, tiny, sizeof(tiny));
+  schema_write_sms(w, report, 'R');
+  if (!w.overflow || strlen(tiny) != sizeof(tiny) - 1 || strncmp(tiny, expected, sizeof(tiny) - 1) != 0)
+  {
+    printf("FAIL: overflow not flagged, or not a prefix: '%s'\n", tiny);
+    failures++;
+  }
+
+  text_init(w, schema_text_buffer, sizeof(schema_text_buffer));
+  schema_write_sms(w, report, 'R');
+  printf("SMS (%zu bytes): %s\n", w.len, w.buf);
+  text_init(w, schema_text_buffer, sizeof(schema_text_buffer));
+  schema_write_query(w, report);
+  printf("Query: %zu bytes; ", w.len);
+  text_init(w, schema_text_buffer, sizeof(schema_text_buffer));
+  schema_write_json_fields(w, report);
+  printf("JSON fields: %zu bytes\n", w.len);
+
+  if (failures > 0)
+  {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("schema_check passed\n");
+  return 0;
+}
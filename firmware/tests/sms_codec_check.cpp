@@ -0,0 +1,209 @@
+// sms_codec_check.cpp: Checks the version 2 SMS packet encoder (waterpal_sms_codec.h) against its decoder, waterpal_sms_decode.py
+// Encodes fixed reports (typical, all zero, negative, and the largest values each field type holds) as "R", "A" and short "r"
+//  packets, at full length and squeezed by max_chars or by the buffer size so that fields get dropped. Each packet has to fit,
+//  keep its fields in sms_priority order, and drop fields only when it has to; one that can't fit even the header must come out empty.
+// With a directory argument, it also writes each packet there (NN.txt), and the JSON that waterpal_sms_decode.py should decode it to
+//  (NN.json) -- "make" checks them with the decoder.
+#include <string>
+
+#include "waterpal_sms_codec.h"
+
+#define NUM_REPORTS 4
+
+int failures = 0;
+
+void expect(bool ok, const char* what, const char* packet)
+{
+  if (!ok)
+  {
+    printf("FAIL: %s (%s)\n", what, packet);
+    failures++;
+  }
+}
+
+void make_reports(dailyReport* reports)
+{
+  for (int i = 0; i < NUM_REPORTS; i++)
+  {
+    reports[i] = {};
+    strcpy(reports[i].imei, "6lDdCiRp6AbC");
+  }
+
+  // A day at a pump in steady use
+  dailyReport& r = reports[0];
+  r.total_sms_count = 87;
+  r.water_usage_time_s = 3725;
+  r.clock_drift_s = 2;
+  r.temperature_low = 18;
+  r.temperature_avg = 24;
+  r.temperature_high = 33;
+  r.humidity_low = 41;
+  r.humidity_avg = 56;
+  r.humidity_high = 72;
+  r.signal_strength = 63;
+  r.battery_charge_status = 1;
+  r.battery_charge_pct = 88;
+  r.battery_voltage_mv = 4012;
+  r.boot_count = 512;
+  r.handle_strokes_total = 2210;
+  r.handle_strokes_flowing_total = 2034;
+  r.handle_strokes_flowing_per_min = 42;
+  r.dry_start_count = 6;
+  r.dry_start_stroke_total = 71;
+  r.dry_start_stroke_avg = 11;
+  r.dry_start_stroke_max = 23;
+
+  // reports[1] is all zero: only the presence bits go out
+
+  // Below-zero readings, and a clock that ran fast
+  dailyReport& n = reports[2];
+  n = r;
+  n.total_sms_count = 31;
+  n.clock_drift_s = -14;
+  n.temperature_low = -12;
+  n.temperature_avg = -3;
+  n.temperature_high = 0;
+
+  // The largest values each field type holds
+  dailyReport& x = reports[3];
+  x.total_sms_count = INT64_MAX;
+  for (size_t i = 0; i < REPORT_NUM_FIELDS; i++)
+  {
+    const reportField& field = report_fields[i];
+    void* member = (uint8_t*)&x + field.offset;
+    switch (field.type)
+    {
+      case REPORT_FIELD_TYPE_INT:    *(int*)member = i % 2 ? INT32_MIN : INT32_MAX; break;
+      case REPORT_FIELD_TYPE_INT64:  *(int64_t*)member = i % 2 ? INT64_MIN : INT64_MAX; break;
+      case REPORT_FIELD_TYPE_UINT32: *(uint32_t*)member = UINT32_MAX; break;
+    }
+  }
+}
+
+// The number of fields a packet kept, from its presence varint (the sentinel bit above the kept fields' bits)
+int packet_num_kept(const char* packet)
+{
+  const char* p = strchr(packet, ',') + 1;
+  for (int varint = 0; varint < 2; varint++)
+  {
+    uint64_t val = 0;
+    int shift = 0;
+    int digit;
+    do
+    {
+      digit = strchr(sms_codec_alphabet, *p++) - sms_codec_alphabet;
+      val |= (uint64_t)(digit & 0x1F) << shift;
+      shift += 5;
+    } while (digit & 0x20);
+    if (varint == 1)
+    {
+      int num_kept = 0;
+      while (val >>= 1)
+      {
+        num_kept++;
+      }
+      return num_kept;
+    }
+  }
+  return -1;
+}
+
+// What waterpal_sms_decode.py prints for the packet
+void write_expected(const std::string& path, const dailyReport& report, char type, const uint8_t* fields, int num_fields, int num_kept)
+{
+  FILE* f = fopen(path.c_str(), "w");
+  size_t imei_len = strlen(report.imei);
+  fprintf(f, "{\"version\": 2, \"type\": \"%c\", \"IMEI\": \"%s\", \"totalSMSCount\": %lld", type,
+          type == SMS_PACKET_SHORT ? report.imei + imei_len - 2 : report.imei,
+          (long long)(type == SMS_PACKET_SHORT ? report.total_sms_count % 32 : report.total_sms_count));
+  for (int i = 0; i < num_kept; i++)
+  {
+    const reportField& field = report_fields[fields[i]];
+    fprintf(f, ", \"%s\": %lld", field.name, (long long)schema_get_value(report, field));
+  }
+  fprintf(f, ", \"missing\": [");
+  for (int i = num_kept; i < num_fields; i++)
+  {
+    fprintf(f, "%s\"%s\"", i > num_kept ? ", " : "", report_fields[fields[i]].name);
+  }
+  fprintf(f, "]}\n");
+  fclose(f);
+}
+
+int main(int argc, char** argv)
+{
+  const char* out_dir = argc > 1 ? argv[1] : NULL;
+  dailyReport reports[NUM_REPORTS];
+  make_reports(reports);
+
+  uint8_t fields[SMS_CODEC_MAX_FIELDS];
+  int num_fields = sms_codec_fields_by_priority(fields);
+
+  // Packet type, max_chars, and buffer size: the squeezed ones drop fields
+  const struct { char type; size_t max_chars; size_t size; } formats[] = {
+    {SMS_PACKET_REGULAR, WATERPAL_SMS_MAX_CHARS, 256},
+    {SMS_PACKET_ALERT, WATERPAL_SMS_MAX_CHARS, 256},
+    {SMS_PACKET_SHORT, WATERPAL_SMS_SHORT_MAX_CHARS, 256},
+    {SMS_PACKET_REGULAR, 40, 256},
+    {SMS_PACKET_REGULAR, 30, 256},
+    {SMS_PACKET_REGULAR, WATERPAL_SMS_MAX_CHARS, 33},
+  };
+
+  int num_packets = 0;
+  for (const dailyReport& report : reports)
+  {
+    for (const auto& format : formats)
+    {
+      char buf[256];
+      size_t len = sms_codec_encode(buf, format.size, report, format.type, format.max_chars);
+      expect(len == strlen(buf) && len > 0, "encoded", buf);
+      if (len == 0)
+      {
+        continue;
+      }
+      int num_kept = packet_num_kept(buf);
+      printf("%-3zu %2d/%d fields  %s\n", len, num_kept, num_fields, buf);
+
+      expect(len <= format.max_chars && len < format.size, "fits", buf);
+      if (num_kept < num_fields)
+      {
+        // Only dropped what it had to: one more field wouldn't have fit. That's its value, plus a presence digit when the
+        //  sentinel bit moves up into the next one.
+        char bigger[512];
+        textWriter w;
+        text_init(w, bigger, sizeof(bigger));
+        text_put(w, buf);
+        int64_t val = schema_get_value(report, report_fields[fields[num_kept]]);
+        if (val != 0)
+        {
+          sms_codec_put_varint(w, sms_codec_zigzag(val));
+        }
+        size_t more_len = w.len + (num_kept % 5 == 4);
+        expect(more_len > format.max_chars || more_len >= format.size, "kept as many fields as fit", buf);
+      }
+
+      if (out_dir != NULL)
+      {
+        std::string path = std::string(out_dir) + "/" + (num_packets < 10 ? "0" : "") + std::to_string(num_packets);
+        FILE* f = fopen((path + ".txt").c_str(), "w");
+        fputs(buf, f);
+        fclose(f);
+        write_expected(path + ".json", report, format.type, fields, num_fields, num_kept);
+      }
+      num_packets++;
+    }
+  }
+
+  // Too short for the header, let alone any fields
+  char buf[256];
+  expect(sms_codec_encode(buf, sizeof(buf), reports[0], SMS_PACKET_REGULAR, 10) == 0 && buf[0] == '\0', "empty when the header doesn't fit", "max_chars 10");
+  expect(sms_codec_encode(buf, 12, reports[0], SMS_PACKET_REGULAR, WATERPAL_SMS_MAX_CHARS) == 0 && buf[0] == '\0', "empty when the header doesn't fit", "12 byte buffer");
+
+  if (failures > 0)
+  {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("sms_codec_check passed\n");
+  return 0;
+}
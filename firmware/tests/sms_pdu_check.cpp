@@ -0,0 +1,154 @@
+// sms_pdu_check.cpp: Checks the binary SMS PDUs (waterpal_sms_pdu.h) against their decoder, waterpal_sms_pdu.py
+// Sends data across the single and multi-part boundaries (140 bytes in one SMS, 134 per concatenated part) to international ("+"),
+//  national, odd and even length numbers through a scripted stand-in modem, and checks the AT commands: each part's +CMGS length
+//  matches its PDU, and the modem is back in text mode (+CMGF=1) after every attempt, including those that fail.
+// With a directory argument, it also writes each message's PDUs there (NN.pdu), and the JSON that "waterpal_sms_pdu.py --data"
+//  should reassemble them to (NN.json) -- "make" checks them with the decoder.
+#include <string>
+
+#include <Arduino.h>
+#include <TinyGsmClient.h>
+
+TinyGsm modem;
+
+void watchdog_pet() {}
+int8_t modem_get_signal_quality() { return 20; }
+
+#include "waterpal_error_logging.h"
+#include "waterpal_sms_pdu.h"
+
+int failures = 0;
+
+void expect(bool ok, const char* what, const char* number, size_t len)
+{
+  if (!ok)
+  {
+    printf("FAIL: %s (%zu bytes to %s)\n", what, len, number);
+    failures++;
+  }
+}
+
+// The PDUs the modem was sent, one per Ctrl-Z
+std::vector<std::string> sent_pdus()
+{
+  std::vector<std::string> pdus;
+  size_t start = 0, end;
+  while ((end = modem.stream.written.find((char)0x1A, start)) != std::string::npos)
+  {
+    pdus.push_back(modem.stream.written.substr(start, end - start));
+    start = end + 1;
+  }
+  return pdus;
+}
+
+void reset_modem()
+{
+  modem.commands.clear();
+  modem.responses.clear();
+  modem.stream.written.clear();
+}
+
+int main(int argc, char** argv)
+{
+  const char* out_dir = argc > 1 ? argv[1] : NULL;
+
+  uint8_t data[SMS_PDU_MAX_PART_DATA * WATERPAL_SMS_BINARY_MAX_PARTS + 1];
+  for (size_t i = 0; i < sizeof(data); i++)
+  {
+    data[i] = i * 37 + (i >> 8); // Every byte value, Ctrl-Z and Esc included
+  }
+
+  expect(sms_pdu_num_parts(1) == 1 && sms_pdu_num_parts(SMS_PDU_MAX_DATA) == 1, "one part up to 140 bytes", "", SMS_PDU_MAX_DATA);
+  expect(sms_pdu_num_parts(SMS_PDU_MAX_DATA + 1) == 2, "two parts past 140 bytes", "", SMS_PDU_MAX_DATA + 1);
+  expect(sms_pdu_num_parts(2 * SMS_PDU_MAX_PART_DATA) == 2, "two parts up to 268 bytes", "", 2 * SMS_PDU_MAX_PART_DATA);
+  expect(sms_pdu_num_parts(2 * SMS_PDU_MAX_PART_DATA + 1) == 3, "three parts past 268 bytes", "", 2 * SMS_PDU_MAX_PART_DATA + 1);
+  expect(sms_pdu_build("5551234", data, SMS_PDU_MAX_DATA + 1, 0, 1, 1) == 0, "too long for one SMS", "5551234", SMS_PDU_MAX_DATA + 1);
+  expect(sms_pdu_build("5551234", data, SMS_PDU_MAX_PART_DATA + 1, 0, 1, 2) == 0, "too long for one part", "5551234", SMS_PDU_MAX_PART_DATA + 1);
+  expect(sms_pdu_build("+123456789012345678901", data, 1, 0, 1, 1) == 0, "number too long", "+123456789012345678901", 1);
+
+  // Number, and data length
+  const struct { const char* number; size_t len; } messages[] = {
+    {"+15551234567", 1},
+    {"5551234", SMS_PDU_MAX_DATA},
+    {"+447700900123", SMS_PDU_MAX_DATA + 1},
+    {"0123456789", 2 * SMS_PDU_MAX_PART_DATA},
+    {"+15551234567", 2 * SMS_PDU_MAX_PART_DATA + 1},
+    {"+12345678901234567890", WATERPAL_SMS_BINARY_MAX_PARTS * SMS_PDU_MAX_PART_DATA},
+  };
+
+  int num_messages = 0;
+  for (const auto& message : messages)
+  {
+    reset_modem();
+    bool sent = sms_pdu_send_binary(message.number, data, message.len, 1);
+    std::vector<std::string> pdus = sent_pdus();
+    int parts = sms_pdu_num_parts(message.len);
+    size_t pdu_bytes = 0;
+    for (const std::string& pdu : pdus)
+    {
+      pdu_bytes += pdu.size() / 2;
+    }
+    printf("%3zu bytes to %-22s %d parts, %zu PDU bytes\n", message.len, message.number, parts, pdu_bytes);
+
+    expect(sent, "sent", message.number, message.len);
+    expect(pdus.size() == parts && modem.commands.size() == 3 * parts, "one PDU per part", message.number, message.len);
+    for (size_t i = 0; i < pdus.size() && 3 * i + 2 < modem.commands.size(); i++)
+    {
+      expect(modem.commands[3 * i] == "+CMGF=0" && modem.commands[3 * i + 2] == "+CMGF=1", "PDU mode for each part, text mode after", message.number, message.len);
+      expect(modem.commands[3 * i + 1] == "+CMGS=" + std::to_string(pdus[i].size() / 2 - 1), "+CMGS length is the TPDU length", message.number, message.len);
+    }
+
+    if (out_dir != NULL)
+    {
+      std::string path = std::string(out_dir) + "/" + (num_messages < 10 ? "0" : "") + std::to_string(num_messages);
+      FILE* f = fopen((path + ".pdu").c_str(), "w");
+      for (const std::string& pdu : pdus)
+      {
+        fprintf(f, "%s\n", pdu.c_str());
+      }
+      fclose(f);
+      f = fopen((path + ".json").c_str(), "w");
+      fprintf(f, "{\"to\": \"%s\", \"parts\": %d, \"data\": \"", message.number, parts);
+      for (size_t i = 0; i < message.len; i++)
+      {
+        fprintf(f, "%02x", data[i]);
+      }
+      fprintf(f, "\"}\n");
+      fclose(f);
+    }
+    num_messages++;
+  }
+
+  // More parts than WATERPAL_SMS_BINARY_MAX_PARTS: nothing goes out
+  reset_modem();
+  expect(!sms_pdu_send_binary("5551234", data, sizeof(data), 1) && modem.commands.empty(), "too many parts", "5551234", sizeof(data));
+
+  // Failures at each step leave the modem in text mode
+  const struct { const char* what; std::deque<int> responses; size_t num_commands; bool pdu_written; } failed_sends[] = {
+    {"+CMGF=0 fails", {0}, 2, false},
+    {"no +CMGS prompt", {1, 0}, 3, false},
+    {"+CMGS fails", {1, 1, 0}, 3, true},
+  };
+  int tpdu_len = sms_pdu_build("5551234", data, 10, 0, 1, 1);
+  for (const auto& failed : failed_sends)
+  {
+    reset_modem();
+    modem.responses = failed.responses;
+    bool sent = sms_pdu_send(tpdu_len);
+    expect(!sent && modem.commands.size() == failed.num_commands && modem.commands.back() == "+CMGF=1", failed.what, "5551234", 10);
+    expect(sent_pdus().empty() != failed.pdu_written, failed.what, "5551234", 10);
+  }
+
+  // A failed part is retried
+  reset_modem();
+  modem.responses = {0, 1};
+  expect(sms_pdu_send_binary("5551234", data, 10, 2) && sent_pdus().size() == 1 && modem.commands.size() == 5, "retried", "5551234", 10);
+
+  if (failures > 0)
+  {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("sms_pdu_check passed\n");
+  return 0;
+}
@@ -0,0 +1,125 @@
+// stats_check.cpp: Checks statsAccumulator (waterpal_stats.h) against exact statistics of the same readings
+// Each run feeds a day-like temperature series (a daily swing plus noise, in DHT22 tenths, with outliers in every third run) to an
+//  accumulator and to a plain array, and compares. Mean, min and max must be exact, the variance within float rounding, and the
+//  P-squared median close in rank: the fraction of readings that fall between the estimate and the true median.
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "waterpal_stats.h"
+
+typedef statsAccumulator<int16_t, 10> tenthsStats;
+
+#define RUNS 200
+
+int failures = 0;
+
+void expect(bool ok, const char* what, int n)
+{
+  if (!ok)
+  {
+    printf("FAIL: %s (n=%d)\n", what, n);
+    failures++;
+  }
+}
+
+int main()
+{
+  printf("statsAccumulator<int16_t, 10>: %zu bytes\n", sizeof(tenthsStats));
+
+  std::mt19937 rng(1);
+  // n, and the worst average median rank error allowed
+  const struct { int n; double max_avg_rank_error; } sizes[] = {{1, 0}, {3, 0}, {5, 0}, {24, 0.06}, {96, 0.03}, {240, 0.02}, {2000, 0.02}};
+  for (const auto& size : sizes)
+  {
+    int n = size.n;
+    double worst_mean = 0, worst_var = 0, worst_rank = 0, sum_rank = 0;
+    for (int run = 0; run < RUNS; run++)
+    {
+      tenthsStats stats;
+      stats.reset();
+      std::vector<double> readings;
+      std::normal_distribution<double> noise(0, 2.0);
+      double base = 15 + run % 20;
+      for (int i = 0; i < n; i++)
+      {
+        double x = round((base + 6 * sin(2 * M_PI * i / 24.0) + noise(rng)) * 10) / 10;
+        if (run % 3 == 0 && i % 17 == 5)
+        {
+          x += 25;
+        }
+        readings.push_back(x);
+        stats.add(x);
+      }
+      stats.add(NAN); // Failed reads are skipped
+
+      std::vector<double> sorted = readings;
+      std::sort(sorted.begin(), sorted.end());
+      double median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+      double mean = 0;
+      for (double x : readings)
+      {
+        mean += x;
+      }
+      mean /= n;
+      double var = 0;
+      for (double x : readings)
+      {
+        var += (x - mean) * (x - mean);
+      }
+      var = n > 1 ? var / (n - 1) : 0;
+
+      expect(stats.count == n, "count", n);
+      expect(fabs(stats.low() - sorted[0]) < 1e-4, "min", n);
+      expect(fabs(stats.high() - sorted[n - 1]) < 1e-4, "max", n);
+      worst_mean = std::max(worst_mean, fabs(stats.mean() - mean));
+      worst_var = std::max(worst_var, fabs(stats.variance() - var) / (var > 0 ? var : 1));
+
+      double estimate = stats.median();
+      int between = 0;
+      for (double x : readings)
+      {
+        if (x > std::min(estimate, median) && x < std::max(estimate, median))
+        {
+          between++;
+        }
+      }
+      worst_rank = std::max(worst_rank, (double)between / n);
+      sum_rank += (double)between / n;
+      if (n <= STATS_NUM_MARKERS)
+      {
+        expect(fabs(estimate - median) < 1e-4, "median is exact", n);
+      }
+    }
+    printf("n=%5d: worst mean error %.2e, worst relative variance error %.2e, median rank error %.1f%% average, %.1f%% worst\n",
+           n, worst_mean, worst_var, 100 * sum_rank / RUNS, 100 * worst_rank);
+    expect(worst_mean < 1e-4, "mean", n);
+    expect(worst_var < 1e-6, "variance", n);
+    expect(sum_rank / RUNS <= size.max_avg_rank_error, "median rank error", n);
+  }
+
+  // Readings outside the type's range are clamped rather than wrapped, and an empty accumulator reads 0
+  tenthsStats stats;
+  stats.reset();
+  expect(stats.mean() == 0 && stats.median() == 0 && stats.variance() == 0, "empty", 0);
+  stats.add(1e6);
+  stats.add(-1e6);
+  expect(stats.high() == 3276.7f && stats.low() == -3276.8f, "clamping", 2);
+
+  // The sums stay exact up to the last reading count takes, at the top of the type's range (as for the flow monitor's rates)
+  statsAccumulator<uint16_t, 1> rates;
+  rates.reset();
+  for (int i = 0; i < UINT16_MAX + 10; i++)
+  {
+    rates.add(UINT16_MAX);
+  }
+  expect(rates.count == UINT16_MAX && rates.mean() == UINT16_MAX && rates.variance() == 0, "uint16_t sums", UINT16_MAX);
+
+  if (failures > 0)
+  {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("stats_check passed\n");
+  return 0;
+}
@@ -0,0 +1,144 @@
+# Minimal stand-in for the WaterPAL CoAP report collector (see waterpal_coap.h)
+# Verifies each report's HMAC and sequence number, ACKs it, and prints the decoded report as JSON.
+import sys
+import argparse
+import hashlib
+import hmac
+import json
+import socket
+
+from waterpal_decode import decode_payload, ReportStore
+
+COAP_TYPE_CON = 0
+COAP_TYPE_ACK = 2
+COAP_TYPE_RST = 3
+COAP_PAYLOAD_MARKER = 0xFF
+HMAC_LEN = 16
+
+# Response codes (class << 5 | detail)
+COAP_CODE_CHANGED = (2 << 5) | 4
+COAP_CODE_BAD_REQUEST = (4 << 5) | 0
+COAP_CODE_UNAUTHORIZED = (4 << 5) | 1
+COAP_CODE_FORBIDDEN = (4 << 5) | 3
+
+def coap_response(msg_type, code, message_id):
+    return bytes([(1 << 6) | (msg_type << 4), code, message_id >> 8, message_id & 0xFF])
+
+def parse_message(data):
+    # Returns (type, token length, code, message ID, payload), or None if the message is malformed
+    if len(data) < 4 or data[0] >> 6 != 1:
+        return None
+    msg_type = (data[0] >> 4) & 0x03
+    token_len = data[0] & 0x0F
+    code = data[1]
+    message_id = (data[2] << 8) | data[3]
+
+    pos = 4 + token_len
+    while pos < len(data) and data[pos] != COAP_PAYLOAD_MARKER:
+        nibbles = [data[pos] >> 4, data[pos] & 0x0F]
+        pos += 1
+        # Extended delta, then extended length (13: one more byte, 14: two more bytes)
+        for i, nibble in enumerate(nibbles):
+            if nibble == 13:
+                nibbles[i] = data[pos] + 13
+                pos += 1
+            elif nibble == 14:
+                nibbles[i] = ((data[pos] << 8) | data[pos + 1]) + 269
+                pos += 2
+            elif nibble == 15:
+                return None
+        pos += nibbles[1]
+
+    payload = data[pos + 1:] if pos < len(data) else b''
+    return msg_type, token_len, code, message_id, payload
+
+class Collector:
+    def __init__(self, key):
+        self.key = key
+        self.last_seq = {}       # IMEI -> last accepted sequence number
+        self.last_datagram = {}  # IMEI -> last accepted datagram, to re-ACK retransmissions
+        self.store = ReportStore()
+        self.reports = 0
+        self.bytes_received = 0
+        self.bytes_sent = 0
+
+    def handle(self, data):
+        # Returns the response datagram (or None to stay silent)
+        self.bytes_received += len(data)
+        msg = parse_message(data)
+        if msg is None:
+            print('Ignoring malformed datagram')
+            return None
+        msg_type, token_len, code, message_id, payload = msg
+        if msg_type != COAP_TYPE_CON:
+            return None
+        if token_len != 0:
+            # The device never sends a token, so we don't echo one
+            return coap_response(COAP_TYPE_RST, 0, message_id)
+
+        if len(payload) < 4 + HMAC_LEN:
+            return coap_response(COAP_TYPE_ACK, COAP_CODE_BAD_REQUEST, message_id)
+
+        signed, mac = data[:-HMAC_LEN], data[-HMAC_LEN:]
+        expected = hmac.new(self.key, signed, hashlib.sha256).digest()[:HMAC_LEN]
+        if not hmac.compare_digest(mac, expected):
+            print(f'Bad HMAC on message {message_id}')
+            return coap_response(COAP_TYPE_ACK, COAP_CODE_UNAUTHORIZED, message_id)
+
+        seq = int.from_bytes(payload[:4], 'big')
+        try:
+            report = decode_payload(payload[4:-HMAC_LEN])
+        except (ValueError, IndexError, KeyError) as e:
+            print(f'Bad CBOR in message {message_id}: {e}')
+            return coap_response(COAP_TYPE_ACK, COAP_CODE_BAD_REQUEST, message_id)
+
+        imei = report.get('IMEI', '')
+        if seq <= self.last_seq.get(imei, 0):
+            if self.last_datagram.get(imei) == data:
+                # Retransmission because our ACK was lost
+                print(f'Re-ACKing retransmitted message {message_id} (seq {seq}) from {imei}')
+                return coap_response(COAP_TYPE_ACK, COAP_CODE_CHANGED, message_id)
+            print(f'Rejecting replayed seq {seq} from {imei} (last accepted: {self.last_seq[imei]})')
+            return coap_response(COAP_TYPE_ACK, COAP_CODE_FORBIDDEN, message_id)
+
+        self.last_seq[imei] = seq
+        self.last_datagram[imei] = data
+        self.reports += 1
+        print(f'Accepted seq {seq} from {imei} ({len(data)} bytes):')
+        for r in report.get('reports', []):
+            try:
+                print(json.dumps(self.store.reconstruct(imei, r), indent=2))
+            except ValueError as e:
+                # Authenticated, so still ACK it -- the next full report fills in the gap
+                print(f'{e}; partial report:')
+                print(json.dumps(r, indent=2))
+        return coap_response(COAP_TYPE_ACK, COAP_CODE_CHANGED, message_id)
+
+def main():
+    parser = argparse.ArgumentParser(description='Run a local stand-in for the WaterPAL CoAP report collector.')
+    parser.add_argument('--key', type=str, required=True, help='HMAC key (WATERPAL_COAP_HMAC_KEY).')
+    parser.add_argument('--host', type=str, default='0.0.0.0', help='Address to listen on.')
+    parser.add_argument('--port', type=int, default=5683, help='UDP port to listen on (WATERPAL_COAP_PORT).')
+    args = parser.parse_args()
+
+    collector = Collector(args.key.encode('utf-8'))
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((args.host, args.port))
+    print(f'Listening on {args.host}:{args.port}')
+
+    try:
+        while True:
+            data, addr = sock.recvfrom(2048)
+            response = collector.handle(data)
+            if response is not None:
+                sock.sendto(response, addr)
+                collector.bytes_sent += len(response)
+    except KeyboardInterrupt:
+        pass
+
+    if collector.reports > 0:
+        total = collector.bytes_received + collector.bytes_sent
+        print(f'{collector.reports} reports, {total} bytes on the wire ({total // collector.reports} bytes per report)')
+
+if __name__ == '__main__':
+    main()
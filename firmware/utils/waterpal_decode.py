@@ -0,0 +1,280 @@
+# Decode a compact (CBOR, optionally heatshrink-compressed) WaterPAL upload into JSON
+# See waterpal_payload.h and fields.md for the format.
+import sys
+import argparse
+import json
+
+# Heatshrink parameters used by the firmware (waterpal_heatshrink.h)
+HEATSHRINK_WINDOW_BITS = 8
+HEATSHRINK_LOOKAHEAD_BITS = 4
+
+PAYLOAD_KEYS = {
+    0: 'IMEI',
+    1: 'reports',
+}
+
+# Integer report keys: the index of each field in report_fields[] (waterpal_schema.h)
+REPORT_KEYS = [
+    'seq',
+    'timestamp',
+    'totalSMSCount',
+    'dailyWaterUsageTime',
+    'detectedClockTimeDrift',
+    'temperatureLow',
+    'temperatureAvg',
+    'temperatureHigh',
+    'humidityLow',
+    'humidityAvg',
+    'humidityHigh',
+    'signalStrength',
+    'batteryChargeStatus',
+    'batteryChargePercent',
+    'batteryVoltage',
+    'bootCount',
+    'handle_strokes_total',
+    'handle_strokes_flowing_total',
+    'handle_strokes_flowing_per_min',
+    'dry_start_count',
+    'dry_start_stroke_total',
+    'dry_start_stroke_avg',
+    'dry_start_stroke_max',
+    'solarVoltageAvg',
+    'solarVoltageHigh',
+    'solarCurrentAvg',
+    'solarCurrentHigh',
+    'flow_session_count',
+    'flow_rate_peak_per_min',
+    'flow_monitor_s',
+    'flow_monitor_uah',
+    'counter_read_fail_count',
+    'channel1_usage_s',
+    'channel1_flow_count',
+    'channel2_usage_s',
+    'channel2_flow_count',
+    'channel3_usage_s',
+    'channel3_flow_count',
+]
+
+# Extra report keys (PAYLOAD_REPORT_KEY_BASE, PAYLOAD_REPORT_KEY_SESSIONS and PAYLOAD_REPORT_KEY_USAGE in waterpal_payload.h)
+REPORT_EXTRA_KEYS = {
+    -1: 'base',
+    -2: 'sessions',
+    -3: 'usageBuckets',
+}
+
+def report_key_name(key):
+    if key in REPORT_EXTRA_KEYS:
+        return REPORT_EXTRA_KEYS[key]
+    return REPORT_KEYS[key] if 0 <= key < len(REPORT_KEYS) else str(key)
+
+def read_varint(data, pos):
+    val = 0
+    shift = 0
+    while True:
+        if pos >= len(data):
+            raise ValueError('Data ends in the middle of a varint')
+        b = data[pos]
+        pos += 1
+        val |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            return val, pos
+
+def decode_sessions(data, timestamp):
+    # Flow sessions (waterpal_flowlog.h): seven varints each -- the start (for the first, seconds before the report's timestamp;
+    #  after that, seconds after the previous start), duration, flowing strokes, dry-start strokes plus one (0 if no dry start),
+    #  peak and median strokes per minute (0 if the flow wasn't monitored), and the estimated time to flow (0 if unknown)
+    sessions = []
+    pos = 0
+    start = None
+    while pos < len(data):
+        gap, pos = read_varint(data, pos)
+        duration, pos = read_varint(data, pos)
+        strokes, pos = read_varint(data, pos)
+        dry, pos = read_varint(data, pos)
+        peak, pos = read_varint(data, pos)
+        median, pos = read_varint(data, pos)
+        time_to_flow, pos = read_varint(data, pos)
+        start = timestamp - gap if start is None else start + gap
+        sessions.append({
+            'start': start,
+            'duration': duration,
+            'flowingStrokes': strokes,
+            'dryStartStrokes': dry - 1 if dry > 0 else None,
+            'ratePeakPerMin': peak,
+            'rateMedianPerMin': median,
+            'timeToFlow': time_to_flow,
+        })
+    return sessions
+
+def decode_usage_buckets(data):
+    # Usage by time of day (waterpal_usage.h): the number of buckets, a bitmap of the non-empty ones (bucket 0 is the low bit of the
+    #  first byte), then seconds and strokes as varints for each non-empty bucket
+    num_buckets = data[0]
+    bitmap_len = (num_buckets + 7) // 8
+    pos = 1 + bitmap_len
+    buckets = []
+    for i in range(num_buckets):
+        if data[1 + i // 8] & (1 << (i % 8)):
+            seconds, pos = read_varint(data, pos)
+            strokes, pos = read_varint(data, pos)
+        else:
+            seconds, strokes = 0, 0
+        buckets.append({'seconds': seconds, 'strokes': strokes})
+    return buckets
+
+def decode_report(report):
+    report = {report_key_name(k): v for k, v in report.items()}
+    if 'sessions' in report:
+        report['sessions'] = decode_sessions(report['sessions'], report['timestamp'])
+    if 'usageBuckets' in report:
+        report['usageBuckets'] = decode_usage_buckets(report['usageBuckets'])
+    return report
+
+class ReportStore:
+    # Full reports received so far, by IMEI and sequence number, for filling in delta reports (see waterpal_delta.h)
+    def __init__(self, records=None):
+        self.records = records if records is not None else {}
+
+    def reconstruct(self, imei, report):
+        # Returns the full report. A delta report ('base' key) takes every field it doesn't have from the report it names.
+        #  Flow sessions and usage buckets belong to their own report, so they are never filled in (or stored).
+        report = dict(report)
+        base_seq = report.pop('base', None)
+        own = {key: report.pop(key) for key in ('sessions', 'usageBuckets') if key in report}
+        if base_seq is not None:
+            base = self.records.get(imei, {}).get(str(base_seq))
+            if base is None:
+                raise ValueError(f'Delta report {report.get("seq")} from {imei} is relative to report {base_seq}, which we do not have')
+            full = dict(base)
+            full.update(report)
+            report = full
+        self.records.setdefault(imei, {})[str(report['seq'])] = report
+        if own:
+            report = dict(report, **own)
+        return report
+
+def heatshrink_decompress(data, window_bits=HEATSHRINK_WINDOW_BITS, lookahead_bits=HEATSHRINK_LOOKAHEAD_BITS):
+    bits_left = len(data) * 8
+    bit_pos = 0
+
+    def get_bits(num_bits):
+        nonlocal bit_pos, bits_left
+        if num_bits > bits_left:
+            return None
+        val = 0
+        for _ in range(num_bits):
+            byte = data[bit_pos // 8]
+            val = (val << 1) | ((byte >> (7 - (bit_pos % 8))) & 1)
+            bit_pos += 1
+        bits_left -= num_bits
+        return val
+
+    out = bytearray()
+    while True:
+        tag = get_bits(1)
+        if tag is None:
+            break
+        if tag == 1:
+            byte = get_bits(8)
+            if byte is None:
+                break
+            out.append(byte)
+        else:
+            offset = get_bits(window_bits)
+            count = get_bits(lookahead_bits)
+            if offset is None or count is None:
+                # Zero padding at the end of the last byte
+                break
+            offset += 1
+            count += 1
+            if offset > len(out):
+                raise ValueError(f'Back-reference offset {offset} is before the start of the data')
+            for _ in range(count):
+                out.append(out[-offset])
+    return bytes(out)
+
+def cbor_decode(data):
+    def decode_item(pos):
+        initial = data[pos]
+        major = initial >> 5
+        info = initial & 0x1F
+        pos += 1
+        if info < 24:
+            arg = info
+        elif info in (24, 25, 26, 27):
+            num_bytes = 1 << (info - 24)
+            arg = int.from_bytes(data[pos:pos + num_bytes], 'big')
+            pos += num_bytes
+        else:
+            raise ValueError(f'Unsupported CBOR additional info {info} at offset {pos - 1}')
+
+        if major == 0:
+            return arg, pos
+        if major == 1:
+            return -1 - arg, pos
+        if major == 2:
+            return bytes(data[pos:pos + arg]), pos + arg
+        if major == 3:
+            return data[pos:pos + arg].decode('utf-8'), pos + arg
+        if major == 4:
+            items = []
+            for _ in range(arg):
+                item, pos = decode_item(pos)
+                items.append(item)
+            return items, pos
+        if major == 5:
+            items = {}
+            for _ in range(arg):
+                key, pos = decode_item(pos)
+                val, pos = decode_item(pos)
+                items[key] = val
+            return items, pos
+        raise ValueError(f'Unsupported CBOR major type {major} at offset {pos - 1}')
+
+    item, pos = decode_item(0)
+    if pos != len(data):
+        raise ValueError(f'{len(data) - pos} trailing bytes after CBOR item')
+    return item
+
+def decode_payload(data, compressed=False):
+    if compressed:
+        data = heatshrink_decompress(data)
+    payload = cbor_decode(data)
+
+    result = {}
+    for key, val in payload.items():
+        name = PAYLOAD_KEYS.get(key, str(key))
+        if name == 'reports':
+            val = [decode_report(report) for report in val]
+        result[name] = val
+    return result
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a compact WaterPAL upload (application/cbor) into JSON.')
+    parser.add_argument('input_file', type=str, help='File containing the raw request body, or - for stdin.')
+    parser.add_argument('--heatshrink', action='store_true', help='The body is heatshrink compressed (Content-Encoding: x-heatshrink).')
+    parser.add_argument('--state', type=str, help='JSON file of reports received so far, used to fill in delta reports (and updated with these).')
+    args = parser.parse_args()
+
+    if args.input_file == '-':
+        data = sys.stdin.buffer.read()
+    else:
+        with open(args.input_file, 'rb') as f:
+            data = f.read()
+
+    result = decode_payload(data, args.heatshrink)
+    if args.state:
+        try:
+            with open(args.state) as f:
+                store = ReportStore(json.load(f))
+        except FileNotFoundError:
+            store = ReportStore()
+        result['reports'] = [store.reconstruct(result['IMEI'], report) for report in result['reports']]
+        with open(args.state, 'w') as f:
+            json.dump(store.records, f)
+
+    print(json.dumps(result, indent=2))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,472 @@
+# Make, apply and sign the delta firmware patches that WATERPAL_USE_OTA downloads (see waterpal_ota.h for the format).
+#
+#  keygen KEY.pem                        Make a signing key, and print the public key for WATERPAL_OTA_PUBLIC_KEY
+#  diff OLD.bin NEW.bin OUT.wpd          Make a patch
+#  apply OLD.bin PATCH.wpd OUT.bin       Apply a patch (the same way the firmware does)
+#  release --key KEY.pem --dir DIR --to VERSION NEW.bin OLD.bin:VERSION ...
+#                                        Make a patch and signed manifest from each old version to the new one, for waterpal_ota_server.py
+#
+# Signing uses the openssl command line tool.
+import sys
+import os
+import argparse
+import hashlib
+import random
+import struct
+import subprocess
+import tempfile
+
+MAGIC = b'WPD1'
+HEADER_LEN = 12
+
+OP_COPY = 1
+OP_ADD = 2
+OP_INSERT = 3
+
+FLASH_SECTOR_SIZE = 4096
+OUT_BUFFER_SIZE = 256
+
+# Matching
+BLOCK = 8         # Bytes hashed to find candidate matches
+STRIDE = 4        # Index every STRIDE'th position of the old image
+MAX_CANDIDATES = 8
+MIN_MATCH = 16    # Shorter exact matches go out as inserted bytes
+MAX_MISMATCH_LEAD = 32 # Stop extending an ADD once the mismatches lead the matches by this much
+
+def put_varint(val):
+    out = bytearray()
+    while True:
+        b = val & 0x7F
+        val >>= 7
+        if val:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+def zigzag(val):
+    return (val << 1) ^ (val >> 31) if val >= 0 else ((-val) << 1) - 1
+
+def match_len(a, ai, b, bi):
+    n = min(len(a) - ai, len(b) - bi)
+    length = 0
+    step = 256
+    while length + step <= n and a[ai + length:ai + length + step] == b[bi + length:bi + length + step]:
+        length += step
+    while length < n and a[ai + length] == b[bi + length]:
+        length += 1
+    return length
+
+def approx_extend(old, oi, new, ni):
+    # How far past an exact match the same alignment keeps matching more often than not (bsdiff style)
+    score = best = best_len = 0
+    k = 0
+    while oi + k < len(old) and ni + k < len(new):
+        score += 1 if old[oi + k] == new[ni + k] else -1
+        k += 1
+        if score > best:
+            best, best_len = score, k
+        elif score < best - MAX_MISMATCH_LEAD:
+            break
+    return best_len
+
+def encode_add(old, src, new, start, length):
+    out = bytearray()
+    diff = bytes((new[start + k] - old[src + k]) & 0xFF for k in range(length))
+    pos = 0
+    while pos < length:
+        zero_run = 0
+        while pos + zero_run < length and diff[pos + zero_run] == 0:
+            zero_run += 1
+        out += put_varint(zero_run)
+        pos += zero_run
+        if pos == length:
+            break
+        lit = 0
+        while pos + lit < length and diff[pos + lit] != 0:
+            lit += 1
+        out += put_varint(lit) + diff[pos:pos + lit]
+        pos += lit
+    return bytes(out)
+
+def make_patch(old, new):
+    index = {}
+    for i in range(0, len(old) - BLOCK + 1, STRIDE):
+        index.setdefault(old[i:i + BLOCK], []).append(i)
+
+    out = bytearray(MAGIC + struct.pack('<II', len(old), len(new)))
+    src = 0         # Source offset the decoder will be at
+    lit_start = 0   # Start of the bytes not covered by an op yet
+    i = 0
+
+    def flush_insert(end):
+        nonlocal out
+        if end > lit_start:
+            out += bytes([OP_INSERT]) + put_varint(end - lit_start) + new[lit_start:end]
+
+    while i < len(new):
+        best_len, best_src, best_back = 0, 0, 0
+        for cand in index.get(new[i:i + BLOCK], [])[-MAX_CANDIDATES:]:
+            length = match_len(old, cand, new, i)
+            back = 0
+            while back < i - lit_start and back < cand and old[cand - back - 1] == new[i - back - 1]:
+                back += 1
+            if length + back > best_len:
+                best_len, best_src, best_back = length + back, cand - back, back
+        if best_len < MIN_MATCH:
+            i += 1
+            continue
+
+        start = i - best_back
+        flush_insert(start)
+        extra = approx_extend(old, best_src + best_len, new, start + best_len)
+        length = best_len + extra
+        op_src = zigzag(best_src - src)
+        if extra == 0:
+            out += bytes([OP_COPY]) + put_varint(length) + put_varint(op_src)
+        else:
+            out += bytes([OP_ADD]) + put_varint(length) + put_varint(op_src) + encode_add(old, best_src, new, start, length)
+        src = best_src + length
+        i = lit_start = start + length
+
+    flush_insert(len(new))
+    return bytes(out)
+
+class PatchError(Exception):
+    pass
+
+class Applier:
+    # The firmware's decoder (waterpal_ota.h), one patch byte at a time, including its checkpoints: state is everything
+    #  the firmware keeps in RTC memory, and checkpoint is a copy of it taken whenever the output buffer is written to flash.
+    def __init__(self, old, image_size, checkpoint=None):
+        self.old = old
+        self.image_size = image_size
+        self.flash = bytearray(b'\xff' * image_size)
+        self.out = bytearray()
+        self.state = dict(checkpoint) if checkpoint else dict(step='header', op=0, varint=0, shift=0, op_remaining=0, run_remaining=0,
+                                                               src=0, patch_offset=0, out_offset=0, header=b'')
+        self.checkpoint = dict(self.state)
+
+    def resume(self, flash):
+        # Pick up from self.checkpoint with the flash as it was (anything after the checkpoint gets rewritten)
+        self.flash = flash
+        self.state = dict(self.checkpoint)
+        self.out = bytearray()
+        self.run()
+
+    def flush(self):
+        s = self.state
+        if not self.out:
+            return
+        if s['out_offset'] % FLASH_SECTOR_SIZE == 0:
+            self.flash[s['out_offset']:s['out_offset'] + FLASH_SECTOR_SIZE] = b'\xff' * len(self.flash[s['out_offset']:s['out_offset'] + FLASH_SECTOR_SIZE])
+        # Programming flash can only clear bits
+        for k, b in enumerate(self.out):
+            self.flash[s['out_offset'] + k] &= b
+        s['out_offset'] += len(self.out)
+        self.out = bytearray()
+        self.checkpoint = dict(s)
+
+    def emit(self, b):
+        if self.state['out_offset'] + len(self.out) >= self.image_size:
+            raise PatchError('Patch makes too many bytes')
+        self.out.append(b)
+        if len(self.out) == OUT_BUFFER_SIZE:
+            self.flush()
+
+    def source(self, offset):
+        if offset >= len(self.old):
+            raise PatchError('Patch reads past the end of the old image')
+        return self.old[offset]
+
+    def run(self):
+        s = self.state
+        while s['step'] in ('copy', 'zero_copy'):
+            if s['run_remaining'] == 0:
+                if s['step'] == 'copy' or s['op_remaining'] == 0:
+                    s['step'] = 'op'
+                else:
+                    s.update(step='literal_len', varint=0, shift=0)
+                continue
+            b = self.source(s['src'])
+            s['src'] += 1
+            s['run_remaining'] -= 1
+            s['op_remaining'] -= 1
+            self.emit(b)
+
+    def feed(self, b):
+        s = self.state
+        s['patch_offset'] += 1
+        step = s['step']
+        if step == 'header':
+            s['header'] += bytes([b])
+            if len(s['header']) == HEADER_LEN:
+                _, new_size = struct.unpack('<II', s['header'][4:])
+                if s['header'][:4] != MAGIC or new_size != self.image_size:
+                    raise PatchError('Not a patch for this image')
+                s['step'] = 'op'
+            return
+        if step == 'op':
+            if b not in (OP_COPY, OP_ADD, OP_INSERT):
+                raise PatchError(f'Unknown op {b}')
+            s.update(op=b, step='len', varint=0, shift=0)
+            return
+        if step in ('literal', 'insert'):
+            out = b
+            if step == 'literal':
+                out = (self.source(s['src']) + b) & 0xFF
+                s['src'] += 1
+            s['run_remaining'] -= 1
+            s['op_remaining'] -= 1
+            if s['run_remaining'] == 0:
+                if s['op'] == OP_ADD and s['op_remaining'] > 0:
+                    s.update(step='zero_run', varint=0, shift=0)
+                else:
+                    s['step'] = 'op'
+            self.emit(out)
+            return
+
+        s['varint'] |= (b & 0x7F) << s['shift']
+        s['shift'] += 7
+        if b & 0x80:
+            if s['shift'] >= 35:
+                raise PatchError('Bad varint')
+            return
+        val = s['varint']
+        if step == 'len':
+            if val == 0 or val > self.image_size - s['out_offset'] - len(self.out):
+                raise PatchError('Bad op length')
+            s['op_remaining'] = val
+            if s['op'] == OP_INSERT:
+                s.update(run_remaining=val, step='insert')
+            else:
+                s.update(step='src', varint=0, shift=0)
+        elif step == 'src':
+            s['src'] += (val >> 1) ^ -(val & 1)
+            if s['op'] == OP_COPY:
+                s.update(run_remaining=s['op_remaining'], step='copy')
+            else:
+                s.update(step='zero_run', varint=0, shift=0)
+        elif step == 'zero_run':
+            if val > s['op_remaining']:
+                raise PatchError('Bad zero run')
+            s.update(run_remaining=val, step='zero_copy')
+        elif step == 'literal_len':
+            if val == 0 or val > s['op_remaining']:
+                raise PatchError('Bad literal length')
+            s.update(run_remaining=val, step='literal')
+        self.run()
+
+    def finish(self):
+        if self.state['step'] != 'op' or self.state['out_offset'] + len(self.out) != self.image_size:
+            raise PatchError('Patch ended before the image was complete')
+        self.flush()
+        return bytes(self.flash)
+
+def apply_patch(old, patch):
+    _, new_size = struct.unpack('<II', patch[4:HEADER_LEN])
+    applier = Applier(old, new_size)
+    for b in patch:
+        applier.feed(b)
+    return applier.finish()
+
+# **********
+# Signing
+# **********
+
+def openssl(args, data=None):
+    return subprocess.run(['openssl'] + args, input=data, capture_output=True, check=True).stdout
+
+def public_key_pem(key_file):
+    return openssl(['ec', '-in', key_file, '-pubout']).decode()
+
+def c_string(pem):
+    lines = pem.strip().split('\n')
+    return '\n'.join(f'  "{line}\\n"' for line in lines) + ';'
+
+def sign(key_file, data):
+    return openssl(['dgst', '-sha256', '-sign', key_file], data)
+
+def verify(public_pem, data, signature):
+    with tempfile.TemporaryDirectory() as tmp:
+        pub_file = os.path.join(tmp, 'pub.pem')
+        sig_file = os.path.join(tmp, 'sig.der')
+        with open(pub_file, 'w') as f:
+            f.write(public_pem)
+        with open(sig_file, 'wb') as f:
+            f.write(signature)
+        result = subprocess.run(['openssl', 'dgst', '-sha256', '-verify', pub_file, '-signature', sig_file], input=data, capture_output=True)
+        return result.returncode == 0
+
+def make_manifest(key_file, from_version, to_version, new, patch):
+    body = (f'from={from_version}\n'
+            f'to={to_version}\n'
+            f'patch_size={len(patch)}\n'
+            f'image_size={len(new)}\n'
+            f'image_sha256={hashlib.sha256(new).hexdigest()}\n').encode()
+    return body + b'sig=' + sign(key_file, body).hex().encode() + b'\n'
+
+def parse_manifest(manifest):
+    # Returns (fields, signed bytes, signature)
+    sig_start = manifest.index(b'\nsig=') + 1
+    fields = dict(line.split('=', 1) for line in manifest.decode().strip().split('\n'))
+    return fields, manifest[:sig_start], bytes.fromhex(fields['sig'])
+
+def make_release(key_file, out_dir, to_version, new, olds):
+    # olds: list of (old image, version). Writes <from>-<to>.wpd and manifest-<from>.txt for each.
+    os.makedirs(out_dir, exist_ok=True)
+    for old, from_version in olds:
+        patch = make_patch(old, new)
+        if apply_patch(old, patch) != new:
+            raise PatchError(f'Patch from {from_version} does not reproduce the new image')
+        with open(os.path.join(out_dir, f'{from_version}-{to_version}.wpd'), 'wb') as f:
+            f.write(patch)
+        with open(os.path.join(out_dir, f'manifest-{from_version}.txt'), 'wb') as f:
+            f.write(make_manifest(key_file, from_version, to_version, new, patch))
+        print(f'{from_version} -> {to_version}: {len(patch)} byte patch for a {len(new)} byte image ({100 * len(patch) / len(new):.1f}%)')
+
+# **********
+# Self-check
+# **********
+
+def fake_firmware(rng, size):
+    # Something with the texture of code: repeated instruction-like words, with addresses in them
+    words = [rng.randrange(1 << 32) for _ in range(64)]
+    out = bytearray()
+    while len(out) < size:
+        word = rng.choice(words) if rng.random() < 0.7 else rng.randrange(1 << 32)
+        out += struct.pack('<I', word)
+    return bytes(out[:size])
+
+def fake_update(rng, old):
+    # Insert and delete some code, which moves everything after it, and shift the addresses in the moved code
+    new = bytearray(old)
+    for _ in range(rng.randrange(1, 6)):
+        pos = rng.randrange(len(new)) & ~3
+        if rng.random() < 0.5:
+            new[pos:pos] = bytes(rng.randrange(256) for _ in range(rng.randrange(4, 2000) & ~3))
+        else:
+            del new[pos:pos + (rng.randrange(4, 2000) & ~3)]
+    for _ in range(rng.randrange(0, 200)):
+        pos = rng.randrange(len(new) - 4) & ~3
+        val = struct.unpack_from('<I', new, pos)[0]
+        struct.pack_into('<I', new, pos, (val + rng.choice([4, 8, 0x100, 0x1000])) & 0xFFFFFFFF)
+    return bytes(new)
+
+def apply_interrupted(old, patch, new_size, rng):
+    # Apply the patch with the "download" cut off at random points, resuming from the last checkpoint each time (as across wakes)
+    applier = Applier(old, new_size)
+    flash = applier.flash
+    pos = 0
+    interruptions = 0
+    while True:
+        cut = min(len(patch), pos + rng.randrange(1, 20000))
+        for b in patch[pos:cut]:
+            applier.feed(b)
+        if cut == len(patch):
+            return applier.finish(), interruptions
+        # Lose everything since the checkpoint (what was written to flash after it stays there, and gets written again)
+        interruptions += 1
+        flash = bytearray(applier.flash)
+        applier.resume(flash)
+        pos = applier.state['patch_offset']
+
+def self_check(iterations):
+    rng = random.Random(1)
+    total_new = total_patch = 0
+    for n in range(iterations):
+        old = fake_firmware(rng, rng.randrange(1, 200000))
+        new = fake_update(rng, old) if n % 5 else fake_firmware(rng, rng.randrange(1, 50000))
+        if not new:
+            continue
+        patch = make_patch(old, new)
+        assert apply_patch(old, patch) == new
+        result, interruptions = apply_interrupted(old, patch, len(new), rng)
+        assert result == new, f'Resumed apply differs (iteration {n}, {interruptions} interruptions)'
+        if n % 5:
+            total_new += len(new)
+            total_patch += len(patch)
+
+    # Corrupt patches must fail cleanly, never overrun
+    old = fake_firmware(rng, 50000)
+    new = fake_update(rng, old)
+    patch = bytearray(make_patch(old, new))
+    for _ in range(200):
+        bad = bytearray(patch)
+        bad[rng.randrange(HEADER_LEN, len(bad))] ^= 1 << rng.randrange(8)
+        try:
+            if apply_patch(old, bytes(bad)) == new:
+                continue
+        except PatchError:
+            continue
+        except IndexError:
+            raise AssertionError('Corrupt patch indexed out of range')
+
+    # Manifests: a good signature verifies, and any change to the signed part breaks it
+    with tempfile.TemporaryDirectory() as tmp:
+        key_file = os.path.join(tmp, 'key.pem')
+        openssl(['ecparam', '-name', 'prime256v1', '-genkey', '-noout', '-out', key_file])
+        public_pem = public_key_pem(key_file)
+        manifest = make_manifest(key_file, 1, 2, new, bytes(patch))
+        fields, signed, sig = parse_manifest(manifest)
+        assert verify(public_pem, signed, sig)
+        assert not verify(public_pem, signed.replace(b'to=2', b'to=3'), sig)
+        assert fields['image_sha256'] == hashlib.sha256(new).hexdigest()
+
+    print(f'Self-check passed ({iterations} patches, updates patched to {100 * total_patch / max(total_new, 1):.1f}% of their size)')
+
+def main():
+    parser = argparse.ArgumentParser(description='Make, apply and sign WaterPAL delta firmware patches.')
+    parser.add_argument('--self-check', action='store_true', help='Patch random firmware-like images, with interrupted and resumed applies, and check manifest signing.')
+    sub = parser.add_subparsers(dest='command')
+    p = sub.add_parser('keygen', help='Make an ECDSA P-256 signing key, and print the public key as a C string.')
+    p.add_argument('key')
+    p = sub.add_parser('diff', help='Make a patch from OLD to NEW.')
+    p.add_argument('old')
+    p.add_argument('new')
+    p.add_argument('patch')
+    p = sub.add_parser('apply', help='Apply a patch to OLD.')
+    p.add_argument('old')
+    p.add_argument('patch')
+    p.add_argument('out')
+    p = sub.add_parser('release', help='Make patches and signed manifests from each old version to the new one.')
+    p.add_argument('--key', required=True)
+    p.add_argument('--dir', required=True)
+    p.add_argument('--to', type=int, required=True, help='Version of the new image (its WATERPAL_FIRMWARE_VERSION).')
+    p.add_argument('new')
+    p.add_argument('olds', nargs='+', help='OLD.bin:VERSION')
+    args = parser.parse_args()
+
+    if args.self_check:
+        self_check(40)
+        return
+
+    def read(path):
+        with open(path, 'rb') as f:
+            return f.read()
+
+    if args.command == 'keygen':
+        openssl(['ecparam', '-name', 'prime256v1', '-genkey', '-noout', '-out', args.key])
+        print('const char WATERPAL_OTA_PUBLIC_KEY[] =')
+        print(c_string(public_key_pem(args.key)))
+    elif args.command == 'diff':
+        old, new = read(args.old), read(args.new)
+        patch = make_patch(old, new)
+        with open(args.patch, 'wb') as f:
+            f.write(patch)
+        print(f'{len(patch)} byte patch for a {len(new)} byte image ({100 * len(patch) / max(len(new), 1):.1f}%)')
+    elif args.command == 'apply':
+        with open(args.out, 'wb') as f:
+            f.write(apply_patch(read(args.old), read(args.patch)))
+    elif args.command == 'release':
+        olds = []
+        for spec in args.olds:
+            path, version = spec.rsplit(':', 1)
+            olds.append((read(path), int(version)))
+        make_release(args.key, args.dir, args.to, read(args.new), olds)
+    else:
+        parser.print_help()
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,199 @@
+# Minimal stand-in for the WaterPAL firmware update server (see waterpal_ota.h)
+# Serves the manifests and patches that "waterpal_ota_patch.py release" writes, with HTTP Range support for resumed downloads:
+#  GET <path>/manifest?version=N   manifest-N.txt, or 204 if there's no update for version N
+#  GET <path>/patch/<from>-<to>.wpd
+import sys
+import argparse
+import hashlib
+import http.client
+import os
+import random
+import re
+import ssl
+import tempfile
+import threading
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import urlparse, parse_qs
+
+import waterpal_ota_patch as ota
+
+class UpdateHandler(BaseHTTPRequestHandler):
+    # Set on the class by make_server()
+    release_dir = '.'
+    path_prefix = '/ota'
+    drop_after = None  # Close a patch response after this many bytes, to test resuming
+    quiet = False
+
+    def log_message(self, format, *args):
+        if not self.quiet:
+            super().log_message(format, *args)
+
+    def send_body(self, status, body, content_type, headers=()):
+        self.send_response(status)
+        self.send_header('Content-Type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        for name, value in headers:
+            self.send_header(name, value)
+        self.end_headers()
+        if self.drop_after is not None and content_type == 'application/octet-stream':
+            body = body[:self.drop_after]
+            self.close_connection = True
+        self.wfile.write(body)
+
+    def do_GET(self):
+        url = urlparse(self.path)
+        if url.path == self.path_prefix + '/manifest':
+            version = parse_qs(url.query).get('version', [''])[0]
+            manifest_file = os.path.join(self.release_dir, f'manifest-{version}.txt')
+            if not version.isdigit() or not os.path.exists(manifest_file):
+                self.send_response(204)
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                return
+            with open(manifest_file, 'rb') as f:
+                self.send_body(200, f.read(), 'text/plain')
+            return
+
+        match = re.fullmatch(re.escape(self.path_prefix) + r'/patch/(\d+-\d+\.wpd)', url.path)
+        patch_file = os.path.join(self.release_dir, match.group(1)) if match else None
+        if patch_file is None or not os.path.exists(patch_file):
+            self.send_body(404, b'', 'text/plain')
+            return
+        with open(patch_file, 'rb') as f:
+            patch = f.read()
+
+        range_header = self.headers.get('Range')
+        if range_header is None:
+            self.send_body(200, patch, 'application/octet-stream')
+            return
+        match = re.fullmatch(r'bytes=(\d+)-', range_header.strip())
+        start = int(match.group(1)) if match else len(patch)
+        if start >= len(patch):
+            self.send_body(416, b'', 'text/plain', [('Content-Range', f'bytes */{len(patch)}')])
+            return
+        self.send_body(206, patch[start:], 'application/octet-stream', [('Content-Range', f'bytes {start}-{len(patch) - 1}/{len(patch)}')])
+
+def make_server(host, port, release_dir, path_prefix, drop_after=None, quiet=False):
+    handler = type('Handler', (UpdateHandler,), dict(release_dir=release_dir, path_prefix=path_prefix, drop_after=drop_after, quiet=quiet))
+    return ThreadingHTTPServer((host, port), handler)
+
+class Device:
+    # What the firmware does over successive wakes (ota_poll()), against a running server
+    def __init__(self, host, port, path_prefix, version, image, public_pem, max_bytes_per_wake):
+        self.host, self.port, self.path_prefix = host, port, path_prefix
+        self.version = version
+        self.image = image
+        self.public_pem = public_pem
+        self.max_bytes_per_wake = max_bytes_per_wake
+        self.manifest = None
+        self.applier = None
+        self.wakes = 0
+        self.bytes_downloaded = 0
+
+    def get(self, path, headers=None):
+        conn = http.client.HTTPConnection(self.host, self.port, timeout=10)
+        conn.request('GET', path, headers=headers or {})
+        return conn, conn.getresponse()
+
+    def check(self):
+        conn, response = self.get(f'{self.path_prefix}/manifest?version={self.version}')
+        body = response.read()
+        conn.close()
+        if response.status != 200:
+            return False
+        fields, signed, sig = ota.parse_manifest(body)
+        if not ota.verify(self.public_pem, signed, sig):
+            raise AssertionError('Bad manifest signature')
+        if int(fields['from']) != self.version or int(fields['to']) <= self.version:
+            raise AssertionError('Manifest is for another version')
+        self.manifest = {k: (v if k in ('image_sha256', 'sig') else int(v)) for k, v in fields.items()}
+        self.applier = ota.Applier(self.image, self.manifest['image_size'])
+        return True
+
+    def wake(self):
+        # Returns the new image once it is complete and verified
+        self.wakes += 1
+        m = self.manifest
+        self.applier.resume(self.applier.flash)
+        offset = self.applier.state['patch_offset']
+        headers = {'Range': f'bytes={offset}-'} if offset > 0 else {}
+        conn, response = self.get(f"{self.path_prefix}/patch/{m['from']}-{m['to']}.wpd", headers)
+        if response.status != (206 if offset > 0 else 200):
+            raise AssertionError(f'Patch request returned {response.status}')
+        want = min(m['patch_size'] - offset, self.max_bytes_per_wake)
+        try:
+            data = response.read(want)
+        except http.client.IncompleteRead as e:
+            data = e.partial
+        conn.close()
+        self.bytes_downloaded += len(data)
+        for b in data:
+            self.applier.feed(b)
+        if self.applier.state['patch_offset'] < m['patch_size']:
+            return None
+        image = self.applier.finish()
+        if hashlib.sha256(image).hexdigest() != m['image_sha256']:
+            raise AssertionError('New image does not match the signed hash')
+        return image
+
+def self_check():
+    rng = random.Random(2)
+    with tempfile.TemporaryDirectory() as tmp:
+        key_file = os.path.join(tmp, 'key.pem')
+        ota.openssl(['ecparam', '-name', 'prime256v1', '-genkey', '-noout', '-out', key_file])
+        public_pem = ota.public_key_pem(key_file)
+        v1 = ota.fake_firmware(rng, 300000)
+        v2 = ota.fake_update(rng, v1)
+        v3 = ota.fake_update(rng, v2)
+        v3 = v3[:100000] + ota.fake_firmware(rng, 40000) + v3[100000:] # Plenty of new code, so the patch takes several wakes
+        release_dir = os.path.join(tmp, 'release')
+        ota.make_release(key_file, release_dir, 3, v3, [(v1, 1), (v2, 2)])
+
+        # A link that drops every patch response part way, and a small per-wake budget: the download has to resume across wakes
+        server = make_server('127.0.0.1', 0, release_dir, '/ota', drop_after=3000, quiet=True)
+        port = server.server_address[1]
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+        try:
+            for version, image in ((1, v1), (2, v2)):
+                device = Device('127.0.0.1', port, '/ota', version, image, public_pem, max_bytes_per_wake=5000)
+                assert device.check()
+                new_image = None
+                while new_image is None:
+                    assert device.wakes < 1000
+                    new_image = device.wake()
+                assert new_image == v3
+                print(f'{version} -> 3: {device.manifest["patch_size"]} byte patch, {device.wakes} wakes, {device.bytes_downloaded} bytes downloaded')
+            assert not Device('127.0.0.1', port, '/ota', 3, v3, public_pem, 5000).check()
+        finally:
+            server.shutdown()
+    print('Self-check passed')
+
+def main():
+    parser = argparse.ArgumentParser(description='Run a local stand-in for the WaterPAL firmware update server.')
+    parser.add_argument('--dir', type=str, default='.', help='Release directory (from "waterpal_ota_patch.py release").')
+    parser.add_argument('--path', type=str, default='/ota', help='URL path prefix (WATERPAL_OTA_PATH).')
+    parser.add_argument('--host', type=str, default='0.0.0.0', help='Address to listen on.')
+    parser.add_argument('--port', type=int, default=8080, help='TCP port to listen on (WATERPAL_OTA_PORT).')
+    parser.add_argument('--cert', type=str, help='TLS certificate (PEM), to serve HTTPS as the firmware expects.')
+    parser.add_argument('--cert-key', type=str, help='TLS private key (PEM) for --cert.')
+    parser.add_argument('--drop-after', type=int, help='Cut every patch response off after this many bytes, to test resuming.')
+    parser.add_argument('--self-check', action='store_true', help='Serve a generated release and download it through a simulated device over a flaky link.')
+    args = parser.parse_args()
+
+    if args.self_check:
+        self_check()
+        return
+
+    server = make_server(args.host, args.port, args.dir, args.path, args.drop_after)
+    if args.cert:
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(args.cert, args.cert_key)
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+    print(f'Serving {args.dir} on {args.host}:{args.port}{args.path}')
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == '__main__':
+    main()
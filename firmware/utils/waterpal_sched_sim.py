@@ -0,0 +1,174 @@
+# Simulate the wake scheduler (waterpal_scheduler.h) over two weeks, and count the timer wakes and task runs.
+#
+# The scheduler functions below follow waterpal_scheduler.h line for line, with local time as a fixed offset from UTC (no DST).
+# Each scenario runs once with every tolerance at zero and once with its tolerances, with float switch wakes at random times
+#  in between, so the tolerances' savings in timer wakes (and modem power-ups) can be checked whenever the scheduler changes.
+#
+#  python3 waterpal_sched_sim.py                 Print the wakes and task runs of each scenario
+#  python3 waterpal_sched_sim.py --self-check    Also check that no task runs late or too early, and that the tolerances save wakes
+import argparse
+import random
+
+TASK_NAMES = ['sensor read', 'GPS', 'extended check', 'report', 'config poll']
+SENSOR_READ, GPS, EXTENDED_CHECK, REPORT, CONFIG_POLL = range(len(TASK_NAMES))
+
+DAY_S = 24 * 60 * 60
+H = 60 * 60
+TASK_RUN_S = 5 # How long a task keeps the device awake
+START_S = 1789948800 + 7 * H # 07:00 UTC
+DAYS = 14
+
+# name: (periods, tolerances), in task order. The float switch wakes average about one every four hours.
+SCENARIOS = [
+    # Hourly sensor reads, reports at 22:00, an extended check and GPS fix every 8 reports, a config poll with each report
+    ('field', [H, 176 * H, 176 * H, 22 * H, 22 * H], [600, 44 * H, 44 * H, 300, 11 * H], False),
+    ('field+float', [H, 176 * H, 176 * H, 22 * H, 22 * H], [600, 44 * H, 44 * H, 300, 11 * H], True),
+    # 7 sensor reads a day (off the report grid), a weekly GPS fix, config polls every 6 hours
+    ('odd periods', [DAY_S // 7, 7 * DAY_S, 176 * H, 22 * H, 6 * H], [1800, 2 * DAY_S, 44 * H, 300, 3 * H], True),
+]
+
+class Scheduler:
+    def __init__(self, utc_offset_s=0):
+        self.utc_offset_s = utc_offset_s
+        self.tasks = [[0, 0, 0] for _ in TASK_NAMES] # next_due_s, period_s, tolerance_s
+
+    def slot_after(self, t, period_s):
+        if period_s > DAY_S:
+            return t + period_s
+        prev_midnight = t - (t + self.utc_offset_s) % DAY_S
+        next_midnight = prev_midnight + DAY_S
+        slot = prev_midnight + ((t - prev_midnight) // period_s + 1) * period_s
+        if slot > next_midnight:
+            slot = next_midnight + period_s
+        return slot
+
+    def set(self, task, due_s, period_s, tolerance_s):
+        if period_s > 0 and tolerance_s > period_s // 2:
+            tolerance_s = period_s // 2
+        self.tasks[task] = [due_s, period_s, tolerance_s]
+
+    def every(self, task, now, period_s, tolerance_s, run_now):
+        self.set(task, now if run_now else self.slot_after(now, period_s), period_s, tolerance_s)
+
+    def window_is_open(self, task, now):
+        due, _, tol = self.tasks[task]
+        return due > 0 and due - tol <= now
+
+    def is_runnable(self, task, now):
+        if not self.window_is_open(task, now):
+            return False
+        due = self.tasks[task][0]
+        if due <= now:
+            return True
+        for other in range(len(self.tasks)):
+            if other != task and self.tasks[other][0] > 0 and not self.window_is_open(other, now) and self.tasks[other][0] <= due:
+                return False
+        return True
+
+    def next_runnable(self, now):
+        for task in range(len(self.tasks)):
+            if self.is_runnable(task, now):
+                return task
+        return -1
+
+    def task_done(self, task, now):
+        due, period_s, tol = self.tasks[task]
+        if period_s == 0:
+            self.tasks[task][0] = 0
+            return
+        next_due_s = self.slot_after(due if due > now else now, period_s)
+        while next_due_s - tol <= now:
+            next_due_s = self.slot_after(next_due_s, period_s)
+        self.tasks[task][0] = next_due_s
+
+    def next_wake(self, now):
+        dues = [t[0] for t in self.tasks if t[0] > 0]
+        next_wake_s = min(dues) if dues else now + DAY_S
+        return max(next_wake_s, now)
+
+def simulate(periods, tolerances, float_wakes, seed):
+    # Returns the timer wakes, float switch wakes, runs per task, and each run's
+    #  (task, seconds early, seconds between the wake and the due time, tolerance)
+    rng = random.Random(seed)
+    sched = Scheduler()
+    now = START_S
+    for task in range(len(TASK_NAMES)):
+        sched.every(task, now, periods[task], tolerances[task], task in (SENSOR_READ, REPORT))
+    end = now + DAYS * DAY_S
+    timer_wakes = float_wake_count = 0
+    runs = [0] * len(TASK_NAMES)
+    log = []
+    next_float = now + rng.randrange(4 * H)
+    while now < end:
+        wake_s = now
+        while True:
+            task = sched.next_runnable(now)
+            if task < 0:
+                break
+            runs[task] += 1
+            log.append((task, sched.tasks[task][0] - now, sched.tasks[task][0] - wake_s, sched.tasks[task][2]))
+            now += TASK_RUN_S
+            sched.task_done(task, now)
+        wake = sched.next_wake(now)
+        if float_wakes and next_float < wake:
+            now = next_float
+            next_float += 600 + rng.randrange(8 * H)
+            float_wake_count += 1
+        else:
+            now = wake
+            timer_wakes += 1
+    return timer_wakes, float_wake_count, runs, log
+
+def describe(name, result):
+    timer_wakes, float_wake_count, runs, log = result
+    early = max((ahead for _, ahead, _, _ in log), default=0)
+    print(f'{name:28} timer wakes {timer_wakes:4}, float wakes {float_wake_count:3}, runs: '
+          + ' '.join(f'{TASK_NAMES[t]}={runs[t]}' for t in range(len(TASK_NAMES))) + f' (max early {early}s)')
+
+def self_check(seed):
+    # Slot arithmetic: hourly slots on the hour, 22 hours at 22:00, a 7th of a day restarting at midnight, long periods follow on
+    sched = Scheduler()
+    midnight = START_S - 7 * H
+    assert sched.slot_after(midnight + 7 * H + 5, H) == midnight + 8 * H
+    assert sched.slot_after(midnight + 7 * H, 22 * H) == midnight + 22 * H
+    assert sched.slot_after(midnight + 22 * H, 22 * H) == midnight + DAY_S + 22 * H
+    assert sched.slot_after(midnight + 7 * (DAY_S // 7) + 1, DAY_S // 7) == midnight + DAY_S + DAY_S // 7
+    assert sched.slot_after(midnight + 123, 176 * H) == midnight + 123 + 176 * H
+    assert Scheduler(-5 * H).slot_after(midnight + 7 * H, 22 * H) == midnight + 5 * H + 22 * H
+
+    for name, periods, tolerances, float_wakes in SCENARIOS:
+        strict = simulate(periods, [0] * len(TASK_NAMES), float_wakes, seed)
+        tolerant = simulate(periods, tolerances, float_wakes, seed)
+        describe(name + ', no tolerance', strict)
+        describe(name + ', tolerance', tolerant)
+
+        # Nothing is late for its wake: every timer wake is at a due time, and a run may only be early by its (capped) tolerance
+        for result in (strict, tolerant):
+            for task, ahead, after_wake, tol in result[3]:
+                assert ahead <= tol and after_wake >= 0, (name, TASK_NAMES[task], ahead, after_wake, tol)
+        assert all(after_wake == 0 for _, _, after_wake, _ in strict[3])
+        # Same work for fewer wakes: each task runs as often (the wide GPS window may fit one more run in before the end)
+        for task in range(len(TASK_NAMES)):
+            assert strict[2][task] <= tolerant[2][task] <= strict[2][task] + 1, (name, TASK_NAMES[task])
+        assert tolerant[0] <= strict[0], name
+        if float_wakes:
+            assert tolerant[0] < strict[0], name
+        # The reports run on time, so their count is the number of days
+        assert strict[2][REPORT] == tolerant[2][REPORT] == DAYS + 1, name
+    print('Self-check passed')
+
+def main():
+    parser = argparse.ArgumentParser(description='Simulate the WaterPAL wake scheduler over two weeks.')
+    parser.add_argument('--seed', type=int, default=1, help='Seed for the float switch wake times.')
+    parser.add_argument('--self-check', action='store_true', help='Check the slot arithmetic, that no task runs late or too early, and that the tolerances save timer wakes.')
+    args = parser.parse_args()
+
+    if args.self_check:
+        self_check(args.seed)
+        return
+    for name, periods, tolerances, float_wakes in SCENARIOS:
+        describe(name + ', no tolerance', simulate(periods, [0] * len(TASK_NAMES), float_wakes, args.seed))
+        describe(name + ', tolerance', simulate(periods, tolerances, float_wakes, args.seed))
+
+if __name__ == '__main__':
+    main()
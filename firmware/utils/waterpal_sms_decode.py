@@ -0,0 +1,176 @@
+# Decode a WaterPAL regular report SMS ("R"/"r" packet, version 1 or 2) into JSON
+# See waterpal_sms_codec.h and fields.md for the format.
+import sys
+import argparse
+import json
+import random
+
+ALPHABET = 'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/'
+
+# Fields in the version 1 packet body, in order (report_fields[] order in waterpal_schema.h)
+V1_FIELDS = [
+    'dailyWaterUsageTime',
+    'detectedClockTimeDrift',
+    'temperatureLow',
+    'temperatureAvg',
+    'temperatureHigh',
+    'humidityLow',
+    'humidityAvg',
+    'humidityHigh',
+    'signalStrength',
+    'batteryChargeStatus',
+    'batteryChargePercent',
+    'batteryVoltage',
+    'bootCount',
+    'handle_strokes_total',
+    'handle_strokes_flowing_total',
+    'handle_strokes_flowing_per_min',
+    'dry_start_count',
+    'dry_start_stroke_total',
+    'dry_start_stroke_avg',
+    'dry_start_stroke_max',
+]
+
+# Fields in the version 2 packet, most important first (sms_priority in waterpal_schema.h)
+V2_FIELDS = [
+    'dailyWaterUsageTime',
+    'batteryChargePercent',
+    'temperatureAvg',
+    'handle_strokes_total',
+    'signalStrength',
+    'batteryVoltage',
+    'detectedClockTimeDrift',
+    'bootCount',
+    'dry_start_count',
+    'handle_strokes_flowing_total',
+    'humidityAvg',
+    'batteryChargeStatus',
+    'handle_strokes_flowing_per_min',
+    'dry_start_stroke_avg',
+    'dry_start_stroke_max',
+    'dry_start_stroke_total',
+    'temperatureLow',
+    'temperatureHigh',
+    'humidityLow',
+    'humidityHigh',
+]
+
+def put_varint(val):
+    out = ''
+    while True:
+        bits = val & 0x1F
+        val >>= 5
+        out += ALPHABET[(0x20 if val > 0 else 0) | bits]
+        if val == 0:
+            return out
+
+def get_varint(text, pos):
+    # Returns (value, new position)
+    val = 0
+    shift = 0
+    while True:
+        if pos >= len(text):
+            raise ValueError('Packet ends in the middle of a value')
+        digit = ALPHABET.index(text[pos])
+        pos += 1
+        val |= (digit & 0x1F) << shift
+        shift += 5
+        if not digit & 0x20:
+            return val, pos
+
+def zigzag(val):
+    return (val << 1) ^ (val >> 63)
+
+def unzigzag(val):
+    return (val >> 1) ^ -(val & 1)
+
+def encode_v2(report, packet_type='R', max_chars=160):
+    # Mirrors sms_codec_encode() in waterpal_sms_codec.h
+    for num_kept in range(len(V2_FIELDS), -1, -1):
+        imei = report['IMEI'][-2:] if packet_type == 'r' else report['IMEI']
+        count = report['totalSMSCount'] % 32 if packet_type == 'r' else report['totalSMSCount']
+        text = '2' + packet_type + imei + ',' + put_varint(count)
+        values = [report.get(name, 0) for name in V2_FIELDS[:num_kept]]
+        presence = 1 << num_kept
+        for i, val in enumerate(values):
+            if val != 0:
+                presence |= 1 << i
+        text += put_varint(presence)
+        text += ''.join(put_varint(zigzag(val)) for val in values if val != 0)
+        if len(text) <= max_chars:
+            return text
+    return ''
+
+def decode_v2(text):
+    packet_type = text[1]
+    comma = text.index(',')
+    report = {'version': 2, 'type': packet_type, 'IMEI': text[2:comma]}
+    report['totalSMSCount'], pos = get_varint(text, comma + 1)
+    presence, pos = get_varint(text, pos)
+    num_kept = presence.bit_length() - 1
+    for i, name in enumerate(V2_FIELDS[:num_kept]):
+        if presence & (1 << i):
+            val, pos = get_varint(text, pos)
+            report[name] = unzigzag(val)
+        else:
+            report[name] = 0
+    if pos != len(text):
+        raise ValueError('Trailing characters after the last value')
+    report['missing'] = V2_FIELDS[num_kept:]
+    return report
+
+def decode_v1(text):
+    parts = text.split(',')
+    report = {'version': 1, 'IMEI': parts[1], 'totalSMSCount': int(parts[2]), 'type': parts[3]}
+    for name, val in zip(V1_FIELDS, parts[4:]):
+        report[name] = int(val)
+    return report
+
+def decode_sms(text):
+    text = text.strip()
+    if text.startswith('1,'):
+        return decode_v1(text)
+    if text.startswith('2'):
+        return decode_v2(text)
+    raise ValueError('Unknown packet version')
+
+def self_check(iterations):
+    # Round-trip random reports through the encoder and decoder, at full length and squeezed
+    rng = random.Random(1)
+    for _ in range(iterations):
+        report = {'IMEI': ''.join(rng.choice(ALPHABET) for _ in range(9)), 'totalSMSCount': rng.randrange(0, 5000)}
+        for name in V2_FIELDS:
+            report[name] = rng.choice([0, rng.randrange(-40, 100), rng.randrange(0, 1 << 31), -rng.randrange(0, 1 << 20)])
+        for packet_type, max_chars in [('R', 160), ('R', 40), ('r', 14)]:
+            text = encode_v2(report, packet_type, max_chars)
+            assert len(text) <= max_chars
+            decoded = decode_v2(text)
+            kept = [name for name in V2_FIELDS if name not in decoded['missing']]
+            assert kept == V2_FIELDS[:len(kept)]
+            for name in kept:
+                assert decoded[name] == report[name], (name, text)
+            if packet_type == 'R':
+                assert decoded['IMEI'] == report['IMEI'] and decoded['totalSMSCount'] == report['totalSMSCount']
+    print(f'Self-check passed ({iterations} reports)')
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a WaterPAL regular report SMS into JSON.')
+    parser.add_argument('message', type=str, nargs='?', help='SMS text.')
+    parser.add_argument('--self-check', action='store_true', help='Round-trip random reports through the encoder and decoder.')
+    args = parser.parse_args()
+
+    if args.self_check:
+        self_check(1000)
+        return
+    if args.message is None:
+        parser.error('message is required')
+
+    try:
+        report = decode_sms(args.message)
+    except (ValueError, IndexError) as e:
+        print(f'Could not decode message: {e}', file=sys.stderr)
+        sys.exit(1)
+    print(json.dumps(report, indent=2))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,178 @@
+# Encode, decode and reassemble the 8-bit binary SMS PDUs sent with WATERPAL_USE_SMS_BINARY (see waterpal_sms_pdu.h),
+#  and decode the reports they carry.
+import sys
+import argparse
+import json
+import random
+
+from waterpal_decode import decode_payload
+
+MAX_DATA = 140
+CONCAT_UDH_LEN = 6
+MAX_PART_DATA = MAX_DATA - CONCAT_UDH_LEN
+
+MTI_DELIVER = 0
+MTI_SUBMIT = 1
+DCS_8BIT = 0x04
+
+# Payload encodings (first byte of the reassembled data), as in waterpal_config.h
+PAYLOAD_ENCODING_CBOR = 1
+PAYLOAD_ENCODING_CBOR_HEATSHRINK = 2
+
+def encode_address(number):
+    toa = 0x91 if number.startswith('+') else 0x81
+    digits = number.lstrip('+')
+    padded = digits + ('F' if len(digits) % 2 else '')
+    swapped = ''.join(padded[i + 1] + padded[i] for i in range(0, len(padded), 2))
+    return bytes([len(digits), toa]) + bytes.fromhex(swapped)
+
+def decode_address(pdu, pos):
+    # Returns (number, new position)
+    num_digits = pdu[pos]
+    toa = pdu[pos + 1]
+    num_octets = (num_digits + 1) // 2
+    swapped = pdu[pos + 2:pos + 2 + num_octets].hex().upper()
+    digits = ''.join(swapped[i + 1] + swapped[i] for i in range(0, len(swapped), 2))[:num_digits]
+    return ('+' if toa == 0x91 else '') + digits, pos + 2 + num_octets
+
+def encode_submit(number, data, reference=0):
+    # Mirrors sms_pdu_build() in waterpal_sms_pdu.h: returns a list of (hex PDU with an empty SMSC field, TPDU length)
+    if len(data) <= MAX_DATA:
+        chunks = [data]
+    else:
+        chunks = [data[i:i + MAX_PART_DATA] for i in range(0, len(data), MAX_PART_DATA)]
+    pdus = []
+    for part, chunk in enumerate(chunks, 1):
+        udh = b''
+        if len(chunks) > 1:
+            udh = bytes([CONCAT_UDH_LEN - 1, 0x00, 0x03, reference, len(chunks), part])
+        tpdu = bytes([MTI_SUBMIT | (0x40 if udh else 0), 0x00]) + encode_address(number) + bytes([0x00, DCS_8BIT, len(udh) + len(chunk)]) + udh + chunk
+        pdus.append(('00' + tpdu.hex().upper(), len(tpdu)))
+    return pdus
+
+def submit_to_deliver(hex_pdu, sender, timestamp='62101812000000'):
+    # What the network turns an SMS-SUBMIT into, as the receiving end sees it (for the simulator)
+    msg = decode_pdu(hex_pdu)
+    udh = b''
+    if msg['concat']:
+        ref, parts, part = msg['concat']
+        udh = bytes([CONCAT_UDH_LEN - 1, 0x00, 0x03, ref, parts, part])
+    tpdu = bytes([MTI_DELIVER | (0x40 if udh else 0)]) + encode_address(sender) + bytes([0x00, DCS_8BIT]) + bytes.fromhex(timestamp) + bytes([len(udh) + len(msg['data'])]) + udh + msg['data']
+    return '00' + tpdu.hex().upper()
+
+def decode_pdu(hex_pdu):
+    # Decode an SMS-SUBMIT or SMS-DELIVER PDU (with its SMSC field) carrying 8-bit data
+    pdu = bytes.fromhex(hex_pdu)
+    pos = 1 + pdu[0]  # Skip the SMSC
+    first = pdu[pos]
+    pos += 1
+    mti = first & 0x03
+    msg = {}
+    if mti == MTI_SUBMIT:
+        pos += 1  # TP-MR
+        msg['to'], pos = decode_address(pdu, pos)
+    elif mti == MTI_DELIVER:
+        msg['from'], pos = decode_address(pdu, pos)
+    else:
+        raise ValueError(f'Unsupported message type {mti}')
+    pos += 1  # TP-PID
+    dcs = pdu[pos]
+    pos += 1
+    if mti == MTI_SUBMIT:
+        vpf = (first >> 3) & 0x03
+        pos += {0: 0, 2: 1}.get(vpf, 7)
+    else:
+        pos += 7  # TP-SCTS
+    if dcs & 0x0C != DCS_8BIT:
+        raise ValueError(f'Not 8-bit data (DCS {dcs:#04x})')
+    udl = pdu[pos]
+    pos += 1
+    ud = pdu[pos:pos + udl]
+    if len(ud) != udl:
+        raise ValueError('PDU is shorter than its user data length')
+
+    msg['concat'] = None
+    if first & 0x40:
+        udhl = ud[0]
+        header, ud = ud[1:1 + udhl], ud[1 + udhl:]
+        i = 0
+        while i < len(header):
+            iei, iedl = header[i], header[i + 1]
+            if iei == 0x00 and iedl == 3:
+                msg['concat'] = tuple(header[i + 2:i + 5])
+            elif iei == 0x08 and iedl == 4:
+                msg['concat'] = ((header[i + 2] << 8) | header[i + 3], header[i + 4], header[i + 5])
+            i += 2 + iedl
+    msg['data'] = ud
+    return msg
+
+class Reassembler:
+    # Collects parts (in any order) and returns the whole data once every part of a message is in
+    def __init__(self):
+        self.pending = {}
+
+    def add(self, msg):
+        if msg['concat'] is None:
+            return msg['data']
+        ref, parts, part = msg['concat']
+        key = (msg.get('from', msg.get('to')), ref, parts)
+        chunks = self.pending.setdefault(key, {})
+        chunks[part] = msg['data']
+        if len(chunks) < parts:
+            return None
+        del self.pending[key]
+        return b''.join(chunks[i] for i in range(1, parts + 1))
+
+def decode_data(data):
+    encoding = data[0]
+    if encoding not in (PAYLOAD_ENCODING_CBOR, PAYLOAD_ENCODING_CBOR_HEATSHRINK):
+        raise ValueError(f'Unknown payload encoding {encoding}')
+    return decode_payload(data[1:], encoding == PAYLOAD_ENCODING_CBOR_HEATSHRINK)
+
+def self_check(iterations):
+    # Send random data through the encoder, the "network" and the reassembler, with parts arriving out of order
+    rng = random.Random(1)
+    reassembler = Reassembler()
+    for n in range(iterations):
+        data = bytes(rng.randrange(256) for _ in range(rng.randrange(1, 4 * MAX_PART_DATA)))
+        number = rng.choice(['+15551234567', '5551234', '+447700900123'])
+        pdus = encode_submit(number, data, reference=n % 256)
+        for hex_pdu, tpdu_len in pdus:
+            assert tpdu_len == len(hex_pdu) // 2 - 1
+            assert decode_pdu(hex_pdu)['to'] == number
+        delivered = [submit_to_deliver(hex_pdu, '+15550001111') for hex_pdu, _ in pdus]
+        rng.shuffle(delivered)
+        results = [reassembler.add(decode_pdu(hex_pdu)) for hex_pdu in delivered]
+        assert results[:-1] == [None] * (len(results) - 1)
+        assert results[-1] == data
+    assert not reassembler.pending
+    print(f'Self-check passed ({iterations} messages)')
+
+def main():
+    parser = argparse.ArgumentParser(description='Reassemble WaterPAL binary SMS PDUs (hex, one per argument, any order) and decode the reports.')
+    parser.add_argument('pdus', type=str, nargs='*', help='Hex PDUs, including the SMSC field.')
+    parser.add_argument('--data', action='store_true', help='Print each message\'s number and data (hex) instead of decoding its reports.')
+    parser.add_argument('--self-check', action='store_true', help='Run random data through the encoder, decoder and reassembler.')
+    args = parser.parse_args()
+
+    if args.self_check:
+        self_check(500)
+        return
+
+    reassembler = Reassembler()
+    for hex_pdu in args.pdus:
+        msg = decode_pdu(hex_pdu)
+        data = reassembler.add(msg)
+        if data is None:
+            continue
+        if args.data:
+            number = {key: msg[key] for key in ('to', 'from') if key in msg}
+            print(json.dumps({**number, 'parts': msg['concat'][1] if msg['concat'] else 1, 'data': data.hex()}, indent=2))
+        else:
+            print(json.dumps(decode_data(data), indent=2))
+    if reassembler.pending:
+        print(f'{len(reassembler.pending)} incomplete messages', file=sys.stderr)
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()